@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+#
+# ps2keymap.py: compile the keyboard's string keymaps into a "Compiled Keymap"
+#
+# Usage: ps2keymap.py [-h] [-o keymap.bin] Info.plist [Platform/Profile]
+#
+# The keyboard configuration is taken from "Platform Profile" in the given plist
+# (VoodooPS2Keyboard-Info.plist or a copy of it), merged the same way the driver
+# does: "Default" first, then the optional profile (e.g. "HPQOEM/ProBook-87" or
+# "HPQOEM/167C", links are followed).  "Custom PS2 Map", "Breakless PS2",
+# "Custom ADB Map", "Function Keys Standard" and "Function Keys Special" are
+# compiled into the binary layout described in VoodooPS2Keyboard.h.
+#
+# Without -o, a plist fragment to paste into the keyboard configuration (or an
+# RMCF override) is printed.  When "Compiled Keymap" is present the driver ignores
+# the string keymaps above, so recompile after editing them.  The exception is a
+# "Compiled Keymap" in "Default": if the platform profile or RMCF sets any of the
+# string keymaps, the driver uses the strings instead.  Put the output in the
+# profile it was compiled for.
+#
+
+import argparse
+import base64
+import plistlib
+import struct
+import sys
+
+KEYMAP_MAGIC = 0x4b325350           # "PS2K"
+KEYMAP_VERSION = 1
+NUM_KEYCODES = 512
+NUM_SCANCODES = 256
+BREAKLESS_KEY = 0x01
+CUSTOM_ADB = 0x80
+
+
+def parse_hex(s, terms):
+    # same rules as parseHex in VoodooPS2Keyboard.cpp
+    n = 0
+    for i, c in enumerate(s):
+        if c in terms:
+            return n, s[i:]
+        if c not in "0123456789abcdefABCDEF":
+            raise ValueError("invalid entry: \"%s\"" % s)
+        n = (n << 4) + int(c, 16)
+    return n, ""
+
+
+def entries(config, name, parse):
+    # like the driver, invalid entries are reported and skipped
+    for s in config.get(name, []):
+        if not isinstance(s, str) or s.startswith(";"):
+            continue
+        try:
+            yield parse(s)
+        except ValueError:
+            sys.stderr.write("%s: invalid entry \"%s\", skipped\n" % (name, s))
+
+
+def index_of(scan, entry):
+    ex = scan >> 8
+    if ex not in (0, 0xe0):
+        raise ValueError("scan code invalid: \"%s\"" % entry)
+    return (scan & 0xff) + (NUM_SCANCODES if ex == 0xe0 else 0)
+
+
+def parse_remap(entry):
+    scan_from, rest = parse_hex(entry, "=")
+    if not rest.startswith("="):
+        raise ValueError("invalid entry: \"%s\"" % entry)
+    scan_to, _ = parse_hex(rest[1:], "\n;")
+    return scan_from, scan_to
+
+
+def parse_ps2_remap(entry):
+    scan_from, scan_to = parse_remap(entry)
+    return index_of(scan_from, entry), index_of(scan_to, entry)
+
+
+def parse_breakless(entry):
+    scan, _ = parse_hex(entry, "\n;")
+    return index_of(scan, entry)
+
+
+def parse_adb_remap(entry):
+    scan, code = parse_remap(entry)
+    if code > 0xff:
+        raise ValueError("ADB code invalid: \"%s\"" % entry)
+    return index_of(scan, entry), code
+
+
+def compile_keymap(config):
+    remap = list(range(NUM_KEYCODES))
+    flags = [0] * NUM_KEYCODES
+    adb = [0] * NUM_KEYCODES
+    for index, target in entries(config, "Custom PS2 Map", parse_ps2_remap):
+        remap[index] = target
+    for index in entries(config, "Breakless PS2", parse_breakless):
+        flags[index] |= BREAKLESS_KEY
+    for index, code in entries(config, "Custom ADB Map", parse_adb_remap):
+        flags[index] |= CUSTOM_ADB
+        adb[index] = code
+    standard = list(entries(config, "Function Keys Standard", parse_ps2_remap))
+    special = list(entries(config, "Function Keys Special", parse_ps2_remap))
+    if not standard or not special:
+        # the driver only supports HIDFKeyMode with both maps
+        standard, special = [], []
+
+    blob = struct.pack("<IHHHHI", KEYMAP_MAGIC, KEYMAP_VERSION, NUM_KEYCODES,
+                       len(standard), len(special), 0)
+    for i in range(NUM_KEYCODES):
+        blob += struct.pack("<HBB", remap[i], flags[i], adb[i])
+    for index, target in standard + special:
+        blob += struct.pack("<HH", index, target)
+    return blob
+
+
+def lookup(node, name):
+    # follows string links the way _getConfigurationNode does ("target;comment")
+    value = node.get(name)
+    while isinstance(value, str):
+        value = node.get(value.split(";")[0])
+    return value
+
+
+def keyboard_config(plist, profile):
+    for personality in plist.get("IOKitPersonalities", {}).values():
+        if personality.get("IOClass") == "ApplePS2Keyboard" and "Platform Profile" in personality:
+            profiles = personality["Platform Profile"]
+            break
+    else:
+        profiles = plist.get("Platform Profile", plist)
+    config = dict(lookup(profiles, "Default") or {})
+    if profile:
+        node = profiles
+        for name in profile.split("/"):
+            node = lookup(node, name)
+            if not isinstance(node, dict):
+                raise ValueError("profile not found: %s" % profile)
+        config.update(node)
+    return config
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(prog=argv[0],
+        description="Compile the keyboard's string keymaps into a \"Compiled Keymap\".")
+    parser.add_argument("plist", help="VoodooPS2Keyboard-Info.plist or a copy of it")
+    parser.add_argument("profile", nargs="?", help="platform profile, e.g. HPQOEM/ProBook-87")
+    parser.add_argument("-o", dest="output", metavar="keymap.bin",
+                        help="write the binary keymap instead of printing a plist fragment")
+    args = parser.parse_args(argv[1:])
+    with open(args.plist, "rb") as f:
+        plist = plistlib.load(f)
+    try:
+        blob = compile_keymap(keyboard_config(plist, args.profile))
+    except ValueError as e:
+        parser.exit(1, "%s: %s\n" % (parser.prog, e))
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(blob)
+    else:
+        print("<key>Compiled Keymap</key>")
+        print("<data>%s</data>" % base64.b64encode(blob).decode("ascii"))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,365 @@
+//
+// ControllerTests.cpp
+//
+// The controller, keyboard and mouse drivers brought up on the emulated 8042:
+// start, input from both ports (alone and interleaved), device resets, a
+// sample rate switch the mouse NAKs, a failed command group answered late,
+// and unload, with no kernel API misuse along the way.
+//
+
+#include "HostTest.h"
+#include "HostStack.h"
+
+#include "VoodooPS2Controller.h"
+#include "ApplePS2KeyboardDevice.h"
+#include "ApplePS2MouseDevice.h"
+#include "VoodooPS2Keyboard.h"
+#include "VoodooPS2Mouse.h"
+
+#include <thread>
+
+static bool startKeyboard(HostStack& stack)
+{
+    return stack.startDriver(new ApplePS2Keyboard,
+                             HostPersonality("VoodooPS2Keyboard/VoodooPS2Keyboard-Info.plist", "ApplePS2Keyboard"),
+                             stack.keyboardDevice);
+}
+
+static bool startMouse(HostStack& stack)
+{
+    return stack.startDriver(new ApplePS2Mouse,
+                             HostPersonality("VoodooPS2Mouse/VoodooPS2Mouse-Info.plist", "ApplePS2Mouse"),
+                             stack.mouseDevice);
+}
+
+static size_t count(const std::vector<HostHIDEvent>& events, HostHIDEvent::Kind kind)
+{
+    size_t result = 0;
+    for (const HostHIDEvent& event : events)
+        result += event.kind == kind;
+    return result;
+}
+
+// the bytes the mouse was sent
+static std::vector<UInt8> received(HostStack& stack)
+{
+    std::vector<UInt8> result;
+    stack.emulator.locked([&] { result = stack.mouse.received; });
+    return result;
+}
+
+// a number in a driver's "Report Rate Statistics"
+static unsigned reportRate(IOService* driver, const char* key)
+{
+    OSDictionary* stats = OSDynamicCast(OSDictionary, driver->getProperty(kReportRateStatistics));
+    OSNumber* value = stats ? OSDynamicCast(OSNumber, stats->getObject(key)) : NULL;
+    return value ? value->unsigned32BitValue() : ~0U;
+}
+
+// 'a' down and up, scan code set 1
+static const UInt8 kKeyA[] = { 0x1e, 0x9e };
+enum { kADB_A = 0x00 };
+
+TEST(controllerStarts)
+{
+    HostStack stack;
+    REQUIRE(stack.startController());
+    // translated set 1, both interrupts on once the devices are published
+    UInt8 commandByte = stack.emulator.commandByte();
+    CHECK(commandByte & kCB_TranslateMode);
+    CHECK(commandByte & kCB_SystemFlag);
+}
+
+TEST(keyboardTypes)
+{
+    HostStack stack;
+    REQUIRE(stack.startController());
+    REQUIRE(startKeyboard(stack));
+    stack.emulator.waitIdle();
+    stack.clearEvents();
+
+    stack.emulator.locked([&] { stack.keyboard.type(kKeyA, 2); });
+    REQUIRE(stack.waitForEvents(2));
+    std::vector<HostHIDEvent> events = stack.events();
+    CHECK_EQ(events[0].kind, HostHIDEvent::kKey);
+    CHECK_EQ(events[0].key, kADB_A);
+    CHECK(events[0].down);
+    CHECK_EQ(events[1].key, kADB_A);
+    CHECK(!events[1].down);
+    CHECK(stack.nub->delivered(kIRQ_Keyboard) > 0);
+}
+
+TEST(mouseMoves)
+{
+    HostStack stack;
+    REQUIRE(stack.startController());
+    REQUIRE(startMouse(stack));
+    REQUIRE(WAIT_FOR(stack.mouse.reporting, 2000));
+    stack.emulator.waitIdle();
+    stack.clearEvents();
+
+    stack.emulator.locked([&] { stack.mouse.move(5, -3, 0); });
+    REQUIRE(stack.waitForEvents(1));
+    std::vector<HostHIDEvent> events = stack.events();
+    CHECK_EQ(events[0].kind, HostHIDEvent::kRelative);
+    CHECK(events[0].dx != 0 || events[0].dy != 0);
+}
+
+TEST(portsInterleave)
+{
+    HostStack stack;
+    REQUIRE(stack.startController());
+    REQUIRE(startKeyboard(stack));
+    REQUIRE(startMouse(stack));
+    REQUIRE(WAIT_FOR(stack.mouse.reporting, 2000));
+    stack.emulator.waitIdle();
+    stack.clearEvents();
+
+    // key strokes and movement arriving together, every byte of both kept
+    enum { kRounds = 50 };
+    for (int i = 0; i < kRounds; i++)
+    {
+        stack.emulator.locked([&] {
+            stack.keyboard.type(kKeyA, 2);
+            stack.mouse.move(1, 1, 0);
+        });
+        IOSleep(1);
+    }
+    stack.emulator.waitIdle();
+    CHECK(WAIT_FOR(count(stack.events(), HostHIDEvent::kKey) == 2 * kRounds, 2000));
+    CHECK(WAIT_FOR(count(stack.events(), HostHIDEvent::kRelative) >= 1, 2000));
+    CHECK_EQ(count(stack.events(), HostHIDEvent::kKey), 2 * kRounds);
+}
+
+TEST(mouseResetKeepsKeyboardGoing)
+{
+    HostStack stack;
+    REQUIRE(stack.startController());
+    REQUIRE(startKeyboard(stack));
+    REQUIRE(startMouse(stack));
+    REQUIRE(WAIT_FOR(stack.mouse.reporting, 2000));
+    stack.emulator.waitIdle();
+
+    // $AA $00 from a mouse that reset itself is taken as a reset notice, not
+    // as a packet (ApplePS2Mouse leaves the mouse as it is)
+    stack.clearEvents();
+    stack.emulator.spontaneousReset(kPS2PortAux);
+    stack.emulator.waitIdle();
+    stack.emulator.locked([&] { stack.keyboard.type(kKeyA, 2); });
+    CHECK(stack.waitForEvents(2));
+    CHECK_EQ(count(stack.events(), HostHIDEvent::kRelative), 0);
+    CHECK_EQ(count(stack.events(), HostHIDEvent::kKey), 2);
+}
+
+TEST(touchpadMessagesWithoutGate)
+{
+    HostStack stack;
+    REQUIRE(stack.startController());
+    REQUIRE(startKeyboard(stack));
+    ApplePS2Mouse* mouse = new ApplePS2Mouse;
+    REQUIRE(stack.startDriver(mouse,
+                              HostPersonality("VoodooPS2Mouse/VoodooPS2Mouse-Info.plist", "ApplePS2Mouse"),
+                              stack.mouseDevice));
+    REQUIRE(WAIT_FOR(stack.mouse.reporting, 2000));
+    stack.emulator.waitIdle();
+
+    // from a thread other than the work loop, as the ACPI and HID paths do,
+    // while the work loop is busy: the handlers must not wait for its gate
+    IOWorkLoop* workLoop = mouse->getWorkLoop();
+    workLoop->closeGate();
+    bool enabled = true;
+    bool delivered = false;
+    std::thread publisher([&] {
+        bool disable = false;
+        stack.keyboardDevice->dispatchMessage(kPS2M_setDisableTouchpad, &disable);
+        stack.keyboardDevice->dispatchMessage(kPS2M_getDisableTouchpad, &enabled);
+        __atomic_store_n(&delivered, true, __ATOMIC_RELEASE);
+    });
+    bool unblocked = WAIT_FOR(__atomic_load_n(&delivered, __ATOMIC_ACQUIRE), 1000);
+    workLoop->openGate();
+    publisher.join();
+    CHECK(unblocked);
+    CHECK(!enabled);
+
+    stack.clearEvents();
+    stack.emulator.locked([&] { stack.mouse.move(5, -3, 0); });
+    stack.emulator.waitIdle();
+    IOSleep(20);
+    CHECK_EQ(count(stack.events(), HostHIDEvent::kRelative), 0);
+
+    enabled = true;
+    stack.keyboardDevice->dispatchMessage(kPS2M_setDisableTouchpad, &enabled);
+    stack.emulator.locked([&] { stack.mouse.move(5, -3, 0); });
+    CHECK(stack.waitForEvents(1));
+
+    // anything else goes on to IOService
+    CHECK_EQ(mouse->message(kIOMessageServiceIsSuspended, NULL, NULL), kIOReturnUnsupported);
+
+    // statistics follow a publish within kNotificationStatsInterval
+    CHECK(WAIT_FOR(stack.controller->getProperty(kNotificationStatistics), kNotificationStatsInterval * 2));
+}
+
+TEST(sampleRateSwitchNak)
+{
+    HostStack stack;
+    REQUIRE(stack.startController());
+    // AdaptiveSampleRate on, back to the low rate kRateIdleMS after motion
+    enum { kRateIdleMS = 500 };
+    OSDictionary* personality = HostPersonality("VoodooPS2Mouse/VoodooPS2Mouse-Info.plist", "ApplePS2Mouse");
+    OSDictionary* profile = personality ? OSDynamicCast(OSDictionary, personality->getObject("Platform Profile")) : NULL;
+    OSDictionary* defaults = profile ? OSDynamicCast(OSDictionary, profile->getObject("Default")) : NULL;
+    REQUIRE(defaults);
+    defaults->setObject("AdaptiveSampleRate", kOSBooleanTrue);
+    OSNumber* idleTime = OSNumber::withNumber(kRateIdleMS * 1000000ULL, 64);
+    defaults->setObject("SampleRateIdleTime", idleTime);
+    idleTime->release();
+    ApplePS2Mouse* mouse = new ApplePS2Mouse;
+    REQUIRE(stack.startDriver(mouse, personality, stack.mouseDevice));
+    // the low rate is programmed once the mouse is enabled
+    REQUIRE(WAIT_FOR(reportRate(mouse, "Current Rate") == 100, 2000));
+    REQUIRE(WAIT_FOR(stack.mouse.reporting, 2000));
+    stack.emulator.waitIdle();
+
+    // motion: the switch to the high rate has its F3 NAKed, and goes through
+    // when it is retried
+    stack.emulator.locked([&] {
+        stack.mouse.received.clear();
+        stack.mouse.nakCommand = kDP_SetMouseSampleRate;
+        stack.mouse.naks = 1;
+        stack.mouse.move(5, -3, 0);
+    });
+    const std::vector<UInt8> retried = {
+        kDP_SetDefaultsAndDisable, kDP_SetMouseSampleRate,
+        kDP_SetDefaultsAndDisable, kDP_SetMouseSampleRate, kHighSampleRate, kDP_Enable };
+    CHECK(WAIT_FOR(received(stack) == retried, 2000));
+    CHECK(WAIT_FOR(stack.mouse.reporting, 1000));
+    CHECK_EQ(stack.mouse.sampleRate, kHighSampleRate);
+    stack.emulator.waitIdle();
+    IOSleep(20);
+    CHECK_EQ(reportRate(mouse, "Current Rate"), kHighSampleRate);
+
+    // idle: the switch back to the low rate is NAKed twice and given up, the
+    // mouse reports again at the high rate
+    stack.emulator.locked([&] {
+        stack.mouse.received.clear();
+        stack.mouse.naks = 2;
+    });
+    const std::vector<UInt8> failed = {
+        kDP_SetDefaultsAndDisable, kDP_SetMouseSampleRate,
+        kDP_SetDefaultsAndDisable, kDP_SetMouseSampleRate, kDP_Enable };
+    CHECK(WAIT_FOR(received(stack) == failed, kRateIdleMS + 2000));
+    CHECK(WAIT_FOR(stack.mouse.reporting, 1000));
+    CHECK_EQ(stack.mouse.sampleRate, kHighSampleRate);
+    stack.emulator.waitIdle();
+    IOSleep(20);
+    CHECK_EQ(reportRate(mouse, "Current Rate"), kHighSampleRate);
+
+    stack.clearEvents();
+    stack.emulator.locked([&] { stack.mouse.move(5, -3, 0); });
+    CHECK(stack.waitForEvents(1));
+}
+
+TEST(typematicFallbackFromWorkLoop)
+{
+    HostStack stack;
+    REQUIRE(stack.startController());
+    ApplePS2Keyboard* keyboard = new ApplePS2Keyboard;
+    REQUIRE(stack.startDriver(keyboard,
+                              HostPersonality("VoodooPS2Keyboard/VoodooPS2Keyboard-Info.plist", "ApplePS2Keyboard"),
+                              stack.keyboardDevice));
+    stack.emulator.waitIdle();
+
+    OSDictionary* dict = OSDictionary::withCapacity(1);
+    dict->setObject("TypematicSuppression", kOSBooleanTrue);
+    keyboard->setProperties(dict);
+    dict->release();
+    REQUIRE(WAIT_FOR(stack.keyboard.makeReleaseOnly, 2000));
+    stack.emulator.waitIdle();
+
+    // a repeat anyway: the keyboard ignored kDP_SetAllMakeRelease, so the
+    // driver falls back to the slowest rate (sent from the work loop, not
+    // from the interrupt handler).  The release follows once the command is
+    // done: a real keyboard stops sending keys while it takes one.
+    static const UInt8 kRepeatA[] = { 0x1e, 0x1e }, kReleaseA[] = { 0x9e };
+    stack.clearEvents();
+    stack.emulator.locked([&] { stack.keyboard.type(kRepeatA, 2); });
+    CHECK(WAIT_FOR(0x7f == stack.keyboard.typematic, 2000));
+    stack.emulator.waitIdle();
+    stack.emulator.locked([&] { stack.keyboard.type(kReleaseA, 1); });
+    CHECK(stack.waitForEvents(2));
+    CHECK_EQ(count(stack.events(), HostHIDEvent::kKey), 2);
+}
+
+// A mouse that answers an $F2 (get ID) with two resends, which fail the
+// command, then sends the ACK and the ID anyway, late
+class LateAckMouse : public PS2Mouse
+{
+public:
+    UInt8 lateID = 0x7f;
+    bool late = false;
+
+    void receive(UInt8 byte) override
+    {
+        if (kDP_GetId != byte || !late)
+            return PS2Mouse::receive(byte);
+        late = false;
+        received.push_back(byte);
+        reply(kSC_Resend);
+        reply(kSC_Resend);
+        reply(kSC_Acknowledge);
+        reply(lateID);
+    }
+};
+
+TEST(failedGroupIsDrained)
+{
+    // polled (the keyboard's interrupt handler is not installed), then on the
+    // request engine
+    for (int pass = 0; pass < 2; pass++)
+    {
+        LateAckMouse mouse;
+        HostStack stack;
+        stack.attachAux(&mouse);
+        REQUIRE(stack.startController());
+        if (pass)
+            REQUIRE(startKeyboard(stack));
+        REQUIRE(startMouse(stack));
+        REQUIRE(WAIT_FOR(mouse.reporting, 2000));
+        stack.emulator.waitIdle();
+        mouse.late = true;
+
+        // two get ID groups: the first fails on the resends, and its late ACK
+        // and ID must not be taken for the answer to the second
+        TPS2Request<8> request;
+        PS2CommandBuilder program(request);
+        unsigned first = program.tryBegin();
+        program.mouseCommand(kDP_GetId);
+        program.read();
+        program.end(first);
+        unsigned second = program.tryBegin();
+        program.mouseCommand(kDP_GetId);
+        unsigned id = program.read();
+        program.end(second);
+        REQUIRE(program.finish());
+        stack.mouseDevice->submitRequestAndBlock(&request);
+
+        CHECK(!program.succeeded(first));
+        CHECK(program.succeeded(second));
+        CHECK_EQ(program.result(id), mouse.deviceID);
+    }
+}
+
+TEST(unloadAndReload)
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        HostStack stack;
+        REQUIRE(stack.startController());
+        REQUIRE(startKeyboard(stack));
+        REQUIRE(startMouse(stack));
+        stack.emulator.waitIdle();
+        stack.stop();
+    }
+}
+
+HOST_TEST_MAIN()
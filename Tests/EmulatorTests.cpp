@@ -0,0 +1,230 @@
+//
+// EmulatorTests.cpp
+//
+// The 8042 emulator on its own, driven through ps2inb/ps2outb the way the
+// controller drives the real thing.
+//
+
+#include "HostTest.h"
+#include "PS2Emulator.h"
+#include "VoodooPS2Controller.h"
+
+#include <atomic>
+
+static bool waitOutput(bool* aux = NULL, unsigned timeoutMS = 500)
+{
+    uint64_t start = HostTestNowMS();
+    for (;;)
+    {
+        UInt8 status = ps2inb(kCommandPort);
+        if (status & kOutputReady)
+        {
+            if (aux)
+                *aux = (status & kMouseData) != 0;
+            return true;
+        }
+        if (HostTestNowMS() - start > timeoutMS)
+            return false;
+        IODelay(10);
+    }
+}
+
+static void waitInput()
+{
+    while (ps2inb(kCommandPort) & kInputBusy)
+        IODelay(1);
+}
+
+static int readByte(bool* aux = NULL)
+{
+    return waitOutput(aux) ? ps2inb(kDataPort) : -1;
+}
+
+static void command(UInt8 byte)
+{
+    waitInput();
+    ps2outb(kCommandPort, byte);
+}
+
+static void data(UInt8 byte)
+{
+    waitInput();
+    ps2outb(kDataPort, byte);
+}
+
+TEST(controllerSelfTest)
+{
+    PS2Emulator emulator;
+    PS2Keyboard keyboard;
+    emulator.attach(kPS2PortKeyboard, &keyboard);
+    emulator.makeCurrent();
+
+    command(kCP_TestController);
+    CHECK_EQ(readByte(), 0x55);
+    command(kCP_TestKeyboardPort);
+    CHECK_EQ(readByte(), 0x00);
+}
+
+TEST(commandByteRoundTrip)
+{
+    PS2Emulator emulator;
+    emulator.makeCurrent();
+
+    command(kCP_GetCommandByte);
+    CHECK_EQ(readByte(), 0x45);
+    command(kCP_SetCommandByte);
+    data(0x47);
+    command(kCP_GetCommandByte);
+    CHECK_EQ(readByte(), 0x47);
+    CHECK_EQ(emulator.commandByte(), 0x47);
+}
+
+TEST(keyboardResetAndIdentify)
+{
+    PS2Emulator emulator;
+    PS2Keyboard keyboard;
+    emulator.attach(kPS2PortKeyboard, &keyboard);
+    emulator.makeCurrent();
+
+    data(kDP_Reset);
+    CHECK_EQ(readByte(), kSC_Acknowledge);
+    CHECK_EQ(readByte(), 0xAA);
+    data(kDP_GetId);
+    CHECK_EQ(readByte(), kSC_Acknowledge);
+    CHECK_EQ(readByte(), 0xAB);
+    CHECK_EQ(readByte(), 0x83);
+    CHECK_EQ(keyboard.resets, 1);
+}
+
+TEST(auxWriteAndIntelliMouseKnock)
+{
+    PS2Emulator emulator;
+    PS2Mouse mouse;
+    emulator.attach(kPS2PortAux, &mouse);
+    emulator.makeCurrent();
+
+    static const UInt8 knock[] = { 200, 100, 80 };
+    for (UInt8 rate : knock)
+    {
+        command(kCP_TransmitToMouse);
+        data(kDP_SetMouseSampleRate);
+        bool aux = false;
+        CHECK_EQ(readByte(&aux), kSC_Acknowledge);
+        CHECK(aux);
+        command(kCP_TransmitToMouse);
+        data(rate);
+        CHECK_EQ(readByte(), kSC_Acknowledge);
+    }
+    command(kCP_TransmitToMouse);
+    data(kDP_GetId);
+    CHECK_EQ(readByte(), kSC_Acknowledge);
+    CHECK_EQ(readByte(), 3);
+    CHECK_EQ(mouse.deviceID, 3);
+}
+
+TEST(missingDeviceTimesOut)
+{
+    PS2Emulator emulator;
+    emulator.makeCurrent();
+
+    command(kCP_TransmitToMouse);
+    data(kDP_GetId);
+    CHECK_EQ(readByte(), kSC_Resend);
+}
+
+TEST(portsInterleaveByArrival)
+{
+    PS2Emulator emulator;
+    PS2Keyboard keyboard;
+    PS2Mouse mouse;
+    emulator.attach(kPS2PortKeyboard, &keyboard);
+    emulator.attach(kPS2PortAux, &mouse);
+    emulator.makeCurrent();
+
+    static const UInt8 kbd[] = { 0x1e, 0x9e };
+    static const UInt8 aux[] = { 0x08, 0x01, 0x02 };
+    emulator.inject(kPS2PortKeyboard, kbd, 2);
+    emulator.inject(kPS2PortAux, aux, 3);
+
+    // each port in order, both ports complete
+    std::vector<UInt8> fromKeyboard, fromAux;
+    for (int i = 0; i < 5; i++)
+    {
+        bool isAux = false;
+        int byte = readByte(&isAux);
+        REQUIRE(byte >= 0);
+        (isAux ? fromAux : fromKeyboard).push_back((UInt8)byte);
+    }
+    CHECK(fromKeyboard == std::vector<UInt8>(kbd, kbd + 2));
+    CHECK(fromAux == std::vector<UInt8>(aux, aux + 3));
+    CHECK_EQ(emulator.stats().staleReads, 0);
+}
+
+TEST(disabledClockHoldsBytes)
+{
+    PS2Emulator emulator;
+    PS2Keyboard keyboard;
+    emulator.attach(kPS2PortKeyboard, &keyboard);
+    emulator.makeCurrent();
+
+    command(kCP_DisableKeyboardClock);
+    static const UInt8 kbd[] = { 0x1e };
+    emulator.inject(kPS2PortKeyboard, kbd, 1);
+    CHECK(!waitOutput(NULL, 20));
+    command(kCP_EnableKeyboardClock);
+    CHECK_EQ(readByte(), 0x1e);
+}
+
+static std::atomic<unsigned> gIRQs[2];
+
+static void countIRQ(void* refCon, int irq)
+{
+    (void)refCon;
+    gIRQs[irq == kIRQ_Mouse ? 1 : 0]++;
+    // a handler drains the byte, as the controller's does
+    ps2inb(kDataPort);
+}
+
+TEST(interruptsFollowTheCommandByte)
+{
+    PS2Emulator emulator;
+    PS2Keyboard keyboard;
+    PS2Mouse mouse;
+    emulator.attach(kPS2PortKeyboard, &keyboard);
+    emulator.attach(kPS2PortAux, &mouse);
+    emulator.makeCurrent();
+    gIRQs[0] = gIRQs[1] = 0;
+    emulator.setInterruptHandler(countIRQ, NULL);
+
+    // keyboard interrupt only
+    command(kCP_SetCommandByte);
+    data(kCB_EnableKeyboardIRQ | kCB_SystemFlag | kCB_TranslateMode);
+    static const UInt8 bytes[] = { 0x1e, 0x9e };
+    emulator.inject(kPS2PortKeyboard, bytes, 2);
+    CHECK(WAIT_FOR(gIRQs[0] == 2, 500));
+    // an aux byte sits in the output buffer without raising IRQ 12...
+    emulator.inject(kPS2PortAux, bytes, 2);
+    IOSleep(10);
+    CHECK_EQ(gIRQs[1], 0);
+
+    // ...until the interrupt is enabled
+    command(kCP_SetCommandByte);
+    data(kCB_EnableKeyboardIRQ | kCB_EnableMouseIRQ | kCB_SystemFlag | kCB_TranslateMode);
+    CHECK(WAIT_FOR(gIRQs[1] == 2, 500));
+    emulator.setInterruptHandler(NULL, NULL);
+}
+
+TEST(spontaneousReset)
+{
+    PS2Emulator emulator;
+    PS2Mouse mouse;
+    emulator.attach(kPS2PortAux, &mouse);
+    emulator.makeCurrent();
+
+    emulator.spontaneousReset(kPS2PortAux);
+    CHECK_EQ(readByte(), 0xAA);
+    CHECK_EQ(readByte(), 0x00);
+    CHECK_EQ(mouse.resets, 1);
+}
+
+HOST_TEST_MAIN()
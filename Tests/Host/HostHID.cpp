@@ -0,0 +1,145 @@
+//
+// HostHID.cpp
+//
+// The HID family base classes for the host build; everything the drivers
+// dispatch ends up at the event sink installed by the test.
+//
+
+#include "HostHID.h"
+
+#include <mutex>
+
+static std::mutex gSinkLock;
+static HostHIDEventSink gSink;
+static void* gSinkRefCon;
+
+void HostHIDSetEventSink(HostHIDEventSink sink, void* refCon)
+{
+    std::lock_guard<std::mutex> guard(gSinkLock);
+    gSink = sink;
+    gSinkRefCon = refCon;
+}
+
+void HostHIDDeliver(HostHIDEvent& event)
+{
+    clock_get_uptime(&event.dispatched);
+    std::lock_guard<std::mutex> guard(gSinkLock);
+    if (gSink)
+        gSink(gSinkRefCon, event);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// IOHIDevice
+//
+
+OSDefineMetaClassAndStructors(IOHIDevice, IOService)
+
+bool IOHIDevice::init(OSDictionary* properties)
+{
+    return IOService::init(properties);
+}
+
+bool IOHIDevice::start(IOService* provider)
+{
+    if (!IOService::start(provider))
+        return false;
+    updateProperties();
+    return true;
+}
+
+IOReturn IOHIDevice::setProperties(OSObject* properties)
+{
+    OSDictionary* dict = OSDynamicCast(OSDictionary, properties);
+    if (!dict)
+        return kIOReturnBadArgument;
+    return setParamProperties(dict);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// IOHIPointing
+//
+
+OSDefineMetaClassAndStructors(IOHIPointing, IOHIDevice)
+
+void IOHIPointing::dispatchRelativePointerEvent(int dx, int dy, UInt32 buttonState, AbsoluteTime ts)
+{
+    HostHIDEvent event = {};
+    event.kind = HostHIDEvent::kRelative;
+    event.sender = this;
+    event.dx = dx;
+    event.dy = dy;
+    event.buttons = buttonState;
+    event.time = ts;
+    HostHIDDeliver(event);
+}
+
+void IOHIPointing::dispatchAbsolutePointerEvent(IOGPoint* newLoc, IOGBounds* bounds, UInt32 buttonState,
+                                                bool proximity, int pressure, int pressureMin,
+                                                int pressureMax, int stylusAngle, AbsoluteTime ts)
+{
+    (void)bounds; (void)proximity; (void)pressure; (void)pressureMin; (void)pressureMax; (void)stylusAngle;
+    HostHIDEvent event = {};
+    event.kind = HostHIDEvent::kAbsolute;
+    event.sender = this;
+    event.dx = newLoc->x;
+    event.dy = newLoc->y;
+    event.buttons = buttonState;
+    event.time = ts;
+    HostHIDDeliver(event);
+}
+
+void IOHIPointing::dispatchScrollWheelEvent(short deltaAxis1, short deltaAxis2, short deltaAxis3, AbsoluteTime ts)
+{
+    HostHIDEvent event = {};
+    event.kind = HostHIDEvent::kScroll;
+    event.sender = this;
+    event.dy = deltaAxis1;
+    event.dx = deltaAxis2;
+    event.dz = deltaAxis3;
+    event.time = ts;
+    HostHIDDeliver(event);
+}
+
+IOReturn IOHIPointing::message(UInt32 type, IOService* provider, void* argument)
+{
+    return IOHIDevice::message(type, provider, argument);
+}
+
+IOReturn IOHIPointing::setParamProperties(OSDictionary* dict)
+{
+    (void)dict;
+    return kIOReturnSuccess;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// IOHIKeyboard
+//
+
+OSDefineMetaClassAndStructors(IOHIKeyboard, IOHIDevice)
+
+void IOHIKeyboard::dispatchKeyboardEvent(unsigned int keyCode, bool goingDown, AbsoluteTime time)
+{
+    HostHIDEvent event = {};
+    event.kind = HostHIDEvent::kKey;
+    event.sender = this;
+    event.key = keyCode;
+    event.down = goingDown;
+    event.time = time;
+    HostHIDDeliver(event);
+}
+
+IOReturn IOHIKeyboard::message(UInt32 type, IOService* provider, void* argument)
+{
+    return IOHIDevice::message(type, provider, argument);
+}
+
+IOReturn IOHIKeyboard::setParamProperties(OSDictionary* dict)
+{
+    (void)dict;
+    return kIOReturnSuccess;
+}
+
+IOReturn IOHIKeyboard::setProperties(OSObject* properties)
+{
+    return IOHIDevice::setProperties(properties);
+}
@@ -0,0 +1,1363 @@
+//
+// HostIOKit.cpp
+//
+// Registry entries, services, matching, power management and the work loop
+// family for the host build.
+//
+
+#include "HostKernel.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Registry entries
+//
+
+const IORegistryPlane* gIOServicePlane = (const IORegistryPlane*)"IOService";
+const IORegistryPlane* gIOACPIPlane = (const IORegistryPlane*)"IOACPIPlane";
+const OSSymbol* gIOFirstPublishNotification = OSSymbol::withCString("IOServiceFirstPublish");
+const OSSymbol* gIOPublishNotification = OSSymbol::withCString("IOServicePublish");
+const OSSymbol* gIOMatchedNotification = OSSymbol::withCString("IOServiceMatched");
+const OSSymbol* gIOFirstMatchNotification = OSSymbol::withCString("IOServiceFirstMatch");
+const OSSymbol* gIOTerminatedNotification = OSSymbol::withCString("IOServiceTerminate");
+
+struct HostRegistryData
+{
+    std::recursive_mutex lock;
+    OSDictionary* properties;
+    std::string name;
+};
+
+static std::mutex gPathLock;
+static std::map<std::string, IORegistryEntry*> gPaths;
+
+OSDefineMetaClassAndStructors(IORegistryEntry, OSObject)
+
+bool IORegistryEntry::init(OSDictionary* dictionary)
+{
+    if (!OSObject::init())
+        return false;
+    _host = new HostRegistryData;
+    _host->properties = dictionary ? OSDictionary::withDictionary(dictionary) : OSDictionary::withCapacity(16);
+    return true;
+}
+
+void IORegistryEntry::free()
+{
+    {
+        std::lock_guard<std::mutex> guard(gPathLock);
+        for (auto it = gPaths.begin(); it != gPaths.end(); )
+            it = it->second == this ? gPaths.erase(it) : std::next(it);
+    }
+    if (_host)
+    {
+        OSSafeReleaseNULL(_host->properties);
+        delete _host;
+        _host = NULL;
+    }
+    OSObject::free();
+}
+
+OSObject* IORegistryEntry::getProperty(const char* aKey) const
+{
+    std::lock_guard<std::recursive_mutex> guard(_host->lock);
+    return _host->properties->getObject(aKey);
+}
+
+OSObject* IORegistryEntry::getProperty(const OSString* aKey) const
+{
+    return aKey ? getProperty(aKey->getCStringNoCopy()) : NULL;
+}
+
+OSObject* IORegistryEntry::getProperty(const OSSymbol* aKey) const
+{
+    return aKey ? getProperty(aKey->getCStringNoCopy()) : NULL;
+}
+
+OSObject* IORegistryEntry::copyProperty(const char* aKey) const
+{
+    std::lock_guard<std::recursive_mutex> guard(_host->lock);
+    OSObject* object = _host->properties->getObject(aKey);
+    if (object)
+        object->retain();
+    return object;
+}
+
+bool IORegistryEntry::setProperty(const char* aKey, OSObject* anObject)
+{
+    std::lock_guard<std::recursive_mutex> guard(_host->lock);
+    return _host->properties->setObject(aKey, anObject);
+}
+
+bool IORegistryEntry::setProperty(const OSString* aKey, OSObject* anObject)
+{
+    return aKey && setProperty(aKey->getCStringNoCopy(), anObject);
+}
+
+bool IORegistryEntry::setProperty(const OSSymbol* aKey, OSObject* anObject)
+{
+    return aKey && setProperty(aKey->getCStringNoCopy(), anObject);
+}
+
+bool IORegistryEntry::setProperty(const char* aKey, const char* aString)
+{
+    OSString* string = OSString::withCString(aString);
+    bool result = setProperty(aKey, string);
+    string->release();
+    return result;
+}
+
+bool IORegistryEntry::setProperty(const char* aKey, bool aBoolean)
+{
+    return setProperty(aKey, (OSObject*)OSBoolean::withBoolean(aBoolean));
+}
+
+bool IORegistryEntry::setProperty(const char* aKey, unsigned long long aValue, unsigned int aNumberOfBits)
+{
+    OSNumber* number = OSNumber::withNumber(aValue, aNumberOfBits);
+    bool result = setProperty(aKey, number);
+    number->release();
+    return result;
+}
+
+bool IORegistryEntry::setProperty(const char* aKey, void* bytes, unsigned int length)
+{
+    OSData* data = OSData::withBytes(bytes, length);
+    bool result = setProperty(aKey, data);
+    data->release();
+    return result;
+}
+
+void IORegistryEntry::removeProperty(const char* aKey)
+{
+    std::lock_guard<std::recursive_mutex> guard(_host->lock);
+    _host->properties->removeObject(aKey);
+}
+
+void IORegistryEntry::removeProperty(const OSSymbol* aKey)
+{
+    if (aKey)
+        removeProperty(aKey->getCStringNoCopy());
+}
+
+OSDictionary* IORegistryEntry::dictionaryWithProperties() const
+{
+    std::lock_guard<std::recursive_mutex> guard(_host->lock);
+    return OSDictionary::withDictionary(_host->properties);
+}
+
+OSDictionary* IORegistryEntry::getPropertyTable() const
+{
+    return _host->properties;
+}
+
+IOReturn IORegistryEntry::setProperties(OSObject* properties)
+{
+    (void)properties;
+    return kIOReturnUnsupported;
+}
+
+const char* IORegistryEntry::getName(const IORegistryPlane* plane) const
+{
+    (void)plane;
+    return _host && !_host->name.empty() ? _host->name.c_str() : getClassName();
+}
+
+void IORegistryEntry::setName(const char* name, const IORegistryPlane* plane)
+{
+    (void)plane;
+    _host->name = name;
+}
+
+bool IORegistryEntry::compareName(OSString* name, OSString** matched) const
+{
+    bool result = name && name->isEqualTo(getName());
+    if (result && matched)
+    {
+        name->retain();
+        *matched = name;
+    }
+    return result;
+}
+
+IORegistryEntry* IORegistryEntry::getParentEntry(const IORegistryPlane* plane) const
+{
+    (void)plane;
+    const IOService* service = OSDynamicCast(IOService, this);
+    return service ? service->getProvider() : NULL;
+}
+
+IORegistryEntry* IORegistryEntry::getChildEntry(const IORegistryPlane* plane) const
+{
+    (void)plane;
+    const IOService* service = OSDynamicCast(IOService, this);
+    return service ? service->getClient() : NULL;
+}
+
+bool IORegistryEntry::getPath(char* path, int* length, const IORegistryPlane* plane) const
+{
+    std::string result = getName(plane);
+    for (IORegistryEntry* parent = getParentEntry(plane); parent; parent = parent->getParentEntry(plane))
+        result = std::string(parent->getName(plane)) + "/" + result;
+    result = "IOService:/" + result;
+    if ((int)result.size() + 1 > *length)
+        return false;
+    strcpy(path, result.c_str());
+    *length = (int)result.size();
+    return true;
+}
+
+IORegistryEntry* IORegistryEntry::fromPath(const char* path, const IORegistryPlane* plane,
+                                           char* residualPath, int* residualLength,
+                                           IORegistryEntry* fromEntry)
+{
+    (void)plane; (void)residualPath; (void)residualLength; (void)fromEntry;
+    std::lock_guard<std::mutex> guard(gPathLock);
+    auto it = gPaths.find(path);
+    if (it == gPaths.end())
+        return NULL;
+    it->second->retain();
+    return it->second;
+}
+
+void IORegistryEntry::hostPublishPath(const char* path)
+{
+    std::lock_guard<std::mutex> guard(gPathLock);
+    gPaths[path] = this;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Matching notifications
+//
+
+class HostMatchingNotifier : public IONotifier
+{
+    OSDeclareDefaultStructors(HostMatchingNotifier);
+
+public:
+    const OSSymbol* type;
+    OSDictionary* matching;
+    IOServiceMatchingNotificationHandler handler;
+    void* target;
+    void* ref;
+    bool removed;
+    void remove() override;
+};
+
+OSDefineMetaClassAndStructors(IONotifier, OSObject)
+OSDefineMetaClassAndStructors(HostMatchingNotifier, IONotifier)
+
+void IONotifier::remove()
+{
+    release();
+}
+
+static std::recursive_mutex gMatchingLock;
+static std::vector<HostMatchingNotifier*> gNotifiers;
+static std::vector<IOService*> gRegistered;
+
+void HostMatchingNotifier::remove()
+{
+    {
+        std::lock_guard<std::recursive_mutex> guard(gMatchingLock);
+        gNotifiers.erase(std::remove(gNotifiers.begin(), gNotifiers.end(), this), gNotifiers.end());
+        removed = true;
+    }
+    OSSafeReleaseNULL(matching);
+    release();
+}
+
+static bool isPublishType(const OSSymbol* type)
+{
+    return type->isEqualTo(gIOFirstPublishNotification) || type->isEqualTo(gIOPublishNotification) ||
+           type->isEqualTo(gIOMatchedNotification) || type->isEqualTo(gIOFirstMatchNotification);
+}
+
+static void deliverNotifications(IOService* service, bool terminated)
+{
+    std::vector<HostMatchingNotifier*> notifiers;
+    {
+        std::lock_guard<std::recursive_mutex> guard(gMatchingLock);
+        for (HostMatchingNotifier* notifier : gNotifiers)
+        {
+            if (terminated != notifier->type->isEqualTo(gIOTerminatedNotification))
+                continue;
+            if (!terminated && !isPublishType(notifier->type))
+                continue;
+            if (!service->hostMatches(notifier->matching))
+                continue;
+            notifier->retain();
+            notifiers.push_back(notifier);
+        }
+    }
+    for (HostMatchingNotifier* notifier : notifiers)
+    {
+        if (!notifier->removed)
+            notifier->handler(notifier->target, notifier->ref, service, notifier);
+        notifier->release();
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// IOService
+//
+
+struct HostServiceData
+{
+    std::recursive_mutex lock;
+    IOService* provider;
+    std::vector<IOService*> clients;
+    std::vector<IOService*> openClients;
+    IOService* powerDriver;
+    bool inactive;
+    bool registered;
+};
+
+OSDefineMetaClassAndStructors(IOService, IORegistryEntry)
+
+bool IOService::init(OSDictionary* dictionary)
+{
+    if (!IORegistryEntry::init(dictionary))
+        return false;
+    _service = new HostServiceData;
+    _service->provider = NULL;
+    _service->powerDriver = NULL;
+    _service->inactive = false;
+    _service->registered = false;
+    return true;
+}
+
+void IOService::free()
+{
+    if (_service)
+    {
+        {
+            std::lock_guard<std::recursive_mutex> guard(gMatchingLock);
+            gRegistered.erase(std::remove(gRegistered.begin(), gRegistered.end(), this), gRegistered.end());
+        }
+        delete _service;
+        _service = NULL;
+    }
+    IORegistryEntry::free();
+}
+
+bool IOService::start(IOService* provider)
+{
+    (void)provider;
+    return true;
+}
+
+void IOService::stop(IOService* provider)
+{
+    (void)provider;
+}
+
+bool IOService::attach(IOService* provider)
+{
+    if (!provider || _service->provider)
+        return false;
+    retain();
+    provider->retain();
+    _service->provider = provider;
+    std::lock_guard<std::recursive_mutex> guard(provider->_service->lock);
+    provider->_service->clients.push_back(this);
+    return true;
+}
+
+void IOService::detach(IOService* provider)
+{
+    if (!provider || _service->provider != provider)
+        return;
+    {
+        std::lock_guard<std::recursive_mutex> guard(provider->_service->lock);
+        auto& clients = provider->_service->clients;
+        clients.erase(std::remove(clients.begin(), clients.end(), this), clients.end());
+    }
+    _service->provider = NULL;
+    provider->release();
+    release();
+}
+
+bool IOService::terminate(IOOptionBits options)
+{
+    (void)options;
+    if (_service->inactive)
+        return false;
+    retain();
+    _service->inactive = true;
+    std::vector<IOService*> clients;
+    {
+        std::lock_guard<std::recursive_mutex> guard(_service->lock);
+        clients = _service->clients;
+    }
+    for (IOService* client : clients)
+        client->terminate(options);
+    messageClients(kIOMessageServiceIsTerminated);
+    if (_service->registered)
+    {
+        deliverNotifications(this, true);
+        std::lock_guard<std::recursive_mutex> guard(gMatchingLock);
+        gRegistered.erase(std::remove(gRegistered.begin(), gRegistered.end(), this), gRegistered.end());
+        _service->registered = false;
+    }
+    if (IOService* provider = _service->provider)
+    {
+        stop(provider);
+        detach(provider);
+    }
+    release();
+    return true;
+}
+
+void IOService::registerService(IOOptionBits options)
+{
+    (void)options;
+    {
+        std::lock_guard<std::recursive_mutex> guard(gMatchingLock);
+        if (_service->registered)
+            return;
+        _service->registered = true;
+        gRegistered.push_back(this);
+    }
+    deliverNotifications(this, false);
+}
+
+IOService* IOService::getProvider() const
+{
+    return _service ? _service->provider : NULL;
+}
+
+IOService* IOService::getClient() const
+{
+    std::lock_guard<std::recursive_mutex> guard(_service->lock);
+    return _service->clients.empty() ? NULL : _service->clients.front();
+}
+
+IOWorkLoop* IOService::getWorkLoop() const
+{
+    IOService* provider = getProvider();
+    return provider ? provider->getWorkLoop() : NULL;
+}
+
+bool IOService::isInactive() const
+{
+    return _service->inactive;
+}
+
+bool IOService::open(IOService* forClient, IOOptionBits options, void* arg)
+{
+    std::lock_guard<std::recursive_mutex> guard(_service->lock);
+    if (_service->inactive)
+        return false;
+    return handleOpen(forClient, options, arg);
+}
+
+void IOService::close(IOService* forClient, IOOptionBits options)
+{
+    std::lock_guard<std::recursive_mutex> guard(_service->lock);
+    if (handleIsOpen(forClient))
+        handleClose(forClient, options);
+}
+
+bool IOService::isOpen(const IOService* forClient) const
+{
+    std::lock_guard<std::recursive_mutex> guard(_service->lock);
+    return handleIsOpen(forClient);
+}
+
+bool IOService::handleOpen(IOService* forClient, IOOptionBits options, void* arg)
+{
+    (void)options; (void)arg;
+    auto& open = _service->openClients;
+    if (std::find(open.begin(), open.end(), forClient) != open.end())
+        return true;
+    if (!open.empty())
+        return false;
+    open.push_back(forClient);
+    return true;
+}
+
+void IOService::handleClose(IOService* forClient, IOOptionBits options)
+{
+    (void)options;
+    auto& open = _service->openClients;
+    open.erase(std::remove(open.begin(), open.end(), forClient), open.end());
+}
+
+bool IOService::handleIsOpen(const IOService* forClient) const
+{
+    auto& open = _service->openClients;
+    if (!forClient)
+        return !open.empty();
+    return std::find(open.begin(), open.end(), forClient) != open.end();
+}
+
+IOReturn IOService::message(UInt32 type, IOService* provider, void* argument)
+{
+    (void)type; (void)provider; (void)argument;
+    return kIOReturnUnsupported;
+}
+
+IOReturn IOService::messageClient(UInt32 messageType, OSObject* client, void* messageArgument, size_t argSize)
+{
+    (void)argSize;
+    IOService* service = OSDynamicCast(IOService, client);
+    if (!service)
+        return kIOReturnBadArgument;
+    return service->message(messageType, this, messageArgument);
+}
+
+IOReturn IOService::messageClients(UInt32 type, void* argument, size_t argSize)
+{
+    std::vector<IOService*> clients;
+    {
+        std::lock_guard<std::recursive_mutex> guard(_service->lock);
+        clients = _service->clients;
+    }
+    for (IOService* client : clients)
+        messageClient(type, client, argument, argSize);
+    return kIOReturnSuccess;
+}
+
+void IOService::PMinit()
+{
+}
+
+void IOService::PMstop()
+{
+    _service->powerDriver = NULL;
+}
+
+IOReturn IOService::registerPowerDriver(IOService* controllingDriver, IOPMPowerState* powerStates, unsigned long numberOfStates)
+{
+    (void)powerStates; (void)numberOfStates;
+    _service->powerDriver = controllingDriver;
+    return kIOReturnSuccess;
+}
+
+void IOService::joinPMtree(IOService* driver)
+{
+    (void)driver;
+}
+
+IOReturn IOService::setPowerState(unsigned long powerStateOrdinal, IOService* whatDevice)
+{
+    (void)powerStateOrdinal; (void)whatDevice;
+    return kIOPMAckImplied;
+}
+
+IOReturn IOService::acknowledgeSetPowerState()
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::makeUsable()
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::changePowerStateTo(unsigned long ordinal)
+{
+    (void)ordinal;
+    return kIOReturnSuccess;
+}
+
+IOPMrootDomain* IOService::getPMRootDomain()
+{
+    static IOPMrootDomain* rootDomain;
+    static std::once_flag once;
+    std::call_once(once, [] {
+        rootDomain = new IOPMrootDomain;
+        rootDomain->init();
+    });
+    return rootDomain;
+}
+
+IOReturn IOService::registerInterrupt(int source, OSObject* target, IOInterruptAction handler, void* refCon)
+{
+    (void)source; (void)target; (void)handler; (void)refCon;
+    return kIOReturnNoResources;
+}
+
+IOReturn IOService::unregisterInterrupt(int source)
+{
+    (void)source;
+    return kIOReturnNoResources;
+}
+
+IOReturn IOService::enableInterrupt(int source)
+{
+    (void)source;
+    return kIOReturnNoResources;
+}
+
+IOReturn IOService::disableInterrupt(int source)
+{
+    (void)source;
+    return kIOReturnNoResources;
+}
+
+IOReturn IOService::getInterruptType(int source, int* interruptType)
+{
+    (void)source; (void)interruptType;
+    return kIOReturnNoResources;
+}
+
+IOReturn IOService::getResources(void)
+{
+    return kIOReturnSuccess;
+}
+
+IOReturn IOService::callPlatformFunction(const char* functionName, bool waitForFunction,
+                                         void* param1, void* param2, void* param3, void* param4)
+{
+    (void)functionName; (void)waitForFunction; (void)param1; (void)param2; (void)param3; (void)param4;
+    return kIOReturnUnsupported;
+}
+
+OSDictionary* IOService::serviceMatching(const char* className, OSDictionary* table)
+{
+    OSDictionary* matching = table ? table : OSDictionary::withCapacity(2);
+    OSString* name = OSString::withCString(className);
+    matching->setObject(kIOProviderClassKey, name);
+    name->release();
+    return matching;
+}
+
+OSDictionary* IOService::nameMatching(const char* name, OSDictionary* table)
+{
+    OSDictionary* matching = table ? table : OSDictionary::withCapacity(2);
+    OSString* string = OSString::withCString(name);
+    matching->setObject(kIONameMatchKey, string);
+    string->release();
+    return matching;
+}
+
+OSDictionary* IOService::propertyMatching(const OSSymbol* key, const OSObject* value, OSDictionary* table)
+{
+    // (like the kernel, this replaces any earlier property match in "table")
+    OSDictionary* matching = table ? table : OSDictionary::withCapacity(2);
+    OSDictionary* properties = OSDictionary::withCapacity(1);
+    properties->setObject(key, value);
+    matching->setObject(kIOPropertyMatchKey, properties);
+    properties->release();
+    return matching;
+}
+
+IONotifier* IOService::addMatchingNotification(const OSSymbol* type, OSDictionary* matching,
+                                               IOServiceMatchingNotificationHandler handler,
+                                               void* target, void* ref, SInt32 priority)
+{
+    (void)priority;
+    HostMatchingNotifier* notifier = new HostMatchingNotifier;
+    notifier->type = type;
+    matching->retain();
+    notifier->matching = matching;
+    notifier->handler = handler;
+    notifier->target = target;
+    notifier->ref = ref;
+    std::vector<IOService*> existing;
+    {
+        std::lock_guard<std::recursive_mutex> guard(gMatchingLock);
+        gNotifiers.push_back(notifier);
+        if (isPublishType(type))
+        {
+            for (IOService* service : gRegistered)
+            {
+                if (service->hostMatches(matching))
+                {
+                    service->retain();
+                    existing.push_back(service);
+                }
+            }
+        }
+    }
+    for (IOService* service : existing)
+    {
+        handler(target, ref, service, notifier);
+        service->release();
+    }
+    return notifier;
+}
+
+IOService* IOService::waitForMatchingService(OSDictionary* matching, uint64_t timeout)
+{
+    // (consumes "matching", like the kernel; nothing turns up later here,
+    // so there is no point waiting out the timeout)
+    (void)timeout;
+    IOService* found = NULL;
+    {
+        std::lock_guard<std::recursive_mutex> guard(gMatchingLock);
+        for (IOService* service : gRegistered)
+        {
+            if (service->hostMatches(matching))
+            {
+                service->retain();
+                found = service;
+                break;
+            }
+        }
+    }
+    matching->release();
+    return found;
+}
+
+OSIterator* IOService::getMatchingServices(OSDictionary* matching)
+{
+    OSArray* array = OSArray::withCapacity(4);
+    {
+        std::lock_guard<std::recursive_mutex> guard(gMatchingLock);
+        for (IOService* service : gRegistered)
+            if (service->hostMatches(matching))
+                array->setObject(service);
+    }
+    OSIterator* iterator = OSCollectionIterator::withCollection(array);
+    array->release();
+    return iterator;
+}
+
+bool IOService::hostMatches(OSDictionary* matching) const
+{
+    if (!matching)
+        return false;
+    if (OSString* className = OSDynamicCast(OSString, matching->getObject(kIOProviderClassKey)))
+        if (!getMetaClass()->isKindOf(className->getCStringNoCopy()))
+            return false;
+    if (OSObject* names = matching->getObject(kIONameMatchKey))
+    {
+        bool matched = false;
+        if (OSString* name = OSDynamicCast(OSString, names))
+            matched = name->isEqualTo(getName());
+        else if (OSArray* array = OSDynamicCast(OSArray, names))
+            for (unsigned i = 0; i < array->getCount() && !matched; i++)
+                if (OSString* name = OSDynamicCast(OSString, array->getObject(i)))
+                    matched = name->isEqualTo(getName());
+        if (!matched)
+            return false;
+    }
+    if (OSDictionary* properties = OSDynamicCast(OSDictionary, matching->getObject(kIOPropertyMatchKey)))
+    {
+        for (unsigned i = 0; i < properties->getCount(); i++)
+        {
+            const OSSymbol* key = properties->keyAt(i);
+            OSObject* value = getProperty(key);
+            if (!value || !value->isEqualTo(properties->getObject(key)))
+                return false;
+        }
+    }
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Power management root domain and platform devices
+//
+
+OSDefineMetaClassAndStructors(IOPMrootDomain, IOService)
+
+bool IOPMrootDomain::activityTickle(unsigned long type, unsigned long stateNumber)
+{
+    (void)type; (void)stateNumber;
+    __atomic_add_fetch(&hostActivityTickles, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+IOReturn IOPMrootDomain::receivePowerNotification(UInt32 msg)
+{
+    __atomic_add_fetch(&hostPowerNotifications, 1, __ATOMIC_RELAXED);
+    hostLastPowerNotification = msg;
+    return kIOReturnSuccess;
+}
+
+OSDefineMetaClassAndStructors(IOACPIPlatformDevice, IOService)
+
+IOReturn IOACPIPlatformDevice::evaluateObject(const char* objectName, OSObject** result,
+                                              OSObject* params[], IOItemCount paramCount,
+                                              IOOptionBits options)
+{
+    (void)options;
+    __atomic_add_fetch(&hostEvaluations, 1, __ATOMIC_RELAXED);
+    if (result)
+        *result = NULL;
+    if (!hostMethod)
+        return kIOReturnNotFound;
+    OSObject* value = NULL;
+    IOReturn status = hostMethod(hostRefCon, objectName, params, paramCount, &value);
+    if (result)
+        *result = value;
+    else if (value)
+        value->release();
+    return status;
+}
+
+IOReturn IOACPIPlatformDevice::evaluateInteger(const char* objectName, UInt64* resultInt64,
+                                               OSObject* params[], IOItemCount paramCount,
+                                               IOOptionBits options)
+{
+    OSObject* result = NULL;
+    IOReturn status = evaluateObject(objectName, &result, params, paramCount, options);
+    if (status == kIOReturnSuccess)
+    {
+        OSNumber* number = OSDynamicCast(OSNumber, result);
+        if (number)
+            *resultInt64 = number->unsigned64BitValue();
+        else
+            status = kIOReturnBadArgument;
+    }
+    OSSafeReleaseNULL(result);
+    return status;
+}
+
+IOReturn IOACPIPlatformDevice::evaluateInteger(const char* objectName, UInt32* resultInt32,
+                                               OSObject* params[], IOItemCount paramCount,
+                                               IOOptionBits options)
+{
+    UInt64 value = 0;
+    IOReturn status = evaluateInteger(objectName, &value, params, paramCount, options);
+    if (status == kIOReturnSuccess)
+        *resultInt32 = (UInt32)value;
+    return status;
+}
+
+IOReturn IOACPIPlatformDevice::validateObject(const char* objectName)
+{
+    if (!hostMethod)
+        return kIOReturnNotFound;
+    // a method is "present" if the test answers anything but NotFound
+    OSObject* value = NULL;
+    IOReturn status = hostMethod(hostRefCon, objectName, NULL, 0, &value);
+    OSSafeReleaseNULL(value);
+    return status == kIOReturnNotFound ? kIOReturnNotFound : kIOReturnSuccess;
+}
+
+OSDefineMetaClassAndStructors(IOBufferMemoryDescriptor, OSObject)
+OSDefineMetaClassAndStructors(IOPlatformExpert, IOService)
+OSDefineMetaClassAndStructors(IOPlatformDevice, IOService)
+OSDefineMetaClassAndStructors(IOUserClient, IOService)
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// IOWorkLoop
+//
+// One thread per work loop.  The gate is a recursive lock that
+// commandSleep releases completely while it waits, as in the kernel.
+//
+
+struct HostWorkLoopData
+{
+    std::mutex mutex;
+    std::condition_variable cv;         // work loop thread: work or deadline
+    std::condition_variable gateCV;     // gate released, sleepers woken
+    std::thread thread;
+    std::thread::id threadID;
+    std::thread::id gateOwner;
+    unsigned gateDepth;
+    std::vector<IOEventSource*> sources;
+    bool workToDo;
+    bool idle;
+    bool quit;
+    struct Sleeper { void* event; bool woken; };
+    std::list<Sleeper*> sleepers;
+};
+
+OSDefineMetaClassAndStructors(IOWorkLoop, OSObject)
+
+static void workLoopThread(IOWorkLoop* loop, HostWorkLoopData* host);
+
+IOWorkLoop* IOWorkLoop::workLoop()
+{
+    IOWorkLoop* loop = new IOWorkLoop;
+    if (!loop->init())
+        OSSafeReleaseNULL(loop);
+    return loop;
+}
+
+bool IOWorkLoop::init()
+{
+    if (!OSObject::init())
+        return false;
+    _host = new HostWorkLoopData;
+    _host->gateDepth = 0;
+    _host->workToDo = false;
+    _host->idle = false;
+    _host->quit = false;
+    std::unique_lock<std::mutex> guard(_host->mutex);
+    _host->thread = std::thread(workLoopThread, this, _host);
+    _host->cv.wait(guard, [&] { return _host->threadID != std::thread::id(); });
+    return true;
+}
+
+void IOWorkLoop::free()
+{
+    if (_host)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_host->mutex);
+            _host->quit = true;
+            _host->cv.notify_all();
+        }
+        if (std::this_thread::get_id() == _host->thread.get_id())
+        {
+            // (released by its own thread; leave the data to the thread)
+            _host->thread.detach();
+            _host = NULL;
+            OSObject::free();
+            return;
+        }
+        _host->thread.join();
+        for (IOEventSource* source : _host->sources)
+        {
+            source->setWorkLoop(NULL);
+            source->release();
+        }
+        delete _host;
+        _host = NULL;
+    }
+    OSObject::free();
+}
+
+IOReturn IOWorkLoop::addEventSource(IOEventSource* newEvent)
+{
+    if (!newEvent)
+        return kIOReturnBadArgument;
+    closeGate();
+    {
+        std::lock_guard<std::mutex> guard(_host->mutex);
+        if (std::find(_host->sources.begin(), _host->sources.end(), newEvent) == _host->sources.end())
+        {
+            newEvent->retain();
+            _host->sources.push_back(newEvent);
+        }
+    }
+    newEvent->setWorkLoop(this);
+    openGate();
+    signalWorkAvailable();
+    return kIOReturnSuccess;
+}
+
+IOReturn IOWorkLoop::removeEventSource(IOEventSource* toRemove)
+{
+    closeGate();
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> guard(_host->mutex);
+        auto it = std::find(_host->sources.begin(), _host->sources.end(), toRemove);
+        if (it != _host->sources.end())
+        {
+            _host->sources.erase(it);
+            found = true;
+        }
+    }
+    if (found)
+    {
+        toRemove->setWorkLoop(NULL);
+        toRemove->release();
+    }
+    openGate();
+    return found ? kIOReturnSuccess : kIOReturnBadArgument;
+}
+
+void IOWorkLoop::closeGate()
+{
+    if (HostKernel::atInterruptLevel())
+        HostKernel::noteViolation("closeGate at interrupt level");
+    std::unique_lock<std::mutex> guard(_host->mutex);
+    std::thread::id self = std::this_thread::get_id();
+    if (_host->gateOwner == self)
+    {
+        _host->gateDepth++;
+        return;
+    }
+    _host->gateCV.wait(guard, [&] { return _host->gateOwner == std::thread::id(); });
+    _host->gateOwner = self;
+    _host->gateDepth = 1;
+}
+
+bool IOWorkLoop::tryCloseGate()
+{
+    std::lock_guard<std::mutex> guard(_host->mutex);
+    std::thread::id self = std::this_thread::get_id();
+    if (_host->gateOwner == self)
+    {
+        _host->gateDepth++;
+        return true;
+    }
+    if (_host->gateOwner != std::thread::id())
+        return false;
+    _host->gateOwner = self;
+    _host->gateDepth = 1;
+    return true;
+}
+
+void IOWorkLoop::openGate()
+{
+    std::lock_guard<std::mutex> guard(_host->mutex);
+    if (_host->gateOwner != std::this_thread::get_id())
+    {
+        HostKernel::noteViolation("openGate without the gate");
+        return;
+    }
+    if (!--_host->gateDepth)
+    {
+        _host->gateOwner = std::thread::id();
+        _host->gateCV.notify_all();
+    }
+}
+
+bool IOWorkLoop::inGate() const
+{
+    std::lock_guard<std::mutex> guard(_host->mutex);
+    return _host->gateOwner == std::this_thread::get_id();
+}
+
+bool IOWorkLoop::onThread() const
+{
+    return std::this_thread::get_id() == _host->threadID;
+}
+
+IOReturn IOWorkLoop::runAction(IOReturn (*action)(OSObject*, void*, void*, void*, void*), OSObject* target,
+                               void* arg0, void* arg1, void* arg2, void* arg3)
+{
+    closeGate();
+    IOReturn result = action(target, arg0, arg1, arg2, arg3);
+    openGate();
+    return result;
+}
+
+void IOWorkLoop::signalWorkAvailable()
+{
+    std::lock_guard<std::mutex> guard(_host->mutex);
+    _host->workToDo = true;
+    _host->cv.notify_all();
+}
+
+int IOWorkLoop::sleepGate(void* event, uint64_t deadline)
+{
+    if (HostKernel::atInterruptLevel())
+        HostKernel::noteViolation("commandSleep at interrupt level");
+    std::unique_lock<std::mutex> guard(_host->mutex);
+    std::thread::id self = std::this_thread::get_id();
+    if (_host->gateOwner != self)
+    {
+        HostKernel::noteViolation("commandSleep without the gate");
+        return THREAD_INTERRUPTED;
+    }
+    HostWorkLoopData::Sleeper sleeper = { event, false };
+    _host->sleepers.push_back(&sleeper);
+    unsigned depth = _host->gateDepth;
+    _host->gateOwner = std::thread::id();
+    _host->gateDepth = 0;
+    _host->gateCV.notify_all();
+    int result = THREAD_AWAKENED;
+    if (deadline)
+    {
+        auto when = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(deadline));
+        if (!_host->gateCV.wait_until(guard, when, [&] { return sleeper.woken; }))
+            result = THREAD_TIMED_OUT;
+    }
+    else
+        _host->gateCV.wait(guard, [&] { return sleeper.woken; });
+    _host->sleepers.remove(&sleeper);
+    _host->gateCV.wait(guard, [&] { return _host->gateOwner == std::thread::id(); });
+    _host->gateOwner = self;
+    _host->gateDepth = depth;
+    return result;
+}
+
+void IOWorkLoop::wakeupGate(void* event, bool oneThread)
+{
+    std::lock_guard<std::mutex> guard(_host->mutex);
+    for (HostWorkLoopData::Sleeper* sleeper : _host->sleepers)
+    {
+        if (sleeper->event != event || sleeper->woken)
+            continue;
+        sleeper->woken = true;
+        if (oneThread)
+            break;
+    }
+    _host->gateCV.notify_all();
+}
+
+static uint64_t earliestDeadline(HostWorkLoopData* host)
+{
+    uint64_t earliest = 0;
+    for (IOEventSource* source : host->sources)
+    {
+        uint64_t deadline = source->hostDeadline();
+        if (deadline && (!earliest || deadline < earliest))
+            earliest = deadline;
+    }
+    return earliest;
+}
+
+static void workLoopThread(IOWorkLoop* loop, HostWorkLoopData* host)
+{
+    {
+        std::lock_guard<std::mutex> guard(host->mutex);
+        host->threadID = std::this_thread::get_id();
+        host->cv.notify_all();
+    }
+    for (;;)
+    {
+        loop->closeGate();
+        bool more;
+        do
+        {
+            more = false;
+            std::vector<IOEventSource*> sources;
+            {
+                std::lock_guard<std::mutex> guard(host->mutex);
+                host->workToDo = false;
+                sources = host->sources;
+                for (IOEventSource* source : sources)
+                    source->retain();
+            }
+            for (IOEventSource* source : sources)
+            {
+                if (source->getWorkLoop() == loop && source->isEnabled() && source->checkForWork())
+                    more = true;
+                source->release();
+            }
+        } while (more);
+        loop->openGate();
+
+        std::unique_lock<std::mutex> guard(host->mutex);
+        if (host->quit)
+            return;
+        if (host->workToDo)
+            continue;
+        host->idle = true;
+        uint64_t deadline = earliestDeadline(host);
+        if (deadline)
+        {
+            auto when = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(deadline));
+            host->cv.wait_until(guard, when, [&] { return host->workToDo || host->quit; });
+        }
+        else
+            host->cv.wait(guard, [&] { return host->workToDo || host->quit; });
+        host->idle = false;
+        if (host->quit)
+            return;
+    }
+}
+
+void IOWorkLoop::hostSettle(unsigned horizonMS)
+{
+    // Quiet means: loop parked, nothing signalled, gate free, and no timer
+    // due within the horizon; it has to hold twice in a row, a millisecond
+    // apart, so work that is just being handed over is not missed.
+    unsigned quiet = 0;
+    for (unsigned tries = 0; tries < 10000 && quiet < 2; tries++)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::lock_guard<std::mutex> guard(_host->mutex);
+        uint64_t deadline = earliestDeadline(_host);
+        bool due = deadline && deadline < mach_absolute_time() + (uint64_t)horizonMS * 1000000;
+        if (_host->idle && !_host->workToDo && _host->gateOwner == std::thread::id() && !due)
+            quiet++;
+        else
+            quiet = 0;
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Event sources
+//
+
+OSDefineMetaClassAndStructors(IOEventSource, OSObject)
+
+bool IOEventSource::init(OSObject* inOwner, void* inAction)
+{
+    if (!OSObject::init())
+        return false;
+    owner = inOwner;
+    action = inAction;
+    enabled = true;
+    return true;
+}
+
+bool IOEventSource::onThread() const
+{
+    return workLoop && workLoop->onThread();
+}
+
+void IOEventSource::signalWorkAvailable()
+{
+    if (IOWorkLoop* loop = workLoop)
+        loop->signalWorkAvailable();
+}
+
+void IOEventSource::closeGate()
+{
+    workLoop->closeGate();
+}
+
+void IOEventSource::openGate()
+{
+    workLoop->openGate();
+}
+
+OSDefineMetaClassAndStructors(IOCommandGate, IOEventSource)
+
+IOCommandGate* IOCommandGate::commandGate(OSObject* owner, Action action)
+{
+    IOCommandGate* gate = new IOCommandGate;
+    if (!gate->init(owner, (void*)action))
+        OSSafeReleaseNULL(gate);
+    return gate;
+}
+
+IOReturn IOCommandGate::runCommand(void* arg0, void* arg1, void* arg2, void* arg3)
+{
+    return runAction((Action)action, arg0, arg1, arg2, arg3);
+}
+
+IOReturn IOCommandGate::runAction(Action inAction, void* arg0, void* arg1, void* arg2, void* arg3)
+{
+    if (!inAction)
+        return kIOReturnBadArgument;
+    IOWorkLoop* loop = workLoop;
+    if (!loop)
+        return kIOReturnNotReady;
+    loop->retain();
+    loop->closeGate();
+    IOReturn result = inAction(owner, arg0, arg1, arg2, arg3);
+    loop->openGate();
+    loop->release();
+    return result;
+}
+
+IOReturn IOCommandGate::attemptAction(Action inAction, void* arg0, void* arg1, void* arg2, void* arg3)
+{
+    if (!inAction)
+        return kIOReturnBadArgument;
+    IOWorkLoop* loop = workLoop;
+    if (!loop)
+        return kIOReturnNotReady;
+    if (!loop->tryCloseGate())
+        return kIOReturnCannotLock;
+    IOReturn result = inAction(owner, arg0, arg1, arg2, arg3);
+    loop->openGate();
+    return result;
+}
+
+IOReturn IOCommandGate::commandSleep(void* event, UInt32 interruptible)
+{
+    (void)interruptible;
+    if (!workLoop)
+        return kIOReturnNotReady;
+    workLoop->sleepGate(event, 0);
+    return THREAD_AWAKENED;
+}
+
+IOReturn IOCommandGate::commandSleep(void* event, AbsoluteTime deadline, UInt32 interruptible)
+{
+    (void)interruptible;
+    if (!workLoop)
+        return kIOReturnNotReady;
+    return workLoop->sleepGate(event, deadline ? deadline : 0);
+}
+
+void IOCommandGate::commandWakeup(void* event, bool oneThread)
+{
+    if (workLoop)
+        workLoop->wakeupGate(event, oneThread);
+}
+
+OSDefineMetaClassAndStructors(IOTimerEventSource, IOEventSource)
+
+IOTimerEventSource* IOTimerEventSource::timerEventSource(OSObject* owner, Action action)
+{
+    IOTimerEventSource* timer = new IOTimerEventSource;
+    if (!timer->init(owner, (void*)action))
+        OSSafeReleaseNULL(timer);
+    return timer;
+}
+
+IOReturn IOTimerEventSource::setTimeoutMS(UInt32 ms)
+{
+    return setTimeout(ms, kMillisecondScale);
+}
+
+IOReturn IOTimerEventSource::setTimeoutUS(UInt32 us)
+{
+    return setTimeout(us, kMicrosecondScale);
+}
+
+IOReturn IOTimerEventSource::setTimeout(UInt32 interval, UInt32 scaleFactor)
+{
+    uint64_t when;
+    clock_interval_to_deadline(interval, scaleFactor, &when);
+    return wakeAtTime(when);
+}
+
+IOReturn IOTimerEventSource::setTimeout(AbsoluteTime interval)
+{
+    return wakeAtTime(mach_absolute_time() + interval);
+}
+
+IOReturn IOTimerEventSource::wakeAtTimeMS(UInt32 ms)
+{
+    return wakeAtTime((uint64_t)ms * kMillisecondScale);
+}
+
+IOReturn IOTimerEventSource::wakeAtTime(AbsoluteTime abstime)
+{
+    if (!action)
+        return kIOReturnNoResources;
+    deadline = abstime ? abstime : 1;
+    signalWorkAvailable();
+    return kIOReturnSuccess;
+}
+
+void IOTimerEventSource::cancelTimeout()
+{
+    deadline = 0;
+}
+
+bool IOTimerEventSource::checkForWork()
+{
+    uint64_t due = deadline;
+    if (!due || due > mach_absolute_time())
+        return false;
+    deadline = 0;
+    ((Action)action)(owner, this);
+    return false;
+}
+
+OSDefineMetaClassAndStructors(IOInterruptEventSource, IOEventSource)
+
+IOInterruptEventSource* IOInterruptEventSource::interruptEventSource(OSObject* owner, Action action,
+                                                                   IOService* provider, int intIndex)
+{
+    (void)provider; (void)intIndex;
+    IOInterruptEventSource* source = new IOInterruptEventSource;
+    if (!source->init(owner, (void*)action))
+        OSSafeReleaseNULL(source);
+    return source;
+}
+
+void IOInterruptEventSource::interruptOccurred(void* nub, IOService* provider, int index)
+{
+    (void)nub; (void)provider; (void)index;
+    __atomic_add_fetch(&producerCount, 1, __ATOMIC_RELEASE);
+    signalWorkAvailable();
+}
+
+bool IOInterruptEventSource::checkForWork()
+{
+    unsigned produced = __atomic_load_n(&producerCount, __ATOMIC_ACQUIRE);
+    int count = (int)(produced - consumerCount);
+    if (count > 0)
+    {
+        consumerCount = produced;
+        ((Action)action)(owner, this, count);
+    }
+    return false;
+}
@@ -0,0 +1,478 @@
+//
+// HostKernel.cpp
+//
+// Kernel services for the host build: time, delays, allocation, locks and
+// thread calls, plus the interrupt-level bookkeeping described in
+// HostKernel.h.
+//
+
+#include "HostKernel.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <sched.h>
+
+int version_major = 21;
+int version_minor = 0;
+kmod_info_t kmod_info = { "VoodooPS2Host", "0.0" };
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Interrupt level
+//
+
+static thread_local bool tInInterrupt;
+static thread_local bool tInterruptsDisabled;
+static std::atomic<unsigned> gViolations(0);
+static std::atomic<bool> gLogging(getenv("HOST_IOLOG") != NULL);
+
+bool HostKernel::atInterruptLevel()
+{
+    return tInInterrupt || tInterruptsDisabled;
+}
+
+void HostKernel::noteViolation(const char* what)
+{
+    gViolations++;
+    fprintf(stderr, "host: violation: %s\n", what);
+}
+
+unsigned HostKernel::violations()
+{
+    return gViolations;
+}
+
+void HostKernel::resetViolations()
+{
+    gViolations = 0;
+}
+
+void HostKernel::setLogging(bool enable)
+{
+    gLogging = enable;
+}
+
+HostKernel::InterruptScope::InterruptScope()
+{
+    saved = tInInterrupt;
+    tInInterrupt = true;
+}
+
+HostKernel::InterruptScope::~InterruptScope()
+{
+    tInInterrupt = saved;
+}
+
+static inline void checkMayBlock(const char* what)
+{
+    if (HostKernel::atInterruptLevel())
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "%s at interrupt level", what);
+        HostKernel::noteViolation(message);
+    }
+}
+
+bool ml_set_interrupts_enabled(bool enable)
+{
+    bool previous = !tInterruptsDisabled;
+    tInterruptsDisabled = !enable;
+    return previous;
+}
+
+bool ml_get_interrupts_enabled(void)
+{
+    return !tInterruptsDisabled;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Logging, time and delays
+//
+
+void IOLog(const char* format, ...)
+{
+    if (!gLogging)
+        return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+void panic(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "panic: ");
+    vfprintf(stderr, format, args);
+    va_end(args);
+    abort();
+}
+
+// absolute time is in nanoseconds, as on Intel Macs
+uint64_t mach_absolute_time(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void clock_get_uptime(uint64_t* result)
+{
+    *result = mach_absolute_time();
+}
+
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result)
+{
+    *result = abstime;
+}
+
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result)
+{
+    *result = nanoseconds;
+}
+
+void clock_interval_to_deadline(uint32_t interval, uint32_t scale_factor, uint64_t* result)
+{
+    *result = mach_absolute_time() + (uint64_t)interval * scale_factor;
+}
+
+void clock_get_system_microtime(uint32_t* secs, uint32_t* microsecs)
+{
+    uint64_t now = mach_absolute_time() / 1000;
+    *secs = (uint32_t)(now / 1000000);
+    *microsecs = (uint32_t)(now % 1000000);
+}
+
+void IOSleep(unsigned milliseconds)
+{
+    checkMayBlock("IOSleep");
+    std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+}
+
+void IODelay(unsigned microseconds)
+{
+    // A spin, like the kernel's, but yielding so the emulated hardware
+    // gets the CPU on small hosts.
+    uint64_t deadline = mach_absolute_time() + (uint64_t)microseconds * 1000;
+    while (mach_absolute_time() < deadline)
+        sched_yield();
+}
+
+boolean_t PE_parse_boot_argn(const char* arg_string, void* arg_ptr, int max_arg)
+{
+    // boot-args come from HOST_BOOT_ARGS, e.g. "vps2_debug=1 -v"
+    const char* args = getenv("HOST_BOOT_ARGS");
+    if (!args)
+        return FALSE;
+    size_t length = strlen(arg_string);
+    for (const char* p = args; *p; )
+    {
+        while (*p == ' ')
+            p++;
+        const char* word = p;
+        while (*p && *p != ' ')
+            p++;
+        if ((size_t)(p - word) < length || strncmp(word, arg_string, length))
+            continue;
+        const char* rest = word + length;
+        if (rest == p)
+        {
+            if (arg_string[0] != '-')
+                continue;
+            long long one = 1;
+            memcpy(arg_ptr, &one, max_arg < (int)sizeof(one) ? max_arg : sizeof(one));
+            return TRUE;
+        }
+        if (*rest != '=')
+            continue;
+        long long value = strtoll(rest + 1, NULL, 0);
+        memcpy(arg_ptr, &value, max_arg < (int)sizeof(value) ? max_arg : sizeof(value));
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Allocation
+//
+
+void* IOMalloc(size_t size)
+{
+    checkMayBlock("IOMalloc");
+    return malloc(size ? size : 1);
+}
+
+void IOFree(void* address, size_t size)
+{
+    (void)size;
+    free(address);
+}
+
+void* IOMallocAligned(size_t size, size_t alignment)
+{
+    checkMayBlock("IOMallocAligned");
+    void* p = NULL;
+    if (alignment < sizeof(void*))
+        alignment = sizeof(void*);
+    if (posix_memalign(&p, alignment, size ? size : 1))
+        return NULL;
+    return p;
+}
+
+void IOFreeAligned(void* address, size_t size)
+{
+    (void)size;
+    free(address);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Locks
+//
+
+struct IOLock
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    unsigned generation;
+};
+
+IOLock* IOLockAlloc(void)
+{
+    return new IOLock();
+}
+
+void IOLockFree(IOLock* lock)
+{
+    delete lock;
+}
+
+void IOLockLock(IOLock* lock)
+{
+    checkMayBlock("IOLockLock");
+    lock->mutex.lock();
+}
+
+bool IOLockTryLock(IOLock* lock)
+{
+    return lock->mutex.try_lock();
+}
+
+void IOLockUnlock(IOLock* lock)
+{
+    lock->mutex.unlock();
+}
+
+int IOLockSleep(IOLock* lock, void* event, UInt32 interType)
+{
+    // one condition per lock; wakeups for other events are just spurious
+    (void)event; (void)interType;
+    checkMayBlock("IOLockSleep");
+    std::unique_lock<std::mutex> guard(lock->mutex, std::adopt_lock);
+    unsigned generation = lock->generation;
+    lock->cv.wait(guard, [&] { return lock->generation != generation; });
+    guard.release();
+    return THREAD_AWAKENED;
+}
+
+void IOLockWakeup(IOLock* lock, void* event, bool oneThread)
+{
+    (void)event; (void)oneThread;
+    lock->generation++;
+    lock->cv.notify_all();
+}
+
+struct IOSimpleLock
+{
+    std::atomic_flag flag = ATOMIC_FLAG_INIT;
+};
+
+IOSimpleLock* IOSimpleLockAlloc(void)
+{
+    return new IOSimpleLock();
+}
+
+void IOSimpleLockFree(IOSimpleLock* lock)
+{
+    delete lock;
+}
+
+void IOSimpleLockLock(IOSimpleLock* lock)
+{
+    while (lock->flag.test_and_set(std::memory_order_acquire))
+        sched_yield();
+}
+
+void IOSimpleLockUnlock(IOSimpleLock* lock)
+{
+    lock->flag.clear(std::memory_order_release);
+}
+
+IOInterruptState IOSimpleLockLockDisableInterrupt(IOSimpleLock* lock)
+{
+    bool enabled = ml_set_interrupts_enabled(false);
+    IOSimpleLockLock(lock);
+    return (IOInterruptState)(uintptr_t)enabled;
+}
+
+void IOSimpleLockUnlockEnableInterrupt(IOSimpleLock* lock, IOInterruptState state)
+{
+    IOSimpleLockUnlock(lock);
+    ml_set_interrupts_enabled((uintptr_t)state != 0);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Thread calls
+//
+// Every enter runs the callout on a thread of its own, so callouts can block
+// on each other and on the work loop the way they can in the kernel.  Freeing
+// a call that is still running is reported, since the kernel would be left
+// with a dangling callout.
+//
+
+struct thread_call
+{
+    thread_call_func_t func;
+    thread_call_param_t param0;
+    thread_call_param_t param1;
+    bool pending;
+    unsigned running;
+    unsigned generation;
+    bool freed;
+};
+
+static std::mutex gCallMutex;
+static std::condition_variable gCallCV;
+static unsigned gCallThreads;
+
+static void runThreadCall(thread_call_t call, unsigned generation, uint64_t deadline)
+{
+    std::unique_lock<std::mutex> guard(gCallMutex);
+    if (deadline)
+    {
+        auto when = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(deadline));
+        gCallCV.wait_until(guard, when, [&] { return call->generation != generation; });
+    }
+    if (call->pending && call->generation == generation)
+    {
+        call->pending = false;
+        call->running++;
+        thread_call_param_t param1 = call->param1;
+        guard.unlock();
+        call->func(call->param0, param1);
+        guard.lock();
+        call->running--;
+    }
+    if (call->freed && !call->pending && !call->running)
+        delete call;
+    gCallThreads--;
+    gCallCV.notify_all();
+}
+
+static boolean_t enterThreadCall(thread_call_t call, thread_call_param_t param1, bool setParam, uint64_t deadline)
+{
+    std::lock_guard<std::mutex> guard(gCallMutex);
+    if (setParam)
+        call->param1 = param1;
+    if (call->pending)
+        return TRUE;
+    call->pending = true;
+    gCallThreads++;
+    std::thread(runThreadCall, call, call->generation, deadline).detach();
+    return FALSE;
+}
+
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0)
+{
+    thread_call_t call = new thread_call();
+    call->func = func;
+    call->param0 = param0;
+    return call;
+}
+
+boolean_t thread_call_enter(thread_call_t call)
+{
+    return enterThreadCall(call, 0, false, 0);
+}
+
+boolean_t thread_call_enter1(thread_call_t call, thread_call_param_t param1)
+{
+    return enterThreadCall(call, param1, true, 0);
+}
+
+boolean_t thread_call_enter_delayed(thread_call_t call, uint64_t deadline)
+{
+    return enterThreadCall(call, 0, false, deadline ? deadline : 1);
+}
+
+boolean_t thread_call_cancel(thread_call_t call)
+{
+    std::lock_guard<std::mutex> guard(gCallMutex);
+    if (!call->pending)
+        return FALSE;
+    call->pending = false;
+    call->generation++;
+    gCallCV.notify_all();
+    return TRUE;
+}
+
+boolean_t thread_call_cancel_wait(thread_call_t call)
+{
+    checkMayBlock("thread_call_cancel_wait");
+    std::unique_lock<std::mutex> guard(gCallMutex);
+    boolean_t cancelled = call->pending;
+    if (call->pending)
+    {
+        call->pending = false;
+        call->generation++;
+        gCallCV.notify_all();
+    }
+    gCallCV.wait(guard, [&] { return !call->running; });
+    return cancelled;
+}
+
+boolean_t thread_call_free(thread_call_t call)
+{
+    std::lock_guard<std::mutex> guard(gCallMutex);
+    if (call->pending)
+        return FALSE;
+    if (call->running)
+    {
+        HostKernel::noteViolation("thread_call_free while the callout is running");
+        call->freed = true;
+        return TRUE;
+    }
+    delete call;
+    return TRUE;
+}
+
+void HostKernel::drainThreadCalls()
+{
+    std::unique_lock<std::mutex> guard(gCallMutex);
+    gCallCV.wait(guard, [] { return !gCallThreads; });
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Privilege check
+//
+
+static std::atomic<bool> gAdministrator(true);
+
+void HostKernel::setAdministrator(bool admin)
+{
+    gAdministrator = admin;
+}
+
+task_t current_task(void)
+{
+    return NULL;
+}
+
+IOReturn IOUserClient::clientHasPrivilege(void* securityToken, const char* privilegeName)
+{
+    (void)securityToken;
+    if (strcmp(privilegeName, kIOClientPrivilegeAdministrator))
+        return kIOReturnUnsupported;
+    return gAdministrator ? kIOReturnSuccess : kIOReturnNotPrivileged;
+}
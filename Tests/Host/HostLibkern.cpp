@@ -0,0 +1,769 @@
+//
+// HostLibkern.cpp
+//
+// OSObject, the OS containers and a property list parser for the host build.
+//
+
+#include "HostKernel.h"
+
+#include <string>
+#include <vector>
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// OSMetaClass and OSObject
+//
+
+bool OSMetaClass::isKindOf(const char* className) const
+{
+    for (const OSMetaClass* meta = this; meta; meta = meta->superClass)
+        if (!strcmp(meta->name, className))
+            return true;
+    return false;
+}
+
+const OSMetaClass OSObject::gMetaClass("OSObject", NULL);
+const OSMetaClass* const OSObject::metaClass = &OSObject::gMetaClass;
+
+void OSObject::retain() const
+{
+    __atomic_add_fetch(&retainCount, 1, __ATOMIC_RELAXED);
+}
+
+void OSObject::release() const
+{
+    if (!__atomic_sub_fetch(&retainCount, 1, __ATOMIC_ACQ_REL))
+        const_cast<OSObject*>(this)->free();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// OSString and OSSymbol
+//
+
+OSDefineMetaClassAndStructors(OSString, OSObject)
+
+OSString* OSString::withCString(const char* cString)
+{
+    return withCString(cString, strlen(cString));
+}
+
+OSString* OSString::withCString(const char* cString, size_t length)
+{
+    OSString* string = new OSString;
+    if (!string->initWithCString(cString, length))
+        OSSafeReleaseNULL(string);
+    return string;
+}
+
+OSString* OSString::withCStringNoCopy(const char* cString)
+{
+    return withCString(cString);
+}
+
+OSString* OSString::withString(const OSString* aString)
+{
+    return withCString(aString->getCStringNoCopy(), aString->getLength());
+}
+
+bool OSString::initWithCString(const char* cString, size_t len)
+{
+    if (!cString)
+        return false;
+    string = (char*)malloc(len + 1);
+    memcpy(string, cString, len);
+    string[len] = 0;
+    length = (unsigned)len;
+    return true;
+}
+
+void OSString::free()
+{
+    ::free(string);
+    OSObject::free();
+}
+
+bool OSString::setChar(char aChar, unsigned index)
+{
+    if (index >= length)
+        return false;
+    string[index] = aChar;
+    return true;
+}
+
+bool OSString::isEqualTo(const char* cString) const
+{
+    return cString && !strcmp(string, cString);
+}
+
+bool OSString::isEqualTo(const OSString* other) const
+{
+    return other && length == other->length && !memcmp(string, other->string, length);
+}
+
+bool OSString::isEqualTo(const OSMetaClassBase* other) const
+{
+    const OSString* string = OSDynamicCast(OSString, other);
+    return string && isEqualTo(string);
+}
+
+OSDefineMetaClassAndStructors(OSSymbol, OSString)
+
+const OSSymbol* OSSymbol::withCString(const char* cString)
+{
+    OSSymbol* symbol = new OSSymbol;
+    if (!symbol->initWithCString(cString, strlen(cString)))
+        OSSafeReleaseNULL(symbol);
+    return symbol;
+}
+
+const OSSymbol* OSSymbol::withCStringNoCopy(const char* cString)
+{
+    return withCString(cString);
+}
+
+const OSSymbol* OSSymbol::withString(const OSString* aString)
+{
+    return withCString(aString->getCStringNoCopy());
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// OSNumber, OSBoolean and OSData
+//
+
+OSDefineMetaClassAndStructors(OSNumber, OSObject)
+
+OSNumber* OSNumber::withNumber(unsigned long long value, unsigned numberOfBits)
+{
+    OSNumber* number = new OSNumber;
+    number->size = numberOfBits ? (numberOfBits > 64 ? 64 : numberOfBits) : 64;
+    number->setValue(value);
+    return number;
+}
+
+OSNumber* OSNumber::withNumber(const char* value, unsigned numberOfBits)
+{
+    return withNumber(strtoull(value, NULL, 0), numberOfBits);
+}
+
+bool OSNumber::isEqualTo(const OSMetaClassBase* other) const
+{
+    const OSNumber* number = OSDynamicCast(OSNumber, other);
+    return number && isEqualTo(number);
+}
+
+OSDefineMetaClassAndStructors(OSBoolean, OSObject)
+
+OSBoolean* OSBoolean::makeStatic(bool value)
+{
+    OSBoolean* boolean = new OSBoolean;
+    boolean->value = value;
+    return boolean;
+}
+
+static OSBoolean* gOSBooleanTrue = OSBoolean::makeStatic(true);
+static OSBoolean* gOSBooleanFalse = OSBoolean::makeStatic(false);
+OSBoolean* const& kOSBooleanTrue = gOSBooleanTrue;
+OSBoolean* const& kOSBooleanFalse = gOSBooleanFalse;
+
+OSBoolean* OSBoolean::withBoolean(bool value)
+{
+    return value ? kOSBooleanTrue : kOSBooleanFalse;
+}
+
+bool OSBoolean::isEqualTo(const OSMetaClassBase* other) const
+{
+    return other == this;
+}
+
+OSDefineMetaClassAndStructors(OSData, OSObject)
+
+OSData* OSData::withCapacity(unsigned capacity)
+{
+    OSData* data = new OSData;
+    data->ensureCapacity(capacity);
+    return data;
+}
+
+OSData* OSData::withBytes(const void* bytes, unsigned numBytes)
+{
+    OSData* data = withCapacity(numBytes);
+    data->appendBytes(bytes, numBytes);
+    return data;
+}
+
+OSData* OSData::withBytesNoCopy(void* bytes, unsigned numBytes)
+{
+    return withBytes(bytes, numBytes);
+}
+
+OSData* OSData::withData(const OSData* other)
+{
+    return withBytes(other->getBytesNoCopy(), other->getLength());
+}
+
+void OSData::free()
+{
+    ::free(data);
+    OSObject::free();
+}
+
+const void* OSData::getBytesNoCopy(unsigned start, unsigned numBytes) const
+{
+    if (start + numBytes > length || start + numBytes < start)
+        return NULL;
+    return (const char*)data + start;
+}
+
+unsigned OSData::ensureCapacity(unsigned newCapacity)
+{
+    if (newCapacity > capacity)
+    {
+        void* grown = realloc(data, newCapacity);
+        if (!grown)
+            return capacity;
+        data = grown;
+        capacity = newCapacity;
+    }
+    return capacity;
+}
+
+bool OSData::appendBytes(const void* bytes, unsigned numBytes)
+{
+    if (ensureCapacity(length + numBytes) < length + numBytes)
+        return false;
+    if (bytes)
+        memcpy((char*)data + length, bytes, numBytes);
+    else
+        memset((char*)data + length, 0, numBytes);
+    length += numBytes;
+    return true;
+}
+
+bool OSData::isEqualTo(const void* bytes, unsigned numBytes) const
+{
+    return numBytes == length && (!length || !memcmp(data, bytes, length));
+}
+
+bool OSData::isEqualTo(const OSMetaClassBase* other) const
+{
+    const OSData* data = OSDynamicCast(OSData, other);
+    return data && isEqualTo(data->getBytesNoCopy(), data->getLength());
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Collections
+//
+
+OSDefineMetaClassAndAbstractStructors(OSCollection, OSObject)
+OSDefineMetaClassAndStructors(OSArray, OSCollection)
+
+OSArray* OSArray::withCapacity(unsigned capacity)
+{
+    OSArray* array = new OSArray;
+    array->capacity = capacity ? capacity : 1;
+    array->array = (OSObject**)calloc(array->capacity, sizeof(OSObject*));
+    return array;
+}
+
+OSArray* OSArray::withObjects(const OSObject* objects[], unsigned count, unsigned capacity)
+{
+    OSArray* array = withCapacity(capacity > count ? capacity : count);
+    for (unsigned i = 0; i < count; i++)
+        array->setObject(objects[i]);
+    return array;
+}
+
+OSArray* OSArray::withArray(const OSArray* other, unsigned capacity)
+{
+    OSArray* array = withCapacity(capacity > other->count ? capacity : other->count);
+    array->merge(other);
+    return array;
+}
+
+void OSArray::free()
+{
+    flushCollection();
+    ::free(array);
+    OSCollection::free();
+}
+
+bool OSArray::setObject(const OSMetaClassBase* object)
+{
+    return setObject(count, object);
+}
+
+bool OSArray::setObject(unsigned index, const OSMetaClassBase* object)
+{
+    const OSObject* value = OSDynamicCast(OSObject, object);
+    if (!value || index > count)
+        return false;
+    if (count == capacity)
+    {
+        capacity *= 2;
+        array = (OSObject**)realloc(array, capacity * sizeof(OSObject*));
+    }
+    memmove(&array[index + 1], &array[index], (count - index) * sizeof(OSObject*));
+    value->retain();
+    array[index] = const_cast<OSObject*>(value);
+    count++;
+    return true;
+}
+
+bool OSArray::replaceObject(unsigned index, const OSMetaClassBase* object)
+{
+    const OSObject* value = OSDynamicCast(OSObject, object);
+    if (!value || index >= count)
+        return false;
+    value->retain();
+    array[index]->release();
+    array[index] = const_cast<OSObject*>(value);
+    return true;
+}
+
+void OSArray::removeObject(unsigned index)
+{
+    if (index >= count)
+        return;
+    OSObject* object = array[index];
+    count--;
+    memmove(&array[index], &array[index + 1], (count - index) * sizeof(OSObject*));
+    object->release();
+}
+
+bool OSArray::merge(const OSArray* other)
+{
+    for (unsigned i = 0; i < other->count; i++)
+        setObject(other->array[i]);
+    return true;
+}
+
+unsigned OSArray::getNextIndexOfObject(const OSMetaClassBase* object, unsigned index) const
+{
+    for (; index < count; index++)
+        if (array[index] == object)
+            return index;
+    return (unsigned)-1;
+}
+
+void OSArray::flushCollection()
+{
+    while (count)
+        array[--count]->release();
+}
+
+bool OSArray::isEqualTo(const OSMetaClassBase* other) const
+{
+    const OSArray* array = OSDynamicCast(OSArray, other);
+    if (!array || array->count != count)
+        return false;
+    for (unsigned i = 0; i < count; i++)
+        if (!this->array[i]->isEqualTo(array->array[i]))
+            return false;
+    return true;
+}
+
+OSDefineMetaClassAndStructors(OSDictionary, OSCollection)
+
+OSDictionary* OSDictionary::withCapacity(unsigned capacity)
+{
+    OSDictionary* dict = new OSDictionary;
+    dict->capacity = capacity ? capacity : 1;
+    dict->entries = (Entry*)calloc(dict->capacity, sizeof(Entry));
+    return dict;
+}
+
+OSDictionary* OSDictionary::withDictionary(const OSDictionary* other, unsigned capacity)
+{
+    OSDictionary* dict = withCapacity(capacity > other->count ? capacity : other->count);
+    dict->merge(other);
+    return dict;
+}
+
+OSDictionary* OSDictionary::withObjects(const OSObject* objects[], const OSSymbol* keys[], unsigned count, unsigned capacity)
+{
+    OSDictionary* dict = withCapacity(capacity > count ? capacity : count);
+    for (unsigned i = 0; i < count; i++)
+        dict->setObject(keys[i], objects[i]);
+    return dict;
+}
+
+OSDictionary* OSDictionary::withObjects(const OSObject* objects[], const OSString* keys[], unsigned count, unsigned capacity)
+{
+    OSDictionary* dict = withCapacity(capacity > count ? capacity : count);
+    for (unsigned i = 0; i < count; i++)
+        dict->setObject(keys[i], objects[i]);
+    return dict;
+}
+
+void OSDictionary::free()
+{
+    flushCollection();
+    ::free(entries);
+    OSCollection::free();
+}
+
+OSObject* OSDictionary::getObject(const char* key) const
+{
+    for (unsigned i = 0; i < count; i++)
+        if (entries[i].key->isEqualTo(key))
+            return entries[i].value;
+    return NULL;
+}
+
+bool OSDictionary::setObject(const char* key, const OSMetaClassBase* object)
+{
+    const OSObject* value = OSDynamicCast(OSObject, object);
+    if (!key || !value)
+        return false;
+    value->retain();
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (entries[i].key->isEqualTo(key))
+        {
+            entries[i].value->release();
+            entries[i].value = const_cast<OSObject*>(value);
+            return true;
+        }
+    }
+    if (count == capacity)
+    {
+        capacity *= 2;
+        entries = (Entry*)realloc(entries, capacity * sizeof(Entry));
+    }
+    entries[count].key = OSSymbol::withCString(key);
+    entries[count].value = const_cast<OSObject*>(value);
+    count++;
+    return true;
+}
+
+void OSDictionary::removeObject(const char* key)
+{
+    for (unsigned i = 0; i < count; i++)
+    {
+        if (entries[i].key->isEqualTo(key))
+        {
+            Entry entry = entries[i];
+            count--;
+            memmove(&entries[i], &entries[i + 1], (count - i) * sizeof(Entry));
+            entry.key->release();
+            entry.value->release();
+            return;
+        }
+    }
+}
+
+bool OSDictionary::merge(const OSDictionary* other)
+{
+    for (unsigned i = 0; i < other->count; i++)
+        setObject(other->entries[i].key, other->entries[i].value);
+    return true;
+}
+
+void OSDictionary::flushCollection()
+{
+    while (count)
+    {
+        count--;
+        entries[count].key->release();
+        entries[count].value->release();
+    }
+}
+
+bool OSDictionary::isEqualTo(const OSMetaClassBase* other) const
+{
+    const OSDictionary* dict = OSDynamicCast(OSDictionary, other);
+    if (!dict || dict->count != count)
+        return false;
+    for (unsigned i = 0; i < count; i++)
+    {
+        OSObject* value = dict->getObject(entries[i].key);
+        if (!value || !entries[i].value->isEqualTo(value))
+            return false;
+    }
+    return true;
+}
+
+OSDefineMetaClassAndStructors(OSSet, OSCollection)
+
+OSSet* OSSet::withCapacity(unsigned capacity)
+{
+    OSSet* set = new OSSet;
+    set->members = OSArray::withCapacity(capacity);
+    return set;
+}
+
+void OSSet::free()
+{
+    OSSafeReleaseNULL(members);
+    OSCollection::free();
+}
+
+bool OSSet::setObject(const OSMetaClassBase* object)
+{
+    if (containsObject(object))
+        return false;
+    return members->setObject(object);
+}
+
+void OSSet::removeObject(const OSMetaClassBase* object)
+{
+    unsigned index = members->getNextIndexOfObject(object, 0);
+    if (index != (unsigned)-1)
+        members->removeObject(index);
+}
+
+bool OSSet::containsObject(const OSMetaClassBase* object) const
+{
+    return members->getNextIndexOfObject(object, 0) != (unsigned)-1;
+}
+
+OSDefineMetaClassAndAbstractStructors(OSIterator, OSObject)
+OSDefineMetaClassAndStructors(OSCollectionIterator, OSIterator)
+
+OSCollectionIterator* OSCollectionIterator::withCollection(const OSCollection* inColl)
+{
+    if (!inColl)
+        return NULL;
+    OSCollectionIterator* iterator = new OSCollectionIterator;
+    inColl->retain();
+    iterator->collection = const_cast<OSCollection*>(inColl);
+    return iterator;
+}
+
+void OSCollectionIterator::free()
+{
+    OSSafeReleaseNULL(collection);
+    OSIterator::free();
+}
+
+OSObject* OSCollectionIterator::getNextObject()
+{
+    if (index >= collection->getCount())
+        return NULL;
+    return collection->iterationObject(index++);
+}
+
+OSDefineMetaClassAndStructors(OSSerialize, OSObject)
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// OSUnserializeXML
+//
+// Enough of the plist format for the drivers' Info.plist files: dict, array,
+// key, string, integer, real (as an integer), data, true and false.
+//
+
+namespace
+{
+    struct PlistParser
+    {
+        const char* p;
+        std::string error;
+
+        void skipSpace()
+        {
+            for (;;)
+            {
+                while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+                    p++;
+                if (!strncmp(p, "<!--", 4))
+                {
+                    const char* end = strstr(p, "-->");
+                    p = end ? end + 3 : p + strlen(p);
+                }
+                else if (!strncmp(p, "<?", 2) || !strncmp(p, "<!", 2))
+                {
+                    const char* end = strchr(p, '>');
+                    p = end ? end + 1 : p + strlen(p);
+                }
+                else
+                    return;
+            }
+        }
+
+        // reads "<name>", "<name/>" or "</name>"; false at anything else
+        bool readTag(std::string& name, bool& closing, bool& empty)
+        {
+            skipSpace();
+            if (*p != '<')
+                return false;
+            const char* end = strchr(p, '>');
+            if (!end)
+                return false;
+            const char* start = p + 1;
+            closing = *start == '/';
+            if (closing)
+                start++;
+            empty = end[-1] == '/';
+            const char* stop = empty ? end - 1 : end;
+            const char* space = start;
+            while (space < stop && *space != ' ')
+                space++;
+            name.assign(start, space - start);
+            p = end + 1;
+            return true;
+        }
+
+        std::string readText(const char* tag)
+        {
+            std::string close = std::string("</") + tag + ">";
+            const char* end = strstr(p, close.c_str());
+            if (!end)
+            {
+                error = std::string("unterminated <") + tag + ">";
+                return std::string();
+            }
+            std::string text;
+            for (const char* c = p; c < end; )
+            {
+                static const struct { const char* entity; char c; } kEntities[] =
+                    { { "&lt;", '<' }, { "&gt;", '>' }, { "&amp;", '&' }, { "&quot;", '"' }, { "&apos;", '\'' } };
+                bool matched = false;
+                if (*c == '&')
+                {
+                    for (auto& e : kEntities)
+                    {
+                        size_t length = strlen(e.entity);
+                        if (!strncmp(c, e.entity, length))
+                        {
+                            text += e.c;
+                            c += length;
+                            matched = true;
+                            break;
+                        }
+                    }
+                }
+                if (!matched)
+                    text += *c++;
+            }
+            p = end + close.size();
+            return text;
+        }
+
+        static OSData* decodeBase64(const std::string& text)
+        {
+            OSData* data = OSData::withCapacity((unsigned)text.size());
+            unsigned accumulator = 0, bits = 0;
+            for (char c : text)
+            {
+                int value;
+                if (c >= 'A' && c <= 'Z') value = c - 'A';
+                else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+                else if (c >= '0' && c <= '9') value = c - '0' + 52;
+                else if (c == '+') value = 62;
+                else if (c == '/') value = 63;
+                else continue;
+                accumulator = (accumulator << 6) | value;
+                bits += 6;
+                if (bits >= 8)
+                {
+                    bits -= 8;
+                    UInt8 byte = (UInt8)(accumulator >> bits);
+                    data->appendBytes(&byte, 1);
+                }
+            }
+            return data;
+        }
+
+        OSObject* parseValue(const std::string& tag, bool empty)
+        {
+            if (tag == "dict")
+            {
+                OSDictionary* dict = OSDictionary::withCapacity(8);
+                if (empty)
+                    return dict;
+                for (;;)
+                {
+                    std::string name;
+                    bool closing, isEmpty;
+                    if (!readTag(name, closing, isEmpty))
+                        break;
+                    if (closing && name == "dict")
+                        return dict;
+                    if (name != "key" || closing || isEmpty)
+                        break;
+                    std::string key = readText("key");
+                    if (!readTag(name, closing, isEmpty) || closing)
+                        break;
+                    OSObject* value = parseValue(name, isEmpty);
+                    if (!value)
+                        break;
+                    dict->setObject(key.c_str(), value);
+                    value->release();
+                }
+                if (error.empty())
+                    error = "bad <dict>";
+                dict->release();
+                return NULL;
+            }
+            if (tag == "array")
+            {
+                OSArray* array = OSArray::withCapacity(8);
+                if (empty)
+                    return array;
+                for (;;)
+                {
+                    std::string name;
+                    bool closing, isEmpty;
+                    if (!readTag(name, closing, isEmpty))
+                        break;
+                    if (closing && name == "array")
+                        return array;
+                    if (closing)
+                        break;
+                    OSObject* value = parseValue(name, isEmpty);
+                    if (!value)
+                        break;
+                    array->setObject(value);
+                    value->release();
+                }
+                if (error.empty())
+                    error = "bad <array>";
+                array->release();
+                return NULL;
+            }
+            if (tag == "true")
+            {
+                if (!empty)
+                    readText("true");
+                return kOSBooleanTrue;
+            }
+            if (tag == "false")
+            {
+                if (!empty)
+                    readText("false");
+                return kOSBooleanFalse;
+            }
+            std::string text = empty ? std::string() : readText(tag.c_str());
+            if (!error.empty())
+                return NULL;
+            if (tag == "string")
+                return OSString::withCString(text.c_str());
+            if (tag == "integer" || tag == "real")
+                return OSNumber::withNumber((unsigned long long)strtoll(text.c_str(), NULL, 0), 64);
+            if (tag == "data")
+                return decodeBase64(text);
+            error = "unsupported <" + tag + ">";
+            return NULL;
+        }
+    };
+}
+
+OSObject* OSUnserializeXML(const char* buffer, OSString** errorString)
+{
+    PlistParser parser;
+    parser.p = buffer;
+    std::string name;
+    bool closing, empty;
+    OSObject* result = NULL;
+    while (parser.readTag(name, closing, empty))
+    {
+        if (name == "plist")
+            continue;
+        result = closing ? NULL : parser.parseValue(name, empty);
+        break;
+    }
+    if (!result && parser.error.empty())
+        parser.error = "no property list";
+    if (errorString)
+        *errorString = result ? NULL : OSString::withCString(parser.error.c_str());
+    return result;
+}
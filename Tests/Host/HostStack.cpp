@@ -0,0 +1,273 @@
+//
+// HostStack.cpp
+//
+
+#include "HostStack.h"
+#include "HostTest.h"
+
+#include "VoodooPS2Controller.h"
+#include "ApplePS2KeyboardDevice.h"
+#include "ApplePS2MouseDevice.h"
+
+#include <cstdio>
+#include <string>
+
+#ifndef VOODOOPS2_SOURCE_DIR
+#error VOODOOPS2_SOURCE_DIR must name the top of the source tree
+#endif
+
+std::vector<char> HostSourceFile(const char* path)
+{
+    std::string full = std::string(VOODOOPS2_SOURCE_DIR) + "/" + path;
+    std::vector<char> contents;
+    FILE* file = fopen(full.c_str(), "rb");
+    if (!file)
+        return contents;
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        contents.insert(contents.end(), buffer, buffer + count);
+    fclose(file);
+    contents.push_back(0);
+    return contents;
+}
+
+OSDictionary* HostPersonality(const char* plist, const char* name)
+{
+    std::vector<char> xml = HostSourceFile(plist);
+    if (xml.empty())
+        return NULL;
+    OSObject* parsed = OSUnserializeXML(xml.data());
+    OSDictionary* info = OSDynamicCast(OSDictionary, parsed);
+    OSDictionary* result = NULL;
+    if (info)
+    {
+        OSDictionary* personalities = OSDynamicCast(OSDictionary, info->getObject("IOKitPersonalities"));
+        if (personalities)
+            result = OSDynamicCast(OSDictionary, personalities->getObject(name));
+        if (result)
+            result = OSDictionary::withDictionary(result);
+    }
+    OSSafeReleaseNULL(parsed);
+    return result;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+HostStack::HostStack(const PS2Timing& timing) : emulator(timing)
+{
+    emulator.attach(kPS2PortKeyboard, &keyboard);
+    emulator.attach(kPS2PortAux, &mouse);
+    emulator.makeCurrent();
+    HostHIDSetEventSink(sink, this);
+}
+
+HostStack::~HostStack()
+{
+    stop();
+    HostHIDSetEventSink(NULL, NULL);
+}
+
+void HostStack::attachAux(PS2Device* aux)
+{
+    emulator.attach(kPS2PortAux, aux);
+}
+
+template <class T>
+static T* firstService(const char* className)
+{
+    T* result = NULL;
+    OSDictionary* matching = IOService::serviceMatching(className);
+    OSIterator* iterator = IOService::getMatchingServices(matching);
+    if (iterator)
+    {
+        result = OSDynamicCast(T, iterator->getNextObject());
+        iterator->release();
+    }
+    OSSafeReleaseNULL(matching);
+    return result;
+}
+
+bool HostStack::startController()
+{
+    nub = HostPS2Nub::withEmulator(&emulator);
+    if (!nub)
+        return false;
+    controller = new ApplePS2Controller;
+    OSDictionary* personality = HostPersonality("VoodooPS2Controller/VoodooPS2Controller-Info.plist", "ApplePS2Controller");
+    if (!personality || !controller->init(personality) || !controller->attach(nub))
+    {
+        OSSafeReleaseNULL(personality);
+        OSSafeReleaseNULL(controller);
+        return false;
+    }
+    personality->release();
+    SInt32 score = 0;
+    if (!controller->probe(nub, &score) || !controller->start(nub))
+    {
+        controller->detach(nub);
+        OSSafeReleaseNULL(controller);
+        return false;
+    }
+    keyboardDevice = firstService<ApplePS2KeyboardDevice>("ApplePS2KeyboardDevice");
+    mouseDevice = firstService<ApplePS2MouseDevice>("ApplePS2MouseDevice");
+    return keyboardDevice && mouseDevice;
+}
+
+bool HostStack::startDriver(IOService* driver, OSDictionary* personality, IOService* provider)
+{
+    if (!driver || !personality || !provider)
+    {
+        OSSafeReleaseNULL(driver);
+        OSSafeReleaseNULL(personality);
+        return false;
+    }
+    bool ok = driver->init(personality) && driver->attach(provider);
+    personality->release();
+    if (!ok)
+    {
+        driver->release();
+        return false;
+    }
+    SInt32 score = 0;
+    if (!driver->probe(provider, &score) || !driver->start(provider))
+    {
+        driver->detach(provider);
+        driver->release();
+        return false;
+    }
+    // published, as IOHIDFamily's start does; the controller subscribes the
+    // ones with RM,deliverNotifications to its messages
+    driver->registerService();
+    _drivers.push_back(driver);
+    return true;
+}
+
+void HostStack::stop()
+{
+    // as on kext unload: drivers first, then the controller (the nub stays)
+    for (auto it = _drivers.rbegin(); it != _drivers.rend(); ++it)
+    {
+        (*it)->terminate();
+        (*it)->release();
+    }
+    _drivers.clear();
+    if (controller)
+    {
+        controller->terminate();
+        OSSafeReleaseNULL(controller);
+    }
+    keyboardDevice = NULL;
+    mouseDevice = NULL;
+    OSSafeReleaseNULL(nub);
+    HostKernel::drainThreadCalls();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void HostStack::sink(void* refCon, const HostHIDEvent& event)
+{
+    HostStack* self = (HostStack*)refCon;
+    std::lock_guard<std::mutex> guard(self->_eventLock);
+    self->_events.push_back(event);
+}
+
+std::vector<HostHIDEvent> HostStack::events()
+{
+    std::lock_guard<std::mutex> guard(_eventLock);
+    return _events;
+}
+
+void HostStack::clearEvents()
+{
+    std::lock_guard<std::mutex> guard(_eventLock);
+    _events.clear();
+}
+
+bool HostStack::waitForEvents(size_t count, unsigned timeoutMS)
+{
+    uint64_t start = HostTestNowMS();
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_eventLock);
+            if (_events.size() >= count)
+                return true;
+        }
+        if (HostTestNowMS() - start >= timeoutMS)
+            return false;
+        IOSleep(1);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+OSDefineMetaClassAndStructors(HostVoodooInput, IOService)
+
+HostVoodooInput* HostVoodooInput::withDriver(IOService* driver)
+{
+    HostVoodooInput* input = new HostVoodooInput;
+    if (!input->init())
+    {
+        input->release();
+        return NULL;
+    }
+    input->setProperty(VOODOO_INPUT_IDENTIFIER, kOSBooleanTrue);
+    if (!driver->open(input))
+    {
+        input->release();
+        return NULL;
+    }
+    driver->retain();
+    input->_driver = driver;
+    return input;
+}
+
+void HostVoodooInput::free()
+{
+    if (_driver)
+    {
+        _driver->close(this);
+        OSSafeReleaseNULL(_driver);
+    }
+    IOService::free();
+}
+
+IOReturn HostVoodooInput::message(UInt32 type, IOService* provider, void* argument)
+{
+    (void)provider;
+    if (kIOMessageVoodooInputMessage == type && argument)
+    {
+        std::lock_guard<std::mutex> guard(_eventLock);
+        _events.push_back(*(VoodooInputEvent*)argument);
+    }
+    return kIOReturnSuccess;
+}
+
+std::vector<VoodooInputEvent> HostVoodooInput::events()
+{
+    std::lock_guard<std::mutex> guard(_eventLock);
+    return _events;
+}
+
+void HostVoodooInput::clearEvents()
+{
+    std::lock_guard<std::mutex> guard(_eventLock);
+    _events.clear();
+}
+
+bool HostVoodooInput::waitForEvents(size_t count, unsigned timeoutMS)
+{
+    uint64_t start = HostTestNowMS();
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_eventLock);
+            if (_events.size() >= count)
+                return true;
+        }
+        if (HostTestNowMS() - start >= timeoutMS)
+            return false;
+        IOSleep(1);
+    }
+}
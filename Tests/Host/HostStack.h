@@ -0,0 +1,92 @@
+//
+// HostStack.h
+//
+// The controller and its drivers brought up on an emulated 8042, the way the
+// kernel would: personalities from the kexts' Info.plist files, probe then
+// start, HID events collected from the event sink.
+//
+
+#ifndef _HOSTSTACK_H
+#define _HOSTSTACK_H
+
+#include "HostHID.h"
+#include "PS2Emulator.h"
+#include "VoodooInput/VoodooInput/VoodooInputMultitouch/VoodooInputEvent.h"
+#include "VoodooInput/VoodooInput/VoodooInputMultitouch/VoodooInputMessages.h"
+
+#include <mutex>
+#include <vector>
+
+class ApplePS2Controller;
+class ApplePS2KeyboardDevice;
+class ApplePS2MouseDevice;
+
+// an IOKitPersonalities entry of one of the kexts, "plist" relative to the
+// source tree (eg. "VoodooPS2Keyboard/VoodooPS2Keyboard-Info.plist")
+OSDictionary* HostPersonality(const char* plist, const char* name);
+
+// the contents of a file in the source tree
+std::vector<char> HostSourceFile(const char* path);
+
+class HostStack
+{
+public:
+    PS2Emulator emulator;
+    PS2Keyboard keyboard;
+    PS2Mouse mouse;
+
+    HostPS2Nub* nub = NULL;
+    ApplePS2Controller* controller = NULL;
+    ApplePS2KeyboardDevice* keyboardDevice = NULL;
+    ApplePS2MouseDevice* mouseDevice = NULL;
+
+    explicit HostStack(const PS2Timing& timing = PS2Timing::fast());
+    ~HostStack();
+
+    // replace the plain mouse on the aux port (eg. with a touchpad model),
+    // NULL leaves the port empty; before startController()
+    void attachAux(PS2Device* aux);
+
+    bool startController();
+    // init, probe and start "driver" on the keyboard or mouse nub, with its
+    // personality; returns false (and releases "driver") if it did not start
+    bool startDriver(IOService* driver, OSDictionary* personality, IOService* provider);
+    void stop();
+
+    // every HID event dispatched since the last clearEvents()
+    std::vector<HostHIDEvent> events();
+    void clearEvents();
+    // wait until at least "count" events arrived
+    bool waitForEvents(size_t count, unsigned timeoutMS = 2000);
+
+private:
+    std::vector<IOService*> _drivers;
+    std::mutex _eventLock;
+    std::vector<HostHIDEvent> _events;
+
+    static void sink(void* refCon, const HostHIDEvent& event);
+};
+
+// VoodooInput as the trackpad drivers see it: it opens the driver, which
+// then sends it a VoodooInputEvent per frame; those are recorded
+class HostVoodooInput : public IOService
+{
+    OSDeclareDefaultStructors(HostVoodooInput);
+
+public:
+    // opens "driver" (which must be started)
+    static HostVoodooInput* withDriver(IOService* driver);
+    void free() override;
+    IOReturn message(UInt32 type, IOService* provider, void* argument) override;
+
+    std::vector<VoodooInputEvent> events();
+    void clearEvents();
+    bool waitForEvents(size_t count, unsigned timeoutMS = 2000);
+
+private:
+    IOService* _driver = NULL;
+    std::mutex _eventLock;
+    std::vector<VoodooInputEvent> _events;
+};
+
+#endif // _HOSTSTACK_H
@@ -0,0 +1,61 @@
+//
+// HostTest.cpp
+//
+
+#include "HostTest.h"
+
+#include <chrono>
+
+static int gFailures;
+static int gCaseFailures;
+
+std::vector<HostTestCase>& HostTestCases()
+{
+    static std::vector<HostTestCase> cases;
+    return cases;
+}
+
+int HostTestFailures()
+{
+    return gFailures;
+}
+
+void HostTestFail(const char* file, int line, const char* what)
+{
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    ++gFailures;
+    ++gCaseFailures;
+}
+
+uint64_t HostTestNowMS()
+{
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+int HostTestMain(int argc, char** argv)
+{
+    int ran = 0;
+    for (const HostTestCase& test : HostTestCases())
+    {
+        if (argc > 1 && !strstr(test.name, argv[1]))
+            continue;
+        gCaseFailures = 0;
+        HostKernel::resetViolations();
+        printf("[ RUN  ] %s\n", test.name);
+        fflush(stdout);
+        test.run();
+        HostKernel::drainThreadCalls();
+        // anything the kernel would have panicked on (or worse, not noticed)
+        if (HostKernel::violations())
+            HostTestFail(__FILE__, __LINE__, "no kernel API misuse (see \"host: violation\" above)");
+        printf("[ %s ] %s\n", gCaseFailures ? "FAIL" : " OK ", test.name);
+        ++ran;
+    }
+    if (!ran)
+    {
+        fprintf(stderr, "no test matches \"%s\"\n", argc > 1 ? argv[1] : "");
+        return 1;
+    }
+    return gFailures ? 1 : 0;
+}
@@ -0,0 +1,70 @@
+//
+// HostTest.h
+//
+// A minimal test runner for the host build.  Each test executable defines
+// its cases with TEST() and ends with HOST_TEST_MAIN(); ctest runs the
+// executable, a filter on the command line runs single cases.
+//
+
+#ifndef _HOSTTEST_H
+#define _HOSTTEST_H
+
+#include "HostKernel.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+struct HostTestCase
+{
+    const char* name;
+    void (*run)();
+};
+
+std::vector<HostTestCase>& HostTestCases();
+int HostTestFailures();
+void HostTestFail(const char* file, int line, const char* what);
+int HostTestMain(int argc, char** argv);
+
+struct HostTestRegistration
+{
+    HostTestRegistration(const char* name, void (*run)()) { HostTestCases().push_back({ name, run }); }
+};
+
+#define TEST(name) \
+    static void name(); \
+    static HostTestRegistration name##_registration(#name, name); \
+    static void name()
+
+#define CHECK(cond) \
+    do { if (!(cond)) HostTestFail(__FILE__, __LINE__, #cond); } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        long long _a = (long long)(a), _b = (long long)(b); \
+        if (_a != _b) { \
+            char _what[256]; \
+            snprintf(_what, sizeof(_what), "%s == %s (%lld != %lld)", #a, #b, _a, _b); \
+            HostTestFail(__FILE__, __LINE__, _what); \
+        } \
+    } while (0)
+
+// stop the current case on failure (for preconditions of the rest of it)
+#define REQUIRE(cond) \
+    do { if (!(cond)) { HostTestFail(__FILE__, __LINE__, #cond); return; } } while (0)
+
+#define HOST_TEST_MAIN() \
+    int main(int argc, char** argv) { return HostTestMain(argc, argv); }
+
+// wait up to "timeoutMS" for "cond" to hold
+#define WAIT_FOR(cond, timeoutMS) \
+    ({ \
+        uint64_t _start = HostTestNowMS(); \
+        while (!(cond) && HostTestNowMS() - _start < (timeoutMS)) \
+            IOSleep(1); \
+        (bool)(cond); \
+    })
+
+uint64_t HostTestNowMS();
+
+#endif // _HOSTTEST_H
@@ -0,0 +1,105 @@
+//
+// MacroInversionRules.h
+//
+// Random "Macro Inversion" rule sets and the rule walk invertMacros did
+// before the rules were compiled into MacroInversionTrie, for the trie's
+// tests and benchmark.
+//
+
+#ifndef _MACROINVERSIONRULES_H
+#define _MACROINVERSIONRULES_H
+
+#include "VoodooPS2Keyboard.h"
+
+#include <random>
+#include <vector>
+
+// the rule layout (VoodooPS2Keyboard.cpp): 0xFFFF, output, modifier mask
+// and compare, then the key data of the packets to match
+enum
+{
+    kRuleOutputOffset = 2,
+    kRuleModifierOffset = 4,
+    kRulePrefixBytes = 8,
+};
+
+// the packets a rule set is drawn from: few, so that rules share prefixes
+static const UInt8 kRuleKeyData[][kPacketKeyDataLength] = {
+    { 0x01, 0x1e }, { 0x01, 0x9e }, { 0x02, 0x5b }, { 0x02, 0xdb },
+    { 0x01, 0x2a }, { 0x01, 0xaa },
+};
+enum { kRuleKeys = sizeof(kRuleKeyData) / sizeof(kRuleKeyData[0]) };
+
+// a NULL terminated array, as loadMacroData makes it
+class MacroRules
+{
+public:
+    std::vector<OSData*> rules;
+
+    MacroRules(std::mt19937& random, int count, int maxLength)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            int length = 1 + random() % maxLength;
+            std::vector<UInt8> data(kRulePrefixBytes + length * kPacketKeyDataLength);
+            data[0] = data[1] = 0xFF;
+            data[kRuleOutputOffset + 0] = 0x02;
+            data[kRuleOutputOffset + 1] = (UInt8)i;
+            // modifier masks and compares: none, exact, any of (0xFFFF)
+            UInt16 mask = 0, compare = 0;
+            switch (random() % 3)
+            {
+                case 1: mask = random() & 0x0F0F; compare = mask & random(); break;
+                case 2: mask = random() & 0x0F0F; compare = 0xFFFF; break;
+            }
+            data[kRuleModifierOffset + 0] = mask >> 8;
+            data[kRuleModifierOffset + 1] = (UInt8)mask;
+            data[kRuleModifierOffset + 2] = compare >> 8;
+            data[kRuleModifierOffset + 3] = (UInt8)compare;
+            for (int j = 0; j < length; j++)
+                memcpy(&data[kRulePrefixBytes + j * kPacketKeyDataLength], kRuleKeyData[random() % kRuleKeys], kPacketKeyDataLength);
+            rules.push_back(OSData::withBytes(data.data(), (unsigned)data.size()));
+        }
+        rules.push_back(NULL);
+    }
+    ~MacroRules()
+    {
+        for (OSData* rule : rules)
+            OSSafeReleaseNULL(rule);
+    }
+    OSData* const* get() const { return rules.data(); }
+};
+
+// invertMacros before the trie: the packets buffered so far (the last one
+// the new one, kPacketLength apart) against every rule, in order
+static MacroInversionTrie::Result linearMatch(OSData* const* rules, const UInt8* buffer, int buffered,
+                                              UInt16 modifiers, const UInt8** output)
+{
+    int total = buffered*kPacketKeyDataLength;
+    for (OSData* const* p = rules; *p; p++)
+    {
+        int length = (*p)->getLength()-kRulePrefixBytes;
+        if (total > length)
+            continue;
+        const UInt8* data = static_cast<const UInt8*>((*p)->getBytesNoCopy());
+        const UInt8* sequence = data+kRulePrefixBytes;
+        bool same = true;
+        for (int i = 0; i < buffered && same; i++)
+            same = buffer[i*kPacketLength] == sequence[i*kPacketKeyDataLength] &&
+                   buffer[i*kPacketLength+1] == sequence[i*kPacketKeyDataLength+1];
+        if (!same)
+            continue;
+        if (total < length)
+            return MacroInversionTrie::kPartial;
+        UInt16 mask = (static_cast<UInt16>(data[kRuleModifierOffset+0]) << 8) + data[kRuleModifierOffset+1];
+        UInt16 compare = (static_cast<UInt16>(data[kRuleModifierOffset+2]) << 8) + data[kRuleModifierOffset+3];
+        if ((0xFFFF == compare && (modifiers & mask)) || ((modifiers & mask) == compare))
+        {
+            *output = data+kRuleOutputOffset;
+            return MacroInversionTrie::kMatch;
+        }
+    }
+    return MacroInversionTrie::kNoMatch;
+}
+
+#endif // _MACROINVERSIONRULES_H
@@ -0,0 +1,888 @@
+//
+// PS2Emulator.cpp
+//
+// See PS2Emulator.h.
+//
+
+#include "PS2Emulator.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+// ports and bits, as in VoodooPS2Controller.h / ApplePS2Device.h
+#define kDataPort       0x60
+#define kCommandPort    0x64
+#define kOutputReady    0x01
+#define kInputBusy      0x02
+#define kSystemFlag     0x04
+#define kCommandLastSent 0x08
+#define kKeyboardEnabled 0x10
+#define kMouseData      0x20
+
+#define kCB_EnableKeyboardIRQ   0x01
+#define kCB_EnableMouseIRQ      0x02
+#define kCB_DisableKeyboardClock 0x10
+#define kCB_DisableMouseClock   0x20
+
+static std::atomic<PS2Emulator*> gCurrent;
+
+UInt8 ps2inb(UInt16 port)
+{
+    PS2Emulator* emulator = gCurrent;
+    // nothing there: a floating bus
+    return emulator ? emulator->inb(port) : (port == kCommandPort ? 0 : 0xFF);
+}
+
+void ps2outb(UInt16 port, UInt8 byte)
+{
+    if (PS2Emulator* emulator = gCurrent)
+        emulator->outb(port, byte);
+}
+
+static inline uint64_t now()
+{
+    return mach_absolute_time();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// PS2Device
+//
+
+void PS2Device::reply(UInt8 byte)
+{
+    lastSent = byte;
+    emulator->queue(port, byte, now() + emulator->_timing.transmitNS + emulator->_timing.byteNS);
+}
+
+void PS2Device::replyAfterSelfTest(UInt8 byte)
+{
+    lastSent = byte;
+    emulator->queue(port, byte, now() + emulator->_timing.transmitNS + emulator->_timing.selfTestNS);
+}
+
+void PS2Device::send(UInt8 byte)
+{
+    lastSent = byte;
+    emulator->queue(port, byte, now() + emulator->_timing.byteNS);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// PS2Keyboard
+//
+
+void PS2Keyboard::powerOn()
+{
+    scanning = true;
+    leds = 0;
+    typematic = 0x2b;
+    makeReleaseOnly = false;
+    pending = 0;
+}
+
+void PS2Keyboard::receive(UInt8 byte)
+{
+    received.push_back(byte);
+    if (pending)
+    {
+        UInt8 command = pending;
+        pending = 0;
+        switch (command)
+        {
+            case 0xED: leds = byte; reply(0xFA); return;
+            case 0xF3: typematic = byte; reply(0xFA); return;
+            case 0xF0:
+                reply(0xFA);
+                if (byte)
+                    scanSet = byte;
+                else
+                    reply(scanSet == 1 ? 0x43 : scanSet == 2 ? 0x41 : 0x3f);    // (translated)
+                return;
+        }
+    }
+    switch (byte)
+    {
+        case 0xED: case 0xF3: case 0xF0:
+            pending = byte;
+            reply(0xFA);
+            break;
+        case 0xEE:
+            reply(0xEE);
+            break;
+        case 0xF2:
+            reply(0xFA); reply(0xAB); reply(0x83);
+            break;
+        case 0xF4:
+            scanning = true;
+            reply(0xFA);
+            break;
+        case 0xF5:
+            powerOn();
+            scanning = false;
+            reply(0xFA);
+            break;
+        case 0xF6:
+            powerOn();
+            reply(0xFA);
+            break;
+        case 0xF8:
+            makeReleaseOnly = true;
+            reply(0xFA);
+            break;
+        case 0xF7: case 0xF9: case 0xFA: case 0xFB: case 0xFC: case 0xFD:
+            reply(0xFA);
+            break;
+        case 0xFE:
+            reply(lastSent);
+            break;
+        case 0xFF:
+            resets++;
+            powerOn();
+            reply(0xFA);
+            replyAfterSelfTest(0xAA);
+            break;
+        default:
+            reply(0xFE);
+            break;
+    }
+}
+
+bool PS2Keyboard::type(const UInt8* bytes, unsigned count)
+{
+    if (!scanning)
+        return false;
+    for (unsigned i = 0; i < count; i++)
+        send(bytes[i]);
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// PS2Mouse
+//
+
+void PS2Mouse::powerOn()
+{
+    reporting = false;
+    remote = false;
+    sampleRate = 100;
+    resolution = 2;
+    scaling2to1 = false;
+    pending = 0;
+    buttonState = 0;
+}
+
+void PS2Mouse::statusRequest()
+{
+    UInt8 status = (remote ? 0x40 : 0) | (reporting ? 0x20 : 0) | (scaling2to1 ? 0x10 : 0) | (buttonState & 7);
+    reply(0xFA); reply(status); reply(resolution); reply(sampleRate);
+}
+
+void PS2Mouse::sampleRateSet(UInt8 rate)
+{
+    sampleRate = rate;
+    rates[0] = rates[1];
+    rates[1] = rates[2];
+    rates[2] = rate;
+    // the IntelliMouse knocks
+    if (rates[0] == 200 && rates[1] == 100 && rates[2] == 80 && deviceID == 0)
+        deviceID = 3;
+    else if (rates[0] == 200 && rates[1] == 200 && rates[2] == 80 && deviceID == 3)
+        deviceID = 4;
+}
+
+void PS2Mouse::receive(UInt8 byte)
+{
+    received.push_back(byte);
+    if (pending)
+    {
+        UInt8 command = pending;
+        pending = 0;
+        reply(0xFA);
+        if (command == 0xE8)
+            resolution = byte & 3;
+        else
+            sampleRateSet(byte);
+        return;
+    }
+    if (naks && byte == nakCommand)
+    {
+        naks--;
+        reply(0xFE);
+        return;
+    }
+    if (byte != 0xF3)
+        rates[0] = rates[1] = rates[2] = 0;
+    switch (byte)
+    {
+        case 0xE6: scaling2to1 = false; reply(0xFA); break;
+        case 0xE7: scaling2to1 = true; reply(0xFA); break;
+        case 0xE8: case 0xF3: pending = byte; reply(0xFA); break;
+        case 0xE9: statusRequest(); break;
+        case 0xEA: remote = false; reply(0xFA); break;
+        case 0xF0: remote = true; reply(0xFA); break;
+        case 0xEB:
+            reply(0xFA);
+            reply(0x08 | (buttonState & 7)); reply(0); reply(0);
+            if (deviceID >= 3)
+                reply(0);
+            break;
+        case 0xEC: case 0xEE: reply(0xFA); break;
+        case 0xF2:
+            reply(0xFA); reply(deviceID);
+            break;
+        case 0xF4: reporting = true; reply(0xFA); break;
+        case 0xF5: reporting = false; reply(0xFA); break;
+        case 0xF6: powerOn(); reply(0xFA); break;
+        case 0xFE: reply(lastSent); break;
+        case 0xFF:
+            resets++;
+            powerOn();
+            deviceID = 0;
+            reply(0xFA);
+            replyAfterSelfTest(0xAA);
+            replyAfterSelfTest(0x00);
+            break;
+        default:
+            reply(0xFE);
+            break;
+    }
+}
+
+bool PS2Mouse::move(int dx, int dy, UInt8 buttons, int wheel)
+{
+    if (!reporting || remote)
+        return false;
+    buttonState = buttons & 7;
+    dx = dx < -255 ? -255 : dx > 255 ? 255 : dx;
+    dy = dy < -255 ? -255 : dy > 255 ? 255 : dy;
+    send(0x08 | (buttons & 7) | (dx < 0 ? 0x10 : 0) | (dy < 0 ? 0x20 : 0));
+    send((UInt8)dx);
+    send((UInt8)dy);
+    if (deviceID >= 3)
+        send((UInt8)(wheel & 0x0f));
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// PS2Synaptics
+//
+
+PS2Synaptics::PS2Synaptics()
+{
+    memset(queries, 0, sizeof(queries));
+    // $00 identify: v8.1, 0x47 (the supported numbering)
+    queries[0x0][0] = 0x01; queries[0x0][1] = 0x47; queries[0x0][2] = 0x08;
+    // $02 capabilities: valid, 4 extended queries
+    queries[0x2][0] = 0xc0; queries[0x2][1] = 0x47;
+    // $08 resolution: 64 x 80 units/mm
+    queries[0x8][0] = 64; queries[0x8][1] = 0x80; queries[0x8][2] = 80;
+    // $0C continued capabilities: reports max and min coordinates
+    queries[0xc][0] = 1 << 1; queries[0xc][1] = 1 << 5;
+    // $0D max 5888 x 4800, $0F min 1024 x 1024
+    queries[0xd][0] = 5888 >> 5; queries[0xd][2] = 4800 >> 5;
+    queries[0xf][0] = 1024 >> 5; queries[0xf][2] = 1024 >> 5;
+}
+
+void PS2Synaptics::powerOn()
+{
+    PS2Mouse::powerOn();
+    modeByte = 0;
+    arguments = 0;
+}
+
+void PS2Synaptics::receive(UInt8 byte)
+{
+    if (0xE8 == pending)
+    {
+        argument = (UInt8)(argument << 2 | (byte & 3));
+        arguments++;
+    }
+    else if (!pending && 0xE8 == byte)
+    {
+        if (arguments >= 4)
+            arguments = 0;
+    }
+    else if (!pending && 0xE9 != byte && 0xF3 != byte)
+        arguments = 0;
+    PS2Mouse::receive(byte);
+}
+
+void PS2Synaptics::statusRequest()
+{
+    if (4 != arguments)
+    {
+        PS2Mouse::statusRequest();
+        return;
+    }
+    arguments = 0;
+    const UInt8* answer = queries[argument & 0x0f];
+    reply(0xFA); reply(answer[0]); reply(answer[1]); reply(answer[2]);
+}
+
+void PS2Synaptics::sampleRateSet(UInt8 rate)
+{
+    if (4 == arguments && 0x14 == rate)
+    {
+        arguments = 0;
+        modeByte = argument;
+        modeByteWrites++;
+        return;
+    }
+    arguments = 0;
+    PS2Mouse::sampleRateSet(rate);
+}
+
+void PS2Synaptics::packet(const UInt8 bytes[6])
+{
+    for (int i = 0; i < 6; i++)
+        send(bytes[i]);
+}
+
+void PS2Synaptics::touchPacket(UInt8 bytes[6], int x, int y, int z, int w, UInt8 buttons)
+{
+    bytes[0] = 0x80 | (w & 0x0c) << 2 | (w & 0x02) << 1 | (buttons & 3);
+    bytes[1] = ((y >> 8) & 0x0f) << 4 | ((x >> 8) & 0x0f);
+    bytes[2] = (UInt8)z;
+    bytes[3] = 0xc0 | ((y >> 12) & 1) << 5 | ((x >> 12) & 1) << 4 | (w & 0x01) << 2 | (buttons & 3);
+    bytes[4] = (UInt8)x;
+    bytes[5] = (UInt8)y;
+}
+
+bool PS2Synaptics::touch(int x, int y, int z, int w, UInt8 buttons)
+{
+    if (!reporting || remote)
+        return false;
+    UInt8 bytes[6];
+    touchPacket(bytes, x, y, z, w, buttons);
+    packet(bytes);
+    return true;
+}
+
+void PS2Synaptics::secondaryPacket(UInt8 bytes[6], int x, int y, int z)
+{
+    // half resolution
+    x >>= 1; y >>= 1; z >>= 1;
+    bytes[0] = 0x84;
+    bytes[1] = (UInt8)x;
+    bytes[2] = (UInt8)y;
+    bytes[3] = 0xc0 | (z & 0x30);
+    bytes[4] = ((y >> 8) & 0x0f) << 4 | ((x >> 8) & 0x0f);
+    bytes[5] = 0x10 | (z & 0x0f);
+}
+
+bool PS2Synaptics::secondary(int x, int y, int z)
+{
+    if (!reporting || remote)
+        return false;
+    UInt8 bytes[6];
+    secondaryPacket(bytes, x, y, z);
+    packet(bytes);
+    return true;
+}
+
+bool PS2Synaptics::fingers(int count)
+{
+    if (!reporting || remote)
+        return false;
+    UInt8 bytes[6] = { 0x84, (UInt8)(count & 0x0f), 0, 0xc0, 0, 0x20 };
+    packet(bytes);
+    return true;
+}
+
+void PS2Synaptics::guestPacket(UInt8 bytes[6], int dx, int dy, UInt8 buttons)
+{
+    bytes[0] = 0x84;
+    bytes[1] = 0x08 | (dy < 0) << 5 | (dx < 0) << 4 | (buttons & 7);
+    bytes[2] = 0;
+    bytes[3] = 0xc4;
+    bytes[4] = (UInt8)dx;
+    bytes[5] = (UInt8)dy;
+}
+
+bool PS2Synaptics::guest(int dx, int dy, UInt8 buttons)
+{
+    if (!reporting || remote)
+        return false;
+    UInt8 bytes[6];
+    guestPacket(bytes, dx, dy, buttons);
+    packet(bytes);
+    return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// PS2Emulator
+//
+
+PS2Emulator::PS2Emulator(const PS2Timing& timing) : _timing(timing)
+{
+    _thread = std::thread(&PS2Emulator::hardwareThread, this);
+}
+
+PS2Emulator::~PS2Emulator()
+{
+    if (gCurrent == this)
+        gCurrent = NULL;
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _quit = true;
+        _cv.notify_all();
+    }
+    _thread.join();
+}
+
+void PS2Emulator::attach(int port, PS2Device* device)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _devices[port] = device;
+    if (device)
+    {
+        device->emulator = this;
+        device->port = port;
+        device->powerOn();
+    }
+}
+
+void PS2Emulator::makeCurrent()
+{
+    gCurrent = this;
+}
+
+PS2Emulator* PS2Emulator::current()
+{
+    return gCurrent;
+}
+
+void PS2Emulator::setInterruptHandler(IRQHandler handler, void* refCon)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _handler = handler;
+    _handlerRefCon = refCon;
+}
+
+void PS2Emulator::setTiming(const PS2Timing& timing)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _timing = timing;
+}
+
+UInt8 PS2Emulator::commandByte()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    return _commandByte;
+}
+
+PS2Emulator::Stats PS2Emulator::stats()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    return _stats;
+}
+
+void PS2Emulator::resetStats()
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    _stats = Stats();
+}
+
+void PS2Emulator::queue(int port, UInt8 byte, uint64_t earliest)
+{
+    // each port delivers in order, one byte time apart
+    uint64_t readyAt = earliest;
+    if (!_fifo[port].empty() && readyAt < _lastReady[port] + _timing.byteNS)
+        readyAt = _lastReady[port] + _timing.byteNS;
+    _lastReady[port] = readyAt;
+    _fifo[port].push_back({ byte, readyAt });
+    _cv.notify_all();
+}
+
+bool PS2Emulator::portClockEnabled(int port) const
+{
+    return !(_commandByte & (port == kPS2PortAux ? kCB_DisableMouseClock : kCB_DisableKeyboardClock));
+}
+
+void PS2Emulator::tryLoad(uint64_t time)
+{
+    if (_full)
+        return;
+    if (!_controllerFifo.empty())
+    {
+        _data = _controllerFifo.front();
+        _controllerFifo.pop_front();
+        _dataAux = _controllerAux && _controllerFifo.empty();
+        if (_controllerFifo.empty())
+            _controllerAux = false;
+    }
+    else
+    {
+        int from = -1;
+        for (int port = 0; port < 2; port++)
+        {
+            if (_fifo[port].empty() || _fifo[port].front().readyAt > time || !portClockEnabled(port))
+                continue;
+            if (from < 0 || _fifo[port].front().readyAt < _fifo[from].front().readyAt)
+                from = port;
+        }
+        if (from < 0)
+            return;
+        _data = _fifo[from].front().byte;
+        _fifo[from].pop_front();
+        _dataAux = from == kPS2PortAux;
+    }
+    _full = true;
+    _irqPending = (_commandByte & (_dataAux ? kCB_EnableMouseIRQ : kCB_EnableKeyboardIRQ)) != 0;
+    if (_irqPending)
+        _cv.notify_all();
+}
+
+void PS2Emulator::setCommandByte(UInt8 byte)
+{
+    UInt8 enabled = byte & ~_commandByte;
+    _commandByte = byte;
+    // the IRQ line goes up if a byte is already waiting
+    if (_full && (enabled & (_dataAux ? kCB_EnableMouseIRQ : kCB_EnableKeyboardIRQ)))
+        _irqPending = true;
+    _cv.notify_all();
+}
+
+UInt8 PS2Emulator::inb(UInt16 port)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    uint64_t time = now();
+    tryLoad(time);
+    if (port == kCommandPort)
+    {
+        UInt8 status = kSystemFlag | kKeyboardEnabled;
+        if (_full)
+            status |= kOutputReady | (_dataAux ? kMouseData : 0);
+        if (time < _busyUntil)
+            status |= kInputBusy;
+        if (_lastWasCommand)
+            status |= kCommandLastSent;
+        return status;
+    }
+    if (!_full)
+    {
+        _stats.staleReads++;
+        return _data;
+    }
+    _full = false;
+    _irqPending = false;
+    _stats.bytesToHost++;
+    UInt8 data = _data;
+    tryLoad(time);
+    _cv.notify_all();
+    return data;
+}
+
+void PS2Emulator::toDevice(int port, UInt8 byte)
+{
+    if (PS2Device* device = _devices[port])
+    {
+        device->receive(byte);
+        return;
+    }
+    // no device: the controller reports a time-out
+    queue(port, 0xFE, now() + _timing.transmitNS * 2);
+}
+
+void PS2Emulator::controllerCommand(UInt8 command)
+{
+    switch (command)
+    {
+        case 0x20:
+            _controllerFifo.push_back(_commandByte);
+            break;
+        case 0x60: case 0xD1: case 0xD2: case 0xD3: case 0xD4:
+            _pendingCommand = command;
+            break;
+        case 0xA7: setCommandByte(_commandByte | kCB_DisableMouseClock); break;
+        case 0xA8: setCommandByte(_commandByte & ~kCB_DisableMouseClock); break;
+        case 0xAD: setCommandByte(_commandByte | kCB_DisableKeyboardClock); break;
+        case 0xAE: setCommandByte(_commandByte & ~kCB_DisableKeyboardClock); break;
+        case 0xA9: case 0xAB:
+            _controllerFifo.push_back(0x00);
+            break;
+        case 0xAA:
+            _controllerFifo.push_back(0x55);
+            break;
+        case 0xC0: case 0xD0:
+            _controllerFifo.push_back(0x00);
+            break;
+        default:
+            if (command >= 0x21 && command <= 0x3F)
+                _controllerFifo.push_back(0x00);
+            else if (command >= 0x61 && command <= 0x7F)
+                _pendingCommand = command;
+            // (0xF0-0xFF pulse output lines; nothing to do)
+            break;
+    }
+}
+
+void PS2Emulator::outb(UInt16 port, UInt8 byte)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    uint64_t time = now();
+    _stats.bytesFromHost++;
+    if (time < _busyUntil)
+        _stats.inputOverruns++;
+    _busyUntil = time + _timing.inputBusyNS;
+    if (port == kCommandPort)
+    {
+        _lastWasCommand = true;
+        _pendingCommand = 0;
+        controllerCommand(byte);
+        tryLoad(time);
+        return;
+    }
+    _lastWasCommand = false;
+    UInt8 command = _pendingCommand;
+    _pendingCommand = 0;
+    switch (command)
+    {
+        case 0x60:
+            setCommandByte(byte);
+            break;
+        case 0xD1:
+            break;
+        case 0xD2:
+            _controllerFifo.push_back(byte);
+            break;
+        case 0xD3:
+            _controllerFifo.push_back(byte);
+            _controllerAux = true;
+            break;
+        case 0xD4:
+            toDevice(kPS2PortAux, byte);
+            break;
+        default:
+            if (command >= 0x61 && command <= 0x7F)
+                break;
+            // a plain data write goes to the keyboard, and enables its port
+            setCommandByte(_commandByte & ~kCB_DisableKeyboardClock);
+            toDevice(kPS2PortKeyboard, byte);
+            break;
+    }
+    tryLoad(time);
+}
+
+void PS2Emulator::inject(int port, const UInt8* bytes, unsigned count, uint64_t gapNS)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    uint64_t when = now() + _timing.byteNS;
+    for (unsigned i = 0; i < count; i++)
+    {
+        queue(port, bytes[i], when);
+        when += gapNS;
+    }
+}
+
+void PS2Emulator::injectAt(int port, UInt8 byte, uint64_t atNS)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    queue(port, byte, atNS);
+}
+
+void PS2Emulator::spontaneousReset(int port)
+{
+    std::lock_guard<std::mutex> guard(_lock);
+    PS2Device* device = _devices[port];
+    if (device)
+    {
+        device->powerOn();
+        if (PS2Mouse* mouse = dynamic_cast<PS2Mouse*>(device))
+        {
+            mouse->deviceID = 0;
+            mouse->resets++;
+        }
+        else if (PS2Keyboard* keyboard = dynamic_cast<PS2Keyboard*>(device))
+            keyboard->resets++;
+    }
+    queue(port, 0xAA, now() + _timing.byteNS);
+    if (port == kPS2PortAux)
+        queue(port, 0x00, now() + _timing.byteNS);
+}
+
+bool PS2Emulator::waitIdle(unsigned timeoutMS)
+{
+    std::unique_lock<std::mutex> guard(_lock);
+    return _cv.wait_for(guard, std::chrono::milliseconds(timeoutMS), [&] {
+        return !_full && _fifo[0].empty() && _fifo[1].empty() && _controllerFifo.empty();
+    });
+}
+
+void PS2Emulator::hardwareThread()
+{
+    std::unique_lock<std::mutex> guard(_lock);
+    while (!_quit)
+    {
+        uint64_t time = now();
+        tryLoad(time);
+        if (_full && _irqPending && _handler)
+        {
+            _irqPending = false;
+            int irq = _dataAux ? 12 : 1;
+            _stats.irqs[_dataAux ? 1 : 0]++;
+            IRQHandler handler = _handler;
+            void* refCon = _handlerRefCon;
+            guard.unlock();
+            handler(refCon, irq);
+            guard.lock();
+            continue;
+        }
+        // sleep until the next byte is due, or something changes
+        uint64_t next = 0;
+        if (!_full)
+        {
+            for (int port = 0; port < 2; port++)
+                if (!_fifo[port].empty() && portClockEnabled(port) && (!next || _fifo[port].front().readyAt < next))
+                    next = _fifo[port].front().readyAt;
+        }
+        if (next)
+            _cv.wait_until(guard, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(next)));
+        else
+            _cv.wait(guard);
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// HostPS2Nub
+//
+
+struct HostNubState
+{
+    std::mutex lock;
+    std::condition_variable cv;
+    unsigned inFlight;
+    std::thread::id handlerThread;
+};
+
+OSDefineMetaClassAndStructors(HostPS2Nub, IOService)
+
+HostPS2Nub* HostPS2Nub::withEmulator(PS2Emulator* emulator)
+{
+    HostPS2Nub* nub = new HostPS2Nub;
+    if (!nub->init())
+    {
+        nub->release();
+        return NULL;
+    }
+    nub->_state = new HostNubState;
+    nub->_state->inFlight = 0;
+    nub->_emulator = emulator;
+    nub->setName("PS2K");
+    emulator->setInterruptHandler(deliverIRQ, nub);
+    return nub;
+}
+
+void HostPS2Nub::free()
+{
+    if (_emulator)
+        _emulator->setInterruptHandler(NULL, NULL);
+    delete _state;
+    _state = NULL;
+    IOService::free();
+}
+
+// The registered vectors of all nubs; the hardware thread copies one out
+// under the lock and calls the handler without it.
+namespace
+{
+    struct NubVectors { HostPS2Nub* nub; int source; OSObject* target; IOInterruptAction handler; void* refCon; bool enabled; unsigned delivered; };
+    std::mutex gVectorLock;
+    std::vector<NubVectors> gVectors;
+
+    NubVectors* findVector(HostPS2Nub* nub, int source)
+    {
+        for (NubVectors& v : gVectors)
+            if (v.nub == nub && v.source == source)
+                return &v;
+        return NULL;
+    }
+}
+
+IOReturn HostPS2Nub::registerInterrupt(int source, OSObject* target, IOInterruptAction handler, void* refCon)
+{
+    std::lock_guard<std::mutex> guard(gVectorLock);
+    if (findVector(this, source))
+        return kIOReturnNoResources;
+    gVectors.push_back({ this, source, target, handler, refCon, false, 0 });
+    return kIOReturnSuccess;
+}
+
+IOReturn HostPS2Nub::unregisterInterrupt(int source)
+{
+    std::unique_lock<std::mutex> guard(_state->lock);
+    // wait out a handler that is running (unless it is us)
+    if (_state->handlerThread != std::this_thread::get_id())
+        _state->cv.wait(guard, [&] { return !_state->inFlight; });
+    std::lock_guard<std::mutex> vectors(gVectorLock);
+    for (auto it = gVectors.begin(); it != gVectors.end(); ++it)
+    {
+        if (it->nub == this && it->source == source)
+        {
+            gVectors.erase(it);
+            return kIOReturnSuccess;
+        }
+    }
+    return kIOReturnNoInterrupt;
+}
+
+IOReturn HostPS2Nub::enableInterrupt(int source)
+{
+    std::lock_guard<std::mutex> guard(gVectorLock);
+    NubVectors* vector = findVector(this, source);
+    if (!vector)
+        return kIOReturnNoInterrupt;
+    vector->enabled = true;
+    return kIOReturnSuccess;
+}
+
+IOReturn HostPS2Nub::disableInterrupt(int source)
+{
+    std::lock_guard<std::mutex> guard(gVectorLock);
+    NubVectors* vector = findVector(this, source);
+    if (!vector)
+        return kIOReturnNoInterrupt;
+    vector->enabled = false;
+    return kIOReturnSuccess;
+}
+
+IOReturn HostPS2Nub::getInterruptType(int source, int* interruptType)
+{
+    (void)source;
+    *interruptType = 0;     // kIOInterruptTypeEdge
+    return kIOReturnSuccess;
+}
+
+unsigned HostPS2Nub::delivered(int irq)
+{
+    std::lock_guard<std::mutex> guard(gVectorLock);
+    NubVectors* vector = findVector(this, irq);
+    return vector ? vector->delivered : 0;
+}
+
+void HostPS2Nub::deliverIRQ(void* refCon, int irq)
+{
+    HostPS2Nub* nub = (HostPS2Nub*)refCon;
+    NubVectors vector;
+    {
+        std::lock_guard<std::mutex> guard(gVectorLock);
+        NubVectors* found = findVector(nub, irq);
+        if (!found || !found->enabled)
+            return;
+        found->delivered++;
+        vector = *found;
+    }
+    {
+        std::lock_guard<std::mutex> guard(nub->_state->lock);
+        nub->_state->inFlight++;
+        nub->_state->handlerThread = std::this_thread::get_id();
+    }
+    {
+        HostKernel::InterruptScope scope;
+        vector.handler(vector.target, vector.refCon, nub, irq);
+    }
+    std::lock_guard<std::mutex> guard(nub->_state->lock);
+    nub->_state->inFlight--;
+    nub->_state->handlerThread = std::thread::id();
+    nub->_state->cv.notify_all();
+}
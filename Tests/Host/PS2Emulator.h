@@ -0,0 +1,288 @@
+//
+// PS2Emulator.h
+//
+// A scriptable 8042 keyboard controller with a keyboard and an aux device
+// attached, standing behind ps2inb/ps2outb in the host build.
+//
+// What is modelled:
+//  - the status register: output buffer full, input buffer busy for a while
+//    after every write, aux data, system flag;
+//  - the controller commands the drivers use (command byte, port clocks,
+//    self tests, write-to-aux, write-to-output-buffer);
+//  - device bytes arriving with per-byte timing, each port in order, the two
+//    ports interleaved by arrival time, held while that port's clock is off;
+//  - IRQ 1 / IRQ 12 raised from a "hardware" thread whenever a byte lands
+//    in the output buffer with its interrupt enabled in the command byte;
+//  - spontaneous device resets ($AA, $AA $00 for the aux port);
+//  - commands the aux device answers with a NAK ($FE) when told to;
+//  - a Synaptics touchpad on the aux port instead of the mouse (PS2Synaptics).
+//
+// Keyboard bytes are produced already translated (scan code set 1), which is
+// what the drivers see with kCB_TranslateMode set.
+//
+
+#ifndef _PS2EMULATOR_H
+#define _PS2EMULATOR_H
+
+#include "HostKernel.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum { kPS2PortKeyboard = 0, kPS2PortAux = 1 };
+
+struct PS2Timing
+{
+    uint64_t inputBusyNS;       // kInputBusy after each write
+    uint64_t transmitNS;        // host -> device, one byte
+    uint64_t byteNS;            // device -> controller, one byte
+    uint64_t selfTestNS;        // device reset (BAT) time
+
+    // fast enough for unit tests
+    static PS2Timing fast()      { return { 5000, 50000, 50000, 1000000 }; }
+    // roughly what a 12 kHz PS/2 clock gives (11 bits a byte)
+    static PS2Timing realistic() { return { 20000, 1000000, 1000000, 20000000 }; }
+};
+
+class PS2Emulator;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Devices
+//
+// receive() and the scripting calls run with the emulator locked; replies go
+// out through send().
+//
+
+class PS2Device
+{
+    friend class PS2Emulator;
+
+public:
+    virtual ~PS2Device() {}
+    // a byte written by the host
+    virtual void receive(UInt8 byte) = 0;
+    // power-on state (called for resets too)
+    virtual void powerOn() {}
+    // every byte the host wrote, in order
+    std::vector<UInt8> received;
+
+protected:
+    PS2Emulator* emulator = NULL;
+    int port = 0;
+    UInt8 lastSent = 0;
+
+    // reply to the byte just received
+    void reply(UInt8 byte);
+    // reply once the self test is over
+    void replyAfterSelfTest(UInt8 byte);
+    // unsolicited data (key strokes, movement)
+    void send(UInt8 byte);
+};
+
+class PS2Keyboard : public PS2Device
+{
+public:
+    bool scanning = true;
+    UInt8 leds = 0;
+    UInt8 typematic = 0x2b;
+    UInt8 scanSet = 2;
+    bool makeReleaseOnly = false;   // kDP_SetAllMakeRelease (no typematic repeat)
+    unsigned resets = 0;
+
+    void receive(UInt8 byte) override;
+    void powerOn() override;
+    // queue set 1 scan code bytes, if scanning is enabled
+    bool type(const UInt8* bytes, unsigned count);
+
+private:
+    UInt8 pending = 0;
+};
+
+class PS2Mouse : public PS2Device
+{
+public:
+    bool reporting = false;
+    bool remote = false;
+    UInt8 sampleRate = 100;
+    UInt8 resolution = 2;
+    bool scaling2to1 = false;
+    UInt8 deviceID = 0;
+    unsigned resets = 0;
+    // answer the next "naks" "nakCommand" bytes (commands, not arguments)
+    // with $FE instead of carrying them out, as a device that missed them
+    UInt8 nakCommand = 0;
+    unsigned naks = 0;
+
+    void receive(UInt8 byte) override;
+    void powerOn() override;
+    // queue a movement packet (3 bytes, 4 with a wheel), if reporting is enabled
+    bool move(int dx, int dy, UInt8 buttons, int wheel = 0);
+
+protected:
+    UInt8 pending = 0;
+    UInt8 rates[3] = {};
+    UInt8 buttonState = 0;
+    virtual void statusRequest();
+    virtual void sampleRateSet(UInt8 rate);
+};
+
+// A Synaptics touchpad: the mouse, plus the "special command" queries and
+// mode byte (4 x $E8 arguments, then $E9 or $F3 $14), and absolute packets.
+// The query answers describe a v8.1 pad with AGM; change them before the
+// driver probes to model another one.
+class PS2Synaptics : public PS2Mouse
+{
+public:
+    UInt8 queries[16][3];
+    UInt8 modeByte = 0;
+    unsigned modeByteWrites = 0;
+
+    PS2Synaptics();
+    void receive(UInt8 byte) override;
+    void powerOn() override;
+
+    // a normal packet: finger 0 (or the "V" packet of 2+ fingers, w 0/1);
+    // z below the driver's z_finger is no touch
+    bool touch(int x, int y, int z, int w, UInt8 buttons = 0);
+    // AGM extended packet (w 2, type 1): the secondary finger
+    bool secondary(int x, int y, int z);
+    // AGM finger count packet (w 2, type 2)
+    bool fingers(int count);
+    // pass through packet (w 3): a 3-byte packet of the guest (trackpoint)
+    bool guest(int dx, int dy, UInt8 buttons);
+    // the bytes of touch, secondary and guest, for feeding a driver directly
+    static void touchPacket(UInt8 bytes[6], int x, int y, int z, int w, UInt8 buttons = 0);
+    static void secondaryPacket(UInt8 bytes[6], int x, int y, int z);
+    static void guestPacket(UInt8 bytes[6], int dx, int dy, UInt8 buttons);
+
+protected:
+    UInt8 argument = 0;
+    unsigned arguments = 0;     // $E8 arguments since the last $E6 (or other)
+    void statusRequest() override;
+    void sampleRateSet(UInt8 rate) override;
+    void packet(const UInt8 bytes[6]);
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The controller
+//
+
+class PS2Emulator
+{
+    friend class PS2Device;
+
+public:
+    explicit PS2Emulator(const PS2Timing& timing = PS2Timing::fast());
+    ~PS2Emulator();
+
+    // attach devices (either may be NULL: nothing plugged in)
+    void attach(int port, PS2Device* device);
+    // ps2inb/ps2outb go to this emulator
+    void makeCurrent();
+    static PS2Emulator* current();
+
+    UInt8 inb(UInt16 port);
+    void outb(UInt16 port, UInt8 byte);
+
+    // IRQ delivery (from the hardware thread)
+    typedef void (*IRQHandler)(void* refCon, int irq);
+    void setInterruptHandler(IRQHandler handler, void* refCon);
+
+    // scripting: bytes from a device, "gapNS" apart (0 = line rate)
+    void inject(int port, const UInt8* bytes, unsigned count, uint64_t gapNS = 0);
+    // scripting: one byte from a device, arriving at "atNS" (uptime) or as
+    // soon after as the port allows
+    void injectAt(int port, UInt8 byte, uint64_t atNS);
+    // the device resets on its own, as on a hot plug or glitch
+    void spontaneousReset(int port);
+    // run "fn" with the emulator locked (to drive devices directly)
+    template <class F> void locked(F fn) { std::lock_guard<std::mutex> guard(_lock); fn(); }
+    // wait until every queued byte has been read by the host
+    bool waitIdle(unsigned timeoutMS = 2000);
+
+    UInt8 commandByte();
+    void setTiming(const PS2Timing& timing);
+
+    struct Stats
+    {
+        unsigned bytesToHost;       // bytes read from the data port
+        unsigned bytesFromHost;     // bytes written to either port
+        unsigned irqs[2];           // keyboard, aux
+        unsigned inputOverruns;     // writes while kInputBusy was still set
+        unsigned staleReads;        // data port reads with nothing in the buffer
+    };
+    Stats stats();
+    void resetStats();
+
+private:
+    struct Pending { UInt8 byte; uint64_t readyAt; };
+
+    std::mutex _lock;
+    std::condition_variable _cv;
+    std::thread _thread;
+    bool _quit = false;
+    PS2Timing _timing;
+    PS2Device* _devices[2] = {};
+
+    // controller state
+    UInt8 _commandByte = 0x45;
+    UInt8 _pendingCommand = 0;
+    bool _lastWasCommand = false;
+    uint64_t _busyUntil = 0;
+    std::deque<Pending> _fifo[2];
+    uint64_t _lastReady[2] = {};
+    std::deque<UInt8> _controllerFifo;
+    bool _controllerAux = false;    // kCP_WriteMouseOutputBuffer
+    bool _full = false;
+    UInt8 _data = 0;
+    bool _dataAux = false;
+    bool _irqPending = false;
+
+    IRQHandler _handler = NULL;
+    void* _handlerRefCon = NULL;
+    Stats _stats = {};
+
+    void queue(int port, UInt8 byte, uint64_t earliest);
+    bool portClockEnabled(int port) const;
+    void tryLoad(uint64_t now);
+    void setCommandByte(UInt8 byte);
+    void controllerCommand(UInt8 command);
+    void toDevice(int port, UInt8 byte);
+    void hardwareThread();
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// The platform nub the controller attaches to
+//
+// Delivers the emulator's IRQs to whatever the controller registered, as an
+// interrupt handler (HostKernel::InterruptScope).  unregisterInterrupt waits
+// for a handler that is running, as the kernel does.
+//
+
+class HostPS2Nub : public IOService
+{
+    OSDeclareDefaultStructors(HostPS2Nub);
+
+public:
+    static HostPS2Nub* withEmulator(PS2Emulator* emulator);
+    void free() override;
+
+    IOReturn registerInterrupt(int source, OSObject* target, IOInterruptAction handler, void* refCon = 0) override;
+    IOReturn unregisterInterrupt(int source) override;
+    IOReturn enableInterrupt(int source) override;
+    IOReturn disableInterrupt(int source) override;
+    IOReturn getInterruptType(int source, int* interruptType) override;
+
+    unsigned delivered(int irq);
+
+private:
+    struct HostNubState* _state;
+    PS2Emulator* _emulator;
+
+    static void deliverIRQ(void* refCon, int irq);
+};
+
+#endif // _PS2EMULATOR_H
@@ -0,0 +1,122 @@
+//
+// PS2Replay.cpp
+//
+
+#include "PS2Replay.h"
+#include "VoodooPS2Controller.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+bool PS2Trace::parse(const void* bytes, size_t length)
+{
+    // same checks as ApplePS2Controller::startPacketReplay
+    const PS2CaptureHeader* header = (const PS2CaptureHeader*)bytes;
+    if (!bytes || length < sizeof(PS2CaptureHeader))
+        return false;
+    if (kCaptureMagic != header->magic || kCaptureVersion != header->version)
+        return false;
+    if (header->headerSize < sizeof(PS2CaptureHeader) || header->headerSize > length)
+        return false;
+    if (header->count > (length - header->headerSize) / sizeof(UInt64))
+        return false;
+
+    startTime = header->startTime;
+    overwritten = header->overwritten;
+    records.resize(header->count);
+    memcpy(records.data(), (const UInt8*)bytes + header->headerSize, header->count * sizeof(UInt64));
+    return true;
+}
+
+static OSData* findCapture(OSObject* object)
+{
+    if (OSDictionary* dict = OSDynamicCast(OSDictionary, object))
+    {
+        if (OSData* data = OSDynamicCast(OSData, dict->getObject(kPacketCapture)))
+            return data;
+        for (unsigned i = 0; i < dict->getCount(); i++)
+            if (OSData* data = findCapture(dict->getObject(dict->keyAt(i))))
+                return data;
+    }
+    else if (OSArray* array = OSDynamicCast(OSArray, object))
+    {
+        for (unsigned i = 0; i < array->getCount(); i++)
+            if (OSData* data = findCapture(array->getObject(i)))
+                return data;
+    }
+    return NULL;
+}
+
+bool PS2Trace::load(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return false;
+    std::vector<char> contents;
+    char buffer[4096];
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        contents.insert(contents.end(), buffer, buffer + got);
+    fclose(file);
+
+    // skip leading white space to tell XML from a raw dump
+    size_t start = 0;
+    while (start < contents.size() && isspace((unsigned char)contents[start]))
+        start++;
+    if (start == contents.size() || '<' != contents[start])
+        return parse(contents.data(), contents.size());
+
+    contents.push_back(0);
+    OSObject* plist = OSUnserializeXML(contents.data() + start);
+    OSData* data = findCapture(plist);
+    bool result = data && parse(data->getBytesNoCopy(), data->getLength());
+    OSSafeReleaseNULL(plist);
+    return result;
+}
+
+OSData* PS2Trace::serialize() const
+{
+    PS2CaptureHeader header = {};
+    header.magic = kCaptureMagic;
+    header.version = kCaptureVersion;
+    header.headerSize = sizeof(header);
+    header.count = (UInt32)records.size();
+    header.overwritten = overwritten;
+    header.startTime = startTime;
+
+    OSData* data = OSData::withCapacity((unsigned)(sizeof(header) + records.size() * sizeof(UInt64)));
+    if (data)
+    {
+        data->appendBytes(&header, sizeof(header));
+        data->appendBytes(records.data(), (unsigned)(records.size() * sizeof(UInt64)));
+    }
+    return data;
+}
+
+unsigned PS2Trace::count(UInt8 deviceType) const
+{
+    unsigned result = 0;
+    for (UInt64 record : records)
+        result += captureRecordDevice(record) == deviceType;
+    return result;
+}
+
+void PS2ReplayTrace(PS2Emulator& emulator, const PS2Trace& trace, unsigned speed)
+{
+    if (trace.records.empty())
+        return;
+    uint64_t base;
+    clock_get_uptime(&base);
+    base += 1000000;    // first byte a millisecond from now
+    UInt64 first = captureRecordTime(trace.records.front());
+    for (UInt64 record : trace.records)
+    {
+        UInt8 deviceType = captureRecordDevice(record);
+        if (kDT_Keyboard != deviceType && kDT_Mouse != deviceType)
+            continue;
+        // captured times are usec; 0 leaves the spacing to the port
+        uint64_t at = speed ? base + (captureRecordTime(record) - first) * 1000 / speed : 0;
+        emulator.injectAt(kDT_Mouse == deviceType ? kPS2PortAux : kPS2PortKeyboard, captureRecordData(record), at);
+    }
+}
@@ -0,0 +1,40 @@
+//
+// PS2Replay.h
+//
+// Packet captures (the controller's "Packet Capture" dump, see
+// PS2CaptureHeader) on the host: parsed from the raw dump or from ioreg's
+// XML output, and replayed into the emulated 8042, so a trace from a field
+// report goes through the interrupt handlers, the request engine and the
+// drivers exactly as it did on the machine it came from.
+//
+
+#ifndef _PS2REPLAY_H
+#define _PS2REPLAY_H
+
+#include "PS2Emulator.h"
+
+#include <vector>
+
+struct PS2Trace
+{
+    UInt64 startTime = 0;           // nsec of uptime when the capture started
+    UInt32 overwritten = 0;         // records lost to the ring wrapping
+    std::vector<UInt64> records;    // makeCaptureRecord() format
+
+    // a "Packet Capture" dump as the controller publishes it
+    bool parse(const void* bytes, size_t length);
+    // the raw dump, or an XML plist with a "Packet Capture" entry anywhere in
+    // it (eg. "ioreg -a -r -n ApplePS2Controller > capture.plist")
+    bool load(const char* path);
+    // back to the dump format (for ReplayPacketCapture)
+    OSData* serialize() const;
+
+    unsigned count(UInt8 deviceType) const;
+};
+
+// Inject "trace" into "emulator": each byte on its port, at its recorded
+// offset divided by "speed" (0: as fast as each port's line allows).
+// Returns at once; the bytes arrive over the trace's duration.
+void PS2ReplayTrace(PS2Emulator& emulator, const PS2Trace& trace, unsigned speed = 1);
+
+#endif // _PS2REPLAY_H
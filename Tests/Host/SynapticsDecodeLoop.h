@@ -0,0 +1,117 @@
+//
+// SynapticsDecodeLoop.h
+//
+// Times the Synaptics driver's bound packet decoder (_decoder) on its own:
+// the packets are queued in its ring buffer a backlog at a time and drained
+// on the work loop, as interruptOccurred and packetReady would, with no
+// emulator or interrupt path around it and (unless asked to) without sending
+// the frames to VoodooInput.  The backlog is unpacked either by
+// decodePacketBatch, as packetReady does, or one packet at a time, for the
+// batch to be compared against.  A template so that it can run against the
+// reference driver too, which is a different class (see CMakeLists.txt).
+//
+
+#ifndef _SYNAPTICSDECODELOOP_H
+#define _SYNAPTICSDECODELOOP_H
+
+#include "VoodooPS2SynapticsTouchPad.h"
+
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+template <class TouchPad>
+struct SynapticsDecodeLoop
+{
+    // packets queued before each drain: 200 ms of a stall at 80 packets/s
+    enum { kBacklog = 16 };
+
+    TouchPad* touchpad;
+    std::vector<UInt8>* packets;    // kPacketBufferLength bytes each
+    int rounds;
+    bool batched;
+    bool send;
+    double result;                  // ns of thread CPU a packet
+
+    // "packets" are rewritten with a fresh arrival time as they are decoded
+    static double run(IOService* service, std::vector<UInt8>& packets, int rounds, bool batched = true, bool send = false)
+    {
+        SynapticsDecodeLoop loop = { OSDynamicCast(TouchPad, service), &packets, rounds, batched, send, 0 };
+        if (!loop.touchpad)
+            return 0;
+        loop.touchpad->_cmdGate->runAction(gated, &loop);
+        return loop.result;
+    }
+
+private:
+    static uint64_t threadNS()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    static void drainBatched(TouchPad* touchpad)
+    {
+        while (touchpad->_ringBuffer.count())
+        {
+            touchpad->decodePacketBatch();
+            const synaptics_packet_batch& batch = touchpad->_batch;
+            for (unsigned i = 0; i < batch.count; i++)
+            {
+                (touchpad->*touchpad->_decoder)(touchpad->_ringBuffer.tail(), batch.x[i], batch.y[i], batch.w[i]);
+                touchpad->_ringBuffer.advanceTail();
+            }
+        }
+    }
+
+    static void drainPerPacket(TouchPad* touchpad)
+    {
+        while (touchpad->_ringBuffer.count())
+        {
+            const UInt8* packet = touchpad->_ringBuffer.tail();
+            int x, y, w;
+            TouchPad::unpackPacket(packet, x, y, w);
+            (touchpad->*touchpad->_decoder)(packet, x, y, w);
+            touchpad->_ringBuffer.advanceTail();
+        }
+    }
+
+    static IOReturn gated(OSObject*, void* arg0, void*, void*, void*)
+    {
+        SynapticsDecodeLoop& loop = *(SynapticsDecodeLoop*)arg0;
+        TouchPad* touchpad = loop.touchpad;
+        size_t count = loop.packets->size() / kPacketBufferLength;
+        IOService* input = touchpad->voodooInputInstance;
+        if (!loop.send)
+            touchpad->voodooInputInstance = NULL;
+
+        uint64_t time;
+        clock_get_uptime(&time);
+        uint64_t start = threadNS();
+        for (int round = 0; round < loop.rounds; round++)
+        {
+            UInt8* packet = loop.packets->data();
+            for (size_t i = 0; i < count; )
+            {
+                for (size_t end = i + kBacklog; i < count && i < end; i++, packet += kPacketBufferLength)
+                {
+                    time += 12500000;
+                    *(uint64_t*)(&packet[kPacketTimeOffset]) = time;
+                    memcpy(touchpad->_ringBuffer.reserve(), packet, kPacketBufferLength);
+                    touchpad->_ringBuffer.commit();
+                }
+                if (loop.batched)
+                    drainBatched(touchpad);
+                else
+                    drainPerPacket(touchpad);
+            }
+        }
+        loop.result = (double)(threadNS() - start) / (count * loop.rounds);
+
+        touchpad->voodooInputInstance = input;
+        return kIOReturnSuccess;
+    }
+};
+
+#endif // _SYNAPTICSDECODELOOP_H
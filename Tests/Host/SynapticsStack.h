@@ -0,0 +1,74 @@
+//
+// SynapticsStack.h
+//
+// The Synaptics driver started on an emulated touchpad (PS2Synaptics on the
+// aux port), with VoodooInput collecting the frames it sends, for the tests
+// and benchmarks that feed it packets.
+//
+
+#ifndef _SYNAPTICSSTACK_H
+#define _SYNAPTICSSTACK_H
+
+#include "HostTest.h"
+#include "HostStack.h"
+
+#include "VoodooPS2Controller.h"
+#include "ApplePS2MouseDevice.h"
+#include "VoodooPS2SynapticsTouchPad.h"
+
+struct SynapticsStack
+{
+    HostStack stack;
+    PS2Synaptics pad;
+    IOService* driver = NULL;
+    HostVoodooInput* input = NULL;
+
+    SynapticsStack() { stack.attachAux(&pad); }
+    ~SynapticsStack()
+    {
+        OSSafeReleaseNULL(input);
+        stack.stop();
+    }
+
+    // "options" are set as the driver's properties once it runs, as a user
+    // would with ioio (eg. ZeroDropTransitions); "touchpad" is the driver to
+    // start, a new ApplePS2SynapticsTouchPad by default
+    bool start(OSDictionary* options = NULL, IOService* touchpad = NULL)
+    {
+        if (!stack.startController())
+        {
+            OSSafeReleaseNULL(touchpad);
+            return false;
+        }
+        OSDictionary* personality = HostPersonality("VoodooPS2Trackpad/VoodooPS2Trackpad-Info.plist", "Synaptics TouchPad");
+        driver = touchpad ? touchpad : new ApplePS2SynapticsTouchPad;
+        if (!stack.startDriver(driver, personality, stack.mouseDevice))
+        {
+            driver = NULL;
+            return false;
+        }
+        input = HostVoodooInput::withDriver(driver);
+        if (!input || !WAIT_FOR(pad.reporting, 5000))
+            return false;
+        if (options)
+            driver->setProperties(options);
+        stack.emulator.waitIdle();
+        input->clearEvents();
+        return true;
+    }
+
+    // one packet (or an AGM packet and the normal one following it), at
+    // about the 80 packets/s of a pad in high rate mode
+    void onePacket(int x, int y, int w, int agmX = -1, int z = 60)
+    {
+        stack.emulator.locked([&] {
+            if (agmX >= 0)
+                pad.secondary(agmX, y, z);
+            pad.touch(x, y, z, w);
+        });
+        stack.emulator.waitIdle();
+        IOSleep(12);
+    }
+};
+
+#endif // _SYNAPTICSSTACK_H
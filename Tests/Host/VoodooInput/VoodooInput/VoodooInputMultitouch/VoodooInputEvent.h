@@ -0,0 +1,18 @@
+//
+// Host build stand-in for VoodooInput's VoodooInputEvent.h.
+//
+
+#ifndef VoodooInputEvent_h
+#define VoodooInputEvent_h
+
+#include "VoodooInputTransducer.h"
+
+#define VOODOO_INPUT_MAX_TRANSDUCERS 10
+
+struct VoodooInputEvent {
+    UInt8 contact_count;
+    AbsoluteTime timestamp;
+    VoodooInputTransducer transducers[VOODOO_INPUT_MAX_TRANSDUCERS];
+};
+
+#endif
@@ -0,0 +1,28 @@
+//
+// Host build stand-in for VoodooInput's VoodooInputMessages.h.
+//
+
+#ifndef VoodooInputMessages_h
+#define VoodooInputMessages_h
+
+#include "HostKernel.h"
+
+#define VOODOO_INPUT_IDENTIFIER "VoodooInputSupported"
+
+#define VOODOO_INPUT_LOGICAL_MAX_X_KEY "Logical Max X"
+#define VOODOO_INPUT_LOGICAL_MAX_Y_KEY "Logical Max Y"
+#define VOODOO_INPUT_PHYSICAL_MAX_X_KEY "Physical Max X"
+#define VOODOO_INPUT_PHYSICAL_MAX_Y_KEY "Physical Max Y"
+
+#define kIOMessageVoodooInputMessage 12345
+#define kIOMessageVoodooInputUpdateDimensionsMessage 12346
+#define kIOMessageVoodooInputUpdatePropertiesNotification 12347
+
+struct VoodooInputDimensions {
+    SInt32 min_x;
+    SInt32 max_x;
+    SInt32 min_y;
+    SInt32 max_y;
+};
+
+#endif
@@ -0,0 +1,38 @@
+//
+// Host build stand-in for VoodooInput's VoodooInputTransducer.h (the real
+// project is checked out next to this repository for kext builds).
+//
+
+#ifndef VoodooInputTransducer_h
+#define VoodooInputTransducer_h
+
+#include "HostKernel.h"
+
+enum VoodooInputTransducerType {
+    STYLUS,
+    FINGER
+};
+
+struct TouchCoordinates {
+    UInt32 x;
+    UInt32 y;
+    UInt8 pressure;
+    UInt8 width;
+};
+
+struct VoodooInputTransducer {
+    AbsoluteTime timestamp;
+
+    UInt32 id;
+    UInt32 secondaryId;
+    VoodooInputTransducerType type;
+
+    bool isValid;
+    bool isPhysicalButtonDown;
+    bool isTransducerActive;
+
+    TouchCoordinates currentCoordinates;
+    TouchCoordinates previousCoordinates;
+};
+
+#endif
@@ -0,0 +1,205 @@
+//
+// HostHID.h
+//
+// IOHIDevice, IOHIPointing and IOHIKeyboard for the host build.  Instead of
+// going to the HID system, everything the drivers dispatch is handed to an
+// event sink the tests install, in dispatch order.
+//
+
+#ifndef _HOSTHID_H
+#define _HOSTHID_H
+
+#include "HostKernel.h"
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Constants the drivers use
+//
+
+#define NX_EVS_DEVICE_TYPE_KEYBOARD         1
+#define NX_EVS_DEVICE_TYPE_MOUSE            2
+#define NX_EVS_DEVICE_INTERFACE_OTHER       0
+#define NX_EVS_DEVICE_INTERFACE_NeXT        1
+#define NX_EVS_DEVICE_INTERFACE_ADB         2
+#define NX_EVS_DEVICE_INTERFACE_ACE         3
+#define NX_EVS_DEVICE_INTERFACE_BUS_ACE     NX_EVS_DEVICE_INTERFACE_ACE
+#define NX_NUMKEYCODES                      128
+
+#define NX_MODIFIERKEY_ALPHALOCK            0
+#define NX_MODIFIERKEY_SHIFT                1
+#define NX_MODIFIERKEY_CONTROL              2
+#define NX_MODIFIERKEY_ALTERNATE            3
+#define NX_MODIFIERKEY_COMMAND              4
+#define NX_MODIFIERKEY_NUMERICPAD           5
+#define NX_MODIFIERKEY_HELP                 6
+#define NX_MODIFIERKEY_SECONDARYFN          7
+#define NX_MODIFIERKEY_NUMLOCK              8
+#define NX_MODIFIERKEY_RSHIFT               9
+#define NX_MODIFIERKEY_RCONTROL             10
+#define NX_MODIFIERKEY_RALTERNATE           11
+#define NX_MODIFIERKEY_RCOMMAND             12
+#define NX_MODIFIERKEY_ALPHALOCK_STATELESS  13
+
+#define NX_KEYTYPE_SOUND_UP                 0
+#define NX_KEYTYPE_SOUND_DOWN               1
+#define NX_KEYTYPE_BRIGHTNESS_UP            2
+#define NX_KEYTYPE_BRIGHTNESS_DOWN          3
+#define NX_KEYTYPE_CAPS_LOCK                4
+#define NX_KEYTYPE_HELP                     5
+#define NX_POWER_KEY                        6
+#define NX_KEYTYPE_MUTE                     7
+#define NX_UP_ARROW_KEY                     8
+#define NX_DOWN_ARROW_KEY                   9
+#define NX_KEYTYPE_NUM_LOCK                 10
+#define NX_KEYTYPE_CONTRAST_UP              11
+#define NX_KEYTYPE_CONTRAST_DOWN            12
+#define NX_KEYTYPE_LAUNCH_PANEL             13
+#define NX_KEYTYPE_EJECT                    14
+#define NX_KEYTYPE_VIDMIRROR                15
+#define NX_KEYTYPE_PLAY                     16
+#define NX_KEYTYPE_NEXT                     17
+#define NX_KEYTYPE_PREVIOUS                 18
+#define NX_KEYTYPE_FAST                     19
+#define NX_KEYTYPE_REWIND                   20
+
+#define kIOHIDPointerAccelerationTypeKey    "HIDPointerAccelerationType"
+#define kIOHIDScrollAccelerationTypeKey     "HIDScrollAccelerationType"
+#define kIOHIDScrollResolutionKey           "HIDScrollResolution"
+#define kIOHIDMouseAccelerationType         "HIDMouseAcceleration"
+#define kIOHIDTrackpadAccelerationType      "HIDTrackpadAcceleration"
+#define kIOHIDTrackpadScrollAccelerationKey "HIDTrackpadScrollAcceleration"
+#define kIOHIDVirtualHIDevice               "HIDVirtualDevice"
+#define kIOHIDPointerResolutionKey          "HIDPointerResolution"
+
+#define kUSBHostMatchingPropertyInterfaceClass      "bInterfaceClass"
+#define kUSBHostMatchingPropertyInterfaceSubClass   "bInterfaceSubClass"
+#define kUSBHostMatchingPropertyInterfaceProtocol   "bInterfaceProtocol"
+#define kUSBHIDInterfaceClass               3
+#define kUSBHIDBootInterfaceSubClass        1
+#define kHIDMouseInterfaceProtocol          2
+#define kBluetoothDeviceClassMajorPeripheral 0x05
+#define kBluetoothDeviceClassMinorPeripheral1Keyboard       0x10
+#define kBluetoothDeviceClassMinorPeripheral1Pointing       0x20
+#define kBluetoothDeviceClassMinorPeripheral1Combo          0x30
+#define kBluetoothDeviceClassMinorPeripheral2Unclassified   0x00
+#define kBluetoothDeviceClassMinorPeripheral2DigitizerTablet 0x05
+#define kBluetoothDeviceClassMinorPeripheral2DigitalPen     0x07
+
+struct IOGPoint { SInt16 x; SInt16 y; };
+struct IOGBounds { SInt16 minx; SInt16 maxx; SInt16 miny; SInt16 maxy; };
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Event sink
+//
+
+struct HostHIDEvent
+{
+    enum Kind { kRelative, kScroll, kAbsolute, kKey } kind;
+    const OSObject* sender;
+    int dx, dy, dz;             // kRelative/kScroll (dz = third scroll axis)
+    UInt32 buttons;
+    unsigned key;               // kKey: ADB key code
+    bool down;
+    uint64_t time;              // timestamp given by the driver
+    uint64_t dispatched;        // clock_get_uptime at dispatch
+};
+
+typedef void (*HostHIDEventSink)(void* refCon, const HostHIDEvent& event);
+void HostHIDSetEventSink(HostHIDEventSink sink, void* refCon);
+void HostHIDDeliver(HostHIDEvent& event);
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// IOHIDevice
+//
+
+class IOHIDevice : public IOService
+{
+    OSDeclareDefaultStructors(IOHIDevice);
+
+public:
+    bool init(OSDictionary* properties = 0) override;
+    bool start(IOService* provider) override;
+    virtual IOHIDKind hidKind() { return 0; }
+    virtual UInt32 deviceType() { return 0; }
+    virtual UInt32 interfaceID() { return 0; }
+    virtual bool updateProperties(void) { return true; }
+    virtual IOReturn setParamProperties(OSDictionary* dict) { (void)dict; return kIOReturnSuccess; }
+    IOReturn setProperties(OSObject* properties) override;
+    virtual UInt64 getGUID() { return 0; }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// IOHIPointing
+//
+
+#define EV_DEFAULTPOINTERACCELLEVEL 0x0000b000
+#define EV_DEFAULTSCROLLACCELLEVEL  0x00005000
+
+class IOHIPointing : public IOHIDevice
+{
+    OSDeclareDefaultStructors(IOHIPointing);
+
+protected:
+    virtual void dispatchRelativePointerEvent(int dx, int dy, UInt32 buttonState, AbsoluteTime ts);
+    virtual void dispatchAbsolutePointerEvent(IOGPoint* newLoc, IOGBounds* bounds, UInt32 buttonState,
+                                              bool proximity, int pressure, int pressureMin,
+                                              int pressureMax, int stylusAngle, AbsoluteTime ts);
+    virtual void dispatchScrollWheelEvent(short deltaAxis1, short deltaAxis2, short deltaAxis3, AbsoluteTime ts);
+
+public:
+    IOReturn message(UInt32 type, IOService* provider, void* argument = 0) override;
+    IOReturn setParamProperties(OSDictionary* dict) override;
+
+protected:
+    virtual IOItemCount buttonCount() { return 2; }
+    virtual IOFixed resolution() { return 100 << 16; }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// IOHIKeyboard
+//
+
+#define EV_DEFAULTINITIALREPEAT 500000000ULL
+#define EV_DEFAULTKEYREPEAT     83333333ULL
+#define EV_MINKEYREPEAT         16700000ULL
+
+class IOHIKeyboardMapper;
+
+class IOHIKeyboard : public IOHIDevice
+{
+    OSDeclareDefaultStructors(IOHIKeyboard);
+
+protected:
+    IOHIKeyboardMapper* _keyMap;
+    unsigned _eventFlags;
+    bool _alphaLock;
+    bool _numLock;
+    bool _charKeyActive;
+
+    virtual void dispatchKeyboardEvent(unsigned int keyCode, bool goingDown, AbsoluteTime time);
+
+public:
+    IOReturn message(UInt32 type, IOService* provider, void* argument = 0) override;
+    IOReturn setParamProperties(OSDictionary* dict) override;
+    IOReturn setProperties(OSObject* properties) override;
+
+protected:
+    virtual const unsigned char* defaultKeymapOfLength(UInt32* length) { *length = 0; return 0; }
+    virtual void setAlphaLockFeedback(bool val) { (void)val; }
+    virtual void setNumLockFeedback(bool val) { (void)val; }
+    virtual UInt32 maxKeyCodes() { return NX_NUMKEYCODES; }
+
+public:
+    virtual unsigned eventFlags() { return _eventFlags; }
+    virtual unsigned deviceFlags() { return _eventFlags; }
+    virtual void setDeviceFlags(unsigned flags) { _eventFlags = flags; }
+    virtual bool alphaLock() { return _alphaLock; }
+    virtual void setAlphaLock(bool val) { _alphaLock = val; setAlphaLockFeedback(val); }
+    virtual bool numLock() { return _numLock; }
+    virtual void setNumLock(bool val) { _numLock = val; setNumLockFeedback(val); }
+    virtual bool charKeyActive() { return _charKeyActive; }
+    virtual void setCharKeyActive(bool val) { _charKeyActive = val; }
+    virtual bool doesKeyLock(unsigned key) { (void)key; return false; }
+    virtual unsigned getLEDStatus() { return 0; }
+};
+
+#endif // _HOSTHID_H
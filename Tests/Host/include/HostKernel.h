@@ -0,0 +1,998 @@
+//
+// HostKernel.h
+//
+// A small stand-in for the parts of libkern/IOKit the drivers use, so the
+// controller, keyboard, mouse and trackpad sources can be compiled and run
+// as an ordinary Linux/macOS process by the tests in this directory.
+//
+// Only behavior the drivers depend on is modelled: reference counted OS
+// containers, registry properties, a work loop with a real thread, command
+// gate sleep/wakeup, timers, interrupt event sources, thread calls, and the
+// interrupt-level rules (no blocking, no allocation while interrupts are
+// disabled or from an interrupt handler), which are counted so tests can
+// assert on them.
+//
+
+#ifndef _HOSTKERNEL_H
+#define _HOSTKERNEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <limits.h>
+#include <type_traits>
+#include <new>
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Basic types
+//
+
+typedef uint8_t     UInt8;
+typedef uint16_t    UInt16;
+typedef uint32_t    UInt32;
+typedef uint64_t    UInt64;
+typedef int8_t      SInt8;
+typedef int16_t     SInt16;
+typedef int32_t     SInt32;
+typedef int64_t     SInt64;
+typedef UInt8       Boolean;
+typedef UInt64      AbsoluteTime;
+typedef int         IOReturn;
+typedef UInt32      IOOptionBits;
+typedef size_t      IOByteCount;
+typedef UInt32      IOItemCount;
+typedef SInt32      IOFixed;
+typedef UInt32      IOPMPowerFlags;
+typedef void*       IOInterruptState;
+typedef UInt32      IOHIDKind;
+typedef int         kern_return_t;
+typedef uint64_t    mach_vm_address_t;
+typedef void*       thread_call_param_t;
+typedef uint32_t    boolean_t;
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+#define KERN_SUCCESS                0
+
+#define kIOReturnSuccess            0
+#define kIOReturnError              ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory           ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources        ((IOReturn)0xe00002be)
+#define kIOReturnBadArgument        ((IOReturn)0xe00002c2)
+#define kIOReturnUnsupported        ((IOReturn)0xe00002c7)
+#define kIOReturnNotPrivileged      ((IOReturn)0xe00002c1)
+#define kIOReturnNotReady           ((IOReturn)0xe00002d8)
+#define kIOReturnTimeout            ((IOReturn)0xe00002d6)
+#define kIOReturnBusy               ((IOReturn)0xe00002d5)
+#define kIOReturnNotFound           ((IOReturn)0xe00002f0)
+#define kIOReturnAborted            ((IOReturn)0xe00002eb)
+#define kIOReturnCannotLock         ((IOReturn)0xe00002cc)
+#define kIOReturnNoInterrupt        ((IOReturn)0xe00002e6)
+
+#define THREAD_AWAKENED             0
+#define THREAD_TIMED_OUT            1
+#define THREAD_INTERRUPTED          2
+#define THREAD_UNINT                0
+#define THREAD_ABORTSAFE            1
+
+#define kNanosecondScale            1
+#define kMicrosecondScale           1000
+#define kMillisecondScale           (1000 * 1000)
+#define kSecondScale                (1000 * 1000 * 1000)
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Kernel services
+//
+
+extern "C" {
+void IOLog(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void IOSleep(unsigned milliseconds);
+void IODelay(unsigned microseconds);
+void* IOMalloc(size_t size);
+void IOFree(void* address, size_t size);
+void* IOMallocAligned(size_t size, size_t alignment);
+void IOFreeAligned(void* address, size_t size);
+void clock_get_uptime(uint64_t* result);
+uint64_t mach_absolute_time(void);
+void absolutetime_to_nanoseconds(uint64_t abstime, uint64_t* result);
+void nanoseconds_to_absolutetime(uint64_t nanoseconds, uint64_t* result);
+void clock_interval_to_deadline(uint32_t interval, uint32_t scale_factor, uint64_t* result);
+void clock_get_system_microtime(uint32_t* secs, uint32_t* microsecs);
+boolean_t PE_parse_boot_argn(const char* arg_string, void* arg_ptr, int max_arg);
+bool ml_set_interrupts_enabled(bool enable);
+bool ml_get_interrupts_enabled(void);
+void panic(const char* format, ...) __attribute__((noreturn));
+}
+
+#define IOMallocType(type)      ((type*)IOMalloc(sizeof(type)))
+#define IOFreeType(p, type)     IOFree(p, sizeof(type))
+
+// libkern/libkern.h and sys/param.h helpers
+static inline unsigned int min(unsigned int a, unsigned int b) { return a < b ? a : b; }
+static inline unsigned int max(unsigned int a, unsigned int b) { return a > b ? a : b; }
+static inline int imin(int a, int b) { return a < b ? a : b; }
+static inline int imax(int a, int b) { return a > b ? a : b; }
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+extern int version_major;
+extern int version_minor;
+
+struct kmod_info_t { char name[64]; char version[64]; };
+extern kmod_info_t kmod_info;
+
+#ifndef assert
+#include <assert.h>
+#endif
+
+// Interrupt level bookkeeping.  The fake nub marks its interrupt handlers,
+// ml_set_interrupts_enabled(false) marks the rest; blocking or allocating
+// there is counted as a violation (and logged) instead of hanging a CPU.
+
+namespace HostKernel
+{
+    bool atInterruptLevel();
+    void noteViolation(const char* what);
+    unsigned violations();
+    void resetViolations();
+    void setLogging(bool enable);
+    // run with this thread flagged as an interrupt handler
+    struct InterruptScope { InterruptScope(); ~InterruptScope(); bool saved; };
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Locks
+//
+
+struct IOLock;
+struct IOSimpleLock;
+typedef IOLock      lck_mtx_t;
+
+IOLock* IOLockAlloc(void);
+void IOLockFree(IOLock* lock);
+void IOLockLock(IOLock* lock);
+bool IOLockTryLock(IOLock* lock);
+void IOLockUnlock(IOLock* lock);
+int IOLockSleep(IOLock* lock, void* event, UInt32 interType);
+void IOLockWakeup(IOLock* lock, void* event, bool oneThread);
+
+IOSimpleLock* IOSimpleLockAlloc(void);
+void IOSimpleLockFree(IOSimpleLock* lock);
+void IOSimpleLockLock(IOSimpleLock* lock);
+void IOSimpleLockUnlock(IOSimpleLock* lock);
+IOInterruptState IOSimpleLockLockDisableInterrupt(IOSimpleLock* lock);
+void IOSimpleLockUnlockEnableInterrupt(IOSimpleLock* lock, IOInterruptState state);
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Thread calls
+//
+
+typedef void (*thread_call_func_t)(thread_call_param_t param0, thread_call_param_t param1);
+struct thread_call;
+typedef thread_call* thread_call_t;
+
+extern "C" {
+thread_call_t thread_call_allocate(thread_call_func_t func, thread_call_param_t param0);
+boolean_t thread_call_enter(thread_call_t call);
+boolean_t thread_call_enter1(thread_call_t call, thread_call_param_t param1);
+boolean_t thread_call_enter_delayed(thread_call_t call, uint64_t deadline);
+boolean_t thread_call_cancel(thread_call_t call);
+boolean_t thread_call_cancel_wait(thread_call_t call);
+boolean_t thread_call_free(thread_call_t call);
+}
+
+// Wait until no thread call is queued or running (tests use this to settle).
+namespace HostKernel { void drainThreadCalls(); }
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// OSObject and the meta class macros
+//
+
+class OSObject;
+class OSString;
+class OSSymbol;
+class OSDictionary;
+class OSSerialize;
+
+class OSMetaClass
+{
+public:
+    const char* name;
+    const OSMetaClass* superClass;
+    OSMetaClass(const char* n, const OSMetaClass* s) : name(n), superClass(s) {}
+    const char* getClassName() const { return name; }
+    bool isKindOf(const char* className) const;
+};
+
+class OSMetaClassBase
+{
+public:
+    virtual ~OSMetaClassBase() {}
+    virtual const OSMetaClass* getMetaClass() const = 0;
+    const char* getClassName() const { return getMetaClass()->getClassName(); }
+
+    // the kernel's pointer-to-member to function pointer conversion (Itanium ABI)
+    template <class T, class F>
+    static void* _ptmf2ptf(const T* self, F func)
+    {
+        union { F fIn; struct { uintptr_t ptr; ptrdiff_t adj; } fOut; } map;
+        map.fIn = func;
+        if (map.fOut.ptr & 1)
+        {
+            void** vtable = *(void***)((const char*)self + map.fOut.adj);
+            return vtable[(map.fOut.ptr - 1) / sizeof(void*)];
+        }
+        return (void*)map.fOut.ptr;
+    }
+};
+
+#define OSMemberFunctionCast(cptrtype, self, func) \
+    ((cptrtype)OSMetaClassBase::_ptmf2ptf(self, func))
+
+#define OSDeclareCommonStructors(className) \
+    public: \
+        static const OSMetaClass gMetaClass; \
+        static const OSMetaClass* const metaClass; \
+        const OSMetaClass* getMetaClass() const override { return &gMetaClass; }
+
+#define OSDeclareDefaultStructors(className) \
+    OSDeclareCommonStructors(className) \
+    public: \
+        className(); \
+    protected: \
+        virtual ~className()
+
+#define OSDeclareAbstractStructors(className) OSDeclareDefaultStructors(className)
+#define OSDeclareFinalStructors(className) OSDeclareDefaultStructors(className)
+
+#define OSDefineMetaClassAndStructors(className, superclassName) \
+    const OSMetaClass className::gMetaClass(#className, &superclassName::gMetaClass); \
+    const OSMetaClass* const className::metaClass = &className::gMetaClass; \
+    className::className() {} \
+    className::~className() {}
+
+#define OSDefineMetaClassAndAbstractStructors(className, superclassName) \
+    OSDefineMetaClassAndStructors(className, superclassName)
+
+#define OSMetaClassDeclareReservedUnused(className, index)
+#define OSMetaClassDefineReservedUnused(className, index)
+
+template <class T, class U>
+inline T* OSDynamicCastHelper(U* object)
+{
+    return dynamic_cast<T*>(const_cast<typename std::remove_const<U>::type*>(object));
+}
+template <class T>
+inline T* OSDynamicCastHelper(decltype(nullptr)) { return nullptr; }
+
+#define OSDynamicCast(type, inst)   OSDynamicCastHelper<type>(inst)
+#define OSRequiredCast(type, inst)  OSDynamicCastHelper<type>(inst)
+#define OSTypeAlloc(type)           (new type)
+#define OSTypeID(type)              (&type::gMetaClass)
+#define OSCheckTypeInst(typeinst, inst) (OSDynamicCast(OSObject, inst) != 0)
+
+#define OSSafeReleaseNULL(inst)     do { if (inst) (inst)->release(); (inst) = NULL; } while (0)
+#define OSSafeRelease(inst)         do { if (inst) (inst)->release(); } while (0)
+
+class OSObject : public OSMetaClassBase
+{
+private:
+    mutable int retainCount;
+
+public:
+    static const OSMetaClass gMetaClass;
+    static const OSMetaClass* const metaClass;
+    const OSMetaClass* getMetaClass() const override { return &gMetaClass; }
+
+    // kernel allocations are zero filled, the drivers rely on that
+    static void* operator new(size_t size) { void* p = ::calloc(1, size); if (!p) throw std::bad_alloc(); return p; }
+    static void operator delete(void* p) { ::free(p); }
+
+    OSObject() : retainCount(1) {}
+
+    virtual bool init() { return true; }
+    virtual void free() { delete this; }
+
+    void retain() const;
+    void release() const;
+    void release(int when) const { release(); (void)when; }
+    int getRetainCount() const { return __atomic_load_n(&retainCount, __ATOMIC_RELAXED); }
+
+    virtual bool isEqualTo(const OSMetaClassBase* other) const { return this == other; }
+    virtual bool serialize(OSSerialize*) const { return false; }
+
+protected:
+    virtual ~OSObject() {}
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Containers
+//
+
+class OSString : public OSObject
+{
+    OSDeclareDefaultStructors(OSString);
+
+protected:
+    char* string;
+    unsigned length;
+    bool noCopy;
+
+public:
+    static OSString* withCString(const char* cString);
+    static OSString* withCStringNoCopy(const char* cString);
+    static OSString* withString(const OSString* aString);
+    static OSString* withCString(const char* cString, size_t length);
+    virtual bool initWithCString(const char* cString, size_t len);
+    void free() override;
+
+    const char* getCStringNoCopy() const { return string; }
+    unsigned getLength() const { return length; }
+    char getChar(unsigned index) const { return index < length ? string[index] : 0; }
+    bool setChar(char aChar, unsigned index);
+    bool isEqualTo(const char* cString) const;
+    bool isEqualTo(const OSMetaClassBase* other) const override;
+    bool isEqualTo(const OSString* other) const;
+};
+
+class OSSymbol : public OSString
+{
+    OSDeclareDefaultStructors(OSSymbol);
+
+public:
+    static const OSSymbol* withCString(const char* cString);
+    static const OSSymbol* withCStringNoCopy(const char* cString);
+    static const OSSymbol* withString(const OSString* aString);
+};
+
+class OSNumber : public OSObject
+{
+    OSDeclareDefaultStructors(OSNumber);
+
+protected:
+    unsigned long long value;
+    unsigned size;
+
+public:
+    static OSNumber* withNumber(unsigned long long value, unsigned numberOfBits);
+    static OSNumber* withNumber(const char* value, unsigned numberOfBits);
+
+    unsigned numberOfBits() const { return size; }
+    unsigned numberOfBytes() const { return (size + 7) / 8; }
+    UInt8  unsigned8BitValue() const  { return (UInt8)value; }
+    UInt16 unsigned16BitValue() const { return (UInt16)value; }
+    UInt32 unsigned32BitValue() const { return (UInt32)value; }
+    UInt64 unsigned64BitValue() const { return (UInt64)value; }
+    void setValue(unsigned long long v) { value = v & (size < 64 ? (1ULL << size) - 1 : ~0ULL); }
+    void addValue(SInt64 v) { setValue(value + v); }
+    bool isEqualTo(const OSMetaClassBase* other) const override;
+    bool isEqualTo(const OSNumber* other) const { return other && value == other->value; }
+};
+
+class OSBoolean : public OSObject
+{
+    OSDeclareDefaultStructors(OSBoolean);
+
+protected:
+    bool value;
+
+public:
+    static OSBoolean* withBoolean(bool value);
+    bool isTrue() const { return value; }
+    bool isFalse() const { return !value; }
+    bool getValue() const { return value; }
+    bool isEqualTo(const OSMetaClassBase* other) const override;
+    bool isEqualTo(const OSBoolean* other) const { return other == this; }
+    void free() override {}     // the two instances live forever
+    static OSBoolean* makeStatic(bool value);
+};
+
+extern OSBoolean* const& kOSBooleanTrue;
+extern OSBoolean* const& kOSBooleanFalse;
+
+class OSData : public OSObject
+{
+    OSDeclareDefaultStructors(OSData);
+
+protected:
+    void* data;
+    unsigned length;
+    unsigned capacity;
+    bool noCopy;
+
+public:
+    static OSData* withCapacity(unsigned capacity);
+    static OSData* withBytes(const void* bytes, unsigned numBytes);
+    static OSData* withBytesNoCopy(void* bytes, unsigned numBytes);
+    static OSData* withData(const OSData* other);
+    void free() override;
+
+    unsigned getLength() const { return length; }
+    unsigned getCapacity() const { return capacity; }
+    const void* getBytesNoCopy() const { return length ? data : 0; }
+    const void* getBytesNoCopy(unsigned start, unsigned numBytes) const;
+    bool appendBytes(const void* bytes, unsigned numBytes);
+    bool appendBytes(const OSData* other) { return appendBytes(other->getBytesNoCopy(), other->getLength()); }
+    unsigned ensureCapacity(unsigned newCapacity);
+    bool isEqualTo(const OSMetaClassBase* other) const override;
+    bool isEqualTo(const void* bytes, unsigned numBytes) const;
+};
+
+class OSCollection : public OSObject
+{
+    OSDeclareDefaultStructors(OSCollection);
+
+public:
+    virtual unsigned getCount() const = 0;
+    // iteration support for OSCollectionIterator
+    virtual OSObject* iterationObject(unsigned index) const = 0;
+    virtual void flushCollection() = 0;
+};
+
+class OSArray : public OSCollection
+{
+    OSDeclareDefaultStructors(OSArray);
+
+protected:
+    OSObject** array;
+    unsigned count;
+    unsigned capacity;
+
+public:
+    static OSArray* withCapacity(unsigned capacity);
+    static OSArray* withObjects(const OSObject* objects[], unsigned count, unsigned capacity = 0);
+    static OSArray* withArray(const OSArray* other, unsigned capacity = 0);
+    void free() override;
+
+    unsigned getCount() const override { return count; }
+    OSObject* getObject(unsigned index) const { return index < count ? array[index] : 0; }
+    OSObject* getLastObject() const { return count ? array[count - 1] : 0; }
+    bool setObject(const OSMetaClassBase* object);
+    bool setObject(unsigned index, const OSMetaClassBase* object);
+    bool replaceObject(unsigned index, const OSMetaClassBase* object);
+    void removeObject(unsigned index);
+    bool merge(const OSArray* other);
+    unsigned getNextIndexOfObject(const OSMetaClassBase* object, unsigned index) const;
+    OSObject* iterationObject(unsigned index) const override { return getObject(index); }
+    void flushCollection() override;
+    bool isEqualTo(const OSMetaClassBase* other) const override;
+};
+
+class OSDictionary : public OSCollection
+{
+    OSDeclareDefaultStructors(OSDictionary);
+
+protected:
+    struct Entry { const OSSymbol* key; OSObject* value; };
+    Entry* entries;
+    unsigned count;
+    unsigned capacity;
+
+public:
+    static OSDictionary* withCapacity(unsigned capacity);
+    static OSDictionary* withDictionary(const OSDictionary* other, unsigned capacity = 0);
+    static OSDictionary* withObjects(const OSObject* objects[], const OSSymbol* keys[], unsigned count, unsigned capacity = 0);
+    static OSDictionary* withObjects(const OSObject* objects[], const OSString* keys[], unsigned count, unsigned capacity = 0);
+    void free() override;
+
+    unsigned getCount() const override { return count; }
+    OSObject* getObject(const char* key) const;
+    OSObject* getObject(const OSString* key) const { return key ? getObject(key->getCStringNoCopy()) : 0; }
+    OSObject* getObject(const OSSymbol* key) const { return key ? getObject(key->getCStringNoCopy()) : 0; }
+    bool setObject(const char* key, const OSMetaClassBase* object);
+    bool setObject(const OSString* key, const OSMetaClassBase* object) { return key && setObject(key->getCStringNoCopy(), object); }
+    bool setObject(const OSSymbol* key, const OSMetaClassBase* object) { return key && setObject(key->getCStringNoCopy(), object); }
+    void removeObject(const char* key);
+    void removeObject(const OSString* key) { if (key) removeObject(key->getCStringNoCopy()); }
+    void removeObject(const OSSymbol* key) { if (key) removeObject(key->getCStringNoCopy()); }
+    bool merge(const OSDictionary* other);
+    const OSSymbol* keyAt(unsigned index) const { return index < count ? entries[index].key : 0; }
+    OSObject* iterationObject(unsigned index) const override { return (OSObject*)keyAt(index); }
+    void flushCollection() override;
+    bool isEqualTo(const OSMetaClassBase* other) const override;
+};
+
+class OSSet : public OSCollection
+{
+    OSDeclareDefaultStructors(OSSet);
+
+protected:
+    OSArray* members;
+
+public:
+    static OSSet* withCapacity(unsigned capacity);
+    void free() override;
+
+    unsigned getCount() const override { return members->getCount(); }
+    bool setObject(const OSMetaClassBase* object);
+    void removeObject(const OSMetaClassBase* object);
+    bool containsObject(const OSMetaClassBase* object) const;
+    bool member(const OSMetaClassBase* object) const { return containsObject(object); }
+    OSObject* getAnyObject() const { return members->getObject(0); }
+    OSObject* iterationObject(unsigned index) const override { return members->getObject(index); }
+    void flushCollection() override { members->flushCollection(); }
+};
+
+class OSIterator : public OSObject
+{
+    OSDeclareDefaultStructors(OSIterator);
+
+public:
+    virtual void reset() = 0;
+    virtual bool isValid() { return true; }
+    virtual OSObject* getNextObject() = 0;
+};
+
+class OSCollectionIterator : public OSIterator
+{
+    OSDeclareDefaultStructors(OSCollectionIterator);
+
+protected:
+    OSCollection* collection;
+    unsigned index;
+
+public:
+    static OSCollectionIterator* withCollection(const OSCollection* inColl);
+    void free() override;
+    void reset() override { index = 0; }
+    OSObject* getNextObject() override;
+};
+
+class OSSerialize : public OSObject
+{
+    OSDeclareDefaultStructors(OSSerialize);
+};
+
+// Parse a property list (XML), as OSUnserializeXML does.
+OSObject* OSUnserializeXML(const char* buffer, OSString** errorString = 0);
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Registry and services
+//
+
+class IOService;
+class IOWorkLoop;
+class IONotifier;
+class IOPMrootDomain;
+struct IOPMPowerState;
+class IORegistryPlane;
+
+extern const IORegistryPlane* gIOServicePlane;
+extern const IORegistryPlane* gIOACPIPlane;
+extern const OSSymbol* gIOFirstPublishNotification;
+extern const OSSymbol* gIOPublishNotification;
+extern const OSSymbol* gIOMatchedNotification;
+extern const OSSymbol* gIOFirstMatchNotification;
+extern const OSSymbol* gIOTerminatedNotification;
+
+#define kIORegistryIterateRecursively   0x00000001
+#define kIORegistryIterateParents       0x00000002
+
+#define kIOProviderClassKey     "IOProviderClass"
+#define kIONameMatchKey         "IONameMatch"
+#define kIOPropertyMatchKey     "IOPropertyMatch"
+#define kIOClassKey             "IOClass"
+
+class IORegistryEntry : public OSObject
+{
+    OSDeclareDefaultStructors(IORegistryEntry);
+
+protected:
+    struct HostRegistryData* _host;
+
+public:
+    virtual bool init(OSDictionary* dictionary = 0);
+    void free() override;
+
+    virtual OSObject* getProperty(const char* aKey) const;
+    virtual OSObject* getProperty(const OSString* aKey) const;
+    virtual OSObject* getProperty(const OSSymbol* aKey) const;
+    virtual OSObject* copyProperty(const char* aKey) const;
+    virtual bool setProperty(const char* aKey, OSObject* anObject);
+    virtual bool setProperty(const OSString* aKey, OSObject* anObject);
+    virtual bool setProperty(const OSSymbol* aKey, OSObject* anObject);
+    virtual bool setProperty(const char* aKey, const char* aString);
+    virtual bool setProperty(const char* aKey, bool aBoolean);
+    virtual bool setProperty(const char* aKey, unsigned long long aValue, unsigned int aNumberOfBits);
+    // (uint64_t is unsigned long here, unsigned long long in the kernel)
+    bool setProperty(const char* aKey, unsigned long aValue, unsigned int aNumberOfBits)
+        { return setProperty(aKey, (unsigned long long)aValue, aNumberOfBits); }
+    bool setProperty(const char* aKey, int aValue, unsigned int aNumberOfBits)
+        { return setProperty(aKey, (unsigned long long)(long long)aValue, aNumberOfBits); }
+    bool setProperty(const char* aKey, unsigned int aValue, unsigned int aNumberOfBits)
+        { return setProperty(aKey, (unsigned long long)aValue, aNumberOfBits); }
+    bool setProperty(const char* aKey, long aValue, unsigned int aNumberOfBits)
+        { return setProperty(aKey, (unsigned long long)aValue, aNumberOfBits); }
+    virtual bool setProperty(const char* aKey, void* bytes, unsigned int length);
+    virtual void removeProperty(const char* aKey);
+    virtual void removeProperty(const OSSymbol* aKey);
+    virtual OSDictionary* dictionaryWithProperties() const;
+    OSDictionary* getPropertyTable() const;
+    virtual IOReturn setProperties(OSObject* properties);
+
+    virtual const char* getName(const IORegistryPlane* plane = 0) const;
+    virtual void setName(const char* name, const IORegistryPlane* plane = 0);
+    virtual bool compareName(OSString* name, OSString** matched = 0) const;
+    virtual IORegistryEntry* getParentEntry(const IORegistryPlane* plane) const;
+    virtual IORegistryEntry* getChildEntry(const IORegistryPlane* plane) const;
+    virtual bool getPath(char* path, int* length, const IORegistryPlane* plane) const;
+
+    // returned retained, like the kernel
+    static IORegistryEntry* fromPath(const char* path, const IORegistryPlane* plane = 0,
+                                     char* residualPath = 0, int* residualLength = 0,
+                                     IORegistryEntry* fromEntry = 0);
+    // tests: make fromPath find this entry
+    void hostPublishPath(const char* path);
+};
+
+typedef void (*IOInterruptAction)(OSObject* target, void* refCon, IOService* nub, int source);
+typedef bool (*IOServiceMatchingNotificationHandler)(void* target, void* refCon,
+                                                     IOService* newService, IONotifier* notifier);
+
+class IONotifier : public OSObject
+{
+    OSDeclareDefaultStructors(IONotifier);
+
+public:
+    virtual void remove();
+    virtual bool disable() { return true; }
+    virtual void enable(bool) {}
+};
+
+#define kIOMessageServiceIsTerminated       0xe0000010
+#define kIOMessageServiceIsSuspended        0xe0000020
+#define kIOMessageServiceIsResumed          0xe0000030
+#define kIOMessageServiceIsRequestingClose  0xe0000100
+#define kIOMessageServiceWasClosed          0xe0000110
+#define kIOMessageCanDevicePowerOff         0xe0000200
+#define kIOMessageDeviceWillPowerOff        0xe0000210
+#define kIOMessageDeviceHasPoweredOn        0xe0000230
+#define kIOMessageSystemWillSleep           0xe0000280
+#define kIOMessageSystemHasPoweredOn        0xe0000300
+
+#define sys_iokit                           0xe0000000
+#define sub_iokit_vendor_specific           0x03ff8000
+#define iokit_vendor_specific_msg(message)  ((UInt32)(sys_iokit | sub_iokit_vendor_specific | (message)))
+#define iokit_common_msg(message)           ((UInt32)(sys_iokit | (message)))
+#define iokit_family_msg(sub, message)      ((UInt32)(sys_iokit | (sub) | (message)))
+
+#define kIOServiceSynchronous               0x00000002
+
+class IOService : public IORegistryEntry
+{
+    OSDeclareDefaultStructors(IOService);
+
+protected:
+    struct HostServiceData* _service;
+
+public:
+    bool init(OSDictionary* dictionary = 0) override;
+    void free() override;
+
+    virtual IOService* probe(IOService* provider, SInt32* score) { (void)provider; (void)score; return this; }
+    virtual bool start(IOService* provider);
+    virtual void stop(IOService* provider);
+    virtual bool attach(IOService* provider);
+    virtual void detach(IOService* provider);
+    virtual bool terminate(IOOptionBits options = 0);
+    virtual void registerService(IOOptionBits options = 0);
+    virtual IOService* getProvider() const;
+    virtual IOService* getClient() const;
+    virtual IOWorkLoop* getWorkLoop() const;
+    virtual bool isInactive() const;
+
+    virtual bool open(IOService* forClient, IOOptionBits options = 0, void* arg = 0);
+    virtual void close(IOService* forClient, IOOptionBits options = 0);
+    virtual bool isOpen(const IOService* forClient = 0) const;
+    virtual bool handleOpen(IOService* forClient, IOOptionBits options, void* arg);
+    virtual void handleClose(IOService* forClient, IOOptionBits options);
+    virtual bool handleIsOpen(const IOService* forClient) const;
+
+    virtual IOReturn message(UInt32 type, IOService* provider, void* argument = 0);
+    virtual IOReturn messageClient(UInt32 messageType, OSObject* client, void* messageArgument = 0, size_t argSize = 0);
+    virtual IOReturn messageClients(UInt32 type, void* argument = 0, size_t argSize = 0);
+
+    // power management: recorded, nothing is driven by it
+    virtual void PMinit();
+    virtual void PMstop();
+    virtual IOReturn registerPowerDriver(IOService* controllingDriver, IOPMPowerState* powerStates, unsigned long numberOfStates);
+    virtual void joinPMtree(IOService* driver);
+    virtual IOReturn setPowerState(unsigned long powerStateOrdinal, IOService* whatDevice);
+    virtual IOReturn acknowledgeSetPowerState();
+    virtual IOReturn makeUsable();
+    virtual IOReturn changePowerStateTo(unsigned long ordinal);
+    virtual IOReturn powerStateWillChangeTo(IOPMPowerFlags, unsigned long, IOService*) { return kIOReturnSuccess; }
+    virtual IOReturn powerStateDidChangeTo(IOPMPowerFlags, unsigned long, IOService*) { return kIOReturnSuccess; }
+    static IOPMrootDomain* getPMRootDomain();
+
+    // interrupts, implemented by the nub the tests provide
+    virtual IOReturn registerInterrupt(int source, OSObject* target, IOInterruptAction handler, void* refCon = 0);
+    virtual IOReturn unregisterInterrupt(int source);
+    virtual IOReturn enableInterrupt(int source);
+    virtual IOReturn disableInterrupt(int source);
+    virtual IOReturn getInterruptType(int source, int* interruptType);
+    virtual IOReturn getResources(void);
+
+    virtual IOReturn callPlatformFunction(const char* functionName, bool waitForFunction,
+                                          void* param1, void* param2, void* param3, void* param4);
+
+    // matching
+    static OSDictionary* serviceMatching(const char* className, OSDictionary* table = 0);
+    static OSDictionary* nameMatching(const char* name, OSDictionary* table = 0);
+    static OSDictionary* propertyMatching(const OSSymbol* key, const OSObject* value, OSDictionary* table = 0);
+    static IONotifier* addMatchingNotification(const OSSymbol* type, OSDictionary* matching,
+                                               IOServiceMatchingNotificationHandler handler,
+                                               void* target, void* ref = 0, SInt32 priority = 0);
+    static IOService* waitForMatchingService(OSDictionary* matching, uint64_t timeout = UINT64_MAX);
+    static OSIterator* getMatchingServices(OSDictionary* matching);
+    bool hostMatches(OSDictionary* matching) const;
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Power management
+//
+
+#define kIOPMPowerOn            0x00000002
+#define kIOPMDeviceUsable       0x00008000
+#define kIOPMDoze               0x00000400
+#define kIOPMPreventIdleSleep   0x00000040
+#define kIOPMSleepCapability    0x00000004
+#define IOPMPowerOn             kIOPMPowerOn
+#define IOPMDeviceUsable        kIOPMDeviceUsable
+#define kIOPMAckImplied         0
+#define IOPMAckImplied          kIOPMAckImplied
+#define kIOPMPowerStateVersion1 1
+
+struct IOPMPowerState
+{
+    unsigned long version;
+    IOPMPowerFlags capabilityFlags;
+    IOPMPowerFlags outputPowerCharacter;
+    IOPMPowerFlags inputPowerRequirement;
+    unsigned long staticPower;
+    unsigned long stateOrder;
+    unsigned long powerToAttain;
+    unsigned long timeToAttain;
+    unsigned long settleUpTime;
+    unsigned long timeToLower;
+    unsigned long settleDownTime;
+    unsigned long powerDomainBudget;
+};
+
+enum { kIOPMSuperclassPolicy1 = 1 };
+#define kIOPMSystemCapabilityChangeInterest 0
+enum { kStimulusDarkWakeActivityTickle = 0 };
+
+class IOPMrootDomain : public IOService
+{
+    OSDeclareDefaultStructors(IOPMrootDomain);
+
+public:
+    unsigned hostActivityTickles;
+    virtual bool activityTickle(unsigned long type, unsigned long stateNumber = 0);
+    virtual void requestFullWake(int reason) { (void)reason; }
+    virtual void wakeFromDoze() {}
+    virtual IOReturn receivePowerNotification(UInt32 msg);
+    unsigned hostPowerNotifications;
+    UInt32 hostLastPowerNotification;
+};
+
+#define kIOPMSleepNow           (1<<0)
+#define kIOPMAllowSleep         (1<<1)
+#define kIOPMPreventSleep       (1<<2)
+#define kIOPMPowerButton        (1<<3)
+#define kIOPMClamshellClosed    (1<<4)
+#define kIOPMPowerEmergency     (1<<5)
+#define kIOPMDisableClamshell   (1<<6)
+#define kIOPMEnableClamshell    (1<<7)
+#define kIOPMProcessorSpeedChange (1<<8)
+#define kIOPMOverTemp           (1<<9)
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Work loop and event sources
+//
+
+class IOEventSource : public OSObject
+{
+    OSDeclareDefaultStructors(IOEventSource);
+    friend class IOWorkLoop;
+
+public:
+    typedef void (*Action)(OSObject* owner, ...);
+
+protected:
+    OSObject* owner;
+    void* action;
+    IOWorkLoop* workLoop;
+    IOEventSource* eventChainNext;
+    volatile bool enabled;
+
+public:
+    virtual bool init(OSObject* owner, void* action = 0);
+    virtual void enable() { enabled = true; signalWorkAvailable(); }
+    virtual void disable() { enabled = false; }
+    virtual bool isEnabled() const { return enabled; }
+    virtual IOWorkLoop* getWorkLoop() const { return workLoop; }
+    virtual void setWorkLoop(IOWorkLoop* loop) { workLoop = loop; }
+    virtual bool onThread() const;
+    // called by the work loop with the gate held; true if more work is pending
+    virtual bool checkForWork() { return false; }
+    // deadline the work loop should wake up for (0 = none)
+    virtual uint64_t hostDeadline() const { return 0; }
+    void signalWorkAvailable();
+    void closeGate();
+    void openGate();
+};
+
+class IOWorkLoop : public OSObject
+{
+    OSDeclareDefaultStructors(IOWorkLoop);
+
+protected:
+    struct HostWorkLoopData* _host;
+
+public:
+    static IOWorkLoop* workLoop();
+    virtual bool init() override;
+    void free() override;
+
+    virtual IOReturn addEventSource(IOEventSource* newEvent);
+    virtual IOReturn removeEventSource(IOEventSource* toRemove);
+    virtual void closeGate();
+    virtual void openGate();
+    virtual bool tryCloseGate();
+    virtual bool inGate() const;
+    virtual bool onThread() const;
+    virtual IOReturn runAction(IOReturn (*action)(OSObject*, void*, void*, void*, void*), OSObject* target,
+                               void* arg0 = 0, void* arg1 = 0, void* arg2 = 0, void* arg3 = 0);
+    void signalWorkAvailable();
+
+    // command gate sleep/wakeup, with the gate held
+    int sleepGate(void* event, uint64_t deadline);
+    void wakeupGate(void* event, bool oneThread);
+
+    // tests: wait until no event source has work and no timer is due
+    // within "horizonMS" (0 = only pending work)
+    void hostSettle(unsigned horizonMS = 0);
+};
+
+class IOCommandGate : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOCommandGate);
+
+public:
+    typedef IOReturn (*Action)(OSObject* owner, void* arg0, void* arg1, void* arg2, void* arg3);
+
+    static IOCommandGate* commandGate(OSObject* owner, Action action = 0);
+    virtual IOReturn runCommand(void* arg0 = 0, void* arg1 = 0, void* arg2 = 0, void* arg3 = 0);
+    virtual IOReturn runAction(Action action, void* arg0 = 0, void* arg1 = 0, void* arg2 = 0, void* arg3 = 0);
+    virtual IOReturn attemptAction(Action action, void* arg0 = 0, void* arg1 = 0, void* arg2 = 0, void* arg3 = 0);
+    virtual IOReturn commandSleep(void* event, UInt32 interruptible = THREAD_ABORTSAFE);
+    virtual IOReturn commandSleep(void* event, AbsoluteTime deadline, UInt32 interruptible);
+    virtual void commandWakeup(void* event, bool oneThread = false);
+};
+
+class IOTimerEventSource : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOTimerEventSource);
+
+public:
+    typedef void (*Action)(OSObject* owner, IOTimerEventSource* sender);
+
+protected:
+    volatile uint64_t deadline;
+
+public:
+    static IOTimerEventSource* timerEventSource(OSObject* owner, Action action = 0);
+    virtual IOReturn setTimeoutMS(UInt32 ms);
+    virtual IOReturn setTimeoutUS(UInt32 us);
+    virtual IOReturn setTimeout(UInt32 interval, UInt32 scaleFactor = kNanosecondScale);
+    virtual IOReturn setTimeout(AbsoluteTime interval);
+    virtual IOReturn wakeAtTime(AbsoluteTime abstime);
+    virtual IOReturn wakeAtTimeMS(UInt32 ms);
+    virtual void cancelTimeout();
+    void disable() override { cancelTimeout(); IOEventSource::disable(); }
+    bool checkForWork() override;
+    uint64_t hostDeadline() const override { return enabled ? deadline : 0; }
+};
+
+class IOInterruptEventSource : public IOEventSource
+{
+    OSDeclareDefaultStructors(IOInterruptEventSource);
+
+public:
+    typedef void (*Action)(OSObject* owner, IOInterruptEventSource* sender, int count);
+
+protected:
+    volatile unsigned producerCount;
+    unsigned consumerCount;
+
+public:
+    static IOInterruptEventSource* interruptEventSource(OSObject* owner, Action action,
+                                                        IOService* provider = 0, int intIndex = 0);
+    virtual void interruptOccurred(void* nub, IOService* provider, int index);
+    bool checkForWork() override;
+};
+
+typedef void (*IOInterruptEventAction)(OSObject* owner, IOInterruptEventSource* sender, int count);
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// ACPI
+//
+
+#define kIOACPIObjectTypeInteger    1
+#define kIOACPIMessageDeviceNotification iokit_family_msg(0x00000000 /* sub_iokit_acpi */, 0x10)
+
+class IOACPIPlatformDevice : public IOService
+{
+    OSDeclareDefaultStructors(IOACPIPlatformDevice);
+
+public:
+    // tests can answer methods; unanswered methods fail with kIOReturnNotFound
+    typedef IOReturn (*HostMethod)(void* refCon, const char* name, OSObject** params, UInt32 paramCount, OSObject** result);
+    HostMethod hostMethod;
+    void* hostRefCon;
+    unsigned hostEvaluations;
+
+    virtual IOReturn evaluateObject(const char* objectName, OSObject** result = 0,
+                                    OSObject* params[] = 0, IOItemCount paramCount = 0,
+                                    IOOptionBits options = 0);
+    virtual IOReturn evaluateInteger(const char* objectName, UInt32* resultInt32,
+                                     OSObject* params[] = 0, IOItemCount paramCount = 0,
+                                     IOOptionBits options = 0);
+    virtual IOReturn evaluateInteger(const char* objectName, UInt64* resultInt64,
+                                     OSObject* params[] = 0, IOItemCount paramCount = 0,
+                                     IOOptionBits options = 0);
+    virtual IOReturn validateObject(const char* objectName);
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Buffer memory (only what the drivers touch)
+//
+
+class IOBufferMemoryDescriptor : public OSObject
+{
+    OSDeclareDefaultStructors(IOBufferMemoryDescriptor);
+};
+
+class IOPlatformExpert : public IOService
+{
+    OSDeclareDefaultStructors(IOPlatformExpert);
+};
+
+class IOPlatformDevice : public IOService
+{
+    OSDeclareDefaultStructors(IOPlatformDevice);
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// User client privilege check
+//
+
+#define kIOClientPrivilegeAdministrator "root"
+typedef struct task* task_t;
+task_t current_task(void);
+
+class IOUserClient : public IOService
+{
+    OSDeclareDefaultStructors(IOUserClient);
+
+public:
+    static IOReturn clientHasPrivilege(void* securityToken, const char* privilegeName);
+};
+
+// tests: whether the "current task" passes the administrator check
+namespace HostKernel { void setAdministrator(bool admin); }
+
+#endif // _HOSTKERNEL_H
@@ -0,0 +1,2 @@
+// host build: see HostKernel.h
+#include "HostKernel.h"
@@ -0,0 +1,2 @@
+// host build: see HostHID.h
+#include "HostHID.h"
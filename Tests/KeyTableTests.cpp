@@ -0,0 +1,460 @@
+//
+// KeyTableTests.cpp
+//
+// The keyboard's packed key table (PS2KeyEntry) against the parallel arrays
+// it replaced: the stock table entry by entry against PS2ToADBMapStock and
+// _PS2flagsStock, and every key code typed on the emulated keyboard against
+// a model of the arrays as the driver kept them before (_PS2ToPS2Map,
+// _PS2ToADBMap, _PS2ToADBMapMapped), with the default profile and with the
+// layout options changed at run time.  Then the "Compiled Keymap" loaded into
+// the table: a valid one, one with a lone function key section (rejected),
+// one from "Default" under a platform profile with its own string map, and
+// the ones Docs/ps2keymap.py compiles from the shipped profiles (see
+// CMakeLists.txt), which must type like the string maps they come from.
+//
+
+#include "HostTest.h"
+#include "HostStack.h"
+
+#include "VoodooPS2Controller.h"
+#include "VoodooPS2Keyboard.h"
+#include "ApplePS2ToADBMap.h"
+
+#include <cstdio>
+#include <string>
+
+// what dispatchKeyboardEventWithPacket tested on the remapped key code
+// before the action was kept in the table
+static bool baselineACPI(unsigned keyCode)
+{
+    return keyCode >= 0x01f0 && keyCode <= 0x01ff;
+}
+
+static bool baselineSpecial(unsigned keyCode)
+{
+    switch (keyCode)
+    {
+        case 0x4e: case 0x4a: case 0x0153: case 0x015f: case 0x0128: case 0x0137: case 0x0127:
+            return true;
+    }
+    return false;
+}
+
+TEST(stockTableMatchesArrays)
+{
+    for (unsigned i = 0; i < ADB_CONVERTER_LEN; i++)
+    {
+        const PS2KeyEntry& key = PS2KeyTableStock.keys[i];
+        CHECK_EQ(key.remap, i);
+        CHECK_EQ(key.flags, _PS2flagsStock[i] & 0xff);
+        CHECK_EQ(key.modifier, _PS2flagsStock[i] >> 8);
+        CHECK_EQ(key.adb, PS2ToADBMapStock[i]);
+        CHECK_EQ(key.adbMapped, PS2ToADBMapStock[i]);
+        CHECK_EQ(key.action, baselineACPI(i) ? kKeyActionACPI : baselineSpecial(i) ? kKeyActionSpecial : kKeyActionNone);
+    }
+}
+
+// The layout options of setParamPropertiesGated, in the order it applies them
+struct LayoutOptions
+{
+    bool swapCapsLock, swapCommandOption, applicationRightWindows, applicationAppleFn, hangulHanja, iso;
+};
+
+// The arrays as the driver kept them before PS2KeyEntry: the stock tables,
+// the PS2 -> PS2 map of the default profile (e027 and e028 disabled), and
+// the options applied to _PS2ToADBMap the way setParamPropertiesGated did
+struct BaselineMaps
+{
+    UInt16 ps2ToPS2[KBV_NUM_KEYCODES];
+    UInt8 adb[ADB_CONVERTER_LEN];
+    UInt8 adbMapped[ADB_CONVERTER_LEN];
+    bool swapcommandoption = false;
+
+    BaselineMaps()
+    {
+        for (int i = 0; i < KBV_NUM_KEYCODES; i++)
+            ps2ToPS2[i] = i;
+        ps2ToPS2[0x127] = 0;
+        ps2ToPS2[0x128] = 0;
+        memcpy(adbMapped, PS2ToADBMapStock, sizeof(adbMapped));
+        memcpy(adb, adbMapped, sizeof(adb));
+    }
+
+    void apply(const LayoutOptions& options)
+    {
+        if (options.swapCapsLock) {
+            adb[0x3a]  = adbMapped[0x1d];
+            adb[0x1d]  = adbMapped[0x3a];
+        }
+        else {
+            adb[0x3a]  = adbMapped[0x3a];
+            adb[0x1d]  = adbMapped[0x1d];
+        }
+        if (options.swapCommandOption) {
+            swapcommandoption = true;
+            adb[0x38]  = adbMapped[0x15b];
+            adb[0x15b] = adbMapped[0x38];
+            adb[0x138] = adbMapped[0x15c];
+            adb[0x15c] = adbMapped[0x138];
+        }
+        else {
+            swapcommandoption = false;
+            adb[0x38]  = adbMapped[0x38];
+            adb[0x15b] = adbMapped[0x15b];
+            adb[0x138] = adbMapped[0x138];
+            adb[0x15c] = adbMapped[0x15c];
+        }
+        bool temp = false;
+        if (options.applicationRightWindows) {
+            adb[0x15d] = swapcommandoption ?  0x3d : 0x36;
+            temp = true;
+        }
+        else {
+            adb[0x15d] = adbMapped[0x15d];
+        }
+        if (!temp) {
+            if (options.applicationAppleFn)
+                adb[0x15d] = 0x3f;
+            else
+                adb[0x15d] = adbMapped[0x15d];
+        }
+        if (options.hangulHanja) {
+            adb[0x138] = adbMapped[0xf2];
+            adb[0x11d] = adbMapped[0xf1];
+        }
+        else {
+            if (swapcommandoption)
+                adb[0x138] = adbMapped[0x15c];
+            else
+                adb[0x138] = adbMapped[0x138];
+            adb[0x11d] = adbMapped[0x11d];
+        }
+        if (options.iso) {
+            adb[0x29]  = adbMapped[0x56];
+            adb[0x56]  = adbMapped[0x29];
+        }
+        else {
+            adb[0x29]  = adbMapped[0x29];
+            adb[0x56]  = adbMapped[0x56];
+        }
+    }
+
+    enum Expect { kSkip, kNoEvent, kKeyEvent };
+
+    // the ADB code a plain key event for "keyCodeRaw" carries (none if it is
+    // mapped to 0), kSkip for the key codes that take another path (special
+    // keys, ACPI, LANG1/2, the scan codes the interrupt handler keeps, ADB
+    // codes handled apart)
+    Expect adbFor(unsigned keyCodeRaw, UInt8& result) const
+    {
+        unsigned scanCode = keyCodeRaw & 0xff;
+        if (!scanCode || 0x60 == scanCode || 0x61 == scanCode || 0x7a == scanCode || 0x7e == scanCode)
+            return kSkip;   // E0, E1, FA and FE as the break code
+        if (0x71 == keyCodeRaw || 0x72 == keyCodeRaw || 0x12a == keyCodeRaw)
+            return kSkip;   // F1/F2 breaks are LANG1/2, e0 2a is print screen's prefix
+        unsigned keyCode = ps2ToPS2[keyCodeRaw];
+        if (!keyCode)
+            return kNoEvent;
+        if (baselineACPI(keyCode) || baselineSpecial(keyCode))
+            return kSkip;
+        result = adb[keyCode];
+        if (0x39 == result || 0x90 == result || 0x91 == result || 0x92 == result)
+            return kSkip;
+        return kKeyEvent;
+    }
+};
+
+static void setBoolean(OSDictionary* dict, const char* key, bool value)
+{
+    dict->setObject(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+// types every key code, make then break, and checks the key events
+static unsigned sweep(HostStack& stack, const BaselineMaps& model)
+{
+    unsigned checked = 0, mismatches = 0;
+    for (unsigned keyCodeRaw = 0; keyCodeRaw < KBV_NUM_KEYCODES; keyCodeRaw++)
+    {
+        if ((keyCodeRaw & 0xff) >= 0x80)
+            continue;
+        UInt8 expected = 0;
+        BaselineMaps::Expect expect = model.adbFor(keyCodeRaw, expected);
+        if (BaselineMaps::kSkip == expect)
+            continue;
+        bool extended = keyCodeRaw >= KBV_NUM_SCANCODES;
+        UInt8 scanCode = (UInt8)keyCodeRaw;
+        UInt8 bytes[4] = { kSC_Extend, scanCode, kSC_Extend, (UInt8)(scanCode | kSC_UpBit) };
+        UInt8 plain[2] = { scanCode, (UInt8)(scanCode | kSC_UpBit) };
+
+        stack.clearEvents();
+        stack.emulator.locked([&] {
+            if (extended)
+                stack.keyboard.type(bytes, 4);
+            else
+                stack.keyboard.type(plain, 2);
+        });
+        if (BaselineMaps::kKeyEvent == expect)
+            stack.waitForEvents(2, 500);
+        else
+        {
+            stack.emulator.waitIdle();
+            IOSleep(20);
+        }
+        std::vector<HostHIDEvent> events = stack.events();
+        bool same = BaselineMaps::kNoEvent == expect ? events.empty() : 2 == events.size() &&
+            HostHIDEvent::kKey == events[0].kind && expected == events[0].key && events[0].down &&
+            HostHIDEvent::kKey == events[1].kind && expected == events[1].key && !events[1].down;
+        if (!same)
+        {
+            printf("  key %03x: expected %02x, got", keyCodeRaw, expected);
+            for (const HostHIDEvent& event : events)
+                printf(" %02x%s", event.key, event.down ? "" : "/up");
+            printf("\n");
+            mismatches++;
+        }
+        checked++;
+    }
+    CHECK(checked > 150);
+    return mismatches;
+}
+
+TEST(keystrokesMatchArrays)
+{
+    HostStack stack;
+    REQUIRE(stack.startController());
+    ApplePS2Keyboard* keyboard = new ApplePS2Keyboard;
+    REQUIRE(stack.startDriver(keyboard,
+                              HostPersonality("VoodooPS2Keyboard/VoodooPS2Keyboard-Info.plist", "ApplePS2Keyboard"),
+                              stack.keyboardDevice));
+    stack.emulator.waitIdle();
+
+    // the default profile
+    BaselineMaps model;
+    model.apply({ false, true, true, false, false, false });
+    CHECK_EQ(sweep(stack, model), 0);
+
+    // every layout option flipped, then one more combination
+    static const LayoutOptions changes[] = {
+        { true, false, false, true, true, true },
+        { false, true, false, false, true, false },
+    };
+    for (const LayoutOptions& options : changes)
+    {
+        OSDictionary* dict = OSDictionary::withCapacity(6);
+        setBoolean(dict, "Swap capslock and left control", options.swapCapsLock);
+        setBoolean(dict, "Swap command and option", options.swapCommandOption);
+        setBoolean(dict, "Make Application key into right windows", options.applicationRightWindows);
+        setBoolean(dict, "Make Application key into Apple Fn key", options.applicationAppleFn);
+        setBoolean(dict, "Make right modifier keys into Hangul and Hanja", options.hangulHanja);
+        setBoolean(dict, "Use ISO layout keyboard", options.iso);
+        keyboard->setProperties(dict);
+        dict->release();
+        stack.emulator.waitIdle();
+
+        model.apply(options);
+        CHECK_EQ(sweep(stack, model), 0);
+    }
+}
+
+// 'a' down and up, scan code set 1
+static const UInt8 kKeyA[] = { 0x1e, 0x9e };
+enum { kADB_A = 0x00, kADB_B = 0x0b, kADB_C = 0x08 };
+
+// a compiled keymap with one PS2 -> PS2 remap, and "standard"/"special"
+// function key records
+static OSData* compiledKeymap(UInt16 from, UInt16 to, UInt16 standard, UInt16 special)
+{
+    PS2KeymapHeader header = { kKeymapMagic, kKeymapVersion, KBV_NUM_KEYCODES, standard, special, 0 };
+    OSData* data = OSData::withBytes(&header, sizeof(header));
+    for (unsigned i = 0; i < KBV_NUM_KEYCODES; i++)
+    {
+        PS2KeymapEntry entry = { (UInt16)(i == from ? to : i), 0, 0 };
+        data->appendBytes(&entry, sizeof(entry));
+    }
+    for (unsigned i = 0; i < standard + special; i++)
+    {
+        PS2KeymapRemap remap = { 0x3b, 0x3b };
+        data->appendBytes(&remap, sizeof(remap));
+    }
+    return data;
+}
+
+// the ADB code 'a' types with "keymap" in the Default profile and, if given,
+// "platform" as the profile of the machine
+static UInt8 typeWithKeymap(OSData* keymap, OSDictionary* platform = NULL)
+{
+    HostStack stack;
+    if (!stack.startController())
+        return 0xff;
+    OSDictionary* personality = HostPersonality("VoodooPS2Keyboard/VoodooPS2Keyboard-Info.plist", "ApplePS2Keyboard");
+    OSDictionary* profiles = OSDynamicCast(OSDictionary, personality->getObject("Platform Profile"));
+    OSDynamicCast(OSDictionary, profiles->getObject("Default"))->setObject("Compiled Keymap", keymap);
+    keymap->release();
+    if (platform)
+    {
+        OSDictionary* manufacturer = OSDictionary::withCapacity(1);
+        manufacturer->setObject("TESTPAD", platform);
+        profiles->setObject("TESTOEM", manufacturer);
+        manufacturer->release();
+        platform->release();
+        stack.controller->setProperty("RM,oem-id", "TESTOEM");
+        stack.controller->setProperty("RM,oem-table-id", "TESTPAD");
+    }
+    if (!stack.startDriver(new ApplePS2Keyboard, personality, stack.keyboardDevice))
+        return 0xff;
+    stack.emulator.waitIdle();
+    stack.clearEvents();
+    stack.emulator.locked([&] { stack.keyboard.type(kKeyA, 2); });
+    if (!stack.waitForEvents(2))
+        return 0xff;
+    return stack.events()[0].key;
+}
+
+TEST(compiledKeymapLoads)
+{
+    // 'a' -> 'b', with and without function key maps
+    CHECK_EQ(typeWithKeymap(compiledKeymap(0x1e, 0x30, 0, 0)), kADB_B);
+    CHECK_EQ(typeWithKeymap(compiledKeymap(0x1e, 0x30, 2, 2)), kADB_B);
+}
+
+TEST(compiledKeymapLoneSectionRejected)
+{
+    // one function key map without the other is not a keymap the tool
+    // writes: the string maps are used
+    CHECK_EQ(typeWithKeymap(compiledKeymap(0x1e, 0x30, 2, 0)), kADB_A);
+    CHECK_EQ(typeWithKeymap(compiledKeymap(0x1e, 0x30, 0, 2)), kADB_A);
+}
+
+TEST(platformStringMapsOverrideDefaultKeymap)
+{
+    // 'a' -> 'c' in the platform profile wins over 'a' -> 'b' compiled in Default
+    OSDictionary* platform = OSDictionary::withCapacity(1);
+    OSArray* map = OSArray::withCapacity(1);
+    OSString* entry = OSString::withCString("1e=2e");
+    map->setObject(entry);
+    entry->release();
+    platform->setObject("Custom PS2 Map", map);
+    map->release();
+    CHECK_EQ(typeWithKeymap(compiledKeymap(0x1e, 0x30, 0, 0), platform), kADB_C);
+
+    // other settings there leave it in place
+    platform = OSDictionary::withCapacity(1);
+    platform->setObject("Swap command and option", kOSBooleanFalse);
+    CHECK_EQ(typeWithKeymap(compiledKeymap(0x1e, 0x30, 0, 0), platform), kADB_B);
+}
+
+#ifdef KEYMAP_DIR
+
+static const char* const kStringMaps[] = {
+    "Custom PS2 Map", "Breakless PS2", "Custom ADB Map", "Function Keys Standard", "Function Keys Special",
+};
+
+static OSData* readKeymap(const char* name)
+{
+    std::string path = std::string(KEYMAP_DIR) + "/" + name + ".keymap";
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return NULL;
+    OSData* data = OSData::withCapacity(4096);
+    UInt8 buffer[4096];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        data->appendBytes(buffer, (unsigned)length);
+    fclose(file);
+    return data;
+}
+
+// every key code typed, make then break, on the shipped configuration for
+// "oemId"/"tableId" (Default if NULL), and the key events it gave; with
+// "keymap", the string maps are taken out of the configuration and the
+// keymap put in the platform's profile instead
+static bool typeEverything(const char* oemId, const char* tableId, OSData* keymap, std::string& out)
+{
+    HostStack stack;
+    if (!stack.startController())
+        return false;
+    OSDictionary* personality = HostPersonality("VoodooPS2Keyboard/VoodooPS2Keyboard-Info.plist", "ApplePS2Keyboard");
+    OSDictionary* profiles = OSDynamicCast(OSDictionary, personality->getObject("Platform Profile"));
+    OSDictionary* defaults = OSDynamicCast(OSDictionary, profiles->getObject("Default"));
+    OSDictionary* platform = defaults;
+    if (oemId)
+    {
+        OSDictionary* manufacturer = OSDynamicCast(OSDictionary, profiles->getObject(oemId));
+        OSString* link = OSDynamicCast(OSString, manufacturer->getObject(tableId));
+        std::string target = link->getCStringNoCopy();
+        platform = OSDynamicCast(OSDictionary, manufacturer->getObject(target.substr(0, target.find(';')).c_str()));
+        stack.controller->setProperty("RM,oem-id", oemId);
+        stack.controller->setProperty("RM,oem-table-id", tableId);
+    }
+    if (keymap)
+    {
+        for (const char* name : kStringMaps)
+        {
+            defaults->removeObject(name);
+            platform->removeObject(name);
+        }
+        platform->setObject("Compiled Keymap", keymap);
+    }
+    if (!stack.startDriver(new ApplePS2Keyboard, personality, stack.keyboardDevice))
+        return false;
+    stack.emulator.waitIdle();
+    stack.clearEvents();
+
+    for (unsigned keyCodeRaw = 0; keyCodeRaw < KBV_NUM_KEYCODES; keyCodeRaw++)
+    {
+        UInt8 scanCode = (UInt8)keyCodeRaw;
+        // (not the prefixes and replies as break codes, nor LANG1/2 and
+        // print screen's prefix, as in sweep)
+        if (scanCode >= 0x80 || !scanCode || 0x60 == scanCode || 0x61 == scanCode || 0x7a == scanCode || 0x7e == scanCode ||
+            0x71 == keyCodeRaw || 0x72 == keyCodeRaw || 0x12a == keyCodeRaw)
+            continue;
+        UInt8 bytes[4] = { kSC_Extend, scanCode, kSC_Extend, (UInt8)(scanCode | kSC_UpBit) };
+        stack.emulator.locked([&] {
+            if (keyCodeRaw >= KBV_NUM_SCANCODES)
+                stack.keyboard.type(bytes, 4);
+            else
+                stack.keyboard.type(bytes + 1, 1), stack.keyboard.type(bytes + 3, 1);
+        });
+        stack.emulator.waitIdle();
+        IOSleep(2);
+    }
+    IOSleep(50);
+    for (const HostHIDEvent& event : stack.events())
+        if (HostHIDEvent::kKey == event.kind)
+            out += std::to_string(event.key) + (event.down ? " " : "/up ");
+    return true;
+}
+
+TEST(toolKeymapTypesLikeStrings)
+{
+    // (Default's string maps only turn off two keys that give no key event
+    // anyway, the ProBook's change the ADB codes and the function keys)
+    struct { const char* oemId; const char* tableId; const char* keymap; bool remaps; } profiles[] = {
+        { NULL, NULL, "Default", false },
+        { "HPQOEM", "1619", "HPQOEM-1619", true },  // ProBook-87
+    };
+    for (const auto& profile : profiles)
+    {
+        OSData* keymap = readKeymap(profile.keymap);
+        REQUIRE(keymap);
+        std::string strings, compiled, none;
+        REQUIRE(typeEverything(profile.oemId, profile.tableId, NULL, strings));
+        REQUIRE(typeEverything(profile.oemId, profile.tableId, keymap, compiled));
+        keymap->release();
+        printf("  %s: %zu bytes of key events\n", profile.keymap, strings.size());
+        CHECK(strings.size() > 1000);
+        CHECK(compiled == strings);
+        if (!profile.remaps)
+            continue;
+        // and the keymap is what makes the difference (an invalid one is
+        // ignored)
+        OSData* empty = OSData::withCapacity(1);
+        REQUIRE(typeEverything(profile.oemId, profile.tableId, empty, none));
+        empty->release();
+        CHECK(none != strings);
+    }
+}
+
+#endif // KEYMAP_DIR
+
+HOST_TEST_MAIN()
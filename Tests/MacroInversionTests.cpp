@@ -0,0 +1,122 @@
+//
+// MacroInversionTests.cpp
+//
+// MacroInversionTrie against the rule walk invertMacros did before it (see
+// MacroInversionRules.h): random rule sets sharing prefixes, with modifier
+// conditions, and random packet streams with random modifiers.  Packet by
+// packet, the trie must give the same answer (no match, partial, or match
+// with the same output) as walking the rules in order.
+//
+
+#include "HostTest.h"
+#include "MacroInversionRules.h"
+
+// random packets fed as invertMacros does, the mismatches counted (and the
+// matches and partial matches of the rules, to see they are exercised)
+static unsigned compare(const MacroRules& rules, std::mt19937& random, int packets,
+                        unsigned& matches, unsigned& partials)
+{
+    MacroInversionTrie trie;
+    if (!trie.build(rules.get()))
+        return packets;
+
+    std::vector<UInt8> buffer(64 * kPacketLength);
+    int current = 0, state = MacroInversionTrie::kRoot;
+    unsigned mismatches = 0;
+    for (int i = 0; i < packets; i++)
+    {
+        UInt8 packet[kPacketLength] = {};
+        memcpy(packet, kRuleKeyData[random() % kRuleKeys], kPacketKeyDataLength);
+        UInt16 modifiers = random() & 0x0F0F;
+
+        memcpy(&buffer[current * kPacketLength], packet, kPacketLength);
+        const UInt8* expectedOutput = NULL;
+        MacroInversionTrie::Result expected = linearMatch(rules.get(), buffer.data(), current + 1, modifiers, &expectedOutput);
+
+        const UInt8* output = NULL;
+        int next = trie.next(state, packet);
+        MacroInversionTrie::Result result = MacroInversionTrie::kNoState == next ?
+            MacroInversionTrie::kNoMatch : trie.match(next, modifiers, &output);
+
+        if (result != expected ||
+            (MacroInversionTrie::kMatch == result && memcmp(output, expectedOutput, kPacketKeyDataLength)))
+        {
+            if (!mismatches)
+                printf("  packet %d (%d buffered): trie %d, rules %d\n", i, current + 1, result, expected);
+            mismatches++;
+        }
+        if (MacroInversionTrie::kPartial == expected)
+        {
+            partials++;
+            current++;
+            state = next;
+        }
+        else
+        {
+            matches += MacroInversionTrie::kMatch == expected;
+            current = 0;
+            state = MacroInversionTrie::kRoot;
+        }
+    }
+    trie.free();
+    return mismatches;
+}
+
+TEST(trieMatchesRuleWalk)
+{
+    static const int counts[] = { 1, 2, 5, 20, 100, 300 };
+    unsigned matches = 0, partials = 0;
+    for (int count : counts)
+    {
+        for (unsigned seed = 1; seed <= 20; seed++)
+        {
+            std::mt19937 random(seed * 1000 + count);
+            MacroRules rules(random, count, 4);
+            unsigned mismatches = compare(rules, random, 5000, matches, partials);
+            if (mismatches)
+                printf("  %d rules, seed %u\n", count, seed);
+            CHECK_EQ(mismatches, 0);
+        }
+    }
+    printf("  %u matches, %u partial matches\n", matches, partials);
+    CHECK(matches > 1000 && partials > 1000);
+}
+
+TEST(shippedRules)
+{
+    // the Fn+F1 rules of the default configuration
+    static const UInt8 kRules[][12] = {
+        { 0xff, 0xff, 0x02, 0x6e, 0x00, 0x00, 0x00, 0x00, 0x02, 0x5b, 0x01, 0x19 },
+        { 0xff, 0xff, 0x02, 0xee, 0x00, 0x00, 0x00, 0x00, 0x02, 0xdb, 0x01, 0x99 },
+        { 0xff, 0xff, 0x02, 0xee, 0x00, 0x00, 0x00, 0x00, 0x01, 0x99, 0x02, 0xdb },
+    };
+    OSData* rules[4] = {};
+    for (int i = 0; i < 3; i++)
+        rules[i] = OSData::withBytes(kRules[i], sizeof(kRules[i]));
+    MacroInversionTrie trie;
+    REQUIRE(trie.build(rules));
+
+    UInt8 winDown[kPacketLength] = { 0x02, 0x5b }, pDown[kPacketLength] = { 0x01, 0x19 };
+    UInt8 pUp[kPacketLength] = { 0x01, 0x99 }, winUp[kPacketLength] = { 0x02, 0xdb };
+    const UInt8* output = NULL;
+    int state = trie.next(MacroInversionTrie::kRoot, winDown);
+    REQUIRE(MacroInversionTrie::kNoState != state);
+    CHECK_EQ(trie.match(state, 0, &output), MacroInversionTrie::kPartial);
+    state = trie.next(state, pDown);
+    REQUIRE(MacroInversionTrie::kNoState != state);
+    CHECK_EQ(trie.match(state, 0, &output), MacroInversionTrie::kMatch);
+    CHECK_EQ(output[1], 0x6e);
+    // the releases, P first
+    state = trie.next(trie.next(MacroInversionTrie::kRoot, pUp), winUp);
+    REQUIRE(MacroInversionTrie::kNoState != state);
+    CHECK_EQ(trie.match(state, 0, &output), MacroInversionTrie::kMatch);
+    CHECK_EQ(output[1], 0xee);
+    // anything else
+    CHECK_EQ(trie.next(MacroInversionTrie::kRoot, pDown), MacroInversionTrie::kNoState);
+
+    trie.free();
+    for (OSData* rule : rules)
+        OSSafeReleaseNULL(rule);
+}
+
+HOST_TEST_MAIN()
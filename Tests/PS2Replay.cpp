@@ -0,0 +1,103 @@
+//
+// PS2Replay.cpp
+//
+// Replay a packet capture from a field report through the keyboard and
+// mouse drivers on the emulated 8042, and print the events they produce:
+//
+//   PS2Replay [--speed N] capture
+//
+// "capture" is the raw "Packet Capture" dump or ioreg's XML output with it
+// (ioreg -a -r -n ApplePS2Controller).  --speed 0 replays as fast as the
+// ports allow, N > 0 at N times the original speed (default 1).
+//
+
+#include "HostStack.h"
+#include "PS2Replay.h"
+
+#include "VoodooPS2Controller.h"
+#include "ApplePS2KeyboardDevice.h"
+#include "ApplePS2MouseDevice.h"
+#include "VoodooPS2Keyboard.h"
+#include "VoodooPS2Mouse.h"
+
+#include <cstdlib>
+#include <cstring>
+
+static int usage()
+{
+    fprintf(stderr, "usage: PS2Replay [--speed N] capture\n");
+    return 2;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned speed = 1;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--speed") && i + 1 < argc)
+            speed = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if (!path && argv[i][0] != '-')
+            path = argv[i];
+        else
+            return usage();
+    }
+    if (!path)
+        return usage();
+
+    PS2Trace trace;
+    if (!trace.load(path))
+    {
+        fprintf(stderr, "%s: not a packet capture\n", path);
+        return 1;
+    }
+    printf("%zu records (%u keyboard, %u mouse), %u lost to the ring wrapping\n",
+           trace.records.size(), trace.count(kDT_Keyboard), trace.count(kDT_Mouse), trace.overwritten);
+
+    HostStack stack;
+    if (!stack.startController() ||
+        !stack.startDriver(new ApplePS2Keyboard,
+                           HostPersonality("VoodooPS2Keyboard/VoodooPS2Keyboard-Info.plist", "ApplePS2Keyboard"),
+                           stack.keyboardDevice) ||
+        !stack.startDriver(new ApplePS2Mouse,
+                           HostPersonality("VoodooPS2Mouse/VoodooPS2Mouse-Info.plist", "ApplePS2Mouse"),
+                           stack.mouseDevice))
+    {
+        fprintf(stderr, "the drivers did not start\n");
+        return 1;
+    }
+    stack.emulator.waitIdle();
+    stack.clearEvents();
+
+    PS2ReplayTrace(stack.emulator, trace, speed);
+    // the last byte is due at its recorded offset (plus the line time)
+    uint64_t duration = trace.records.empty() ? 0 :
+        (captureRecordTime(trace.records.back()) - captureRecordTime(trace.records.front())) / 1000;
+    IOSleep(speed ? (unsigned)(duration / speed) : 0);
+    stack.emulator.waitIdle((unsigned)(duration + 2000));
+    IOSleep(100);
+
+    std::vector<HostHIDEvent> events = stack.events();
+    uint64_t start = events.empty() ? 0 : events.front().dispatched;
+    for (const HostHIDEvent& event : events)
+    {
+        printf("%10.3f ms  ", (event.dispatched - start) / 1000000.0);
+        switch (event.kind)
+        {
+            case HostHIDEvent::kKey:
+                printf("key 0x%02x %s\n", event.key, event.down ? "down" : "up");
+                break;
+            case HostHIDEvent::kRelative:
+                printf("move %d,%d buttons 0x%x\n", event.dx, event.dy, event.buttons);
+                break;
+            case HostHIDEvent::kScroll:
+                printf("scroll %d,%d,%d\n", event.dx, event.dy, event.dz);
+                break;
+            case HostHIDEvent::kAbsolute:
+                printf("absolute %d,%d buttons 0x%x\n", event.dx, event.dy, event.buttons);
+                break;
+        }
+    }
+    stack.stop();
+    return 0;
+}
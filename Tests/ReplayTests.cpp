@@ -0,0 +1,230 @@
+//
+// ReplayTests.cpp
+//
+// Packet capture and replay: what is captured, who may ask for it, the
+// controller's replay holding off live input, and host replay of a capture
+// reproducing the events it was taken from.
+//
+
+#include "HostTest.h"
+#include "HostStack.h"
+#include "PS2Replay.h"
+
+#include "VoodooPS2Controller.h"
+#include "ApplePS2KeyboardDevice.h"
+#include "ApplePS2MouseDevice.h"
+#include "VoodooPS2Keyboard.h"
+#include "VoodooPS2Mouse.h"
+
+#include <algorithm>
+
+static bool startStack(HostStack& stack)
+{
+    if (!stack.startController())
+        return false;
+    if (!stack.startDriver(new ApplePS2Keyboard,
+                           HostPersonality("VoodooPS2Keyboard/VoodooPS2Keyboard-Info.plist", "ApplePS2Keyboard"),
+                           stack.keyboardDevice))
+        return false;
+    if (!stack.startDriver(new ApplePS2Mouse,
+                           HostPersonality("VoodooPS2Mouse/VoodooPS2Mouse-Info.plist", "ApplePS2Mouse"),
+                           stack.mouseDevice))
+        return false;
+    if (!WAIT_FOR(stack.mouse.reporting, 5000))
+        return false;
+    stack.emulator.waitIdle();
+    stack.clearEvents();
+    return true;
+}
+
+static IOReturn setControllerProperty(HostStack& stack, const char* key, OSObject* value)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(1);
+    dict->setObject(key, value);
+    IOReturn result = stack.controller->setProperties(dict);
+    dict->release();
+    return result;
+}
+
+static IOReturn setControllerProperty(HostStack& stack, const char* key, bool value)
+{
+    return setControllerProperty(stack, key, value ? kOSBooleanTrue : kOSBooleanFalse);
+}
+
+static bool dumpCapture(HostStack& stack, PS2Trace& trace)
+{
+    if (kIOReturnSuccess != setControllerProperty(stack, "DumpPacketCapture", true))
+        return false;
+    OSData* data = OSDynamicCast(OSData, stack.controller->getProperty(kPacketCapture));
+    return data && trace.parse(data->getBytesNoCopy(), data->getLength());
+}
+
+static size_t mouseResets(HostStack& stack)
+{
+    size_t result = 0;
+    stack.emulator.locked([&] {
+        result = std::count(stack.mouse.received.begin(), stack.mouse.received.end(), (UInt8)kDP_SetDefaults);
+    });
+    return result;
+}
+
+static size_t count(const std::vector<HostHIDEvent>& events, HostHIDEvent::Kind kind)
+{
+    size_t result = 0;
+    for (const HostHIDEvent& event : events)
+        result += event.kind == kind;
+    return result;
+}
+
+// 'a' and 's' down and up, scan code set 1
+static const UInt8 kKeys[] = { 0x1e, 0x9e, 0x1f, 0x9f };
+
+// key strokes and movement, a packet at a time as a user would
+static void someInput(HostStack& stack, int rounds)
+{
+    for (int i = 0; i < rounds; i++)
+    {
+        stack.emulator.locked([&] {
+            stack.keyboard.type(kKeys + (i & 1) * 2, 2);
+            stack.mouse.move(i + 1, -(i & 3), i & 1);
+        });
+        IOSleep(5);
+    }
+    stack.emulator.waitIdle();
+}
+
+TEST(propertiesNeedAdministrator)
+{
+    HostStack stack;
+    REQUIRE(startStack(stack));
+
+    // start a capture and dump it, in one go
+    OSDictionary* dict = OSDictionary::withCapacity(2);
+    dict->setObject("PacketCapture", kOSBooleanTrue);
+    dict->setObject("DumpPacketCapture", kOSBooleanTrue);
+    HostKernel::setAdministrator(false);
+    CHECK_EQ(stack.controller->setProperties(dict), kIOReturnNotPrivileged);
+    HostKernel::setAdministrator(true);
+    CHECK(!stack.controller->getProperty(kPacketCapture));
+    CHECK_EQ(stack.controller->setProperties(dict), kIOReturnSuccess);
+    CHECK(stack.controller->getProperty(kPacketCapture));
+    dict->release();
+}
+
+TEST(keyboardCapturedOnlyOnRequest)
+{
+    HostStack stack;
+    REQUIRE(startStack(stack));
+
+    REQUIRE(kIOReturnSuccess == setControllerProperty(stack, "PacketCapture", true));
+    someInput(stack, 4);
+    REQUIRE(stack.waitForEvents(4 * 2 + 4));
+    PS2Trace trace;
+    REQUIRE(dumpCapture(stack, trace));
+    CHECK_EQ(trace.count(kDT_Keyboard), 0);
+    CHECK_EQ(trace.count(kDT_Mouse), 4 * 4);
+
+    REQUIRE(kIOReturnSuccess == setControllerProperty(stack, "PacketCaptureKeyboard", true));
+    stack.clearEvents();
+    someInput(stack, 2);
+    REQUIRE(stack.waitForEvents(2 * 2 + 2));
+    REQUIRE(dumpCapture(stack, trace));
+    CHECK_EQ(trace.count(kDT_Keyboard), 2 * 2);
+    CHECK_EQ(trace.count(kDT_Mouse), 6 * 4);
+}
+
+TEST(hostReplayReproducesEvents)
+{
+    PS2Trace trace;
+    std::vector<HostHIDEvent> original;
+    {
+        HostStack stack;
+        REQUIRE(startStack(stack));
+        REQUIRE(kIOReturnSuccess == setControllerProperty(stack, "PacketCaptureKeyboard", true));
+        REQUIRE(kIOReturnSuccess == setControllerProperty(stack, "PacketCapture", true));
+        someInput(stack, 10);
+        REQUIRE(stack.waitForEvents(10 * 2 + 10));
+        original = stack.events();
+        REQUIRE(dumpCapture(stack, trace));
+    }
+
+    // a dump survives the round trip through the registry format
+    OSData* data = trace.serialize();
+    PS2Trace copy;
+    REQUIRE(copy.parse(data->getBytesNoCopy(), data->getLength()));
+    data->release();
+    CHECK(copy.records == trace.records);
+
+    HostStack stack;
+    REQUIRE(startStack(stack));
+    PS2ReplayTrace(stack.emulator, copy, 0);
+    REQUIRE(stack.waitForEvents(original.size()));
+    stack.emulator.waitIdle();
+    std::vector<HostHIDEvent> replayed = stack.events();
+    REQUIRE(replayed.size() == original.size());
+    // the ports are independent: compare each stream in order
+    for (HostHIDEvent::Kind kind : { HostHIDEvent::kKey, HostHIDEvent::kRelative })
+    {
+        std::vector<HostHIDEvent> a, b;
+        std::copy_if(original.begin(), original.end(), std::back_inserter(a), [&](const HostHIDEvent& e) { return e.kind == kind; });
+        std::copy_if(replayed.begin(), replayed.end(), std::back_inserter(b), [&](const HostHIDEvent& e) { return e.kind == kind; });
+        REQUIRE(a.size() == b.size());
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            CHECK_EQ(a[i].key, b[i].key);
+            CHECK_EQ(a[i].down, b[i].down);
+            CHECK_EQ(a[i].dx, b[i].dx);
+            CHECK_EQ(a[i].dy, b[i].dy);
+            CHECK_EQ(a[i].buttons, b[i].buttons);
+        }
+    }
+}
+
+TEST(controllerReplayHoldsLiveInput)
+{
+    HostStack stack;
+    REQUIRE(startStack(stack));
+
+    // a trace of 20 mouse packets 10 ms apart (the emulated mouse is an
+    // IntelliMouse: 4 bytes a packet)
+    PS2Trace trace;
+    for (int i = 0; i < 20; i++)
+    {
+        static const UInt8 packet[] = { 0x08, 0x01, 0x00, 0x00 };
+        for (int j = 0; j < 4; j++)
+            trace.records.push_back(makeCaptureRecord(i * 10000 + j * 1000, kDT_Mouse, packet[j]));
+    }
+    OSData* data = trace.serialize();
+    size_t resets = mouseResets(stack);
+    IOReturn result = setControllerProperty(stack, "ReplayPacketCapture", data);
+    data->release();
+    REQUIRE(kIOReturnSuccess == result);
+
+    // key strokes and movement while the trace plays are dropped
+    for (int i = 0; i < 5; i++)
+    {
+        stack.emulator.locked([&] {
+            stack.keyboard.type(kKeys, 2);
+            stack.mouse.move(-7, 7, 0);
+        });
+        IOSleep(10);
+    }
+    REQUIRE(WAIT_FOR(stack.controller->getProperty(kPacketReplay), 2000));
+    stack.emulator.waitIdle();
+    std::vector<HostHIDEvent> events = stack.events();
+    CHECK_EQ(count(events, HostHIDEvent::kKey), 0);
+    CHECK_EQ(count(events, HostHIDEvent::kRelative), 20);
+    for (const HostHIDEvent& event : events)
+        CHECK(event.dx > 0);
+
+    // then the devices are reset, as on wake, and live input is back
+    CHECK(WAIT_FOR(mouseResets(stack) > resets, 2000));
+    REQUIRE(WAIT_FOR(stack.mouse.reporting, 2000));
+    stack.emulator.waitIdle();
+    stack.clearEvents();
+    someInput(stack, 1);
+    CHECK(stack.waitForEvents(3));
+    CHECK_EQ(count(stack.events(), HostHIDEvent::kKey), 2);
+}
+
+HOST_TEST_MAIN()
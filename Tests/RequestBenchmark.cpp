@@ -0,0 +1,238 @@
+//
+// RequestBenchmark.cpp
+//
+// Latency and CPU time of the interrupt driven request engine, on the
+// emulated 8042 with PS/2 line timing (about 1 ms a byte):
+//
+//  - wall clock and CPU time per request for LED updates submitted with
+//    submitRequestAndBlock: the caller sleeps while the bytes are on the
+//    wire, so CPU per request has to be a small fraction of its wall time
+//    (a polling engine spends all of it in readDataPort);
+//  - how long mouse packets wait for dispatch while a stream of LED updates
+//    runs on the same controller (the cursor stalls of the polling engine);
+//  - submission throughput of PS2RequestQueue against the IOLock guarded
+//    queue_head_t it replaced, with several threads submitting while the
+//    consumer drains.
+//
+// Results are printed; the checks only catch regressions to polling.
+//
+
+#include "HostTest.h"
+#include "HostStack.h"
+
+#include "VoodooPS2Controller.h"
+#include "ApplePS2KeyboardDevice.h"
+#include "ApplePS2MouseDevice.h"
+#include "VoodooPS2Keyboard.h"
+#include "VoodooPS2Mouse.h"
+
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <thread>
+
+static uint64_t cpuNS()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t wallNS()
+{
+    uint64_t now;
+    clock_get_uptime(&now);
+    return now;
+}
+
+static double percentile(std::vector<uint64_t> values, double p)
+{
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = std::min(values.size() - 1, (size_t)(p * values.size()));
+    return values[index] / 1000.0;
+}
+
+static void setLEDs(ApplePS2KeyboardDevice* device, UInt8 leds)
+{
+    TPS2Request<4> request;
+    request.commands[0].command = kPS2C_WriteDataPort;
+    request.commands[0].inOrOut = kDP_SetKeyboardLEDs;
+    request.commands[1].command = kPS2C_ReadDataPortAndCompare;
+    request.commands[1].inOrOut = kSC_Acknowledge;
+    request.commands[2].command = kPS2C_WriteDataPort;
+    request.commands[2].inOrOut = leds;
+    request.commands[3].command = kPS2C_ReadDataPortAndCompare;
+    request.commands[3].inOrOut = kSC_Acknowledge;
+    request.commandsCount = 4;
+    device->submitRequestAndBlock(&request);
+}
+
+static bool startStack(HostStack& stack)
+{
+    if (!stack.startController())
+        return false;
+    if (!stack.startDriver(new ApplePS2Keyboard,
+                           HostPersonality("VoodooPS2Keyboard/VoodooPS2Keyboard-Info.plist", "ApplePS2Keyboard"),
+                           stack.keyboardDevice))
+        return false;
+    if (!stack.startDriver(new ApplePS2Mouse,
+                           HostPersonality("VoodooPS2Mouse/VoodooPS2Mouse-Info.plist", "ApplePS2Mouse"),
+                           stack.mouseDevice))
+        return false;
+    if (!WAIT_FOR(stack.mouse.reporting, 5000))
+        return false;
+    stack.emulator.waitIdle();
+    return true;
+}
+
+TEST(requestLatencyAndCPU)
+{
+    HostStack stack(PS2Timing::realistic());
+    REQUIRE(startStack(stack));
+
+    enum { kRequests = 100 };
+    std::vector<uint64_t> wall;
+    uint64_t cpuStart = cpuNS();
+    uint64_t wallStart = wallNS();
+    for (int i = 0; i < kRequests; i++)
+    {
+        uint64_t start = wallNS();
+        setLEDs(stack.keyboardDevice, i & 7);
+        wall.push_back(wallNS() - start);
+    }
+    uint64_t cpu = cpuNS() - cpuStart;
+    uint64_t total = wallNS() - wallStart;
+
+    CHECK_EQ(stack.keyboard.leds, (kRequests - 1) & 7);
+    double cpuPerRequest = cpu / 1000.0 / kRequests;
+    double wallPerRequest = total / 1000.0 / kRequests;
+    printf("  LED request (4 bytes on the wire): wall p50 %.0f us, p99 %.0f us, max %.0f us\n",
+           percentile(wall, 0.5), percentile(wall, 0.99), percentile(wall, 1.0));
+    printf("  CPU per request %.0f us of %.0f us wall (%.1f%%, emulator included)\n",
+           cpuPerRequest, wallPerRequest, 100.0 * cpuPerRequest / wallPerRequest);
+    // polling would be ~100%: the work loop spins for every byte
+    CHECK(cpuPerRequest < wallPerRequest * 0.5);
+}
+
+TEST(mouseDispatchDuringLEDUpdates)
+{
+    HostStack stack(PS2Timing::realistic());
+    REQUIRE(startStack(stack));
+    stack.clearEvents();
+
+    // LED updates back to back from another thread, as a caps lock storm or
+    // a wake would, while the mouse reports at ~100 Hz
+    std::atomic<bool> done(false);
+    std::atomic<unsigned> updates(0);
+    std::thread leds([&] {
+        for (UInt8 state = 0; !done; state++)
+        {
+            setLEDs(stack.keyboardDevice, state & 7);
+            updates++;
+        }
+    });
+    enum { kPackets = 100 };
+    for (int i = 0; i < kPackets; i++)
+    {
+        stack.emulator.locked([&] { stack.mouse.move(1, 0, 0); });
+        IOSleep(10);
+    }
+    stack.emulator.waitIdle();
+    WAIT_FOR(stack.events().size() >= kPackets, 2000);
+    done = true;
+    leds.join();
+
+    // from the first byte of the packet arriving to its dispatch
+    std::vector<uint64_t> waits;
+    for (const HostHIDEvent& event : stack.events())
+        if (event.kind == HostHIDEvent::kRelative)
+            waits.push_back(event.dispatched - event.time);
+    CHECK_EQ(waits.size(), kPackets);
+    printf("  %u LED updates alongside %d mouse packets\n", updates.load(), kPackets);
+    printf("  first byte to dispatch: p50 %.0f us, p99 %.0f us, max %.0f us (4 bytes at ~1 ms each)\n",
+           percentile(waits, 0.5), percentile(waits, 0.99), percentile(waits, 1.0));
+    // the packet itself takes 3 ms on the wire; a request in progress must
+    // not hold it back for the length of the request (the tail is left out of
+    // the check: timer wake ups on a loaded host can be late by milliseconds)
+    CHECK(percentile(waits, 0.9) < 5000);
+}
+
+// the request queue as it was: queue_enter under a lock, and the consumer
+// taking one request at a time under the same lock
+class LockedRequestQueue
+{
+    IOLock* m_lock;
+    queue_head_t m_queue;
+
+public:
+    LockedRequestQueue() : m_lock(IOLockAlloc()) { queue_init(&m_queue); }
+    ~LockedRequestQueue() { IOLockFree(m_lock); }
+    void enqueue(PS2Request* request)
+    {
+        IOLockLock(m_lock);
+        queue_enter(&m_queue, request, PS2Request *, chain);
+        IOLockUnlock(m_lock);
+    }
+    PS2Request* dequeue()
+    {
+        PS2Request* request = 0;
+        IOLockLock(m_lock);
+        if (!queue_empty(&m_queue))
+            queue_remove_first(&m_queue, request, PS2Request *, chain);
+        IOLockUnlock(m_lock);
+        return request;
+    }
+};
+
+// ns per request from the first submission to the last one dequeued
+template <class Queue>
+static double queueThroughput(unsigned producers, unsigned perProducer)
+{
+    std::vector<TPS2Request<1>> requests(producers * perProducer);
+    Queue queue;
+    std::atomic<unsigned> started(0);
+    std::vector<std::thread> threads;
+    for (unsigned p = 0; p < producers; p++)
+        threads.emplace_back([&, p] {
+            started++;
+            while (started <= producers)
+                std::this_thread::yield();
+            for (unsigned i = 0; i < perProducer; i++)
+                queue.enqueue(&requests[p * perProducer + i]);
+        });
+    while (started < producers)
+        std::this_thread::yield();
+    uint64_t start = wallNS();
+    started++;
+    unsigned received = 0;
+    while (received < requests.size())
+    {
+        if (queue.dequeue())
+            received++;
+        else
+            std::this_thread::yield();
+    }
+    uint64_t elapsed = wallNS() - start;
+    for (std::thread& thread : threads)
+        thread.join();
+    return (double)elapsed / requests.size();
+}
+
+TEST(requestQueueContention)
+{
+    enum { kPerProducer = 200000 };
+    printf("  %u CPUs\n", std::thread::hardware_concurrency());
+    for (unsigned producers : { 1, 2, 4, 8 })
+    {
+        double locked = queueThroughput<LockedRequestQueue>(producers, kPerProducer / producers);
+        double lockFree = queueThroughput<PS2RequestQueue>(producers, kPerProducer / producers);
+        printf("  %u producers: IOLock %.1f ns, PS2RequestQueue %.1f ns a request\n",
+               producers, locked, lockFree);
+        // only a gross regression: it does less than the lock in every case
+        CHECK(lockFree < locked * 2);
+    }
+}
+
+HOST_TEST_MAIN()
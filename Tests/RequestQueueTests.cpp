@@ -0,0 +1,122 @@
+//
+// RequestQueueTests.cpp
+//
+// PS2RequestQueue on its own: lanes served highest priority first and in
+// submission order within a lane, and several producer threads against the
+// consumer (as drivers submitting from their own threads against the work
+// loop) with nothing lost, duplicated or reordered within a lane.
+//
+
+#include "HostTest.h"
+#include "VoodooPS2Controller.h"
+
+#include <atomic>
+#include <thread>
+
+// a request's producer and sequence number, kept in completionParam
+static inline void tag(PS2Request* request, unsigned producer, unsigned sequence)
+{
+    request->completionParam = (void*)(((uintptr_t)producer << 32) | sequence);
+}
+
+static inline unsigned producerOf(PS2Request* request)
+{
+    return (unsigned)((uintptr_t)request->completionParam >> 32);
+}
+
+static inline unsigned sequenceOf(PS2Request* request)
+{
+    return (unsigned)(uintptr_t)request->completionParam;
+}
+
+TEST(lanesInPriorityOrder)
+{
+    PS2RequestQueue queue;
+    CHECK(!queue.dequeue());
+
+    static const UInt8 priorities[] = {
+        kPS2RP_Cosmetic, kPS2RP_Normal, kPS2RP_Input, kPS2RP_Normal,
+        kPS2RP_Cosmetic, kPS2RP_Input, kPS2RP_Normal,
+    };
+    enum { kRequests = sizeof(priorities) };
+    TPS2Request<1> requests[kRequests];
+    for (unsigned i = 0; i < kRequests; i++)
+    {
+        requests[i].priority = priorities[i];
+        tag(&requests[i], 0, i);
+        queue.enqueue(&requests[i]);
+    }
+    static const unsigned expected[] = { 2, 5, 1, 3, 6, 0, 4 };
+    for (unsigned i = 0; i < kRequests; i++)
+    {
+        PS2Request* request = queue.dequeue();
+        REQUIRE(request);
+        CHECK_EQ(sequenceOf(request), expected[i]);
+    }
+    CHECK(!queue.dequeue());
+
+    // an out of range priority goes to the normal lane
+    TPS2Request<1> odd, normal;
+    odd.priority = 200;
+    queue.enqueue(&normal);
+    queue.enqueue(&odd);
+    CHECK(queue.dequeue() == &normal);
+    CHECK(queue.dequeue() == &odd);
+    CHECK(!queue.dequeue());
+}
+
+TEST(producersAgainstConsumer)
+{
+    enum { kProducers = 4, kPerProducer = 100000 };
+    std::vector<TPS2Request<1>> requests(kProducers * kPerProducer);
+    PS2RequestQueue queue;
+    std::atomic<unsigned> started(0);
+
+    std::vector<std::thread> producers;
+    for (unsigned p = 0; p < kProducers; p++)
+        producers.emplace_back([&, p] {
+            started++;
+            while (started < kProducers)
+                std::this_thread::yield();
+            for (unsigned i = 0; i < kPerProducer; i++)
+            {
+                PS2Request* request = &requests[p * kPerProducer + i];
+                request->priority = (UInt8)((p + i) % kPS2RP_Count);
+                tag(request, p, i);
+                queue.enqueue(request);
+                if (0 == (i & 63))
+                    std::this_thread::yield();
+            }
+        });
+
+    // per producer and lane, the last sequence number seen
+    long last[kProducers][kPS2RP_Count];
+    for (auto& lanes : last)
+        for (long& sequence : lanes)
+            sequence = -1;
+    std::vector<UInt8> seen(requests.size(), 0);
+    unsigned received = 0, misordered = 0, duplicates = 0;
+    while (received < requests.size())
+    {
+        PS2Request* request = queue.dequeue();
+        if (!request)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        unsigned p = producerOf(request), sequence = sequenceOf(request);
+        REQUIRE(p < kProducers && sequence < kPerProducer);
+        misordered += sequence <= last[p][request->priority];
+        last[p][request->priority] = sequence;
+        duplicates += seen[p * kPerProducer + sequence]++;
+        received++;
+    }
+    for (std::thread& producer : producers)
+        producer.join();
+
+    CHECK_EQ(misordered, 0);
+    CHECK_EQ(duplicates, 0);
+    CHECK(!queue.dequeue());
+}
+
+HOST_TEST_MAIN()
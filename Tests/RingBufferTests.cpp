@@ -0,0 +1,202 @@
+//
+// RingBufferTests.cpp
+//
+// RingBuffer on its own: capacity and overflow accounting, discard(),
+// peek(), and a producer and a consumer on separate threads (as
+// interruptOccurred and packetReady are) checking that no packet is lost
+// without being counted, none arrives twice or out of order, and none is
+// seen half written, also with the consumer discarding while the producer
+// runs.
+//
+
+#include "HostTest.h"
+#include "ApplePS2Device.h"
+
+#include <atomic>
+#include <thread>
+
+TEST(capacityAndOverflows)
+{
+    RingBuffer<UInt8, 8> ring;
+    CHECK_EQ(ring.count(), 0);
+    // one slot stays free to tell full from empty
+    for (int i = 0; i < 7; i++)
+        CHECK(ring.push((UInt8)i));
+    CHECK(!ring.push(7));
+    CHECK(!ring.push(8));
+    CHECK_EQ(ring.count(), 7);
+    CHECK_EQ(ring.overflows(), 2);
+    CHECK_EQ(ring.highWater(), 7);
+    for (int i = 0; i < 7; i++)
+        CHECK_EQ(ring.fetch(), i);
+    CHECK_EQ(ring.count(), 0);
+
+    // wrapping many times over keeps the order
+    for (int i = 0; i < 1000; i++)
+    {
+        CHECK(ring.push((UInt8)i));
+        CHECK(ring.push((UInt8)(i + 1)));
+        CHECK_EQ(ring.fetch(), (UInt8)i);
+        CHECK_EQ(ring.fetch(), (UInt8)(i + 1));
+    }
+    CHECK_EQ(ring.overflows(), 2);
+    CHECK_EQ(ring.highWater(), 7);
+}
+
+TEST(discardKeepsStatistics)
+{
+    RingBuffer<UInt8, 8> ring;
+    for (int i = 0; i < 9; i++)
+        ring.push((UInt8)i);
+    ring.discard();
+    CHECK_EQ(ring.count(), 0);
+    CHECK_EQ(ring.overflows(), 2);
+    CHECK_EQ(ring.highWater(), 7);
+    // and the ring goes on from where the producer is
+    CHECK(ring.push(42));
+    CHECK_EQ(ring.count(), 1);
+    CHECK_EQ(ring.fetch(), 42);
+}
+
+TEST(peekSeesQueuedPackets)
+{
+    RingBuffer<UInt8, 8, 2> ring;
+    for (int i = 0; i < 5; i++)
+    {
+        UInt8* packet = ring.reserve();
+        packet[0] = (UInt8)i;
+        packet[1] = (UInt8)~i;
+        CHECK(ring.commit());
+    }
+    // an uncommitted packet is not counted
+    ring.reserve()[0] = 0xff;
+    CHECK_EQ(ring.count(), 5);
+    for (unsigned i = 0; i < ring.count(); i++)
+        CHECK_EQ(ring.peek(i)[0], i);
+    ring.advanceTail();
+    CHECK_EQ(ring.tail()[0], 1);
+    CHECK_EQ(ring.peek(3)[1], (UInt8)~4);
+}
+
+TEST(publishOnlyOnChange)
+{
+    OSDictionary* personality = OSDictionary::withCapacity(1);
+    IOService* entry = new IOService;
+    REQUIRE(entry->init(personality));
+    personality->release();
+
+    RingBuffer<UInt8, 4> ring;
+    ring.publishStats(entry, "Ring");
+    CHECK(!entry->getProperty("Ring"));
+    ring.push(1);
+    ring.publishStats(entry, "Ring");
+    OSDictionary* stats = OSDynamicCast(OSDictionary, entry->getProperty("Ring"));
+    REQUIRE(stats);
+    CHECK_EQ(OSDynamicCast(OSNumber, stats->getObject("Capacity"))->unsigned32BitValue(), 3);
+    CHECK_EQ(OSDynamicCast(OSNumber, stats->getObject("HighWater"))->unsigned32BitValue(), 1);
+    CHECK_EQ(OSDynamicCast(OSNumber, stats->getObject("Overflows"))->unsigned32BitValue(), 0);
+    entry->release();
+}
+
+// Packets of 8 bytes: a sequence number, then the bytes of a pattern derived
+// from it.  A consumer that saw a packet before it was completely written
+// would find the pattern broken.
+enum { kPacket = 8 };
+
+static UInt8 patternByte(UInt32 sequence, int i)
+{
+    return (UInt8)(sequence * 31 + i * 7);
+}
+
+// "retry": the producer waits for room instead of dropping the packet, so
+// every packet goes through the ring
+// "discardEvery": the consumer discards instead of reading every so many
+// rounds, as the drivers do on a mode change while input keeps coming
+static void stress(unsigned packets, bool retry, unsigned discardEvery = 0)
+{
+    RingBuffer<UInt8, 32, kPacket> ring;
+    std::atomic<bool> done(false);
+    UInt32 committed = 0;
+
+    std::thread producer([&] {
+        for (UInt32 sequence = 0; sequence < packets; sequence++)
+        {
+            UInt8* packet = ring.reserve();
+            memcpy(packet, &sequence, sizeof(sequence));
+            for (int i = sizeof(sequence); i < kPacket; i++)
+                packet[i] = patternByte(sequence, i);
+            // dropped when full, as in interruptOccurred
+            bool ok;
+            while (!(ok = ring.commit()) && retry)
+                std::this_thread::yield();
+            committed += ok;
+            // bursts of input, so the consumer gets to run between them
+            // even on a single CPU
+            if (!retry && 0 == (sequence & 15))
+                std::this_thread::yield();
+        }
+        done = true;
+    });
+
+    UInt32 received = 0, torn = 0, misordered = 0, discards = 0, tooMany = 0;
+    SInt64 last = -1;
+    for (unsigned round = 1;; round++)
+    {
+        bool finished = done;
+        if (discardEvery && 0 == round % discardEvery)
+        {
+            ring.discard();
+            discards++;
+        }
+        while (unsigned count = ring.count())
+        {
+            tooMany += count > 31;
+            for (unsigned n = 0; n < count; n++)
+            {
+                UInt8* packet = ring.tail();
+                UInt32 sequence;
+                memcpy(&sequence, packet, sizeof(sequence));
+                for (int i = sizeof(sequence); i < kPacket; i++)
+                    torn += packet[i] != patternByte(sequence, i);
+                misordered += (SInt64)sequence <= last;
+                last = sequence;
+                received++;
+                ring.advanceTail();
+            }
+        }
+        if (finished && !ring.count())
+            break;
+        std::this_thread::yield();
+    }
+    producer.join();
+
+    printf("  %u packets: %u received, %u overflows, high water %u, %u discards\n",
+           packets, received, ring.overflows(), ring.highWater(), discards);
+    CHECK_EQ(torn, 0);
+    CHECK_EQ(misordered, 0);
+    CHECK_EQ(tooMany, 0);
+    if (discardEvery)
+        CHECK(received <= committed);
+    else
+        CHECK_EQ(received, committed);
+    CHECK_EQ(committed, retry ? packets : packets - ring.overflows());
+    CHECK(ring.highWater() <= 31);
+    CHECK(received > packets / 100);
+}
+
+TEST(producerConsumerStress)
+{
+    stress(1000000, true);
+}
+
+TEST(producerConsumerStressWithOverflows)
+{
+    stress(1000000, false);
+}
+
+TEST(producerConsumerStressWithDiscards)
+{
+    stress(1000000, false, 7);
+}
+
+HOST_TEST_MAIN()
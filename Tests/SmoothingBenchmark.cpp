@@ -0,0 +1,131 @@
+//
+// SmoothingBenchmark.cpp
+//
+// Lag and jitter of the Synaptics finger smoothing (SmoothingFilter): the
+// same stream of 6-byte packets, a finger resting with sensor noise, then a
+// swipe at constant speed, then resting again, goes through the driver on
+// the emulated touchpad with each filter, and the positions it reports to
+// VoodooInput are compared with the noise free path:
+//
+//  - jitter: standard deviation of the reported x while the finger rests;
+//  - lag: how far the reported x trails the finger during the swipe, in
+//    packets (12.5 ms each at 80 packets/s).
+//
+
+#include "SynapticsStack.h"
+
+#include <cmath>
+
+enum
+{
+    kRest = 30,             // packets before and after the swipe
+    kSwipe = 40,
+    kSpeed = 40,            // units a packet (3200 units/s at 80 packets/s)
+    kNoise = 8,             // +- units of sensor noise
+    kStartX = 2500,
+    kY = 3000,
+};
+
+// the finger's x without noise, packet "i"
+static int pathX(int i)
+{
+    if (i < kRest)
+        return kStartX;
+    if (i < kRest + kSwipe)
+        return kStartX + (i - kRest + 1) * kSpeed;
+    return kStartX + kSwipe * kSpeed;
+}
+
+// deterministic noise, the same for every filter
+static int noise(int i)
+{
+    UInt32 hash = (UInt32)i * 2654435761U;
+    return (int)(hash >> 16) % (2 * kNoise + 1) - kNoise;
+}
+
+struct SmoothingResult
+{
+    double jitter;
+    double lag;
+};
+
+static void setNumber(OSDictionary* dict, const char* key, int value)
+{
+    OSNumber* number = OSNumber::withNumber(value, 32);
+    dict->setObject(key, number);
+    number->release();
+}
+
+static bool measure(int filter, int predictionTime, SmoothingResult& result)
+{
+    SynapticsStack synaptics;
+    OSDictionary* options = OSDictionary::withCapacity(2);
+    setNumber(options, "SmoothingFilter", filter);
+    setNumber(options, "PredictionTime", predictionTime);
+    bool started = synaptics.start(options);
+    options->release();
+    if (!started)
+        return false;
+
+    enum { kPackets = 2 * kRest + kSwipe };
+    for (int i = 0; i < kPackets; i++)
+        synaptics.onePacket(pathX(i) + noise(i), kY, 4);
+    IOSleep(20);
+    std::vector<VoodooInputEvent> events = synaptics.input->events();
+    // the first packets of a touch may not be reported: line the frames
+    // up with the packets from the end
+    if (events.size() < kPackets - 5 || events.size() > kPackets)
+        return false;
+    size_t first = kPackets - events.size();
+    std::vector<double> reported(kPackets, NAN);
+    for (size_t i = 0; i < events.size(); i++)
+        reported[first + i] = events[i].contact_count ? events[i].transducers[0].currentCoordinates.x : NAN;
+
+    // reported x is relative to the logical minimum: take the offset from
+    // the end of the first rest, where every filter has settled
+    double offset = 0, jitter = 0;
+    int settled = kRest - 15;
+    for (int i = settled; i < kRest; i++)
+        offset += reported[i] - pathX(i);
+    offset /= kRest - settled;
+    for (int i = settled; i < kRest; i++)
+        jitter += pow(reported[i] - pathX(i) - offset, 2);
+    result.jitter = sqrt(jitter / (kRest - settled));
+
+    // in the middle of the swipe, past the filters' start
+    double lag = 0;
+    int from = kRest + 10, to = kRest + kSwipe - 5;
+    for (int i = from; i < to; i++)
+        lag += pathX(i) - (reported[i] - offset);
+    result.lag = lag / (to - from) / kSpeed;
+    return true;
+}
+
+TEST(smoothingLagAndJitter)
+{
+    static const struct { const char* name; int filter; int predictionTime; } configs[] = {
+        { "5 sample average", 0, 0 },
+        { "1 euro", 1, 0 },
+        { "1 euro, predicted", 2, 0 },
+        { "1 euro, +12.5 ms", 2, 12500 },
+    };
+    enum { kConfigs = sizeof(configs) / sizeof(configs[0]) };
+    SmoothingResult results[kConfigs];
+    for (int i = 0; i < kConfigs; i++)
+    {
+        REQUIRE(measure(configs[i].filter, configs[i].predictionTime, results[i]));
+        printf("  %-18s jitter %5.2f units, lag %5.2f packets (%5.1f ms at 80 packets/s)\n",
+               configs[i].name, results[i].jitter, results[i].lag, results[i].lag * 12.5);
+    }
+    printf("  (sensor noise +-%d units, uniform: %.2f units standard deviation)\n",
+           kNoise, sqrt(((2 * kNoise + 1) * (2 * kNoise + 1) - 1) / 12.0));
+    // the point of the 1 euro filter: less lag than the average in motion,
+    // without giving up its smoothing at rest
+    CHECK(results[1].lag < results[0].lag);
+    CHECK(results[1].jitter < kNoise);
+    // prediction makes up for the sample's wait, and PredictionTime for more
+    CHECK(results[2].lag <= results[1].lag);
+    CHECK(results[3].lag < results[2].lag - 0.5);
+}
+
+HOST_TEST_MAIN()
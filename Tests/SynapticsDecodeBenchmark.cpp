@@ -0,0 +1,123 @@
+//
+// SynapticsDecodeBenchmark.cpp
+//
+// CPU time of the Synaptics packet decoder: the specialized one bound by
+// selectDecoder (synaptics_parse_hw_state<>) against the reference driver,
+// whose decoder tests ClickPad/ThinkPad/pass through on every packet (see
+// CMakeLists.txt), on a plain touchpad and on a ThinkPad ClickPad with a
+// pass through device; and the fields of a backlog unpacked in one pass by
+// decodePacketBatch against unpacking them packet by packet.  The packets go
+// to the decoder directly on the work loop (SynapticsDecodeLoop), one finger
+// moving with a guest packet every 8th; the best of a few rounds is reported.
+//
+
+#include "SynapticsStack.h"
+#include "SynapticsDecodeLoop.h"
+
+IOService* createReferenceTouchPad();
+double referenceDecodeNS(IOService* touchpad, std::vector<UInt8>& packets, int rounds);
+
+enum { kPackets = 4096, kRepeat = 16, kRounds = 5 };
+
+static std::vector<UInt8> stream()
+{
+    std::vector<UInt8> packets(kPackets * kPacketBufferLength);
+    for (int i = 0; i < kPackets; i++)
+    {
+        UInt8* packet = &packets[i * kPacketBufferLength];
+        if (7 == (i & 7))
+            PS2Synaptics::guestPacket(packet, 1, -1, 0);
+        else
+            PS2Synaptics::touchPacket(packet, 2000 + (i & 511) * 4, 2500 + (i & 255) * 2, 60, 4);
+    }
+    return packets;
+}
+
+// ns of CPU a packet, the best of kRounds after one to warm up
+static bool measure(bool capabilities, bool reference, double& result, bool batched = true)
+{
+    SynapticsStack synaptics;
+    if (capabilities)
+    {
+        synaptics.pad.queries[0xc][0] |= 0x10;      // ClickPad
+        synaptics.pad.queries[0x1][0] |= 0x01;      // guest present
+        synaptics.pad.queries[0x2][2] |= 0x80;      // pass through
+    }
+    OSDictionary* options = OSDictionary::withCapacity(1);
+    options->setObject("Thinkpad", capabilities ? kOSBooleanTrue : kOSBooleanFalse);
+    bool started = synaptics.start(options, reference ? createReferenceTouchPad() : NULL);
+    options->release();
+    if (!started)
+        return false;
+
+    std::vector<UInt8> packets = stream();
+    result = 0;
+    for (int round = 0; round <= kRounds; round++)
+    {
+        synaptics.stack.clearEvents();
+        double perPacket = reference ? referenceDecodeNS(synaptics.driver, packets, kRepeat) :
+            SynapticsDecodeLoop<ApplePS2SynapticsTouchPad>::run(synaptics.driver, packets, kRepeat, batched);
+        if (perPacket <= 0)
+            return false;
+        if (1 == round || (round && perPacket < result))
+            result = perPacket;
+    }
+    return true;
+}
+
+TEST(decodeCostPerPacket)
+{
+    // the first measurements of a process can be much slower throughout
+    // (the CPU clocking up?): one to discard
+    double ns;
+    REQUIRE(measure(false, false, ns));
+
+    for (bool capabilities : { false, true })
+    {
+        // each on two driver instances, taking turns
+        double specialized = 0, reference = 0;
+        for (int instance = 0; instance < 2; instance++)
+        {
+            REQUIRE(measure(capabilities, false, ns));
+            if (!instance || ns < specialized)
+                specialized = ns;
+            REQUIRE(measure(capabilities, true, ns));
+            if (!instance || ns < reference)
+                reference = ns;
+        }
+        printf("  %-34s specialized %6.1f ns, reference %6.1f ns a packet (%+.1f%%)\n",
+               capabilities ? "ThinkPad ClickPad, pass through:" : "plain touchpad:",
+               specialized, reference, 100.0 * (specialized - reference) / reference);
+        // the capability tests are a few predictable branches: expect a
+        // difference in the noise, and flag only a gross regression
+        CHECK(specialized < reference * 1.5);
+    }
+}
+
+TEST(batchedUnpackCost)
+{
+    double ns;
+    REQUIRE(measure(false, false, ns));
+
+    for (bool capabilities : { false, true })
+    {
+        double batched = 0, perPacket = 0;
+        for (int instance = 0; instance < 2; instance++)
+        {
+            REQUIRE(measure(capabilities, false, ns, true));
+            if (!instance || ns < batched)
+                batched = ns;
+            REQUIRE(measure(capabilities, false, ns, false));
+            if (!instance || ns < perPacket)
+                perPacket = ns;
+        }
+        printf("  %-34s batched %6.1f ns, per packet %6.1f ns a packet (%+.1f%%)\n",
+               capabilities ? "ThinkPad ClickPad, pass through:" : "plain touchpad:",
+               batched, perPacket, 100.0 * (batched - perPacket) / perPacket);
+        // a few shifts and masks a packet against the whole state logic:
+        // again, flag only a gross regression
+        CHECK(batched < perPacket * 1.5);
+    }
+}
+
+HOST_TEST_MAIN()
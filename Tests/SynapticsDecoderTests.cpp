@@ -0,0 +1,255 @@
+//
+// SynapticsDecoderTests.cpp
+//
+// The packet decoders bound by selectDecoder (synaptics_parse_hw_state<>,
+// specialized per ClickPad/ThinkPad/pass through) against a golden trace of
+// the driver before they were (SynapticsDecoderTrace.txt): for each of the
+// eight combinations, what the same packets made that driver send to
+// VoodooInput and HID.  And the fields of a backlog unpacked in one pass by
+// decodePacketBatch against unpacking each packet on its own.
+//
+
+#include "SynapticsStack.h"
+#include "SynapticsDecodeLoop.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdlib>
+#include <functional>
+#include <string>
+
+// Recorded from the Synaptics driver of the baseline (17536c9), built into
+// these tests with its own RingBuffer, by running them with
+// SYNAPTICS_RECORD_TRACE set to the file to write.
+#define kDecoderTrace "Tests/SynapticsDecoderTrace.txt"
+#define kDecoderTraceHeader \
+    "# feed() of SynapticsDecoderTests.cpp through the Synaptics driver of the\n" \
+    "# baseline (17536c9), for each combination of ClickPad, ThinkPad and pass\n" \
+    "# through: the HID events and VoodooInput frames it sent.\n"
+
+static void appendf(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static void appendf(std::string& out, const char* format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    out += line;
+}
+
+// packets that take every capability dependent path of the decoder
+static void feed(SynapticsStack& synaptics)
+{
+    PS2Synaptics& pad = synaptics.pad;
+    auto send = [&](const std::function<void()>& packet) {
+        synaptics.stack.emulator.locked(packet);
+        synaptics.stack.emulator.waitIdle();
+        IOSleep(12);
+    };
+
+    // one finger moving, touchpad buttons (on a ClickPad, the click)
+    for (int i = 0; i < 8; i++)
+        send([&] { pad.touch(3000 + i * 24, 2500 - i * 16, 60, 4, i >= 4 ? 1 : 0); });
+    send([&] { pad.touch(3200, 2400, 60, 4, 2); });
+    send([&] { pad.touch(3200, 2400, 60, 4, 0); });
+    // the "real" buttons of a ThinkPad ClickPad: bp 2 with left/right
+    // in the low bits of x and y
+    send([&] { pad.touch(3201, 2400, 60, 4, 2); });
+    send([&] { pad.touch(3200, 2401, 60, 4, 2); });
+    send([&] { pad.touch(3200, 2400, 60, 4, 0); });
+    send([&] { pad.touch(3200, 2400, 0, 0, 0); });
+
+    // the guest: movement, buttons, middle button scrolling
+    for (int i = 0; i < 4; i++)
+        send([&] { pad.guest(5 + i, -3 * i, 0); });
+    send([&] { pad.guest(0, 0, 1); });
+    send([&] { pad.guest(2, 2, 1); });
+    send([&] { pad.guest(0, 0, 0); });
+    for (int i = 0; i < 4; i++)
+        send([&] { pad.guest(1, 6 - 4 * i, 4); });
+    send([&] { pad.guest(0, 0, 0); });
+
+    // two fingers (AGM) and lifting them
+    for (int i = 0; i < 4; i++)
+        send([&] { pad.secondary(2000 + i * 32, 2600, 60); pad.touch(4000 - i * 32, 2600, 60, 0); });
+    send([&] { pad.touch(4000, 2600, 60, 4); });
+    send([&] { pad.touch(4000, 2600, 0, 0); });
+    IOSleep(50);
+}
+
+static void print(SynapticsStack& synaptics, std::string& out);
+
+static bool decode(bool clickpad, bool thinkpad, bool passthru, std::string& out)
+{
+    SynapticsStack synaptics;
+    if (clickpad)
+        synaptics.pad.queries[0xc][0] |= 0x10;
+    if (passthru)
+    {
+        synaptics.pad.queries[0x1][0] |= 0x01;   // guest present
+        synaptics.pad.queries[0x2][2] |= 0x80;   // pass through capability
+    }
+    // with the "no touch" frames unlimited, as the baseline sent them
+    OSDictionary* options = OSDictionary::withCapacity(2);
+    options->setObject("Thinkpad", thinkpad ? kOSBooleanTrue : kOSBooleanFalse);
+    OSNumber* idleFrames = OSNumber::withNumber(0ULL, 32);
+    options->setObject("IdleFrames", idleFrames);
+    idleFrames->release();
+    bool started = synaptics.start(options);
+    options->release();
+    if (!started)
+        return false;
+    synaptics.stack.clearEvents();
+
+    feed(synaptics);
+
+    appendf(out, "clickpad %d thinkpad %d passthru %d\n", clickpad, thinkpad, passthru);
+    print(synaptics, out);
+    return true;
+}
+
+static void print(SynapticsStack& synaptics, std::string& out)
+{
+    for (const HostHIDEvent& event : synaptics.stack.events())
+        appendf(out, "hid %d %d %d %d %u\n", event.kind, event.dx, event.dy, event.dz, event.buttons);
+    for (const VoodooInputEvent& event : synaptics.input->events())
+    {
+        appendf(out, "frame %u\n", event.contact_count);
+        for (int i = 0; i < event.contact_count; i++)
+        {
+            const VoodooInputTransducer& t = event.transducers[i];
+            appendf(out, "  %u %u %u %u %u %u %d%d%d\n", t.id, t.secondaryId,
+                    t.currentCoordinates.x, t.currentCoordinates.y,
+                    t.currentCoordinates.pressure, t.currentCoordinates.width,
+                    t.isValid, t.isTransducerActive, t.isPhysicalButtonDown);
+        }
+    }
+}
+
+// the first line where "a" and "b" differ, and the combination it is in
+static void printDifference(const std::string& a, const std::string& b,
+                            const char* nameA = "specialized", const char* nameB = "baseline")
+{
+    size_t start = 0, caps = 0;
+    for (size_t i = 0; i < std::min(a.size(), b.size()) && a[i] == b[i]; i++)
+    {
+        if ('\n' != a[i])
+            continue;
+        start = i + 1;
+        if (!a.compare(start, 8, "clickpad"))
+            caps = start;
+    }
+    printf("  %s\n    %-12s %s\n    %-12s %s\n",
+           a.substr(caps, a.find('\n', caps) - caps).c_str(),
+           (std::string(nameA) + ":").c_str(), a.substr(start, a.find('\n', start) - start).c_str(),
+           (std::string(nameB) + ":").c_str(), b.substr(start, b.find('\n', start) - start).c_str());
+}
+
+TEST(decodersMatchBaseline)
+{
+    std::string specialized;
+    for (int caps = 0; caps < 8; caps++)
+    {
+        size_t start = specialized.size();
+        REQUIRE(decode(caps & 4, caps & 2, caps & 1, specialized));
+        // (and the packets did get through)
+        CHECK(specialized.find("frame", start) != std::string::npos);
+    }
+
+    if (const char* path = getenv("SYNAPTICS_RECORD_TRACE"))
+    {
+        FILE* file = fopen(path, "w");
+        REQUIRE(file);
+        fputs(kDecoderTraceHeader, file);
+        fputs(specialized.c_str(), file);
+        fclose(file);
+        printf("  recorded %s\n", path);
+        return;
+    }
+
+    std::vector<char> file = HostSourceFile(kDecoderTrace);
+    REQUIRE(!file.empty());
+    std::string baseline(file.data());
+    REQUIRE(!baseline.compare(0, strlen(kDecoderTraceHeader), kDecoderTraceHeader));
+    baseline.erase(0, strlen(kDecoderTraceHeader));
+    if (specialized != baseline)
+        printDifference(specialized, baseline);
+    CHECK(specialized == baseline);
+}
+
+// one and two fingers anywhere on the pad (all 13 bits of x and y), the
+// buttons, lifting, and the guest, in a fixed pseudo random order
+static std::vector<UInt8> mixedStream(size_t count)
+{
+    std::vector<UInt8> packets(count * kPacketBufferLength);
+    UInt32 seed = 12345;
+    auto next = [&seed](UInt32 range) { seed = seed * 1103515245 + 12345; return (seed >> 8) % range; };
+    int x = 3000, y = 2500;
+    for (size_t i = 0; i < count; i++)
+    {
+        UInt8* packet = &packets[i * kPacketBufferLength];
+        x = std::max(1024, std::min(8191, x + (int)next(401) - 200));
+        y = std::max(1024, std::min(8191, y + (int)next(401) - 200));
+        switch (next(8))
+        {
+            case 0:
+                PS2Synaptics::guestPacket(packet, (int)next(21) - 10, (int)next(21) - 10, next(8));
+                break;
+            case 1:
+                PS2Synaptics::secondaryPacket(packet, x / 2 + 1000, y, 60);
+                break;
+            case 2:
+                PS2Synaptics::touchPacket(packet, x, y, 60, next(2), next(4));
+                break;
+            case 3:
+                PS2Synaptics::touchPacket(packet, x, y, next(2) ? 0 : 20, 0);
+                break;
+            default:
+                PS2Synaptics::touchPacket(packet, x, y, 30 + next(100), 4 + next(12), next(4));
+                break;
+        }
+    }
+    return packets;
+}
+
+static bool decodeBacklogs(bool capabilities, bool batched, std::string& out)
+{
+    SynapticsStack synaptics;
+    if (capabilities)
+    {
+        synaptics.pad.queries[0xc][0] |= 0x10;      // ClickPad
+        synaptics.pad.queries[0x1][0] |= 0x01;      // guest present
+        synaptics.pad.queries[0x2][2] |= 0x80;      // pass through
+    }
+    OSDictionary* options = OSDictionary::withCapacity(1);
+    options->setObject("Thinkpad", capabilities ? kOSBooleanTrue : kOSBooleanFalse);
+    bool started = synaptics.start(options);
+    options->release();
+    if (!started)
+        return false;
+    synaptics.stack.clearEvents();
+
+    std::vector<UInt8> packets = mixedStream(4000);
+    if (SynapticsDecodeLoop<ApplePS2SynapticsTouchPad>::run(synaptics.driver, packets, 1, batched, true) <= 0)
+        return false;
+    appendf(out, "clickpad %d thinkpad %d passthru %d\n", capabilities, capabilities, capabilities);
+    print(synaptics, out);
+    return true;
+}
+
+TEST(batchedDecodeMatchesPerPacket)
+{
+    for (bool capabilities : { false, true })
+    {
+        std::string batched, perPacket;
+        REQUIRE(decodeBacklogs(capabilities, true, batched));
+        REQUIRE(decodeBacklogs(capabilities, false, perPacket));
+        CHECK(batched.find("frame 2") != std::string::npos);
+        if (batched != perPacket)
+            printDifference(batched, perPacket, "batched", "per packet");
+        CHECK(batched == perPacket);
+    }
+}
+
+HOST_TEST_MAIN()
@@ -0,0 +1,388 @@
+//
+// SynapticsTests.cpp
+//
+// The Synaptics driver on an emulated v8.1 touchpad with AGM: probe and
+// mode byte, the frames sent to VoodooInput for finger count changes, the
+// frames coalesced out of a backlog, the "no touch" frames after lift-off,
+// the latency statistics of coalesced frames, and report rate switches the
+// touchpad NAKs.
+//
+
+#include "SynapticsStack.h"
+
+#include <algorithm>
+#include <string>
+
+static OSDictionary* option(const char* key, bool value)
+{
+    OSDictionary* dict = OSDictionary::withCapacity(1);
+    dict->setObject(key, value ? kOSBooleanTrue : kOSBooleanFalse);
+    return dict;
+}
+
+TEST(touchpadStarts)
+{
+    SynapticsStack synaptics;
+    REQUIRE(synaptics.start());
+    // absolute mode with W
+    CHECK(synaptics.pad.modeByte & 0x80);
+    CHECK(synaptics.pad.modeByte & 0x01);
+}
+
+static size_t framesWith(const std::vector<VoodooInputEvent>& events, int fingers)
+{
+    size_t result = 0;
+    for (const VoodooInputEvent& event : events)
+        result += event.contact_count == fingers;
+    return result;
+}
+
+static void secondFingerDown(bool zeroDrop, size_t& twoFingerFrames)
+{
+    SynapticsStack synaptics;
+    OSDictionary* options = option("ZeroDropTransitions", zeroDrop);
+    bool started = synaptics.start(options);
+    options->release();
+    REQUIRE(started);
+
+    for (int i = 0; i < 3; i++)
+        synaptics.onePacket(4000, 3000, 5);
+    for (int i = 0; i < 3; i++)
+        synaptics.onePacket(4000, 3000, 0, 2000);
+    IOSleep(20);
+    twoFingerFrames = framesWith(synaptics.input->events(), 2);
+}
+
+TEST(transitionFrameDroppedByDefault)
+{
+    // the first packet with the second finger is not reported
+    size_t frames = 0;
+    secondFingerDown(false, frames);
+    CHECK_EQ(frames, 2);
+}
+
+TEST(zeroDropReportsFirstPacket)
+{
+    size_t frames = 0;
+    secondFingerDown(true, frames);
+    CHECK_EQ(frames, 3);
+}
+
+TEST(zeroDropIgnoresStaleAGM)
+{
+    SynapticsStack synaptics;
+    OSDictionary* options = option("ZeroDropTransitions", true);
+    bool started = synaptics.start(options);
+    options->release();
+    REQUIRE(started);
+
+    // two fingers, the secondary one at x 2000
+    for (int i = 0; i < 3; i++)
+        synaptics.onePacket(4000, 3000, 0, 2000);
+    // then one finger, for well over kAGMMaxAge
+    for (int i = 0; i < 15; i++)
+        synaptics.onePacket(4000, 3000, 5);
+    synaptics.input->clearEvents();
+
+    // a second finger at x 5000: its AGM packet comes after the first normal
+    // packet, which must not put the new finger where the old one was
+    synaptics.onePacket(4000, 3000, 0);
+    synaptics.onePacket(4000, 3000, 0, 5000);
+    synaptics.onePacket(4000, 3000, 0, 5000);
+    IOSleep(20);
+    std::vector<VoodooInputEvent> events = synaptics.input->events();
+    CHECK(framesWith(events, 2) > 0);
+    int minX = 1 << 20;
+    for (const VoodooInputEvent& event : events)
+        for (int i = 0; i < event.contact_count; i++)
+            minX = std::min(minX, (int)event.transducers[i].currentCoordinates.x);
+    // reported x is relative to the logical minimum (1024 plus a 5 mm
+    // margin); the old finger would be at about 2000 - 1344
+    CHECK(minX > 2000);
+}
+
+// the "Count" of a stage of the driver's Latency Statistics
+static unsigned latencyCount(IOService* driver, const char* stage)
+{
+    OSDictionary* stats = OSDynamicCast(OSDictionary, driver->getProperty(kLatencyStatistics));
+    OSDictionary* dict = stats ? OSDynamicCast(OSDictionary, stats->getObject(stage)) : NULL;
+    OSNumber* count = dict ? OSDynamicCast(OSNumber, dict->getObject("Count")) : NULL;
+    return count ? count->unsigned32BitValue() : ~0U;
+}
+
+TEST(latencyCountsDeliveredFrames)
+{
+    SynapticsStack synaptics;
+    OSDictionary* options = option("CoalescePackets", true);
+    options->setObject(kResetLatencyStatistics, kOSBooleanTrue);
+    bool started = synaptics.start(options);
+    options->release();
+    REQUIRE(started);
+
+    // a finger down, then a burst queued up behind the work loop, for its
+    // frames to be coalesced, then one more packet past the once a second
+    // publishing
+    synaptics.onePacket(4000, 3000, 5);
+    IOWorkLoop* workLoop = synaptics.driver->getWorkLoop();
+    workLoop->closeGate();
+    synaptics.stack.emulator.locked([&] {
+        for (int i = 1; i <= 20; i++)
+            synaptics.pad.touch(4000 + 10 * i, 3000, 60, 5);
+    });
+    synaptics.stack.emulator.waitIdle();
+    workLoop->openGate();
+    IOSleep(1100);
+    synaptics.onePacket(4300, 3000, 5);
+
+    size_t frames = synaptics.input->events().size();
+    printf("  22 packets, %zu frames\n", frames);
+    CHECK(frames < 10);
+    CHECK_EQ(latencyCount(synaptics.driver, "IRQ to dispatch"), frames);
+    CHECK_EQ(latencyCount(synaptics.driver, "Drain to parse"), frames);
+}
+
+// a number in the driver's "Coalescing Statistics"
+static unsigned coalescingCount(IOService* driver, const char* key)
+{
+    OSDictionary* stats = OSDynamicCast(OSDictionary, driver->getProperty(kCoalescingStatistics));
+    OSNumber* count = stats ? OSDynamicCast(OSNumber, stats->getObject(key)) : NULL;
+    return count ? count->unsigned32BitValue() : ~0U;
+}
+
+// finger count of a frame and where the fingers are
+static std::string frameState(const VoodooInputEvent& event)
+{
+    std::string result = std::to_string(event.contact_count) + ":";
+    for (int i = 0; i < event.contact_count; i++)
+    {
+        const TouchCoordinates& point = event.transducers[i].currentCoordinates;
+        result += " " + std::to_string(point.x) + "," + std::to_string(point.y);
+    }
+    return result;
+}
+
+static bool contains(const std::vector<VoodooInputEvent>& events, const VoodooInputEvent& frame)
+{
+    for (const VoodooInputEvent& event : events)
+        if (frameState(event) == frameState(frame))
+            return true;
+    return false;
+}
+
+// one finger down, then a burst queued up behind the work loop: motion, the
+// left button held and released, and a second finger (the first packet
+// with it is dropped); every other packet is a frame of its own
+enum { kClickFrame = 5, kReleaseFrame = 9, kTwoFingerFrame = 12, kBurstFrames = 15 };
+
+static bool fingerDown(SynapticsStack& synaptics, bool coalesce)
+{
+    OSDictionary* options = option("CoalescePackets", coalesce);
+    bool started = synaptics.start(options);
+    options->release();
+    if (!started)
+        return false;
+    for (int i = 0; i < 3; i++)
+        synaptics.onePacket(4000, 3000, 5);
+    synaptics.input->clearEvents();
+    return true;
+}
+
+static void clickAndSecondFinger(SynapticsStack& synaptics)
+{
+    IOWorkLoop* workLoop = synaptics.driver->getWorkLoop();
+    workLoop->closeGate();
+    synaptics.stack.emulator.locked([&] {
+        PS2Synaptics& pad = synaptics.pad;
+        int x = 4000;
+        for (int i = 0; i < 5; i++)
+            pad.touch(x += 10, 3000, 60, 5);
+        for (int i = 0; i < 4; i++)
+            pad.touch(x += 10, 3000, 60, 5, 1);
+        for (int i = 0; i < 3; i++)
+            pad.touch(x += 10, 3000, 60, 5);
+        for (int i = 0; i < 4; i++)
+        {
+            pad.secondary(2000, 3000, 60);
+            pad.touch(x += 10, 3000, 60, 0);
+        }
+    });
+    synaptics.stack.emulator.waitIdle();
+    workLoop->openGate();
+    IOSleep(50);
+}
+
+TEST(coalescingKeepsTransitions)
+{
+    // every frame built goes out without coalescing
+    std::vector<VoodooInputEvent> built;
+    {
+        SynapticsStack all;
+        REQUIRE(fingerDown(all, false));
+        clickAndSecondFinger(all);
+        built = all.input->events();
+    }
+    REQUIRE(built.size() == kBurstFrames);
+
+    SynapticsStack coalesced;
+    REQUIRE(fingerDown(coalesced, true));
+    // the counts before the burst, and after it (setting the option again
+    // publishes them right away)
+    OSDictionary* options = option("CoalescePackets", true);
+    coalesced.driver->setProperties(options);
+    unsigned delivered = coalescingCount(coalesced.driver, "Delivered");
+    unsigned dropped = coalescingCount(coalesced.driver, "Coalesced");
+    clickAndSecondFinger(coalesced);
+    coalesced.driver->setProperties(options);
+    options->release();
+    delivered = coalescingCount(coalesced.driver, "Delivered") - delivered;
+    dropped = coalescingCount(coalesced.driver, "Coalesced") - dropped;
+
+    std::vector<VoodooInputEvent> events = coalesced.input->events();
+    printf("  %zu frames built, %zu delivered\n", built.size(), events.size());
+    CHECK(events.size() < built.size());
+    // the click, its release and the second finger are not coalesced away
+    CHECK(contains(events, built[kClickFrame]));
+    CHECK(contains(events, built[kReleaseFrame]));
+    CHECK(contains(events, built[kTwoFingerFrame]));
+    CHECK_EQ(framesWith(events, 2), framesWith(built, 2) - 1);
+    // and the last frame of the burst goes out once it is drained
+    CHECK(frameState(events.back()) == frameState(built.back()));
+
+    CHECK_EQ(delivered, events.size());
+    CHECK_EQ(delivered + dropped, built.size());
+}
+
+// the IdleFrames of idleFramesAfterLiftOff, other than the default of 10
+enum { kIdleFrames = 4 };
+
+// a number in the driver's "Idle Frame Statistics", published right away
+// (by setting IdleFrames to kIdleFrames)
+static unsigned idleFrameCount(IOService* driver, const char* key)
+{
+    OSDictionary* options = OSDictionary::withCapacity(1);
+    OSNumber* limit = OSNumber::withNumber(kIdleFrames, 32);
+    options->setObject("IdleFrames", limit);
+    limit->release();
+    driver->setProperties(options);
+    options->release();
+    OSDictionary* stats = OSDynamicCast(OSDictionary, driver->getProperty(kIdleFrameStatistics));
+    OSNumber* count = stats ? OSDynamicCast(OSNumber, stats->getObject(key)) : NULL;
+    return count ? count->unsigned32BitValue() : ~0U;
+}
+
+TEST(idleFramesAfterLiftOff)
+{
+    SynapticsStack synaptics;
+    REQUIRE(synaptics.start());
+    unsigned sent = idleFrameCount(synaptics.driver, "Sent");
+    unsigned suppressed = idleFrameCount(synaptics.driver, "Suppressed");
+    for (int i = 0; i < 3; i++)
+        synaptics.onePacket(4000, 3000, 5);
+    synaptics.input->clearEvents();
+
+    // lift-off (dropped as a finger count change), then the pad reporting
+    // nothing for a while
+    enum { kIdlePackets = 12 };
+    synaptics.onePacket(4000, 3000, 5, -1, 0);
+    for (int i = 0; i < kIdlePackets; i++)
+        synaptics.onePacket(4000, 3000, 5, -1, 0);
+    std::vector<VoodooInputEvent> events = synaptics.input->events();
+    CHECK_EQ(events.size(), kIdleFrames);
+    CHECK_EQ(framesWith(events, 0), kIdleFrames);
+    CHECK_EQ(idleFrameCount(synaptics.driver, "Sent") - sent, kIdleFrames);
+    CHECK_EQ(idleFrameCount(synaptics.driver, "Suppressed") - suppressed, kIdlePackets - kIdleFrames);
+
+    // a button change goes out (it is not an idle frame), and starts a new
+    // run while the button is held
+    synaptics.input->clearEvents();
+    for (int i = 0; i < 1 + kIdlePackets; i++)
+    {
+        synaptics.stack.emulator.locked([&] { synaptics.pad.touch(4000, 3000, 0, 5, 1); });
+        synaptics.stack.emulator.waitIdle();
+        IOSleep(12);
+        if (!i)
+            CHECK_EQ(synaptics.input->events().size(), 1);
+    }
+    events = synaptics.input->events();
+    CHECK_EQ(events.size(), 1 + kIdleFrames);
+    CHECK_EQ(framesWith(events, 0), 1 + kIdleFrames);
+    CHECK_EQ(idleFrameCount(synaptics.driver, "Sent") - sent, 2 * kIdleFrames);
+    CHECK_EQ(idleFrameCount(synaptics.driver, "Suppressed") - suppressed, 2 * (kIdlePackets - kIdleFrames));
+}
+
+// the ReportRateIdleTime of reportRateSwitchNak
+enum { kRateIdleMS = 500 };
+
+// a number in the driver's "Report Rate Statistics"
+static unsigned reportRate(IOService* driver, const char* key)
+{
+    OSDictionary* stats = OSDynamicCast(OSDictionary, driver->getProperty(kReportRateStatistics));
+    OSNumber* value = stats ? OSDynamicCast(OSNumber, stats->getObject(key)) : NULL;
+    return value ? value->unsigned32BitValue() : ~0U;
+}
+
+// how many of "byte" the touchpad was sent
+static size_t sent(SynapticsStack& synaptics, UInt8 byte)
+{
+    size_t result = 0;
+    synaptics.stack.emulator.locked([&] {
+        result = std::count(synaptics.pad.received.begin(), synaptics.pad.received.end(), byte);
+    });
+    return result;
+}
+
+TEST(reportRateSwitchNak)
+{
+    SynapticsStack synaptics;
+    OSDictionary* options = option("AdaptiveReportRate", true);
+    OSNumber* idleTime = OSNumber::withNumber(kRateIdleMS * 1000000ULL, 64);
+    options->setObject("ReportRateIdleTime", idleTime);
+    idleTime->release();
+    bool started = synaptics.start(options);
+    options->release();
+    REQUIRE(started);
+    PS2Synaptics& pad = synaptics.pad;
+    REQUIRE(pad.modeByte & 0x40);
+
+    // idle: the switch to the low rate has the F3 of its mode byte NAKed, and
+    // goes through when it is retried
+    unsigned writes = 0;
+    synaptics.stack.emulator.locked([&] {
+        pad.received.clear();
+        pad.nakCommand = kDP_SetMouseSampleRate;
+        pad.naks = 1;
+        writes = pad.modeByteWrites;
+    });
+    CHECK(WAIT_FOR(!(pad.modeByte & 0x40) && pad.reporting, kRateIdleMS + 2000));
+    synaptics.stack.emulator.waitIdle();
+    IOSleep(20);
+    // each try starts with F5 F5
+    CHECK_EQ(sent(synaptics, kDP_SetDefaultsAndDisable), 2 * 2);
+    CHECK_EQ(pad.modeByteWrites - writes, 1);
+    CHECK_EQ(reportRate(synaptics.driver, "Current Rate"), 40);
+
+    // motion: the switch back to the high rate is NAKed twice and given up,
+    // the touchpad is enabled again at the low rate
+    synaptics.stack.emulator.locked([&] {
+        pad.received.clear();
+        pad.naks = 2;
+        writes = pad.modeByteWrites;
+    });
+    synaptics.onePacket(4000, 3000, 5);
+    CHECK(WAIT_FOR(sent(synaptics, kDP_Enable) == 1 && pad.reporting, 2000));
+    synaptics.stack.emulator.waitIdle();
+    IOSleep(20);
+    CHECK_EQ(sent(synaptics, kDP_SetDefaultsAndDisable), 2 * 2);
+    CHECK_EQ(pad.modeByteWrites, writes);
+    CHECK(!(pad.modeByte & 0x40));
+    CHECK_EQ(reportRate(synaptics.driver, "Current Rate"), 40);
+
+    // and more motion switches it
+    synaptics.input->clearEvents();
+    for (int i = 1; i <= 3 && !(pad.modeByte & 0x40); i++)
+        synaptics.onePacket(4000 + 100 * i, 3000, 5);
+    CHECK(WAIT_FOR(pad.modeByte & 0x40, 2000));
+    CHECK(synaptics.input->events().size() > 0);
+}
+
+HOST_TEST_MAIN()
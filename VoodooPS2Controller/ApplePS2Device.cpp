@@ -133,6 +133,13 @@ void ApplePS2Device::uninstallPowerControlAction()
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Device::powerControlSleep(UInt32 ms)
+{
+    _controller->powerControlSleep(ms);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2Device::dispatchMessage(int message, void *data)
 {
     _controller->dispatchMessage(message, data);
@@ -140,6 +147,13 @@ void ApplePS2Device::dispatchMessage(int message, void *data)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+PS2KeyClock* ApplePS2Device::getKeyClock()
+{
+    return _controller->getKeyClock();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 ApplePS2Controller* ApplePS2Device::getController()
 {
     return _controller;
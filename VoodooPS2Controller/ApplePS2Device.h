@@ -164,90 +164,584 @@
 #define kApplePS2Controller          "ApplePS2Controller"
 #define kApplePS2Keyboard            "ApplePS2Keyboard"
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Registry helpers
+//
+// Add a number to a dictionary (for publishing statistics in the registry).
+
+inline void setPropertyNumber(OSDictionary* dict, const char* key, UInt64 value, unsigned bits)
+{
+    if (OSNumber* num = OSNumber::withNumber(value, bits))
+    {
+        dict->setObject(key, num);
+        num->release();
+    }
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // RingBuffer
+//
+// Registry key the drivers publish their ring buffer statistics under.
+
+#define kRingBufferStatistics   "RingBuffer Statistics"
+
 //
 // A simple ring buffer class for devices to use in their real interrupt
 // routine for buffering packets.
 //
-// Standard FIFO ring buffer implemented as an array.
+// Single producer (interrupt time), single consumer (work loop) FIFO of
+// N slots, each holding a packet of P elements (P = 1 for a plain FIFO).
+// N must be a power of two; head and tail run free and are masked into
+// the array.  Head is published with release semantics and read with
+// acquire semantics (and the other way around for tail), so the consumer
+// never sees a packet before all of its bytes are stored.
 //
-// Note: there is no error checking in this class.  And no check for
-// overflow/underflow conditions.  Make sure you have a large enough
-// buffer to handle your needs.  And don't advance or try to fetch
-// data that doesn't exist (need to check result from count() first)
+// Producer:  reserve() returns the slot being filled.  It stays the same
+//            slot until commit() publishes it, so a packet can be built a
+//            byte at a time over several interrupts.  If the buffer is full,
+//            commit() drops the packet and counts an overflow.
 //
-// This class is written for simplicity and efficiency, not to be
-// user friendly.
+// Consumer:  count() packets are available, tail() is the oldest one
+//            (peek(i) the i-th oldest), and advanceTail() releases it back
+//            to the producer.  discard() drops everything committed so far
+//            (after a device reset or a mode change); it only moves tail, so
+//            the producer may keep running, and the statistics are kept.
 //
-// The tail and head buffer can be accessed directly for effeciency,
-// but there are no provisions for dealing with "wrap-around," so it
-// is best that your buffer size is a mutliple of the packet size.
+// One slot is always kept free for the producer, so the usable capacity is
+// N-1 packets.  overflows() and highWater() can be published in the
+// registry with publishStats().
 //
 
-template <class T, unsigned N>
+template <class T, unsigned N, unsigned P = 1>
 class RingBuffer
 {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "RingBuffer size must be a power of two");
+
 private:
-    T m_buffer[N];
-    volatile unsigned m_head;   // m_head is volatile: commonly accessed at interrupt time
-    unsigned m_tail;
-    unsigned count(unsigned head, unsigned tail)
-    {
-        if (head >= tail)
-            return head - tail;
-        else
-            return N - tail + head;
-    }
-    
-public:
-    inline RingBuffer() { reset(); }
+    T m_buffer[N][P];
+    unsigned m_head;                // written by producer only
+    unsigned m_tail;                // written by consumer only
+    UInt32 m_overflows;             // written by producer only
+    UInt32 m_highWater;             // written by producer only
+    UInt32 m_publishedOverflows;    // consumer side copies of the above
+    UInt32 m_publishedHighWater;
+
+    // (construction only: head and the counters belong to the producer)
     void reset()
     {
         m_head = 0;
         m_tail = 0;
+        m_overflows = 0;
+        m_highWater = 0;
+        m_publishedOverflows = 0;
+        m_publishedHighWater = 0;
     }
-    inline unsigned count() { return count(m_head, m_tail); }
-    void push(T data)
+
+public:
+    inline RingBuffer() { reset(); }
+
+    // producer
+    inline T* reserve() { return m_buffer[m_head & (N - 1)]; }
+    bool commit()
     {
-        // add new data to head, check for overflow.
-        unsigned new_head = m_head + 1;
-        if (new_head >= N)
-            new_head = 0;
-        if (new_head != m_tail)
+        unsigned head = m_head;
+        unsigned used = head - __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE);
+        if (used >= N - 1)
         {
-            m_buffer[m_head] = data;
-            m_head = new_head;
+            __atomic_store_n(&m_overflows, m_overflows + 1, __ATOMIC_RELAXED);
+            return false;
         }
+        __atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+        if (used + 1 > m_highWater)
+            __atomic_store_n(&m_highWater, used + 1, __ATOMIC_RELAXED);
+        return true;
+    }
+    inline bool push(T data)
+    {
+        reserve()[0] = data;
+        return commit();
     }
+
+    // consumer
+    inline unsigned count() { return __atomic_load_n(&m_head, __ATOMIC_ACQUIRE) - m_tail; }
+    inline T* tail() { return m_buffer[m_tail & (N - 1)]; }
+    inline T* peek(unsigned i) { return m_buffer[(m_tail + i) & (N - 1)]; }   // i < count()
+    inline void advanceTail() { __atomic_store_n(&m_tail, m_tail + 1, __ATOMIC_RELEASE); }
+    inline void discard() { __atomic_store_n(&m_tail, __atomic_load_n(&m_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE); }
     T fetch()
     {
         // grab new data from tail, no check for underflow.
-        T result = m_buffer[m_tail++];
-        if (m_tail >= N)
-            m_tail = 0;
+        T result = tail()[0];
+        advanceTail();
         return result;
     }
-    inline T* head() { return &m_buffer[m_head]; }
-    inline T* tail() { return &m_buffer[m_tail]; }
-    void advanceHead(unsigned move)
+
+    // statistics
+    inline UInt32 overflows() { return __atomic_load_n(&m_overflows, __ATOMIC_RELAXED); }
+    inline UInt32 highWater() { return __atomic_load_n(&m_highWater, __ATOMIC_RELAXED); }
+    void publishStats(IORegistryEntry* entry, const char* key)
+    {
+        // (consumer side) only touches the registry when something changed
+        UInt32 overflowCount = overflows();
+        UInt32 highWaterMark = highWater();
+        if (overflowCount == m_publishedOverflows && highWaterMark == m_publishedHighWater)
+            return;
+        m_publishedOverflows = overflowCount;
+        m_publishedHighWater = highWaterMark;
+        if (OSDictionary* dict = OSDictionary::withCapacity(3))
+        {
+            setPropertyNumber(dict, "Capacity", N - 1, 32);
+            setPropertyNumber(dict, "HighWater", highWaterMark, 32);
+            setPropertyNumber(dict, "Overflows", overflowCount, 32);
+            entry->setProperty(key, dict);
+            dict->release();
+        }
+    }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// QueueingDelay
+//
+// Pointing drivers stamp each packet with the arrival time of its first byte
+// and report events with that time.  This keeps track of how long packets
+// waited for the work loop before being dispatched: a running mean (each new
+// sample weighs 1/16) and the maximum, published at most once a second.
+//
+
+#define kQueueingDelay              "Queueing Delay"
+
+class QueueingDelay
+{
+private:
+    UInt64 m_mean;              // microseconds << 4
+    UInt32 m_max;               // microseconds
+    UInt32 m_count;
+    UInt32 m_publishedCount;
+    uint64_t m_publishTime;
+
+public:
+    inline QueueingDelay() { reset(); }
+    void reset()
+    {
+        m_mean = 0;
+        m_max = 0;
+        m_count = 0;
+        m_publishedCount = ~0U;
+        m_publishTime = 0;
+    }
+    void record(uint64_t arrival)
+    {
+        uint64_t now, ns;
+        clock_get_uptime(&now);
+        if (!arrival || arrival > now)
+            return;
+        absolutetime_to_nanoseconds(now - arrival, &ns);
+        UInt64 us = ns / 1000;
+        m_mean = m_count ? m_mean - (m_mean >> 4) + us : us << 4;
+        if (us > m_max)
+            m_max = us > 0xFFFFFFFF ? 0xFFFFFFFF : (UInt32)us;
+        m_count++;
+    }
+    void publish(IORegistryEntry* entry)
+    {
+        uint64_t now, ns;
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - m_publishTime, &ns);
+        if (m_count == m_publishedCount || ns < 1000000000ULL)
+            return;
+        m_publishedCount = m_count;
+        m_publishTime = now;
+        if (OSDictionary* dict = OSDictionary::withCapacity(3))
+        {
+            setPropertyNumber(dict, "Count", m_count, 32);
+            setPropertyNumber(dict, "Mean (us)", m_mean >> 4, 32);
+            setPropertyNumber(dict, "Max (us)", m_max, 32);
+            entry->setProperty(kQueueingDelay, dict);
+            dict->release();
+        }
+    }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// ReportRate
+//
+// State of an adaptive report rate: the device runs at its high rate while
+// there is motion and drops to its low rate after an idle timeout.  The
+// driver reprograms the device when active() or idle() says so and drives
+// idle() from a timer; this only keeps the state and the time spent at
+// each rate.  All times are in nanoseconds.
+//
+// Switches are queued without blocking, one at a time: request() hands out
+// the rate to program when the device is not at the wanted one, and the
+// request's completion reports back through complete(), which tells the
+// driver to retry a failed switch or, failing again, to give up (and bring
+// the device back, which the failed sequence may have left disabled).  The
+// rate the device runs at changes on success only.
+//
+
+#define kReportRateStatistics       "Report Rate Statistics"
+#define kReportRateRetries          1
+
+class ReportRate
+{
+public:
+    enum { kLow, kHigh, kCount };
+
+private:
+    int m_rate;                     // wanted
+    int m_device;                   // programmed
+    int m_requested;                // in flight
+    bool m_pending;
+    bool m_stopped;
+    unsigned m_retries;
+    uint64_t m_lastActivity;
+    uint64_t m_since;               // entered the current rate
+    uint64_t m_time[kCount];
+    UInt32 m_switches;
+
+    void enter(int rate, uint64_t now)
+    {
+        m_time[m_rate] += now - m_since;
+        m_since = now;
+        m_rate = rate;
+        m_switches++;
+    }
+
+public:
+    enum { kDone, kRetry, kFailed };
+
+    inline ReportRate() : m_pending(false), m_stopped(false), m_retries(0) { reset(kHigh, 0); }
+    void reset(int rate, uint64_t now)
+    {
+        m_rate = m_device = m_requested = rate;
+        m_lastActivity = m_since = now;
+        m_time[kLow] = m_time[kHigh] = 0;
+        m_switches = 0;
+    }
+    inline int rate() const { return m_rate; }
+    // device was (re)programmed to 'rate' outside of active()/idle(), or
+    // is to be ('programmed' false: its rate is unknown, request() hands out
+    // 'rate' next)
+    void sync(int rate, uint64_t now, bool programmed = true)
+    {
+        if (!m_since)
+        {
+            reset(rate, now);
+            m_device = programmed ? rate : kCount;
+            return;
+        }
+        m_lastActivity = now;
+        m_device = programmed ? rate : kCount;
+        if (rate != m_rate)
+            enter(rate, now);
+    }
+    inline int device() const { return m_device; }
+    inline int requested() const { return m_requested; }
+
+    // the rate to program, if a switch is due and none is in flight
+    bool request(int& rate)
+    {
+        if (m_pending || m_stopped || m_rate == m_device)
+            return false;
+        m_pending = true;
+        rate = m_requested = m_rate;
+        return true;
+    }
+    // the switch handed out by request() is done
+    int complete(bool ok, uint64_t now)
+    {
+        if (ok)
+        {
+            m_device = m_requested;
+            m_retries = 0;
+            m_pending = false;
+            return kDone;
+        }
+        if (!m_stopped && m_retries < kReportRateRetries)
+        {
+            m_retries++;
+            return kRetry;
+        }
+        // back in step with the device
+        m_retries = 0;
+        m_pending = false;
+        if (m_device < kCount && m_rate != m_device)
+            enter(m_device, now);
+        return kFailed;
+    }
+    // no more switches (the driver is stopping)
+    inline void stop() { m_stopped = true; }
+    inline bool stopped() const { return m_stopped; }
+
+    // motion seen: true if the device has to go to the high rate
+    bool active(uint64_t now)
+    {
+        m_lastActivity = now;
+        if (m_rate == kHigh)
+            return false;
+        enter(kHigh, now);
+        return true;
+    }
+    // idle timer: true if the device has to drop to the low rate, otherwise
+    // 'remaining' is when to check again (0 if already low)
+    bool idle(uint64_t now, uint64_t timeout, uint64_t& remaining)
+    {
+        remaining = 0;
+        if (m_rate == kLow)
+            return false;
+        uint64_t quiet = now - m_lastActivity;
+        if (quiet < timeout)
+        {
+            remaining = timeout - quiet;
+            return false;
+        }
+        enter(kLow, now);
+        return true;
+    }
+
+    void publish(IORegistryEntry* entry, UInt32 lowRate, UInt32 highRate, uint64_t now) const
+    {
+        uint64_t time[kCount] = { m_time[kLow], m_time[kHigh] };
+        time[m_rate] += now - m_since;
+        if (OSDictionary* dict = OSDictionary::withCapacity(6))
+        {
+            setPropertyNumber(dict, "Low Rate", lowRate, 32);
+            setPropertyNumber(dict, "High Rate", highRate, 32);
+            setPropertyNumber(dict, "Current Rate", m_rate == kHigh ? highRate : lowRate, 32);
+            setPropertyNumber(dict, "Time at Low Rate (ms)", time[kLow] / 1000000, 64);
+            setPropertyNumber(dict, "Time at High Rate (ms)", time[kHigh] / 1000000, 64);
+            setPropertyNumber(dict, "Switches", m_switches, 32);
+            entry->setProperty(kReportRateStatistics, dict);
+            dict->release();
+        }
+    }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// LatencyStats
+//
+// Per-stage input latency, from the first byte of a packet arriving at
+// interrupt time to the event it produces being handed to the HID/VoodooInput
+// client:
+//
+//   IRQ to push        first byte of the packet until commit() into the ring
+//   Push to drain      queued in the ring until packetReady() picks it up
+//   Drain to parse     decoding the packet
+//   Parse to dispatch  handing the decoded event to the client
+//   IRQ to dispatch    the whole path
+//
+// The producer side (packetStarted/packetQueued) only takes timestamps and
+// passes them through a small FIFO next to the packet ring; everything
+// else, including the histograms, lives on the work loop.  Each stage is a
+// histogram of power-of-two microsecond buckets, so p50/p99 are reported
+// as bucket upper bounds and Max is exact.
+//
+// Only packets that produce an event are recorded, once, when the first of
+// their events is delivered (packetDispatched from the dispatch wrappers).
+// A frame held back for coalescing keeps the stamps of its packet
+// (packetHeld) until it is delivered (heldDispatched) or replaced, and
+// events after the drain (timers) belong to no packet.
+//
+// Set PS2_LATENCY_STATS to 0 to compile all of this out.
+
+#ifndef PS2_LATENCY_STATS
+#define PS2_LATENCY_STATS 1
+#endif
+
+#define kLatencyStatistics          "Latency Statistics"
+#define kResetLatencyStatistics     "ResetLatencyStatistics"
+
+#if PS2_LATENCY_STATS
+
+class LatencyHistogram
+{
+    enum { kBuckets = 24 };     // bucket b holds [2^(b-1), 2^b) us, last one is open
+
+private:
+    UInt32 m_buckets[kBuckets];
+    UInt32 m_count;
+    UInt32 m_max;               // microseconds
+
+    UInt32 percentile(unsigned pct) const
+    {
+        UInt32 rank = (UInt32)(((UInt64)m_count * pct + 99) / 100);
+        UInt32 seen = 0;
+        for (unsigned b = 0; b < kBuckets; b++)
+        {
+            seen += m_buckets[b];
+            if (seen >= rank)
+                return b == kBuckets - 1 || (1U << b) > m_max ? m_max : 1U << b;
+        }
+        return m_max;
+    }
+
+public:
+    inline LatencyHistogram() { reset(); }
+    inline void reset() { bzero(this, sizeof(*this)); }
+    inline UInt32 count() const { return m_count; }
+    void record(uint64_t abs)
+    {
+        uint64_t ns;
+        absolutetime_to_nanoseconds(abs, &ns);
+        UInt64 us = ns / 1000;
+        unsigned b = us ? 64 - __builtin_clzll(us) : 0;
+        if (b >= kBuckets)
+            b = kBuckets - 1;
+        m_buckets[b]++;
+        m_count++;
+        if (us > m_max)
+            m_max = us > 0xFFFFFFFF ? 0xFFFFFFFF : (UInt32)us;
+    }
+    void publish(OSDictionary* parent, const char* key) const
+    {
+        if (OSDictionary* dict = OSDictionary::withCapacity(4))
+        {
+            setPropertyNumber(dict, "Count", m_count, 32);
+            setPropertyNumber(dict, "P50 (us)", m_count ? percentile(50) : 0, 32);
+            setPropertyNumber(dict, "P99 (us)", m_count ? percentile(99) : 0, 32);
+            setPropertyNumber(dict, "Max (us)", m_max, 32);
+            parent->setObject(key, dict);
+            dict->release();
+        }
+    }
+};
+
+class LatencyStats
+{
+    enum { kLS_Interrupt, kLS_Queued, kLS_Parse, kLS_Dispatch, kLS_Total, kLS_Count };
+    struct Stamp { uint64_t irq, push; };
+    struct Packet
+    {
+        Stamp stamp;
+        uint64_t drain;
+        uint64_t parse;
+        bool pending;           // not recorded yet
+    };
+
+private:
+    RingBuffer<Stamp, 32> m_stamps;
+    uint64_t m_irq;             // producer: first byte of the packet being built
+    Packet m_current;           // consumer: the packet being handled
+    Packet m_held;              // consumer: the packet of a held back frame
+    LatencyHistogram m_stage[kLS_Count];
+    UInt32 m_publishedCount;
+    uint64_t m_publishTime;
+
+    void record(Packet& packet)
+    {
+        if (!packet.pending)
+            return;
+        packet.pending = false;
+        uint64_t now;
+        clock_get_uptime(&now);
+        if (packet.parse)
+        {
+            m_stage[kLS_Parse].record(packet.parse - packet.drain);
+            m_stage[kLS_Dispatch].record(now - packet.parse);
+        }
+        else
+            m_stage[kLS_Parse].record(now - packet.drain);
+        if (packet.stamp.push)
+        {
+            m_stage[kLS_Interrupt].record(packet.stamp.push - packet.stamp.irq);
+            m_stage[kLS_Queued].record(packet.drain - packet.stamp.push);
+            m_stage[kLS_Total].record(now - packet.stamp.irq);
+        }
+    }
+
+public:
+    inline LatencyStats() : m_irq(0)
+    {
+        bzero(&m_current, sizeof(m_current));
+        bzero(&m_held, sizeof(m_held));
+        reset();
+    }
+    void reset()
+    {
+        // (consumer side) clears the histograms only, packets in flight keep their stamps
+        for (unsigned i = 0; i < kLS_Count; i++)
+            m_stage[i].reset();
+        m_publishedCount = ~0U;
+        m_publishTime = 0;
+    }
+
+    // producer (interrupt time)
+    inline void packetStarted() { clock_get_uptime(&m_irq); }
+    void packetQueued()
+    {
+        // call for every successful commit() so the stamps stay in step
+        Stamp stamp;
+        clock_get_uptime(&stamp.push);
+        stamp.irq = m_irq ? m_irq : stamp.push;
+        m_irq = 0;
+        m_stamps.push(stamp);
+    }
+    // consumer: the packet ring buffer was discarded
+    inline void discardPackets() { m_stamps.discard(); }
+
+    // consumer (work loop)
+    void packetDrained()
     {
-        // advance head by specified amount, check for overflow
-        unsigned new_head = m_head + move;
-        if (new_head >= N)
-            new_head -= N;
-        if (count(new_head, m_tail) >= count())
-            m_head = new_head;
+        clock_get_uptime(&m_current.drain);
+        m_current.parse = 0;
+        m_current.pending = true;
+        if (m_stamps.count())
+            m_current.stamp = m_stamps.fetch();
+        else
+            m_current.stamp.irq = m_current.stamp.push = 0;
     }
-    void advanceTail(unsigned move)
+    inline void packetParsed() { if (m_current.pending && !m_current.parse) clock_get_uptime(&m_current.parse); }
+    // an event of the packet being handled went to the client
+    inline void packetDispatched() { record(m_current); }
+    // the packet's event is held back; replaces (drops) a frame held before
+    inline void packetHeld() { m_held = m_current; m_current.pending = false; }
+    // the held back frame went to the client
+    inline void heldDispatched() { record(m_held); }
+
+    void publish(IORegistryEntry* entry)
     {
-        // advance tail by specified amount, no check for underflow.
-        m_tail += move;
-        if (m_tail >= N)
-            m_tail -= N;
+        // (end of the drain)
+        m_current.pending = false;
+        // refreshed at most once a second, and only when something was recorded
+        uint64_t now, ns;
+        clock_get_uptime(&now);
+        absolutetime_to_nanoseconds(now - m_publishTime, &ns);
+        if (m_stage[kLS_Parse].count() == m_publishedCount || ns < 1000000000ULL)
+            return;
+        m_publishedCount = m_stage[kLS_Parse].count();
+        m_publishTime = now;
+        if (OSDictionary* dict = OSDictionary::withCapacity(kLS_Count))
+        {
+            m_stage[kLS_Interrupt].publish(dict, "IRQ to push");
+            m_stage[kLS_Queued].publish(dict, "Push to drain");
+            m_stage[kLS_Parse].publish(dict, "Drain to parse");
+            m_stage[kLS_Dispatch].publish(dict, "Parse to dispatch");
+            m_stage[kLS_Total].publish(dict, "IRQ to dispatch");
+            entry->setProperty(kLatencyStatistics, dict);
+            dict->release();
+        }
     }
 };
 
+#else
+
+class LatencyStats
+{
+public:
+    inline void reset() {}
+    inline void packetStarted() {}
+    inline void packetQueued() {}
+    inline void discardPackets() {}
+    inline void packetDrained() {}
+    inline void packetParsed() {}
+    inline void packetDispatched() {}
+    inline void packetHeld() {}
+    inline void heldDispatched() {}
+    inline void publish(IORegistryEntry*) {}
+};
+
+#endif // PS2_LATENCY_STATS
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // PS/2 Command Primitives
 //
@@ -270,6 +764,26 @@ public:
 //    o  Description: Writes the byte in the In Field to the command port (64h).
 //    o  In Field:    Holds byte that should be written.
 //
+// o  kPS2C_TryCommands:
+//    o  Description: The next skipCount commands form a group.  If one of
+//                    them fails, the rest of the group is skipped and the
+//                    request carries on after the group instead of being
+//                    aborted.  The Out Fields of the group's read commands
+//                    are cleared to zero.  Groups do not nest.
+//    o  In Field:    skipCount holds the number of commands in the group.
+//    o  Out Field:   failedAt is 0 if the group succeeded, otherwise the
+//                    position of the failed command relative to this one.
+//
+// o  kPS2C_SkipUnlessBitsSet, kPS2C_SkipUnlessEqual:
+//    o  Description: Tests the Out Field of the earlier command testIndex,
+//                    masked with testMask.  Unless any bit is set (or the
+//                    result equals testValue), the next skipCount commands
+//                    are skipped.  Commands that never ran read as zero, as
+//                    long as the request was zero initialized.
+//    o  In Field:    skipCount, testIndex, testMask and testValue.
+//
+// PS2CommandBuilder (below) takes care of the indices for these.
+//
 
 enum PS2CommandEnum
 {
@@ -283,6 +797,9 @@ enum PS2CommandEnum
   kPS2C_FlushDataPort,
   kPS2C_SleepMS,
   kPS2C_ModifyCommandByte,
+  kPS2C_TryCommands,
+  kPS2C_SkipUnlessBitsSet,
+  kPS2C_SkipUnlessEqual,
 };
 typedef enum PS2CommandEnum PS2CommandEnum;
 
@@ -299,6 +816,17 @@ struct PS2Command
           UInt8 clearBits;
           UInt8 oldBits;
       };
+      struct
+      {
+          UInt8 skipCount;
+          UInt8 testIndex;
+          UInt8 testMask;
+          union
+          {
+              UInt8 testValue;
+              UInt8 failedAt;
+          };
+      };
   };
 };
 typedef struct PS2Command PS2Command;
@@ -398,6 +926,21 @@ typedef struct PS2Command PS2Command;
 
 typedef void (*PS2CompletionAction)(void * target, void * param);
 
+//
+// Request priorities (PS2Request::priority).  Queued requests are started
+// highest priority first, and in submission order within a priority.  Only
+// give a request a priority other than kPS2RP_Normal if it stands on its
+// own: a sequence split over several requests must keep one priority.
+//
+
+enum PS2RequestPriority
+{
+    kPS2RP_Input,       // input critical, eg. re-enabling a device after wake
+    kPS2RP_Normal,      // default
+    kPS2RP_Cosmetic,    // LEDs: can wait for everything else
+    kPS2RP_Count
+};
+
 struct PS2Request
 {
     friend class ApplePS2Controller;
@@ -407,11 +950,14 @@ protected:
     static void* operator new(size_t); // "hide" it
     static inline void* operator new(size_t, int max)
         { return ::operator new(sizeof(PS2Request) + sizeof(PS2Command)*max); }
+    static inline void* operator new(size_t, void* block)
+        { return block; }
     static inline void operator delete(void*p)
         { ::operator delete(p); }
 
 public:
     UInt8               commandsCount;
+    UInt8               priority;           // PS2RequestPriority
     void *              completionTarget;
     PS2CompletionAction completionAction;
     void *              completionParam;
@@ -439,6 +985,130 @@ public:
     PS2Command          commands[max];
 };
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// PS2CommandBuilder
+//
+// Composes a whole command sequence (a device init, a series of queries)
+// into one request, so that it is submitted and executed in a single pass
+// instead of one submitRequestAndBlock per step.
+//
+// Each append returns the index of the new command; after completion, the
+// result of a read is at that index.  tryBegin() and the skipUnless...()
+// calls open a block (see kPS2C_TryCommands and kPS2C_SkipUnlessBitsSet),
+// which end() closes.  Appending beyond the capacity of the request is not
+// done, but remembered: finish() then returns false.
+//
+//      TPS2Request<40> request;
+//      PS2CommandBuilder program(request);
+//      unsigned group = program.tryBegin();
+//      program.mouseCommand(kDP_GetId);
+//      unsigned id = program.read();
+//      program.end(group);
+//      if (program.finish())
+//      {
+//          _device->submitRequestAndBlock(&request);
+//          if (program.succeeded(group))
+//              ... program.result(id) ...
+//      }
+//
+
+class PS2CommandBuilder
+{
+    enum { kNotRun = 0xFF };    // failedAt of a group that was skipped
+
+private:
+    PS2Request* m_request;
+    PS2Command* m_commands;
+    unsigned    m_max;
+    unsigned    m_count;
+    bool        m_overflow;
+
+public:
+    template<int max> PS2CommandBuilder(TPS2Request<max>& request)
+        : m_request(&request), m_commands(request.commands), m_max(max), m_count(0), m_overflow(false) {}
+    PS2CommandBuilder(PS2Request* request, unsigned max)
+        : m_request(request), m_commands(request->commands), m_max(max), m_count(0), m_overflow(false) {}
+
+    unsigned add(PS2CommandEnum command, UInt8 inOrOut = 0)
+    {
+        if (m_count >= m_max || m_count >= 0xFF)
+        {
+            m_overflow = true;
+            return 0;
+        }
+        m_commands[m_count].command = command;
+        m_commands[m_count].inOrOut32 = 0;
+        m_commands[m_count].inOrOut = inOrOut;
+        return m_count++;
+    }
+    inline unsigned mouseCommand(UInt8 command) { return add(kPS2C_SendMouseCommandAndCompareAck, command); }
+    inline unsigned read() { return add(kPS2C_ReadDataPort); }
+    unsigned sleep(UInt32 ms)
+    {
+        unsigned index = add(kPS2C_SleepMS);
+        if (!m_overflow)
+            m_commands[index].inOrOut32 = ms;
+        return index;
+    }
+    unsigned specialCommand(UInt8 arg)
+    {
+        // 4 set resolution commands, each encode 2 bits of the argument
+        unsigned index = m_count;
+        for (int shift = 6; shift >= 0; shift -= 2)
+        {
+            mouseCommand(kDP_SetMouseResolution);
+            mouseCommand((arg >> shift) & 0x3);
+        }
+        return index;
+    }
+
+    // blocks
+    unsigned tryBegin()
+    {
+        unsigned index = add(kPS2C_TryCommands);
+        if (!m_overflow)
+            m_commands[index].failedAt = kNotRun;
+        return index;
+    }
+    unsigned skipUnlessBitsSet(unsigned testIndex, UInt8 mask)
+    {
+        unsigned index = add(kPS2C_SkipUnlessBitsSet);
+        if (!m_overflow)
+        {
+            m_commands[index].testIndex = testIndex;
+            m_commands[index].testMask = mask;
+        }
+        return index;
+    }
+    unsigned skipUnlessEqual(unsigned testIndex, UInt8 mask, UInt8 value)
+    {
+        unsigned index = add(kPS2C_SkipUnlessEqual);
+        if (!m_overflow)
+        {
+            m_commands[index].testIndex = testIndex;
+            m_commands[index].testMask = mask;
+            m_commands[index].testValue = value;
+        }
+        return index;
+    }
+    inline void end(unsigned block)
+    {
+        if (!m_overflow)
+            m_commands[block].skipCount = m_count - block - 1;
+    }
+
+    inline bool finish()
+    {
+        m_request->commandsCount = m_count;
+        return !m_overflow;
+    }
+
+    // after completion
+    inline bool completed() const { return m_request->commandsCount == m_count; }
+    inline bool succeeded(unsigned group) const { return group < m_request->commandsCount && 0 == m_commands[group].failedAt; }
+    inline UInt8 result(unsigned index) const { return m_commands[index].inOrOut; }
+};
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // ApplePS2KeyboardDevice and ApplePS2MouseDevice Class Descriptions
 //
@@ -469,7 +1139,9 @@ public:
 // o  allocateRequest:
 //    o  Description:  Allocate a request structure, blocks until successful.
 //    o  Result:       Request structure pointer.
-//    o  Comments:     Request structure is guaranteed to be zeroed.
+//    o  Comments:     Request structure is guaranteed to be zeroed.  Requests
+//                     of up to kMaxCommands commands come from a preallocated
+//                     pool while it lasts, without touching the heap.
 //
 // o  freeRequest:
 //    o  Description:  Deallocate a request structure.
@@ -501,6 +1173,11 @@ typedef void (*PS2PacketAction)(void * target);
 // intercept power changes on the PS/2 controller, and to manage the device
 // accordingly.
 //
+// On wake, the keyboard and mouse actions may run at the same time on
+// different threads (see PARALLEL_WAKE).  An action that has to give its
+// device time to settle should use powerControlSleep rather than IOSleep,
+// so the other device's reinitialization is not held up meanwhile.
+//
 
 typedef void (*PS2PowerControlAction)(void * target, UInt32 whatToDo);
 
@@ -515,6 +1192,9 @@ typedef void (*PS2PowerControlAction)(void * target, UInt32 whatToDo);
 
 // Published property for devices to express interest in receiving messages
 #define kDeliverNotifications   "RM,deliverNotifications"
+// Optional array of the kPS2M_* codes (as passed to iokit_vendor_specific_msg)
+// a device wants, all of them if not present
+#define kNotificationTopics     "RM,notificationTopics"
 
 typedef void (*PS2MessageAction)(void* target, int message, void* data);
 
@@ -536,6 +1216,45 @@ typedef struct PS2KeyInfo
     bool    eatKey;
 } PS2KeyInfo;
 
+//
+// PS2KeyClock: time of the last key event that counts as typing for
+// "QuietTimeAfterTyping", owned by the controller.  The keyboard stores it
+// with a single atomic store, the mouse/trackpad drivers read it directly
+// in their packet handlers instead of waiting for kPS2M_notifyKeyPressed.
+// Padded so it shares its cache line with nothing else.
+//
+
+class PS2KeyClock
+{
+    UInt8 m_pad0[64];
+    uint64_t m_time;
+    UInt8 m_pad1[64 - sizeof(uint64_t)];
+
+public:
+    inline PS2KeyClock() : m_time(0) {}
+    inline void keyPressed(uint64_t time_ns) { __atomic_store_n(&m_time, time_ns, __ATOMIC_RELEASE); }
+    inline uint64_t lastKeyTime() const { return __atomic_load_n(&m_time, __ATOMIC_ACQUIRE); }
+
+    // modifier keys going down do not count (for example multi-click select)
+    static inline bool isTypingKey(UInt16 adbKeyCode, bool goingDown)
+    {
+        switch (adbKeyCode)
+        {
+            case 0x38:  // left shift
+            case 0x3c:  // right shift
+            case 0x3b:  // left control
+            case 0x3e:  // right control
+            case 0x3a:  // left windows (option)
+            case 0x3d:  // right windows
+            case 0x37:  // left alt (command)
+            case 0x36:  // right alt
+            case 0x3f:  // osx fn (function)
+                return !goingDown;
+        }
+        return true;
+    }
+};
+
 
 //
 // Enumeration of 'whatToDo' values passed to power control action.
@@ -594,9 +1313,11 @@ public:
 
     virtual void installPowerControlAction(OSObject *, PS2PowerControlAction);
     virtual void uninstallPowerControlAction();
+    virtual void powerControlSleep(UInt32 ms);
 
     // Messaging
     virtual void dispatchMessage(int message, void *data);
+    virtual PS2KeyClock* getKeyClock();
 
     // Exclusive access (command byte contention)
 
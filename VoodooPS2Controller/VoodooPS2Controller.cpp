@@ -27,6 +27,7 @@
 #include <IOKit/IOWorkLoop.h>
 #include <IOKit/IOCommandGate.h>
 #include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOUserClient.h>
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Winconsistent-missing-override"
@@ -102,7 +103,7 @@ void ApplePS2Controller::interruptHandlerKeyboard(OSObject*, void* refCon, IOSer
 
   // Verify that data is available on the controller's input port.
 
-  if ( ((status = inb(kCommandPort)) & kOutputReady) )
+  if ( ((status = ps2inb(kCommandPort)) & kOutputReady) )
   {
     // Verify that the data is keyboard data, otherwise call mouse handler.
     // This case should never really happen, but if it does, we handle it.
@@ -116,7 +117,7 @@ void ApplePS2Controller::interruptHandlerKeyboard(OSObject*, void* refCon, IOSer
       // Retrieve the keyboard data on the controller's input port.
 
       IODelay(kDataDelay);
-      key = inb(kDataPort);
+      key = ps2inb(kDataPort);
 
       // Call the debugger-key-sequence checking code (if a debugger sequence
       // completes, the debugger function will be invoked immediately within
@@ -176,15 +177,25 @@ void ApplePS2Controller::handleInterrupt(PS2DeviceType deviceType)
     
     bool wakeMouse = false;
     bool wakeKeyboard = false;
+#if INTERRUPT_DRIVEN_REQUESTS
+    bool wakeQueue = false;
+#endif
     while (1)
     {
         // while getting status and reading the port, no interrupts...
         bool enable = ml_set_interrupts_enabled(false);
+#if INTERRUPT_DRIVEN_REQUESTS
+        // ...and no request engine changing where the data goes
+        IOSimpleLockLock(_responseLock);
+#endif
         IODelay(kDataDelay);
-        UInt8 status = inb(kCommandPort);
+        UInt8 status = ps2inb(kCommandPort);
         if (!(status & kOutputReady))
         {
             // no data available, so break out and return
+#if INTERRUPT_DRIVEN_REQUESTS
+            IOSimpleLockUnlock(_responseLock);
+#endif
             ml_set_interrupts_enabled(enable);
             break;
         }
@@ -193,6 +204,9 @@ void ApplePS2Controller::handleInterrupt(PS2DeviceType deviceType)
         // do not process mouse data in watchdog timer
         if (deviceType == kDT_Watchdog && (status & kMouseData))
         {
+#if INTERRUPT_DRIVEN_REQUESTS
+            IOSimpleLockUnlock(_responseLock);
+#endif
             ml_set_interrupts_enabled(enable);
             break;
         }
@@ -200,17 +214,47 @@ void ApplePS2Controller::handleInterrupt(PS2DeviceType deviceType)
         
         // read the data
         IODelay(kDataDelay);
-        UInt8 data = inb(kDataPort);
+        UInt8 data = ps2inb(kDataPort);
         
+#if INTERRUPT_DRIVEN_REQUESTS
+        // A request waiting on this input stream takes the byte.  Anything
+        // else goes on its driver's feed while the lock still keeps it in
+        // port order; the driver itself runs with the lock released and
+        // interrupts enabled again.
+        PS2DeviceType deviceType = (status & kMouseData) ? kDT_Mouse : kDT_Keyboard;
+        bool response = routeResponseByte(status, data);
+        if (!response)
+            queueDriverByte(deviceType, data);
+        IOSimpleLockUnlock(_responseLock);
+        ml_set_interrupts_enabled(enable);
+        if (response)
+        {
+            wakeQueue = true;
+            continue;
+        }
+#else
         // now ok for interrupts, we have read status, and found data...
         // (it does not matter [too much] if keyboard data is delivered out of order)
         ml_set_interrupts_enabled(enable);
+#endif
         
 #if WATCHDOG_TIMER
         //REVIEW: remove this debug eventually...
         if (deviceType == kDT_Watchdog)
             IOLog("%s:handleInterrupt(kDT_Watchdog): %s = %02x\n", getName(), status & kMouseData ? "mouse" : "keyboard", data);
 #endif
+#if INTERRUPT_DRIVEN_REQUESTS
+        // Dispatch the feed to the driver (unless someone else already is).
+        if (feedDriver(deviceType))
+        {
+            if (kDT_Mouse == deviceType)
+                wakeMouse = true;
+            else
+                wakeKeyboard = true;
+        }
+#else
+        if (liveInputHeld())
+            continue;
         if (status & kMouseData)
         {
             // Dispatch the data to the mouse driver.
@@ -223,6 +267,7 @@ void ApplePS2Controller::handleInterrupt(PS2DeviceType deviceType)
             if (kPS2IR_packetReady == _dispatchDriverInterrupt(kDT_Keyboard, data))
                 wakeKeyboard = true;
         }
+#endif
     } // while (forever)
     
     // wake up workloop based mouse interrupt source if needed
@@ -231,6 +276,11 @@ void ApplePS2Controller::handleInterrupt(PS2DeviceType deviceType)
     // wake up workloop based keyboard interrupt source if needed
     if (wakeKeyboard)
         _interruptSourceKeyboard->interruptOccurred(0, 0, 0);
+#if INTERRUPT_DRIVEN_REQUESTS
+    // wake up the request engine if a response byte arrived
+    if (wakeQueue)
+        _interruptSourceQueue->interruptOccurred(0, 0, 0);
+#endif
 }
 
 #else // HANDLE_INTERRUPT_DATA_LATER
@@ -243,7 +293,7 @@ void ApplePS2Controller::handleInterrupt(PS2DeviceType deviceType)
     
     UInt8 status;
     IODelay(kDataDelay);
-    while ((status = inb(kCommandPort)) & kOutputReady)
+    while ((status = ps2inb(kCommandPort)) & kOutputReady)
     {
 #if WATCHDOG_TIMER
         if (deviceType == kDT_Watchdog && (status & kMouseData))
@@ -251,11 +301,17 @@ void ApplePS2Controller::handleInterrupt(PS2DeviceType deviceType)
 #endif
         
         IODelay(kDataDelay);
-        UInt8 data = inb(kDataPort);
+        UInt8 data = ps2inb(kDataPort);
 #if WATCHDOG_TIMER
         //REVIEW: remove this debug eventually...
         if (deviceType == kDT_Watchdog)
             IOLog("%s:handleInterrupt(kDT_Watchdog): %s = %02x\n", getName(), status & kMouseData ? "mouse" : "keyboard", data);
+#endif
+#if INTERRUPT_DRIVEN_REQUESTS
+        // (already on the work loop, so no need for _responseLock here)
+        if (routeResponseByte(status, data))
+            _interruptSourceQueue->interruptOccurred(0, 0, 0);
+        else
 #endif
         dispatchDriverInterrupt(status & kMouseData ? kDT_Mouse : kDT_Keyboard, data);
         IODelay(kDataDelay);
@@ -293,6 +349,10 @@ bool ApplePS2Controller::init(OSDictionary* dict)
   _cmdbyteLock = IOLockAlloc();
   if (!_cmdbyteLock)
       return false;
+  if (!_requestPool.init())
+      return false;
+  if (!_notificationBus.init())
+      return false;
 
   _workLoop                = 0;
 
@@ -327,16 +387,52 @@ bool ApplePS2Controller::init(OSDictionary* dict)
     
   _wakedelay = 10;
   _mouseWakeFirst = false;
+#if PARALLEL_WAKE
+  _parallelWake = true;
+  _wakeParallelActive = false;
+  _wakeMousePending = false;
+  _wakeMouseThreadCall = 0;
+#endif
+#if PACKET_CAPTURE
+  _captureRing = 0;
+  _captureHead = 0;
+  _capturing = false;
+  _captureKeyboard = false;
+  _captureStart = 0;
+  _replayTimer = 0;
+  _replayTrace = 0;
+  _replayIndex = 0;
+  _replaySpeed = 1;
+  _replayStart = 0;
+  _replaying = false;
+#endif
+  _wakeTime = 0;
+  _wakeProbeTime = 0;
+  _wakeReinitTime[kDT_Keyboard] = _wakeReinitTime[kDT_Mouse] = 0;
+  _wakeFirstEventTime[kDT_Keyboard] = _wakeFirstEventTime[kDT_Mouse] = 0;
+  _wakeFirstEventPending[kDT_Keyboard] = _wakeFirstEventPending[kDT_Mouse] = false;
   _cmdGate = 0;
-    
-  _requestQueueLock = 0;
+  _notificationStatsTimer = 0;
+  _notificationStatsPending = false;
 
 #if WATCHDOG_TIMER
   _watchdogTimer = 0;
+#endif
+#if INTERRUPT_DRIVEN_REQUESTS
+  _requestTimer = 0;
+  _responseStream = kResponseStreamNone;
+  _activeRequest = 0;
+  _activeWait = kRW_None;
+  _activeDraining = false;
+  _requestWaiters = 0;
+  _driverFeedOwner[kDT_Keyboard] = _driverFeedOwner[kDT_Mouse] = 0;
+
+  _responseLock = IOSimpleLockAlloc();
+  if (!_responseLock)
+      return false;
 #endif
   _rmcfCache = 0;
     
-  queue_init(&_requestQueue);
 
   _currentPowerState = kPS2PowerStateNormal;
   
@@ -353,8 +449,6 @@ bool ApplePS2Controller::init(OSDictionary* dict)
   if (!_controllerLock) return false;
 #endif //DEBUGGER_SUPPORT
     
-  _notificationServices = OSSet::withCapacity(1);
-    
   return true;
 }
 
@@ -383,12 +477,28 @@ void ApplePS2Controller::free(void)
         IOLockFree(_cmdbyteLock);
         _cmdbyteLock = 0;
     }
+    _requestPool.free();
+    _notificationBus.free();
+#if PACKET_CAPTURE
+    if (_captureRing)
+    {
+        IOFree(_captureRing, sizeof(UInt64) * kCaptureRecords);
+        _captureRing = 0;
+    }
+#endif
 #if DEBUGGER_SUPPORT
     if (_controllerLock)
     {
         IOSimpleLockFree(_controllerLock);
         _controllerLock = 0;
     }
+#endif
+#if INTERRUPT_DRIVEN_REQUESTS
+    if (_responseLock)
+    {
+        IOSimpleLockFree(_responseLock);
+        _responseLock = 0;
+    }
 #endif
     super::free();
 }
@@ -413,15 +523,49 @@ IOReturn ApplePS2Controller::setPropertiesGated(OSObject* props)
         _mouseWakeFirst = flag->isTrue();
         setProperty("MouseWakeFirst", _mouseWakeFirst);
     }
+#if PACKET_CAPTURE
+    // start/stop capture, replay a trace (same format as the capture dump)
+    if (OSBoolean* flag = OSDynamicCast(OSBoolean, dict->getObject("PacketCaptureKeyboard")))
+    {
+        _captureKeyboard = flag->isTrue();
+        setProperty("PacketCaptureKeyboard", _captureKeyboard);
+    }
+    if (OSBoolean* flag = OSDynamicCast(OSBoolean, dict->getObject("PacketCapture")))
+        setPacketCapture(flag->isTrue());
+    if (OSBoolean* flag = OSDynamicCast(OSBoolean, dict->getObject("DumpPacketCapture")))
+        if (flag->isTrue())
+            publishPacketCapture();
+    if (OSData* trace = OSDynamicCast(OSData, dict->getObject("ReplayPacketCapture")))
+    {
+        OSNumber* num = OSDynamicCast(OSNumber, dict->getObject("ReplaySpeed"));
+        startPacketReplay(trace, num ? num->unsigned32BitValue() : 1);
+    }
+    if (OSBoolean* flag = OSDynamicCast(OSBoolean, dict->getObject("StopPacketReplay")))
+        if (flag->isTrue())
+            stopPacketReplay(true);
+#endif
+#if PARALLEL_WAKE
+    // get parallelWake
+    if (OSBoolean* flag = OSDynamicCast(OSBoolean, dict->getObject("ParallelWake")))
+    {
+        _parallelWake = flag->isTrue();
+        setProperty("ParallelWake", _parallelWake);
+    }
+#endif
     return kIOReturnSuccess;
 }
 
 IOReturn ApplePS2Controller::setProperties(OSObject* props)
 {
+    // (packet capture records input, replay injects it)
+    IOReturn result = IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator);
+    if (kIOReturnSuccess != result)
+        return result;
+
     if (_cmdGate)
     {
         // syncronize through workloop...
-        IOReturn result = _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePS2Controller::setPropertiesGated), props);
+        result = _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePS2Controller::setPropertiesGated), props);
         if (kIOReturnSuccess != result)
             return result;
     }
@@ -439,10 +583,10 @@ void ApplePS2Controller::resetController(void)
     writeCommandPort(kCP_DisableKeyboardClock);
     writeCommandPort(kCP_DisableMouseClock);
     // Flush any data
-    while ( inb(kCommandPort) & kOutputReady )
+    while ( ps2inb(kCommandPort) & kOutputReady )
     {
         IODelay(kDataDelay);
-        inb(kDataPort);
+        ps2inb(kDataPort);
         IODelay(kDataDelay);
     }
     writeCommandPort(kCP_EnableMouseClock);
@@ -489,10 +633,10 @@ void ApplePS2Controller::resetController(void)
     // the work loop.
     //
     
-    while ( inb(kCommandPort) & kOutputReady )
+    while ( ps2inb(kCommandPort) & kOutputReady )
     {
         IODelay(kDataDelay);
-        inb(kDataPort);
+        ps2inb(kDataPort);
         IODelay(kDataDelay);
     }
 }
@@ -566,13 +710,6 @@ bool ApplePS2Controller::start(IOService * provider)
     
   resetController();
 
-  //
-  // Use a spin lock to protect the client async request queue.
-  //
-
-  _requestQueueLock = IOLockAlloc();
-  if (!_requestQueueLock) goto fail;
-
   //
   // Initialize our work loop, our command gate, and our interrupt event
   // sources.  The work loop can accept requests after this step.
@@ -593,11 +730,24 @@ bool ApplePS2Controller::start(IOService * provider)
   _interruptSourceQueue    = IOInterruptEventSource::interruptEventSource( this,
 			OSMemberFunctionCast(IOInterruptEventAction, this, &ApplePS2Controller::processRequestQueue));
   _cmdGate = IOCommandGate::commandGate(this);
+  _notificationStatsTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2Controller::onNotificationStatsTimer));
+  if (!_notificationStatsTimer)
+    goto fail;
 #if WATCHDOG_TIMER
   _watchdogTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2Controller::onWatchdogTimer));
   if (!_watchdogTimer)
     goto fail;
 #endif
+#if INTERRUPT_DRIVEN_REQUESTS
+  _requestTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2Controller::onRequestTimer));
+  if (!_requestTimer)
+    goto fail;
+#endif
+#if PACKET_CAPTURE
+  _replayTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2Controller::onReplayTimer));
+  if (!_replayTimer)
+    goto fail;
+#endif
     
   if ( !_workLoop                ||
        !_interruptSourceMouse    ||
@@ -609,11 +759,21 @@ bool ApplePS2Controller::start(IOService * provider)
     goto fail;
   if ( _workLoop->addEventSource(_cmdGate) != kIOReturnSuccess )
     goto fail;
+  if ( _workLoop->addEventSource(_notificationStatsTimer) != kIOReturnSuccess )
+    goto fail;
     
 #if WATCHDOG_TIMER
   if ( _workLoop->addEventSource(_watchdogTimer) != kIOReturnSuccess )
     goto fail;
   _watchdogTimer->setTimeoutMS(kWatchdogTimerInterval);
+#endif
+#if INTERRUPT_DRIVEN_REQUESTS
+  if ( _workLoop->addEventSource(_requestTimer) != kIOReturnSuccess )
+    goto fail;
+#endif
+#if PACKET_CAPTURE
+  if ( _workLoop->addEventSource(_replayTimer) != kIOReturnSuccess )
+    goto fail;
 #endif
   _interruptSourceQueue->enable();
 
@@ -628,6 +788,13 @@ bool ApplePS2Controller::start(IOService * provider)
                            (thread_call_param_t) this );
   if ( !_powerChangeThreadCall )
     goto fail;
+#if PARALLEL_WAKE
+  _wakeMouseThreadCall = thread_call_allocate(
+                         (thread_call_func_t)  wakeMouseCallout,
+                         (thread_call_param_t) this );
+  if ( !_wakeMouseThreadCall )
+    goto fail;
+#endif
 
   //
   // Initialize our PM superclass variables and register as the power
@@ -707,8 +874,7 @@ void ApplePS2Controller::stop(IOService * provider)
   _publishNotify->remove();
   _terminateNotify->remove();
 
-  _notificationServices->flushCollection();
-  OSSafeReleaseNULL(_notificationServices);
+  _notificationBus.clear();
     
   // Free the nubs we created.
   OSSafeReleaseNULL(_keyboardDevice);
@@ -719,9 +885,35 @@ void ApplePS2Controller::stop(IOService * provider)
   OSSafeReleaseNULL(_interruptSourceMouse);
   OSSafeReleaseNULL(_interruptSourceQueue);
   OSSafeReleaseNULL(_cmdGate);
+  if (_notificationStatsTimer)
+  {
+    _notificationStatsTimer->cancelTimeout();
+    if (_workLoop)
+      _workLoop->removeEventSource(_notificationStatsTimer);
+    OSSafeReleaseNULL(_notificationStatsTimer);
+  }
 #if WATCHDOG_TIMER
   OSSafeReleaseNULL(_watchdogTimer);
 #endif
+#if INTERRUPT_DRIVEN_REQUESTS
+  if (_requestTimer)
+  {
+    _requestTimer->cancelTimeout();
+    if (_workLoop)
+      _workLoop->removeEventSource(_requestTimer);
+    OSSafeReleaseNULL(_requestTimer);
+  }
+#endif
+#if PACKET_CAPTURE
+  _capturing = false;
+  if (_replayTimer)
+  {
+    stopPacketReplay(false);
+    if (_workLoop)
+      _workLoop->removeEventSource(_replayTimer);
+    OSSafeReleaseNULL(_replayTimer);
+  }
+#endif
     
   // Free the work loop.
   OSSafeReleaseNULL(_workLoop);
@@ -729,14 +921,9 @@ void ApplePS2Controller::stop(IOService * provider)
   // Free the RMCF configuration cache
   OSSafeReleaseNULL(_rmcfCache);
 
-  // Free the request queue lock and empty out the request queue.
-  if (_requestQueueLock)
-  {
-    _hardwareOffline = true;
-    processRequestQueue(0, 0);
-    IOLockFree(_requestQueueLock);
-    _requestQueueLock = 0;
-  }
+  // Empty out the request queue.
+  _hardwareOffline = true;
+  processRequestQueue(0, 0);
 
   // Free the power management thread call.
   if (_powerChangeThreadCall)
@@ -744,6 +931,16 @@ void ApplePS2Controller::stop(IOService * provider)
     thread_call_free(_powerChangeThreadCall);
     _powerChangeThreadCall = 0;
   }
+#if PARALLEL_WAKE
+  if (_wakeMouseThreadCall)
+  {
+    // a wake still running on it uses the gate released above
+    if (thread_call_cancel_wait(_wakeMouseThreadCall))
+      release();  // drop the retain from wakeDevicesParallel()
+    thread_call_free(_wakeMouseThreadCall);
+    _wakeMouseThreadCall = 0;
+  }
+#endif
 
   // Detach from power management plane.
   PMstop();
@@ -887,21 +1084,389 @@ void ApplePS2Controller::uninstallInterruptAction(PS2DeviceType deviceType)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+// PS2RequestPool Implementation
+//
+// Size classes: sized for the usual small requests (LEDs), the touchpad
+// special command sequences, and anything up to kMaxCommands.
+
+static const struct { unsigned commands, count; } kRequestPoolLayout[] =
+{
+  { 4,            16 },
+  { 12,           8  },
+  { kMaxCommands, 4  },
+};
+
+bool PS2RequestPool::init()
+{
+  static_assert(countof(kRequestPoolLayout) == kClasses, "kRequestPoolLayout does not match kClasses");
+
+  bzero(m_classes, sizeof(m_classes));
+  bzero(m_published, sizeof(m_published));
+  for (unsigned i = 0; i < kClasses; i++)
+  {
+    SizeClass& c = m_classes[i];
+    c.commands = kRequestPoolLayout[i].commands;
+    c.count = kRequestPoolLayout[i].count;
+    c.blockSize = (sizeof(PS2Request) + sizeof(PS2Command) * c.commands + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    c.blocks = (UInt8*)IOMalloc(c.blockSize * c.count);
+    c.next = (UInt32*)IOMalloc(sizeof(UInt32) * c.count);
+    if (!c.blocks || !c.next)
+      return false;
+    for (unsigned j = 0; j < c.count; j++)
+      c.next[j] = j + 1 < c.count ? j + 2 : 0;
+    c.freeHead = 1;
+  }
+  return true;
+}
+
+void PS2RequestPool::free()
+{
+  for (unsigned i = 0; i < kClasses; i++)
+  {
+    SizeClass& c = m_classes[i];
+    if (c.blocks)
+      IOFree(c.blocks, c.blockSize * c.count);
+    if (c.next)
+      IOFree(c.next, sizeof(UInt32) * c.count);
+    c.blocks = 0;
+    c.next = 0;
+    c.freeHead = 0;
+  }
+}
+
+void* PS2RequestPool::allocate(unsigned commands)
+{
+  unsigned i = 0;
+  while (i < kClasses && m_classes[i].commands < commands)
+    i++;
+  if (i >= kClasses)
+    return 0;
+
+  // pop the first free block; the pop count changes the head even if the
+  // same block is at the front again by the time we swap
+  SizeClass& c = m_classes[i];
+  UInt64 head = __atomic_load_n(&c.freeHead, __ATOMIC_ACQUIRE);
+  UInt32 first;
+  do
+  {
+    first = (UInt32)head;
+    if (!first)
+    {
+      __atomic_add_fetch(&c.exhausted, 1, __ATOMIC_RELAXED);
+      return 0;
+    }
+    UInt64 next = __atomic_load_n(&c.next[first - 1], __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&c.freeHead, &head, ((head >> 32) + 1) << 32 | next, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+      break;
+  } while (1);
+
+  UInt32 inUse = __atomic_add_fetch(&c.inUse, 1, __ATOMIC_RELAXED);
+  if (inUse > __atomic_load_n(&c.highWater, __ATOMIC_RELAXED))
+    __atomic_store_n(&c.highWater, inUse, __ATOMIC_RELAXED);
+
+  UInt8* block = c.blocks + c.blockSize * (first - 1);
+  bzero(block, c.blockSize);
+  return block;
+}
+
+bool PS2RequestPool::release(void* block)
+{
+  for (unsigned i = 0; i < kClasses; i++)
+  {
+    SizeClass& c = m_classes[i];
+    if ((UInt8*)block < c.blocks || (UInt8*)block >= c.blocks + c.blockSize * c.count)
+      continue;
+
+    UInt32 index = (UInt32)(((UInt8*)block - c.blocks) / c.blockSize);
+    UInt64 head = __atomic_load_n(&c.freeHead, __ATOMIC_RELAXED);
+    do
+      __atomic_store_n(&c.next[index], (UInt32)head, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&c.freeHead, &head, (head & 0xFFFFFFFF00000000ULL) | (index + 1), true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_sub_fetch(&c.inUse, 1, __ATOMIC_RELAXED);
+    return true;
+  }
+  return false;
+}
+
+void PS2RequestPool::publishStats(IORegistryEntry* entry, const char* key)
+{
+  // only touches the registry when something changed
+  bool changed = false;
+  for (unsigned i = 0; i < kClasses; i++)
+  {
+    UInt32 exhausted = __atomic_load_n(&m_classes[i].exhausted, __ATOMIC_RELAXED);
+    UInt32 highWater = __atomic_load_n(&m_classes[i].highWater, __ATOMIC_RELAXED);
+    if (exhausted != m_published[i][0] || highWater != m_published[i][1])
+      changed = true;
+    m_published[i][0] = exhausted;
+    m_published[i][1] = highWater;
+  }
+  if (!changed)
+    return;
+
+  OSArray* array = OSArray::withCapacity(kClasses);
+  if (!array)
+    return;
+  for (unsigned i = 0; i < kClasses; i++)
+  {
+    if (OSDictionary* dict = OSDictionary::withCapacity(4))
+    {
+      setPropertyNumber(dict, "Commands", m_classes[i].commands, 32);
+      setPropertyNumber(dict, "Capacity", m_classes[i].count, 32);
+      setPropertyNumber(dict, "HighWater", m_published[i][1], 32);
+      setPropertyNumber(dict, "Exhausted", m_published[i][0], 32);
+      array->setObject(dict);
+      dict->release();
+    }
+  }
+  entry->setProperty(key, array);
+  array->release();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// PS2NotificationBus Implementation
+
+static const char* const kNotificationTopicNames[] =
+{
+  "setDisableTouchpad",
+  "getDisableTouchpad",
+  "notifyKeyPressed",
+  "notifyKeyTime",
+  "other",
+};
+
+bool PS2NotificationBus::init()
+{
+  static_assert(countof(kNotificationTopicNames) == kTopicCount, "kNotificationTopicNames does not match kTopicCount");
+
+  bzero(m_tables, sizeof(m_tables));
+  bzero(m_services, sizeof(m_services));
+  bzero(m_topics, sizeof(m_topics));
+  bzero(m_stats, sizeof(m_stats));
+  m_active = 0;
+  m_rebuilding = false;
+  m_lock = IOLockAlloc();
+  return m_lock != 0;
+}
+
+void PS2NotificationBus::free()
+{
+  if (!m_lock)
+    return;
+  clear();
+  IOLockFree(m_lock);
+  m_lock = 0;
+}
+
+void PS2NotificationBus::clear()
+{
+  IOLockLock(m_lock);
+  IOService* services[kMaxSubscribers];
+  memcpy(services, m_services, sizeof(services));
+  bzero(m_services, sizeof(m_services));
+  bzero(m_topics, sizeof(m_topics));
+  rebuild();
+  IOLockUnlock(m_lock);
+  for (unsigned i = 0; i < kMaxSubscribers; i++)
+    if (services[i])
+      services[i]->release();
+}
+
+int PS2NotificationBus::topicOf(int message)
+{
+  switch ((UInt32)message)
+  {
+    case kPS2M_setDisableTouchpad:  return kTopicSetDisableTouchpad;
+    case kPS2M_getDisableTouchpad:  return kTopicGetDisableTouchpad;
+    case kPS2M_notifyKeyPressed:    return kTopicNotifyKeyPressed;
+    case kPS2M_notifyKeyTime:       return kTopicNotifyKeyTime;
+  }
+  return kTopicOther;
+}
+
+void PS2NotificationBus::drain(Table& table)
+{
+  // called with m_lock dropped: deliveries are short, subscription changes
+  // rare, but a delivery may be waiting for a gate held by someone who is
+  // about to subscribe
+  while (__atomic_load_n(&table.readers, __ATOMIC_SEQ_CST))
+    IOSleep(1);
+}
+
+void PS2NotificationBus::rebuild()
+{
+  // fill the inactive table (once nobody reads it any more), switch to it,
+  // then wait until the old one is unused too, so the caller may release
+  // services that were dropped.  Called and returns with m_lock held; one
+  // rebuild at a time, a change made meanwhile is picked up by its own.
+  while (m_rebuilding)
+    IOLockSleep(m_lock, &m_rebuilding, THREAD_UNINT);
+  m_rebuilding = true;
+  UInt32 inactive = m_active ^ 1;
+  Table& table = m_tables[inactive];
+  IOLockUnlock(m_lock);
+  drain(table);
+  IOLockLock(m_lock);
+  bzero(table.count, sizeof(table.count));
+  for (unsigned i = 0; i < kMaxSubscribers; i++)
+  {
+    if (!m_services[i])
+      continue;
+    for (unsigned topic = 0; topic < kTopicCount; topic++)
+      if (m_topics[i] & (1 << topic))
+        table.subscribers[topic][table.count[topic]++] = m_services[i];
+  }
+  __atomic_store_n(&m_active, inactive, __ATOMIC_SEQ_CST);
+  IOLockUnlock(m_lock);
+  drain(m_tables[inactive ^ 1]);
+  IOLockLock(m_lock);
+  m_rebuilding = false;
+  IOLockWakeup(m_lock, &m_rebuilding, false);
+}
+
+bool PS2NotificationBus::subscribe(IOService* service)
+{
+  UInt32 topics = (1 << kTopicCount) - 1;
+  if (OSArray* list = OSDynamicCast(OSArray, service->getProperty(kNotificationTopics)))
+  {
+    topics = 0;
+    for (unsigned i = 0; i < list->getCount(); i++)
+      if (OSNumber* code = OSDynamicCast(OSNumber, list->getObject(i)))
+        topics |= 1 << topicOf(iokit_vendor_specific_msg(code->unsigned32BitValue()));
+  }
+
+  IOLockLock(m_lock);
+  int slot = -1;
+  for (int i = 0; i < kMaxSubscribers; i++)
+  {
+    if (m_services[i] == service)
+    {
+      IOLockUnlock(m_lock);
+      return true;
+    }
+    if (!m_services[i] && slot < 0)
+      slot = i;
+  }
+  if (slot >= 0)
+  {
+    service->retain();
+    m_services[slot] = service;
+    m_topics[slot] = topics;
+    rebuild();
+  }
+  IOLockUnlock(m_lock);
+  return slot >= 0;
+}
+
+void PS2NotificationBus::unsubscribe(IOService* service)
+{
+  IOLockLock(m_lock);
+  bool found = false;
+  for (unsigned i = 0; i < kMaxSubscribers; i++)
+  {
+    if (m_services[i] != service)
+      continue;
+    m_services[i] = 0;
+    m_topics[i] = 0;
+    found = true;
+  }
+  if (found)
+    rebuild();
+  IOLockUnlock(m_lock);
+  if (found)
+    service->release();
+}
+
+void PS2NotificationBus::publish(int message, IOService* sender, void* data)
+{
+  // pin the active table; if it was switched while we got here, try again
+  Table* table;
+  for (;;)
+  {
+    UInt32 active = __atomic_load_n(&m_active, __ATOMIC_SEQ_CST);
+    table = &m_tables[active];
+    __atomic_add_fetch(&table->readers, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&m_active, __ATOMIC_SEQ_CST) == active)
+      break;
+    __atomic_sub_fetch(&table->readers, 1, __ATOMIC_SEQ_CST);
+  }
+
+  int topic = topicOf(message);
+  TopicStats& stats = m_stats[topic];
+  UInt32 count = table->count[topic];
+  if (!count)
+  {
+    // nobody listening (kPS2M_notifyKeyPressed on every key, usually)
+    __atomic_sub_fetch(&table->readers, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&stats.published, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  uint64_t start_abs, end_abs;
+  clock_get_uptime(&start_abs);
+  for (unsigned i = 0; i < count; i++)
+    table->subscribers[topic][i]->message(message, sender, data);
+  clock_get_uptime(&end_abs);
+  __atomic_sub_fetch(&table->readers, 1, __ATOMIC_SEQ_CST);
+
+  uint64_t elapsed;
+  absolutetime_to_nanoseconds(end_abs - start_abs, &elapsed);
+  __atomic_add_fetch(&stats.published, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.delivered, count, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.totalTime, elapsed, __ATOMIC_RELAXED);
+  if (elapsed > __atomic_load_n(&stats.maxTime, __ATOMIC_RELAXED))
+    __atomic_store_n(&stats.maxTime, elapsed, __ATOMIC_RELAXED);
+}
+
+void PS2NotificationBus::publishStats(IORegistryEntry* entry, const char* key)
+{
+  OSDictionary* topics = OSDictionary::withCapacity(kTopicCount);
+  if (!topics)
+    return;
+  const Table& table = m_tables[__atomic_load_n(&m_active, __ATOMIC_SEQ_CST)];
+  for (unsigned i = 0; i < kTopicCount; i++)
+  {
+    if (OSDictionary* dict = OSDictionary::withCapacity(5))
+    {
+      const TopicStats& stats = m_stats[i];
+      UInt64 count = __atomic_load_n(&stats.published, __ATOMIC_RELAXED);
+      UInt64 total = __atomic_load_n(&stats.totalTime, __ATOMIC_RELAXED);
+      setPropertyNumber(dict, "Subscribers", table.count[i], 32);
+      setPropertyNumber(dict, "Published", count, 64);
+      setPropertyNumber(dict, "Delivered", __atomic_load_n(&stats.delivered, __ATOMIC_RELAXED), 64);
+      setPropertyNumber(dict, "Mean Latency (us)", count ? total / count / 1000 : 0, 64);
+      setPropertyNumber(dict, "Max Latency (us)", __atomic_load_n(&stats.maxTime, __ATOMIC_RELAXED) / 1000, 64);
+      topics->setObject(kNotificationTopicNames[i], dict);
+      dict->release();
+    }
+  }
+  entry->setProperty(key, topics);
+  topics->release();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 PS2Request * ApplePS2Controller::allocateRequest(int max)
 {
   //
   // Allocate a request structure.  Blocks until successful.
   // Most of request structure is guaranteed to be zeroed.
   //
+  // Taken from the request pool when possible, which does not block and
+  // may be used at interrupt time.
+  //
     
   assert(max > 0);
-    
+
+  if (void* block = _requestPool.allocate(max))
+    return new(block) PS2Request;
   return new(max) PS2Request;
 }
 
 EXPORT PS2Request::PS2Request()
 {
   commandsCount = 0;
+  priority = kPS2RP_Normal;
   completionTarget = 0;
   completionAction = 0;
   completionParam = 0;
@@ -922,7 +1487,8 @@ void ApplePS2Controller::freeRequest(PS2Request * request)
   // Deallocate a request structure.
   //
 
-  delete request;
+  if (!_requestPool.release(request))
+    delete request;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -943,6 +1509,9 @@ void ApplePS2Controller::setCommandByteGated(PS2Request* request)
 {
     UInt8 setBits = request->commands[0].setBits;
     UInt8 clearBits = request->commands[0].clearBits;
+#if INTERRUPT_DRIVEN_REQUESTS
+    finishRequestsPolled();
+#endif
     ++_ignoreInterrupts;
     writeCommandPort(kCP_GetCommandByte);
     UInt8 oldCommandByte = readDataPort(kDT_Keyboard);
@@ -966,9 +1535,7 @@ bool ApplePS2Controller::submitRequest(PS2Request * request)
   // Submit the request to the controller for processing, asynchronously.
   //
 
-  IOLockLock(_requestQueueLock);
-  queue_enter(&_requestQueue, request, PS2Request *, chain);
-  IOLockUnlock(_requestQueueLock);
+  _requestQueue.enqueue(request);
 
   _interruptSourceQueue->interruptOccurred(0, 0, 0);
 
@@ -986,7 +1553,31 @@ void ApplePS2Controller::submitRequestAndBlock(PS2Request * request)
 
 void ApplePS2Controller::submitRequestAndBlockGated(PS2Request* request)
 {
+#if INTERRUPT_DRIVEN_REQUESTS
+    //
+    // Queue the request behind any asynchronous ones and sleep until the
+    // request engine completes it.  The command gate is open while we sleep,
+    // so packets keep flowing.  The work loop thread itself cannot sleep here
+    // (it is what runs the engine), so it falls back to polling, as does any
+    // request made while interrupts are not being serviced.
+    //
+
+    if (!_workLoop->onThread() && canUseRequestEngine())
+    {
+        RequestWaiter waiter = { request, false, _requestWaiters };
+        _requestWaiters = &waiter;
+
+        _requestQueue.enqueue(request);
+
+        runRequestEngine();
+        while (!waiter.done)
+            _cmdGate->commandSleep(&waiter, THREAD_UNINT);
+        return;
+    }
+    finishRequestsPolled();
+#else
     processRequestQueue(0, 0);
+#endif
     processRequest(request);
 }
 
@@ -1029,12 +1620,12 @@ void ApplePS2Controller::interruptOccurred(IOInterruptEventSource* source, int)
 
     // See if data is available on the mouse input stream (off real port).
 
-    else if ( (inb(kCommandPort) & (kOutputReady | kMouseData)) ==
+    else if ( (ps2inb(kCommandPort) & (kOutputReady | kMouseData)) ==
                                    (kOutputReady | kMouseData))
     {
       unlockController(state);
       IODelay(kDataDelay);
-      dispatchDriverInterrupt(kDT_Mouse, inb(kDataPort));
+      dispatchDriverInterrupt(kDT_Mouse, ps2inb(kDataPort));
       lockController(&state);
     }
     else break; // out of loop
@@ -1052,7 +1643,10 @@ void ApplePS2Controller::packetReadyKeyboard(IOInterruptEventSource *, int)
     // a complete packet has arrived for the keyboard and has signaled the workloop
     // -- dispatch it to the installed keyboard packet handler
     if (_interruptInstalledKeyboard)
+    {
+        noteFirstEvent(kDT_Keyboard);
         (*_packetActionKeyboard)(_interruptTargetKeyboard);
+    }
 }
 
 void ApplePS2Controller::packetReadyMouse(IOInterruptEventSource *, int)
@@ -1060,7 +1654,10 @@ void ApplePS2Controller::packetReadyMouse(IOInterruptEventSource *, int)
     // a complete packet has arrived for the mouse and has signaled the workloop
     // -- dispatch it to the installed mouse packet handler
     if (_interruptInstalledMouse)
+    {
+        noteFirstEvent(kDT_Mouse);
         (*_packetActionMouse)(_interruptTargetMouse);
+    }
 }
 #endif // !HANDLE_INTERRUPT_DATA_LATER
 
@@ -1069,6 +1666,10 @@ void ApplePS2Controller::packetReadyMouse(IOInterruptEventSource *, int)
 PS2InterruptResult ApplePS2Controller::_dispatchDriverInterrupt(PS2DeviceType deviceType, UInt8 data)
 {
     PS2InterruptResult result = kPS2IR_packetBuffering;
+#if PACKET_CAPTURE
+    if (_capturing && !_replaying && (kDT_Keyboard != deviceType || _captureKeyboard))
+        captureByte(deviceType, data);
+#endif
     if (kDT_Mouse == deviceType && _interruptInstalledMouse)
     {
         // Dispatch the data to the mouse driver.
@@ -1084,60 +1685,347 @@ PS2InterruptResult ApplePS2Controller::_dispatchDriverInterrupt(PS2DeviceType de
 
 void ApplePS2Controller::dispatchDriverInterrupt(PS2DeviceType deviceType, UInt8 data)
 {
+#if INTERRUPT_DRIVEN_REQUESTS
+    // (behind whatever the interrupt handlers have queued for this driver)
+    IOInterruptState state = IOSimpleLockLockDisableInterrupt(_responseLock);
+    queueDriverByte(deviceType, data);
+    IOSimpleLockUnlockEnableInterrupt(_responseLock, state);
+    if (feedDriver(deviceType))
+        signalPacketReady(deviceType);
+#else
+    if (liveInputHeld())
+        return;
     PS2InterruptResult result = _dispatchDriverInterrupt(deviceType, data);
     if (kPS2IR_packetReady == result)
+        signalPacketReady(deviceType);
+#endif
+}
+
+#if INTERRUPT_DRIVEN_REQUESTS
+
+bool ApplePS2Controller::feedDriver(PS2DeviceType deviceType)
+{
+    //
+    // Deliver the bytes queued on a driver's feed.  Called from the interrupt
+    // handlers and the request engine with _responseLock released.  A caller
+    // that finds the feed owned leaves its bytes to the owner, which checks
+    // again after letting go; so a driver never sees two callers at once,
+    // and nobody waits.  Returns true if a packet became ready.
+    //
+
+    RingBuffer<UInt8, 128>& feed = _driverFeed[deviceType];
+    UInt32* owner = &_driverFeedOwner[deviceType];
+    bool ready = false;
+
+    do
     {
+        UInt32 expected = 0;
+        if (!__atomic_compare_exchange_n(owner, &expected, 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            break;
+        while (feed.count())
+        {
+            if (kPS2IR_packetReady == _dispatchDriverInterrupt(deviceType, feed.fetch()))
+                ready = true;
+        }
+        __atomic_store_n(owner, 0, __ATOMIC_SEQ_CST);
+    } while (feed.count());
+
+    return ready;
+}
+
+#endif // INTERRUPT_DRIVEN_REQUESTS
+
+void ApplePS2Controller::signalPacketReady(PS2DeviceType deviceType)
+{
 #if HANDLE_INTERRUPT_DATA_LATER
-        if (kDT_Mouse == deviceType)
-            (*_packetActionMouse)(_interruptTargetMouse);
-        else if (kDT_Keyboard == deviceType)
-            (*_packetActionKeyboard)(_interruptTargetKeyboard);
+    noteFirstEvent(deviceType);
+    if (kDT_Mouse == deviceType)
+        (*_packetActionMouse)(_interruptTargetMouse);
+    else if (kDT_Keyboard == deviceType)
+        (*_packetActionKeyboard)(_interruptTargetKeyboard);
 #else
-        if (kDT_Mouse == deviceType)
-            _interruptSourceMouse->interruptOccurred(0, 0, 0);
-        else if (kDT_Keyboard == deviceType)
-            _interruptSourceKeyboard->interruptOccurred(0, 0, 0);
+    if (kDT_Mouse == deviceType)
+        _interruptSourceMouse->interruptOccurred(0, 0, 0);
+    else if (kDT_Keyboard == deviceType)
+        _interruptSourceKeyboard->interruptOccurred(0, 0, 0);
 #endif
-    }
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Packet capture and replay
+//
 
-void ApplePS2Controller::processRequest(PS2Request * request)
+#if PACKET_CAPTURE
+
+void ApplePS2Controller::captureByte(PS2DeviceType deviceType, UInt8 data)
 {
   //
-  // Our work loop has informed us of a request submission. Process
-  // the request.  Note that this code "figures out" when the mouse
-  // input stream should be read over the keyboard input stream.
-  //
-  // This method should only be called from our single-threaded work loop.
+  // Record a byte on its way to a driver.  Called at interrupt time, possibly
+  // for keyboard and mouse at once, so each one claims its own slot.  The ring
+  // keeps the most recent kCaptureRecords bytes.
   //
 
-  UInt8         byte;
-  PS2DeviceType deviceMode      = kDT_Keyboard;
-  bool          failed          = false;
-  bool          transmitToMouse = false;
-  unsigned      index;
-
-  if (_hardwareOffline)
-  {
-    failed = true;
-    index  = 0;
-    goto hardware_offline;
-  }
+  uint64_t now;
+  clock_get_uptime(&now);
+  absolutetime_to_nanoseconds(now - _captureStart, &now);
+  UInt32 slot = __atomic_fetch_add(&_captureHead, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&_captureRing[slot & (kCaptureRecords - 1)],
+                   makeCaptureRecord(now / 1000, deviceType, data), __ATOMIC_RELAXED);
+}
 
-  // Don't handle interrupts during this process.  We want to read the
-  // data by polling for it here.
-    
-  ++_ignoreInterrupts;
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-  // Process each of the commands in the list.
+void ApplePS2Controller::setPacketCapture(bool enable)
+{
+  //
+  // (Re)start or stop capturing.  Stopping publishes what was captured.
+  // The ring is allocated on first use and kept until we are freed, since
+  // an interrupt may still be writing to it just after capture stops.
+  //
+  // This method should only be called with the command gate closed.
+  //
 
-  for (index = 0; index < request->commandsCount; index++)
+  if (!enable)
   {
-    switch (request->commands[index].command)
+    if (_capturing)
     {
-      case kPS2C_ReadDataPort:
+      _capturing = false;
+      publishPacketCapture();
+    }
+    return;
+  }
+
+  if (!_captureRing)
+  {
+    _captureRing = (UInt64*)IOMalloc(sizeof(UInt64) * kCaptureRecords);
+    if (!_captureRing)
+      return;
+  }
+  _capturing = false;
+  _captureHead = 0;
+  clock_get_uptime(&_captureStart);
+  __atomic_store_n(&_capturing, true, __ATOMIC_RELEASE);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::publishPacketCapture(void)
+{
+  //
+  // Dump the ring, oldest record first, as kPacketCapture.  While capture is
+  // still running, records written during the copy may be missed.
+  //
+
+  if (!_captureRing)
+    return;
+
+  UInt32 head = __atomic_load_n(&_captureHead, __ATOMIC_ACQUIRE);
+  UInt32 count = head < kCaptureRecords ? head : kCaptureRecords;
+
+  PS2CaptureHeader header;
+  header.magic = kCaptureMagic;
+  header.version = kCaptureVersion;
+  header.headerSize = sizeof(header);
+  header.count = count;
+  header.overwritten = head - count;
+  absolutetime_to_nanoseconds(_captureStart, &header.startTime);
+
+  OSData* data = OSData::withCapacity(sizeof(header) + sizeof(UInt64) * count);
+  if (!data)
+    return;
+  data->appendBytes(&header, sizeof(header));
+  for (UInt32 i = head - count; i != head; i++)
+  {
+    UInt64 record = __atomic_load_n(&_captureRing[i & (kCaptureRecords - 1)], __ATOMIC_RELAXED);
+    data->appendBytes(&record, sizeof(record));
+  }
+  setProperty(kPacketCapture, data);
+  data->release();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::startPacketReplay(OSData* trace, unsigned speed)
+{
+  //
+  // Feed a captured trace back to the drivers, through the same interrupt
+  // actions real input goes through.  Capture is suspended meanwhile, so a
+  // replay is never recorded into the ring, and live input is dropped, so
+  // it does not interleave with the trace inside a packet.
+  //
+  // This method should only be called with the command gate closed.
+  //
+
+  stopPacketReplay(false);
+
+  const PS2CaptureHeader* header = (const PS2CaptureHeader*)trace->getBytesNoCopy();
+  if (trace->getLength() < sizeof(*header) || header->magic != kCaptureMagic ||
+      header->version != kCaptureVersion || header->headerSize < sizeof(*header) ||
+      header->headerSize + (UInt64)header->count * sizeof(UInt64) > trace->getLength())
+  {
+    IOLog("%s: ReplayPacketCapture is not a packet capture\n", getName());
+    return;
+  }
+
+  trace->retain();
+  _replayTrace = trace;
+  _replayIndex = 0;
+  _replaySpeed = speed;
+  _replaying = true;
+  clock_get_uptime(&_replayStart);
+  onReplayTimer();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::stopPacketReplay(bool resync)
+{
+  //
+  // End a replay.  With "resync", the devices are then reset as on wake: the
+  // drivers were left wherever the trace ended, and the devices kept sending
+  // while their input was dropped, so neither is in step with the other.
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
+
+  if (!_replayTrace)
+    return;
+
+  _replayTimer->cancelTimeout();
+  if (OSDictionary* dict = OSDictionary::withCapacity(2))
+  {
+    const PS2CaptureHeader* header = (const PS2CaptureHeader*)_replayTrace->getBytesNoCopy();
+    uint64_t now;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - _replayStart, &now);
+    setPropertyNumber(dict, "Records", _replayIndex, 32);
+    setPropertyNumber(dict, "Skipped", header->count - _replayIndex, 32);
+    setPropertyNumber(dict, "Duration (us)", now / 1000, 64);
+    setProperty(kPacketReplay, dict);
+    dict->release();
+  }
+  OSSafeReleaseNULL(_replayTrace);
+  _replaying = false;
+
+  if (resync)
+  {
+    dispatchDriverPowerControl(kPS2C_DisableDevice, kDT_Mouse);
+    dispatchDriverPowerControl(kPS2C_DisableDevice, kDT_Keyboard);
+    dispatchDriverPowerControl(kPS2C_EnableDevice, kDT_Keyboard);
+    dispatchDriverPowerControl(kPS2C_EnableDevice, kDT_Mouse);
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::onReplayTimer(void)
+{
+  //
+  // Deliver every record that is due, then sleep until the next one.  With
+  // no delays (speed 0), deliver up to one complete packet per pass, giving
+  // the driver the chance to process it before the next one.
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
+
+  if (!_replayTrace)
+    return;
+
+  const PS2CaptureHeader* header = (const PS2CaptureHeader*)_replayTrace->getBytesNoCopy();
+  const UInt64* records = (const UInt64*)((const UInt8*)header + header->headerSize);
+  bool delivered = false;
+
+  while (_replayIndex < header->count)
+  {
+    UInt64 record = records[_replayIndex];
+    if (_replaySpeed)
+    {
+      // (due and elapsed in usec, both relative to the first record)
+      uint64_t elapsed, due = (captureRecordTime(record) - captureRecordTime(records[0])) / _replaySpeed;
+      clock_get_uptime(&elapsed);
+      absolutetime_to_nanoseconds(elapsed - _replayStart, &elapsed);
+      elapsed /= 1000;
+      if (due > elapsed)
+      {
+        _replayTimer->setTimeoutUS(due - elapsed > 1000000 ? 1000000 : (UInt32)(due - elapsed));
+        return;
+      }
+    }
+    _replayIndex++;
+    delivered = true;
+
+    PS2DeviceType deviceType = (PS2DeviceType)captureRecordDevice(record);
+    if (kDT_Keyboard != deviceType && kDT_Mouse != deviceType)
+      continue;
+#if INTERRUPT_DRIVEN_REQUESTS
+    // (through the same feed as the interrupt handlers, which hold theirs)
+    IOInterruptState state = IOSimpleLockLockDisableInterrupt(_responseLock);
+    _driverFeed[deviceType].push(captureRecordData(record));
+    IOSimpleLockUnlockEnableInterrupt(_responseLock, state);
+    bool ready = feedDriver(deviceType);
+#else
+    bool ready = kPS2IR_packetReady == _dispatchDriverInterrupt(deviceType, captureRecordData(record));
+#endif
+    if (ready)
+    {
+      signalPacketReady(deviceType);
+      if (!_replaySpeed)
+      {
+        _replayTimer->setTimeoutUS(1);
+        return;
+      }
+    }
+  }
+  if (delivered)
+  {
+    // let the drivers take the last packet before they are reset
+    _replayTimer->setTimeoutMS(10);
+    return;
+  }
+  stopPacketReplay(true);
+}
+
+#endif // PACKET_CAPTURE
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::processRequest(PS2Request * request)
+{
+  //
+  // Our work loop has informed us of a request submission. Process
+  // the request.  Note that this code "figures out" when the mouse
+  // input stream should be read over the keyboard input stream.
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
+
+  UInt8         byte;
+  PS2DeviceType deviceMode      = kDT_Keyboard;
+  bool          failed          = false;
+  bool          transmitToMouse = false;
+  unsigned      index;
+  unsigned      groupStart      = 0;
+  unsigned      groupEnd        = 0;
+
+  if (_hardwareOffline)
+  {
+    failed = true;
+    index  = 0;
+    goto hardware_offline;
+  }
+
+  // Don't handle interrupts during this process.  We want to read the
+  // data by polling for it here.
+    
+  ++_ignoreInterrupts;
+
+  // Process each of the commands in the list.
+
+  for (index = 0; index < request->commandsCount; index++)
+  {
+    switch (request->commands[index].command)
+    {
+      case kPS2C_ReadDataPort:
         request->commands[index].inOrOut = readDataPort(deviceMode);
         break;
 
@@ -1208,11 +2096,11 @@ void ApplePS2Controller::processRequest(PS2Request * request)
             
       case kPS2C_FlushDataPort:
         request->commands[index].inOrOut32 = 0;
-        while ( inb(kCommandPort) & kOutputReady )
+        while ( ps2inb(kCommandPort) & kOutputReady )
         {
             ++request->commands[index].inOrOut32;
             IODelay(kDataDelay);
-            inb(kDataPort);
+            ps2inb(kDataPort);
             IODelay(kDataDelay);
         }
         break;
@@ -1222,71 +2110,708 @@ void ApplePS2Controller::processRequest(PS2Request * request)
         break;
             
       case kPS2C_ModifyCommandByte:
+      {
         writeCommandPort(kCP_GetCommandByte);
         UInt8 commandByte = readDataPort(kDT_Keyboard);
         writeCommandPort(kCP_SetCommandByte);
         writeDataPort((commandByte | request->commands[index].setBits) & ~request->commands[index].clearBits);
         request->commands[index].oldBits = commandByte;
         break;
+      }
+
+      case kPS2C_TryCommands:
+        groupStart = index;
+        groupEnd   = index + 1 + request->commands[index].skipCount;
+        request->commands[index].failedAt = 0;
+        break;
+
+      case kPS2C_SkipUnlessBitsSet:
+      case kPS2C_SkipUnlessEqual:
+        if (!testCommandCondition(request, index))
+          index += request->commands[index].skipCount;
+        break;
+    }
+
+    if (failed)
+    {
+      // inside kPS2C_TryCommands only the rest of the group is abandoned,
+      // and what the device still sends for it is dropped
+      if (index >= groupEnd) break;
+      index  = abandonCommandGroup(request, groupStart, index);
+      drainDataPort(deviceMode);
+      failed = false;
+      transmitToMouse = false;
+    }
+  }
+    
+  // Now it is ok to process interrupts normally.
+    
+  --_ignoreInterrupts;
+    
+hardware_offline:
+
+  completeRequest(request, failed, index);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::completeRequest(PS2Request * request, bool failed, unsigned index)
+{
+  // If a command failed and stopped the request processing, store its
+  // index into the commandsCount field.
+
+  if (failed) request->commandsCount = index;
+
+#if INTERRUPT_DRIVEN_REQUESTS
+  // Wake up the submitRequestAndBlock caller waiting on this request, if any.
+  // (must be done before the completion routine may free the request)
+
+  for (RequestWaiter** link = &_requestWaiters; *link; link = &(*link)->next)
+  {
+    RequestWaiter* waiter = *link;
+    if (waiter->request == request)
+    {
+      *link = waiter->next;
+      waiter->done = true;
+      _cmdGate->commandWakeup(waiter);
+      break;
+    }
+  }
+#endif
+
+  // Invoke the completion routine, if one was supplied.
+
+  if (request->completionTarget != kStackCompletionTarget && request->completionTarget && request->completionAction)
+  {
+    (*request->completionAction)(request->completionTarget,
+                                 request->completionParam);
+  }
+  else
+  {
+    if (request->completionTarget != kStackCompletionTarget)
+      freeRequest(request);
+  }
+  _requestPool.publishStats(this, kRequestPoolStatistics);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool ApplePS2Controller::testCommandCondition(PS2Request * request, unsigned index)
+{
+  //
+  // kPS2C_SkipUnlessBitsSet / kPS2C_SkipUnlessEqual: test the byte captured
+  // by an earlier command of the same request.
+  //
+
+  PS2Command & command = request->commands[index];
+  UInt8 value = 0;
+
+  if (command.testIndex < index)
+    value = request->commands[command.testIndex].inOrOut & command.testMask;
+
+  if (command.command == kPS2C_SkipUnlessBitsSet)
+    return value != 0;
+  return value == command.testValue;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+unsigned ApplePS2Controller::abandonCommandGroup(PS2Request * request, unsigned groupStart, unsigned index)
+{
+  //
+  // A command inside a kPS2C_TryCommands group failed.  Record which one,
+  // clear whatever the group's read commands captured (so later tests see
+  // zero, as if nothing was read), and return the index of the group's last
+  // command so that processing carries on right after the group.
+  //
+
+  PS2Command & group = request->commands[groupStart];
+  unsigned groupEnd = groupStart + 1 + group.skipCount;
+
+  group.failedAt = index - groupStart;
+  for (unsigned i = groupStart + 1; i < groupEnd; i++)
+  {
+    if (request->commands[i].command == kPS2C_ReadDataPort ||
+        request->commands[i].command == kPS2C_ReadMouseDataPort)
+      request->commands[i].inOrOut = 0;
+  }
+  return groupEnd - 1;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+UInt32 ApplePS2Controller::drainDataPort(PS2DeviceType deviceType)
+{
+  //
+  // After a failed command group: drop what the device still sends on the
+  // given input stream (a late ACK, the data bytes of a command answered
+  // with something else) until it has been quiet for kFailedGroupQuietMS,
+  // so that none of it is read as the response to the next command.  Data
+  // for the other input stream is dispatched to its driver, as readDataPort
+  // does.  Returns the number of bytes dropped.
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
+
+  UInt32 count = 0;
+  UInt32 quietCounter = kFailedGroupQuietMS * 1000 / kDataDelay;
+
+  while (quietCounter && count < kFailedGroupDrainMax)
+  {
+    UInt8 status = ps2inb(kCommandPort);
+    if (!(status & kOutputReady))
+    {
+      quietCounter--;
+      IODelay(kDataDelay);
+      continue;
+    }
+    IODelay(kDataDelay);
+    UInt8 readByte = ps2inb(kDataPort);
+    if (((status & kMouseData) ? kDT_Mouse : kDT_Keyboard) == deviceType)
+    {
+      ++count;
+      quietCounter = kFailedGroupQuietMS * 1000 / kDataDelay;
+    }
+    else
+      dispatchDriverInterrupt(deviceType == kDT_Keyboard ? kDT_Mouse : kDT_Keyboard, readByte);
+  }
+  return count;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::processRequestQueue(IOInterruptEventSource *, int)
+{
+#if INTERRUPT_DRIVEN_REQUESTS
+  runRequestEngine();
+#else
+  // Process each queued (async) request in order.
+
+  while (PS2Request * request = _requestQueue.dequeue())
+    processRequest(request);
+#endif
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+#if INTERRUPT_DRIVEN_REQUESTS
+
+bool ApplePS2Controller::canUseRequestEngine(void)
+{
+  //
+  // The request engine depends on the interrupt handlers to deliver response
+  // bytes.  Both of them must be live: a byte nobody takes on one stream sits
+  // in the controller's output buffer and holds up the other stream.
+  //
+
+  return !_ignoreInterrupts && !_suppressTimeout && !_hardwareOffline &&
+         _interruptInstalledKeyboard && (_interruptInstalledMouse || !_mouseDevice);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::runRequestEngine(void)
+{
+  //
+  // Run the active request as far as it goes without waiting on the device,
+  // then carry on with the queued ones.  When a request has to wait, we just
+  // return; the interrupt handlers (through _interruptSourceQueue) or the
+  // request timer call us again once there is something to do.
+  //
+  // This method should only be called with the command gate closed.
+  //
+
+  while (1)
+  {
+    if (!_activeRequest)
+    {
+      PS2Request * request = _requestQueue.dequeue();
+      if (!request)
+        return;
+
+      // No interrupts to wait for (or hardware offline): the old way.
+
+      if (!canUseRequestEngine())
+      {
+        processRequest(request);
+        continue;
+      }
+
+      _activeRequest         = request;
+      _activeIndex           = 0;
+      _activeDeviceMode      = kDT_Keyboard;
+      _activeTransmitToMouse = false;
+      _activeFailed          = false;
+      _activeGroupStart      = 0;
+      _activeGroupEnd        = 0;
+      _activeFirstByteHeld   = false;
+      _activeWait            = kRW_None;
+      _activeDraining        = false;
+    }
+
+    if (!stepActiveRequest(false))
+      return;
+
+    PS2Request * request = _activeRequest;
+    _activeRequest = 0;
+    setResponseStream(kResponseStreamNone);
+    completeRequest(request, _activeFailed, _activeIndex);
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool ApplePS2Controller::stepActiveRequest(bool polled)
+{
+  //
+  // Execute the commands of the active request, starting at _activeIndex.
+  // Same semantics as processRequest, except that responses are taken from
+  // _responseBuffer, and that we return false whenever the request has to
+  // wait.  The next call resumes at the same command (_activeWait tells it
+  // that the writes preceding the wait were already done).  With polled set
+  // we never return false.
+  //
+
+  PS2Request * request = _activeRequest;
+  UInt8        byte;
+
+  for (; _activeIndex < request->commandsCount; _activeIndex++)
+  {
+    // (a failed group is drained before the command after it)
+    if (_activeDraining && !drainResponseData(polled))
+      return false;
+
+    PS2Command & command = request->commands[_activeIndex];
+
+    switch (command.command)
+    {
+      case kPS2C_ReadDataPort:
+        setResponseStream(_activeDeviceMode);
+        if (!readResponseByte(-1, &byte, polled))
+          return false;
+        command.inOrOut = byte;
+        break;
+
+      case kPS2C_ReadDataPortAndCompare:
+        setResponseStream(_activeDeviceMode);
+#if OUT_OF_ORDER_DATA_CORRECTION_FEATURE
+        if (!readResponseByte(command.inOrOut, &byte, polled))
+#else
+        if (!readResponseByte(-1, &byte, polled))
+#endif
+          return false;
+        _activeFailed = (byte != command.inOrOut);
+        command.inOrOut = byte;
+        break;
+
+      case kPS2C_WriteDataPort:
+        // next reads from the mouse input stream if transmitting to mouse;
+        // route it before the response can possibly arrive
+        _activeDeviceMode      = _activeTransmitToMouse ? kDT_Mouse : kDT_Keyboard;
+        _activeTransmitToMouse = false;
+        setResponseStream(_activeDeviceMode);
+        writeDataPort(command.inOrOut);
+        break;
+
+      case kPS2C_WriteCommandPort:
+        writeCommandPort(command.inOrOut);
+        if (command.inOrOut == kCP_TransmitToMouse)
+          _activeTransmitToMouse = true; // preparing to transmit data to mouse
+        break;
+
+      case kPS2C_SendMouseCommandAndCompareAck:
+        if (_activeWait == kRW_None)
+        {
+          _activeDeviceMode = kDT_Mouse;
+          setResponseStream(kDT_Mouse);
+          writeCommandPort(kCP_TransmitToMouse);
+          writeDataPort(command.inOrOut);
+        }
+#if OUT_OF_ORDER_DATA_CORRECTION_FEATURE
+        if (!readResponseByte(kSC_Acknowledge, &byte, polled))
+#else
+        if (!readResponseByte(-1, &byte, polled))
+#endif
+          return false;
+        _activeFailed = (byte != kSC_Acknowledge);
+        break;
+
+      case kPS2C_ReadMouseDataPort:
+        _activeDeviceMode = kDT_Mouse;
+        setResponseStream(kDT_Mouse);
+        if (!readResponseByte(-1, &byte, polled))
+          return false;
+        command.inOrOut = byte;
+        break;
+
+      case kPS2C_ReadMouseDataPortAndCompare:
+        _activeDeviceMode = kDT_Mouse;
+        setResponseStream(kDT_Mouse);
+#if OUT_OF_ORDER_DATA_CORRECTION_FEATURE
+        if (!readResponseByte(command.inOrOut, &byte, polled))
+#else
+        if (!readResponseByte(-1, &byte, polled))
+#endif
+          return false;
+        _activeFailed = (byte != command.inOrOut);
+        break;
+
+      case kPS2C_FlushDataPort:
+        command.inOrOut32 = flushResponseData();
+        break;
+
+      case kPS2C_SleepMS:
+        if (polled)
+        {
+          if (_activeWait != kRW_Expired)
+            IOSleep(command.inOrOut32);
+        }
+        else if (_activeWait == kRW_None && command.inOrOut32)
+        {
+          // sleep on the request timer instead of holding the work loop
+          _activeWait = kRW_Sleep;
+          _requestTimer->setTimeoutMS(command.inOrOut32);
+          return false;
+        }
+        else if (_activeWait == kRW_Sleep)
+          return false;
+        _activeWait = kRW_None;
+        break;
+
+      case kPS2C_ModifyCommandByte:
+        // the controller answers on the keyboard input stream
+        if (_activeWait == kRW_None)
+        {
+          setResponseStream(kDT_Keyboard);
+          writeCommandPort(kCP_GetCommandByte);
+        }
+        if (!readResponseByte(-1, &byte, polled))
+          return false;
+        writeCommandPort(kCP_SetCommandByte);
+        writeDataPort((byte | command.setBits) & ~command.clearBits);
+        command.oldBits = byte;
+        break;
+
+      case kPS2C_TryCommands:
+        _activeGroupStart = _activeIndex;
+        _activeGroupEnd   = _activeIndex + 1 + command.skipCount;
+        command.failedAt  = 0;
+        break;
+
+      case kPS2C_SkipUnlessBitsSet:
+      case kPS2C_SkipUnlessEqual:
+        if (!testCommandCondition(request, _activeIndex))
+          _activeIndex += command.skipCount;
+        break;
     }
 
-    if (failed) break;
+    if (_activeFailed)
+    {
+      // inside kPS2C_TryCommands only the rest of the group is abandoned,
+      // and what the device still sends for it is dropped; after a failed
+      // request, a late response goes back to the driver
+      if (_activeIndex >= _activeGroupEnd) break;
+      _activeIndex  = abandonCommandGroup(request, _activeGroupStart, _activeIndex);
+      _activeFailed = false;
+      _activeTransmitToMouse = false;
+      _activeDraining = true;
+      _activeDrained  = 0;
+      setResponseStream(_activeDeviceMode);
+    }
   }
-    
-  // Now it is ok to process interrupts normally.
-    
-  --_ignoreInterrupts;
-    
-hardware_offline:
 
-  // If a command failed and stopped the request processing, store its
-  // index into the commandsCount field.
+  return true;
+}
 
-  if (failed) request->commandsCount = index;
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-  // Invoke the completion routine, if one was supplied.
+bool ApplePS2Controller::readResponseByte(int expectedByte, UInt8 * result, bool polled)
+{
+  //
+  // Returns the next byte on the active request's input stream, as
+  // delivered to _responseBuffer by the interrupt handlers.  If expectedByte
+  // is not negative, this has the "second chance" logic of the readDataPort
+  // version with an expected byte (see OUT_OF_ORDER_DATA_CORRECTION_FEATURE).
+  //
+  // Returns false if there is nothing to return yet, after arming the
+  // request timer.  With polled set, we poll the data port instead and
+  // always return true.
+  //
 
-  if (request->completionTarget != kStackCompletionTarget && request->completionTarget && request->completionAction)
+  UInt8 byte;
+
+  while (1)
   {
-    (*request->completionAction)(request->completionTarget,
-                                 request->completionParam);
+    while (_responseBuffer.count())
+    {
+      byte = _responseBuffer.fetch();
+      if (expectedByte < 0 || byte == expectedByte)
+      {
+        // Normal case, or our assumption was correct and the second byte
+        // matched.  Dispatch the first byte to the interrupt handler.
+        if (_activeFirstByteHeld && !_ignoreOutOfOrder)
+          dispatchResponseByte(_activeFirstByte);
+        goto done;
+      }
+      if (!_activeFirstByteHeld)
+      {
+        // Does not match the byte we are expecting.  Put it aside for the
+        // moment.
+        _activeFirstByteHeld = true;
+        _activeFirstByte     = byte;
+      }
+      else
+      {
+        // The second byte mismatched as well.
+        if (!_ignoreOutOfOrder)
+          dispatchResponseByte(byte);
+        byte = _activeFirstByte;
+        goto done;
+      }
+    }
+
+    if (_activeWait == kRW_Expired)
+    {
+      // If we timed out, we return the first byte we read, if any, otherwise
+      // something went awfully wrong and we return a fake value.
+      if (_activeFirstByteHeld)
+      {
+        byte = _activeFirstByte;
+        goto done;
+      }
+      IOLog("%s: Timed out on %s input stream.\n", getName(),
+                          (_responseStream == kDT_Mouse) ? "mouse" : "keyboard");
+      byte = 0;
+      goto done;
+    }
+
+    if (!polled)
+    {
+      if (_activeWait == kRW_None)
+      {
+        _activeWait = kRW_Byte;
+        _requestTimer->setTimeoutMS(kRequestByteTimeout);
+      }
+      return false;
+    }
+
+    if (!pollResponseByte())
+      _activeWait = kRW_Expired;
   }
-  else
+
+done:
+  if (_activeWait == kRW_Byte)
+    _requestTimer->cancelTimeout();
+  _activeWait          = kRW_None;
+  _activeFirstByteHeld = false;
+  *result = byte;
+  return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+bool ApplePS2Controller::pollResponseByte(UInt32 timeoutMS)
+{
+  //
+  // Polls the data port until a byte for the active request arrives, like
+  // readDataPort does.  Used when the active request has to be finished
+  // without the interrupt handlers.  Data for the other input stream is
+  // dispatched to its driver.  Returns false on timeout.
+  //
+
+  UInt32 timeoutCounter = timeoutMS * 1000 / kDataDelay;
+
+  while (timeoutCounter)
   {
-    if (request->completionTarget != kStackCompletionTarget)
-      freeRequest(request);
+    IOInterruptState state = IOSimpleLockLockDisableInterrupt(_responseLock);
+    UInt8 status = ps2inb(kCommandPort);
+    if (status & kOutputReady)
+    {
+      IODelay(kDataDelay);
+      UInt8 data = ps2inb(kDataPort);
+      if (routeResponseByte(status, data))
+      {
+        IOSimpleLockUnlockEnableInterrupt(_responseLock, state);
+        return true;
+      }
+      PS2DeviceType deviceType = (status & kMouseData) ? kDT_Mouse : kDT_Keyboard;
+      queueDriverByte(deviceType, data);
+      IOSimpleLockUnlockEnableInterrupt(_responseLock, state);
+      if (feedDriver(deviceType))
+        signalPacketReady(deviceType);
+      continue;
+    }
+    IOSimpleLockUnlockEnableInterrupt(_responseLock, state);
+    timeoutCounter--;
+    IODelay(kDataDelay);
   }
+  return false;
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-void ApplePS2Controller::processRequestQueue(IOInterruptEventSource *, int)
+void ApplePS2Controller::setResponseStream(int stream)
+{
+  //
+  // Route the given input stream to _responseBuffer (kResponseStreamNone to
+  // stop routing).  Anything still buffered from the previous stream was not
+  // part of a response, so it goes back to the driver it was meant for.
+  //
+
+  if (_responseStream == stream)
+    return;
+
+  int previous = _responseStream;
+
+  IOInterruptState state = IOSimpleLockLockDisableInterrupt(_responseLock);
+  while (_responseBuffer.count())
+    queueDriverByte((PS2DeviceType)previous, _responseBuffer.fetch());
+  _responseStream = stream;
+  IOSimpleLockUnlockEnableInterrupt(_responseLock, state);
+
+  if (kResponseStreamNone != previous && feedDriver((PS2DeviceType)previous))
+    signalPacketReady((PS2DeviceType)previous);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::dispatchResponseByte(UInt8 data)
+{
+  //
+  // Hand a byte on the active request's input stream back to its driver,
+  // through the driver's feed, since the interrupt handlers may be feeding
+  // this driver a moment later at the same time.
+  //
+
+  PS2DeviceType deviceType = (PS2DeviceType)_responseStream;
+  IOInterruptState state = IOSimpleLockLockDisableInterrupt(_responseLock);
+  queueDriverByte(deviceType, data);
+  IOSimpleLockUnlockEnableInterrupt(_responseLock, state);
+
+  if (feedDriver(deviceType))
+    signalPacketReady(deviceType);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+UInt32 ApplePS2Controller::flushResponseData(void)
 {
-  queue_head_t localQueue;
+  //
+  // kPS2C_FlushDataPort: drop whatever was routed to the active request, and
+  // whatever is still waiting in the controller.  Returns the byte count.
+  //
+
+  UInt32 count = 0;
+
+  IOInterruptState state = IOSimpleLockLockDisableInterrupt(_responseLock);
+  for (; _responseBuffer.count(); ++count)
+    _responseBuffer.fetch();
+  while ( ps2inb(kCommandPort) & kOutputReady )
+  {
+    ++count;
+    IODelay(kDataDelay);
+    ps2inb(kDataPort);
+    IODelay(kDataDelay);
+  }
+  IOSimpleLockUnlockEnableInterrupt(_responseLock, state);
 
-  // Transfer queued (async) requests to a local queue.
+  return count;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-  IOLockLock(_requestQueueLock);
+bool ApplePS2Controller::drainResponseData(bool polled)
+{
+  //
+  // After a failed command group: drop what the device still sends on the
+  // active input stream (a late ACK, the data bytes of a command answered
+  // with something else) until it has been quiet for kFailedGroupQuietMS,
+  // so that none of it is taken for the response to the next command.
+  // Every byte restarts the wait, up to kFailedGroupDrainMax bytes.
+  // Returns false while waiting, as readResponseByte does.
+  //
 
-  if (!queue_empty(&_requestQueue))
+  while (1)
   {
-    queue_assign(&localQueue, &_requestQueue, PS2Request *, chain);
-    queue_init(&_requestQueue);
+    bool dropped = false;
+    for (; _responseBuffer.count(); dropped = true)
+    {
+      _responseBuffer.fetch();
+      ++_activeDrained;
+    }
+    if (_activeDrained >= kFailedGroupDrainMax || (_activeWait == kRW_Expired && !dropped))
+      break;
+
+    if (!polled)
+    {
+      if (_activeWait != kRW_Drain || dropped)
+      {
+        _activeWait = kRW_Drain;
+        _requestTimer->setTimeoutMS(kFailedGroupQuietMS);
+      }
+      return false;
+    }
+
+    if (!pollResponseByte(kFailedGroupQuietMS))
+      _activeWait = kRW_Expired;
   }
-  else queue_init(&localQueue);
 
-  IOLockUnlock(_requestQueueLock);
+  if (_activeWait == kRW_Drain)
+    _requestTimer->cancelTimeout();
+  _activeWait     = kRW_None;
+  _activeDraining = false;
+  return true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-  // Process each request in order.
+void ApplePS2Controller::finishRequestsPolled(void)
+{
+  //
+  // Complete the active request and everything queued behind it without
+  // waiting for interrupts.  For callers that need the controller to
+  // themselves right now: setCommandByte, requests issued from the work
+  // loop thread, or while interrupts are being ignored.
+  //
+  // This method should only be called with the command gate closed.
+  //
 
-  while (!queue_empty(&localQueue))
+  if (_activeRequest)
   {
-    PS2Request * request;
-    queue_remove_first(&localQueue, request, PS2Request *, chain);
-    processRequest(request);
+    _requestTimer->cancelTimeout();
+    ++_ignoreInterrupts;
+    stepActiveRequest(true);
+    --_ignoreInterrupts;
+
+    PS2Request * request = _activeRequest;
+    _activeRequest = 0;
+    setResponseStream(kResponseStreamNone);
+    completeRequest(request, _activeFailed, _activeIndex);
   }
+
+  while (PS2Request * request = _requestQueue.dequeue())
+    processRequest(request);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::onRequestTimer(void)
+{
+  //
+  // The active request's response byte did not show up in time, or its
+  // kPS2C_SleepMS is over.  Before giving up on a byte, pick up anything the
+  // interrupt handlers did not get to (eg. IRQ disabled in the command byte).
+  //
+
+  if (_activeWait == kRW_Byte)
+    handleInterrupt(kDT_Keyboard);
+  if (_activeWait != kRW_None)
+    _activeWait = kRW_Expired;
+  runRequestEngine();
 }
 
+#endif // INTERRUPT_DRIVEN_REQUESTS
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType)
@@ -1324,7 +2849,7 @@ UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType)
     // Wait for the controller's output buffer to become ready.
     //
 
-    while (timeoutCounter && !((status = inb(kCommandPort)) & kOutputReady))
+    while (timeoutCounter && !((status = ps2inb(kCommandPort)) & kOutputReady))
     {
       timeoutCounter--;
       IODelay(kDataDelay);
@@ -1359,7 +2884,7 @@ UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType)
     // the requested input stream.
     //
 
-    readByte = inb(kDataPort);
+    readByte = ps2inb(kDataPort);
 
 #if DEBUGGER_SUPPORT
     unlockController(state);    // (release interrupt lockout + access to queue)
@@ -1446,7 +2971,7 @@ UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType,
     // Wait for the controller's output buffer to become ready.
     //
 
-    while (timeoutCounter && !((status = inb(kCommandPort)) & kOutputReady))
+    while (timeoutCounter && !((status = ps2inb(kCommandPort)) & kOutputReady))
     {
       timeoutCounter--;
       IODelay(kDataDelay);
@@ -1484,7 +3009,7 @@ UInt8 ApplePS2Controller::readDataPort(PS2DeviceType deviceType,
     // the requested input stream.
     //
 
-    readByte        = inb(kDataPort);
+    readByte        = ps2inb(kDataPort);
     requestedStream = false;
 
     if ( (status & kMouseData) )
@@ -1576,10 +3101,10 @@ void ApplePS2Controller::writeDataPort(UInt8 byte)
   // This method should only be dispatched from our single-threaded work loop.
   //
 
-  while (inb(kCommandPort) & kInputBusy)
+  while (ps2inb(kCommandPort) & kInputBusy)
       IODelay(kDataDelay);
   IODelay(kDataDelay);
-  outb(kDataPort, byte);
+  ps2outb(kDataPort, byte);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -1593,10 +3118,10 @@ void ApplePS2Controller::writeCommandPort(UInt8 byte)
   // This method should only be dispatched from our single-threaded work loop.
   //
 
-  while (inb(kCommandPort) & kInputBusy)
+  while (ps2inb(kCommandPort) & kInputBusy)
       IODelay(kDataDelay);
   IODelay(kDataDelay);
-  outb(kCommandPort, byte);
+  ps2outb(kCommandPort, byte);
 }
 
 // =============================================================================
@@ -1679,10 +3204,10 @@ bool ApplePS2Controller::doEscape(UInt8 scancode)
     {
       // Disable the mouse by forcing the clock line low.
 
-      while (inb(kCommandPort) & kInputBusy)
+      while (ps2inb(kCommandPort) & kInputBusy)
           IODelay(kDataDelay);
       IODelay(kDataDelay);
-      outb(kCommandPort, kCP_DisableMouseClock);
+      ps2outb(kCommandPort, kCP_DisableMouseClock);
 
       // Call the debugger function.
 
@@ -1690,10 +3215,10 @@ bool ApplePS2Controller::doEscape(UInt8 scancode)
 
       // Re-enable the mouse by making the clock line active.
 
-      while (inb(kCommandPort) & kInputBusy)
+      while (ps2inb(kCommandPort) & kInputBusy)
           IODelay(kDataDelay);
       IODelay(kDataDelay);
-      outb(kCommandPort, kCP_EnableMouseClock);
+      ps2outb(kCommandPort, kCP_EnableMouseClock);
 
       releaseModifiers = true;
     }
@@ -1900,8 +3425,12 @@ void ApplePS2Controller::setPowerStateGated( UInt32 powerState )
           break;
         }
             
-        if (_wakedelay)
-            IOSleep(_wakedelay);
+        //
+        // Wait for the 8042 to come back, but no longer than it takes.
+        //
+
+        clock_get_uptime(&_wakeTime);
+        _wakeProbeTime = probeControllerReady(_wakedelay);
             
 #if FULL_INIT_AFTER_WAKE
         //
@@ -1930,16 +3459,24 @@ void ApplePS2Controller::setPowerStateGated( UInt32 powerState )
         // 3. Notify clients about the state change: Keyboard, then Mouse.
         //   (This ordering is also part of the fix for ProBook 4x40s trackpad wake issue)
         //    The ordering can be reversed from normal by setting MouseWakeFirst=true
+        //    With ParallelWake (and no MouseWakeFirst), both are woken at once.
 
+#if PARALLEL_WAKE
+        if (_parallelWake && !_mouseWakeFirst)
+        {
+            wakeDevicesParallel();
+            break;
+        }
+#endif
         if (!_mouseWakeFirst)
         {
-            dispatchDriverPowerControl( kPS2C_EnableDevice, kDT_Keyboard );
-            dispatchDriverPowerControl( kPS2C_EnableDevice, kDT_Mouse );
+            wakeDevice( kDT_Keyboard );
+            wakeDevice( kDT_Mouse );
         }
         else
         {
-            dispatchDriverPowerControl( kPS2C_EnableDevice, kDT_Mouse );
-            dispatchDriverPowerControl( kPS2C_EnableDevice, kDT_Keyboard );
+            wakeDevice( kDT_Mouse );
+            wakeDevice( kDT_Keyboard );
         }
 
         // 4. Now safe to enable the IRQs...
@@ -1947,6 +3484,7 @@ void ApplePS2Controller::setPowerStateGated( UInt32 powerState )
         DEBUG_LOG("%s: setCommandByte for wake 2\n", getName());
         setCommandByte(kCB_EnableKeyboardIRQ | kCB_EnableMouseIRQ | kCB_SystemFlag, 0);
         --_ignoreInterrupts;
+        publishWakeStatistics();
         break;
 
       default:
@@ -1978,6 +3516,204 @@ void ApplePS2Controller::dispatchDriverPowerControl( UInt32 whatToDo, PS2DeviceT
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+UInt32 ApplePS2Controller::probeControllerReady(UInt32 limit)
+{
+  //
+  // Replaces a fixed sleep before touching the 8042 after wake.  While the
+  // controller is still coming up, the status port floats (reads 0xFF) or
+  // reports its input buffer busy, and it does not answer commands.  Probe
+  // it by reading the command byte until it answers, for at most 'limit' ms
+  // (the old fixed WakeDelay).  Returns the time spent waiting, in usec.
+  //
+  // This method should only be called with the command gate closed and
+  // interrupts ignored.
+  //
+
+  if (!limit)
+    return 0;
+
+  uint64_t start, now, deadline;
+  clock_get_uptime(&start);
+  clock_interval_to_deadline(limit, kMillisecondScale, &deadline);
+
+  for (now = start; now < deadline; clock_get_uptime(&now))
+  {
+    UInt8 status = ps2inb(kCommandPort);
+    if (0xFF != status && !(status & kInputBusy))
+    {
+      // toss stale data left over from before sleep
+      for (int i = 0; i < 32 && (ps2inb(kCommandPort) & kOutputReady); i++)
+      {
+        IODelay(kDataDelay);
+        ps2inb(kDataPort);
+      }
+
+      ps2outb(kCommandPort, kCP_GetCommandByte);
+      for (int i = 0; i < kWakeProbeResponse; i += kDataDelay)
+      {
+        IODelay(kDataDelay);
+        if (ps2inb(kCommandPort) & kOutputReady)
+        {
+          ps2inb(kDataPort);
+          clock_get_uptime(&now);
+          absolutetime_to_nanoseconds(now - start, &now);
+          return (UInt32)(now / 1000);
+        }
+      }
+    }
+    IOSleep(kWakeProbeInterval);
+  }
+
+  IOLog("%s: controller not ready after %u ms\n", getName(), (unsigned)limit);
+  return limit * 1000;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::wakeDevice(PS2DeviceType deviceType)
+{
+  //
+  // Run the driver's wake (reinitialization) and note how long it took.
+  // Its first packet after this marks the device usable again.
+  //
+
+  uint64_t start, now;
+  clock_get_uptime(&start);
+  dispatchDriverPowerControl( kPS2C_EnableDevice, deviceType );
+  clock_get_uptime(&now);
+  absolutetime_to_nanoseconds(now - start, &now);
+  _wakeReinitTime[deviceType] = (UInt32)(now / 1000);
+  _wakeFirstEventTime[deviceType] = 0;
+  _wakeFirstEventPending[deviceType] = true;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+#if PARALLEL_WAKE
+
+void ApplePS2Controller::wakeDevicesParallel(void)
+{
+  //
+  // Reinitialize keyboard and mouse at the same time.  Interrupts are
+  // enabled first so the request engine can run: the requests of both drivers
+  // then share the 8042 one at a time, with response bytes routed by port.
+  // Other input is held back (liveInputHeld) until both are done, so neither
+  // driver sees packets while one of them is halfway through its reinit,
+  // as in a sequential wake.  The mouse is woken on its own thread; the
+  // keyboard on this one.  Whenever either is waiting (on its device, or in
+  // powerControlSleep), the command gate is open for the other.
+  //
+  // This method should only be called with the command gate closed.
+  //
+
+  _wakeParallelActive = true;
+  DEBUG_LOG("%s: setCommandByte for wake 2\n", getName());
+  setCommandByte(kCB_EnableKeyboardIRQ | kCB_EnableMouseIRQ | kCB_SystemFlag, 0);
+  --_ignoreInterrupts;
+
+  _wakeMousePending = true;
+  retain();
+  if ( thread_call_enter( _wakeMouseThreadCall ) == TRUE )
+    release();
+
+  wakeDevice( kDT_Keyboard );
+
+  while (_wakeMousePending)
+    _cmdGate->commandSleep(&_wakeMousePending, THREAD_UNINT);
+  _wakeParallelActive = false;
+
+  publishWakeStatistics();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::wakeMouseCallout(thread_call_param_t param0,
+                                          thread_call_param_t param1)
+{
+  ApplePS2Controller * me = (ApplePS2Controller *) param0;
+  assert(me);
+
+  me->_cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, me, &ApplePS2Controller::wakeMouseGated));
+  me->release();  // drop the retain from wakeDevicesParallel()
+}
+
+void ApplePS2Controller::wakeMouseGated(void)
+{
+  wakeDevice( kDT_Mouse );
+  _wakeMousePending = false;
+  _cmdGate->commandWakeup(&_wakeMousePending);
+}
+
+#endif // PARALLEL_WAKE
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::powerControlSleep(UInt32 ms)
+{
+  //
+  // Called by drivers from their power control action.  While devices are
+  // woken in parallel, the action runs with the command gate closed, so
+  // release it while we sleep: the other device's requests can go on.
+  //
+
+#if PARALLEL_WAKE
+  if (_wakeParallelActive && _workLoop->inGate())
+  {
+    AbsoluteTime deadline;
+    int event;  // never signalled, only the deadline ends the sleep
+    clock_interval_to_deadline(ms, kMillisecondScale, (uint64_t*)&deadline);
+    _cmdGate->commandSleep(&event, deadline, THREAD_UNINT);
+    return;
+  }
+#endif
+  IOSleep(ms);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::noteFirstEvent(PS2DeviceType deviceType)
+{
+  //
+  // Time from the start of wake to the first packet a device delivers after
+  // being reinitialized -- ie. when the user actually has input again.
+  //
+  // This method should only be called from our single-threaded work loop.
+  //
+
+  if (!_wakeFirstEventPending[deviceType])
+    return;
+  _wakeFirstEventPending[deviceType] = false;
+
+  uint64_t now;
+  clock_get_uptime(&now);
+  absolutetime_to_nanoseconds(now - _wakeTime, &now);
+  _wakeFirstEventTime[deviceType] = (UInt32)(now / 1000000);
+  publishWakeStatistics();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Controller::publishWakeStatistics(void)
+{
+  //
+  // Timings of the last wake.  A first event of 0 means the device has not
+  // delivered anything since.
+  //
+
+  if (OSDictionary* dict = OSDictionary::withCapacity(5))
+  {
+    setPropertyNumber(dict, "Ready Probe (us)", _wakeProbeTime, 32);
+    setPropertyNumber(dict, "Keyboard Reinit (us)", _wakeReinitTime[kDT_Keyboard], 32);
+    setPropertyNumber(dict, "Mouse Reinit (us)", _wakeReinitTime[kDT_Mouse], 32);
+    setPropertyNumber(dict, "Keyboard First Event (ms)", _wakeFirstEventTime[kDT_Keyboard], 32);
+    setPropertyNumber(dict, "Mouse First Event (ms)", _wakeFirstEventTime[kDT_Mouse], 32);
+    setProperty(kWakeStatistics, dict);
+    dict->release();
+  }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2Controller::installPowerControlAction(
                                           PS2DeviceType         deviceType,
                                           OSObject *            target, 
@@ -2021,39 +3757,39 @@ void ApplePS2Controller::uninstallPowerControlAction( PS2DeviceType deviceType )
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-void ApplePS2Controller::notificationHandlerGated(IOService * newService, IONotifier * notifier)
+bool ApplePS2Controller::notificationHandler(void * refCon, IOService * newService, IONotifier * notifier)
 {
+    // not gated: a subscription change may wait for deliveries in progress,
+    // and those can run into the gate themselves
+    if (newService == this)
+        return true;
+
     if (notifier == _publishNotify) {
         IOLog("%s: Notification consumer published: %s\n", getName(), newService->getName());
-        _notificationServices->setObject(newService);
+        if (!_notificationBus.subscribe(newService))
+            IOLog("%s: Too many notification consumers, ignoring %s\n", getName(), newService->getName());
     }
     
     if (notifier == _terminateNotify) {
         IOLog("%s: Notification consumer terminated: %s\n", getName(), newService->getName());
-        _notificationServices->removeObject(newService);
+        _notificationBus.unsubscribe(newService);
     }
+    _notificationBus.publishStats(this, kNotificationStatistics);
+    return true;
 }
 
-bool ApplePS2Controller::notificationHandler(void * refCon, IOService * newService, IONotifier * notifier)
+void ApplePS2Controller::onNotificationStatsTimer(void)
 {
-    _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePS2Controller::notificationHandlerGated), newService, notifier);
-    return true;
+    __atomic_store_n(&_notificationStatsPending, false, __ATOMIC_SEQ_CST);
+    _notificationBus.publishStats(this, kNotificationStatistics);
 }
 
-void ApplePS2Controller::dispatchMessageGated(int* message, void* data)
+void ApplePS2Controller::dispatchMessage(int message, void* data)
 {
-    OSCollectionIterator* i = OSCollectionIterator::withCollection(_notificationServices);
-    
-    if (i != NULL) {
-        while (IOService* service = OSDynamicCast(IOService, i->getNextObject())) {
-            service->message(*message, this, data);
-        }
-        i->release();
-    }
-    
+    _notificationBus.publish(message, this, data);
 
     // Convert kPS2M_notifyKeyPressed events into additional kPS2M_notifyKeyTime events for external consumers
-    if (*message == kPS2M_notifyKeyPressed) {
+    if (message == kPS2M_notifyKeyPressed) {
         
         // Register last key press, used for palm detection
         PS2KeyInfo* pInfo = (PS2KeyInfo*)data;
@@ -2072,15 +3808,13 @@ void ApplePS2Controller::dispatchMessageGated(int* message, void* data)
             case 0x3f:  // osx fn (function)
                 break;
             default:
-                int dispatchMessage = kPS2M_notifyKeyTime;
-                dispatchMessageGated(&dispatchMessage, &(pInfo->time));
+                _notificationBus.publish(kPS2M_notifyKeyTime, this, &(pInfo->time));
         }
     }
-}
-
-void ApplePS2Controller::dispatchMessage(int message, void* data)
-{
-    _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePS2Controller::dispatchMessageGated), &message, data);
+    // statistics follow within kNotificationStatsInterval, so the key press
+    // path only arms the timer, and only once per interval
+    if (_notificationStatsTimer && !__atomic_exchange_n(&_notificationStatsPending, true, __ATOMIC_SEQ_CST))
+        _notificationStatsTimer->setTimeoutMS(kNotificationStatsInterval);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
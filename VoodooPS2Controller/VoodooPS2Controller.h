@@ -117,6 +117,36 @@ class ApplePS2MouseDevice;
 #define HANDLE_INTERRUPT_DATA_LATER 0
 #define WATCHDOG_TIMER 0
 
+// Enable the interrupt driven request engine.  Response bytes for requests
+// are delivered by the keyboard/mouse interrupt handlers instead of being
+// polled off the data port, so the work loop is not held while a device is
+// slow to answer.  Requests issued while interrupts are unavailable (startup,
+// power transitions, device probing) are still processed by polling.
+
+#define INTERRUPT_DRIVEN_REQUESTS 1
+
+// Enable parallel keyboard/mouse reinitialization on wake.  Both drivers are
+// woken at the same time and their requests share the 8042 through the
+// request engine, so the keyboard is usable without waiting for the mouse
+// (or trackpad) to finish its reset.  Requires the request engine.
+
+#define PARALLEL_WAKE INTERRUPT_DRIVEN_REQUESTS
+
+// Enable packet capture and replay.  Every byte delivered to the mouse driver
+// (and the keyboard driver, with PacketCaptureKeyboard=true) can be recorded
+// (PacketCapture=true) and dumped to the registry; a dumped trace can be fed
+// back to the drivers, at its original speed or faster (ReplayPacketCapture),
+// to reproduce field reports.  Debug builds only: a capture of the keyboard
+// is a key log.
+
+#ifndef PACKET_CAPTURE
+#ifdef DEBUG
+#define PACKET_CAPTURE 1
+#else
+#define PACKET_CAPTURE 0
+#endif
+#endif
+
 // Interrupt definitions.
 
 #define kIRQ_Keyboard           1
@@ -133,6 +163,22 @@ class ApplePS2MouseDevice;
 #define kDataPort               0x60    // keyboard data & cmds (read/write)
 #define kCommandPort            0x64    // keybd status (read), command (write)
 
+// Port access.  All 8042 I/O done by the controller goes through these two,
+// so a build defining PS2_EXTERNAL_PORT_IO can supply its own implementation
+// (eg. an emulated 8042) without touching the request/interrupt logic.
+
+#ifndef PS2_EXTERNAL_PORT_IO
+#define PS2_EXTERNAL_PORT_IO 0
+#endif
+
+#if PS2_EXTERNAL_PORT_IO
+extern UInt8 ps2inb(UInt16 port);
+extern void  ps2outb(UInt16 port, UInt8 byte);
+#else
+static inline UInt8 ps2inb(UInt16 port)              { return inb(port); }
+static inline void  ps2outb(UInt16 port, UInt8 byte) { outb(port, byte); }
+#endif
+
 // Bit definitions for kCommandPort read values (status).
 
 #define kOutputReady            0x01    // output (from keybd) buffer full
@@ -146,6 +192,53 @@ class ApplePS2MouseDevice;
 
 #define kWatchdogTimerInterval  100
 
+// Request engine definitions
+
+#define kRequestByteTimeout     70      // ms, same budget as polled readDataPort
+#define kFailedGroupQuietMS     5       // ms without input that ends the drain after a failed group
+#define kFailedGroupDrainMax    16      // bytes at most dropped by that drain
+#define kResponseStreamNone     (-1)    // no request is waiting on either stream
+
+// Packet capture definitions
+//
+// A dumped capture ("Packet Capture") is a PS2CaptureHeader followed by
+// 'count' records, oldest first.  Each record is one byte delivered to a
+// driver, packed in 64 bits (so it is written and read in one go):
+//
+//    bits 0-7    the byte
+//    bits 8-15   device type (kDT_Keyboard, kDT_Mouse)
+//    bits 16-63  usec since the capture was started
+//
+// The same format is accepted for replay.
+
+#define kCaptureRecords         8192    // records kept (power of two)
+#define kCaptureMagic           0x43325350  // 'PS2C'
+#define kCaptureVersion         1
+#define kPacketCapture          "Packet Capture"
+#define kPacketReplay           "Packet Replay"
+
+struct PS2CaptureHeader
+{
+    UInt32 magic;
+    UInt16 version;
+    UInt16 headerSize;          // offset of the first record
+    UInt32 count;               // records following the header
+    UInt32 overwritten;         // older records lost to the ring wrapping
+    UInt64 startTime;           // nsec of uptime when the capture started
+};
+
+static inline UInt64 makeCaptureRecord(UInt64 time, UInt8 deviceType, UInt8 data)
+    { return time << 16 | (UInt64)deviceType << 8 | data; }
+static inline UInt64 captureRecordTime(UInt64 record) { return record >> 16; }
+static inline UInt8 captureRecordDevice(UInt64 record) { return (UInt8)(record >> 8); }
+static inline UInt8 captureRecordData(UInt64 record) { return (UInt8)record; }
+
+// Wake definitions
+
+#define kWakeProbeInterval      1       // ms between controller readiness probes
+#define kWakeProbeResponse      500     // usec for the controller to answer a probe
+#define kWakeStatistics         "Wake Statistics"
+
 #if DEBUGGER_SUPPORT
 // Definitions for our internal keyboard queue (holds keys processed by the
 // interrupt-time mini-monitor-key-sequence detection code).
@@ -160,6 +253,202 @@ struct KeyboardQueueElement
 };
 #endif //DEBUGGER_SUPPORT
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// PS2RequestQueue
+//
+// Lock-free multiple producer, single consumer queue of requests waiting for
+// the controller, with one lane per PS2RequestPriority.  Requests are linked
+// through their own chain.next, so queueing never allocates.
+//
+// Producers (any thread, any context):  enqueue() pushes the request onto
+//            the incoming stack of its lane with a compare and swap.
+//
+// Consumer (command gate closed):  dequeue() serves the lanes highest
+//            priority first.  When a lane's private list runs out, it takes
+//            the lane's whole incoming stack with one exchange and reverses
+//            it, so requests of a lane come out in the order they went in.
+//
+// Only the consumer removes requests, and it always takes a whole stack, so
+// a producer's compare and swap can not be fooled by a recycled request (ABA).
+//
+
+class PS2RequestQueue
+{
+    struct Lane
+    {
+        PS2Request* incoming;       // newest first, shared with producers
+        PS2Request* pending;        // oldest first, consumer only
+    };
+    Lane m_lanes[kPS2RP_Count];
+
+    static inline PS2Request* next(PS2Request* request)
+        { return (PS2Request*)request->chain.next; }
+    static inline void setNext(PS2Request* request, PS2Request* next)
+        { request->chain.next = (queue_entry_t)next; }
+
+public:
+    inline PS2RequestQueue() { bzero(m_lanes, sizeof(m_lanes)); }
+
+    // producers
+    void enqueue(PS2Request* request)
+    {
+        unsigned priority = request->priority;
+        if (priority >= kPS2RP_Count)
+            priority = kPS2RP_Normal;
+        Lane& lane = m_lanes[priority];
+        PS2Request* head = __atomic_load_n(&lane.incoming, __ATOMIC_RELAXED);
+        do
+            setNext(request, head);
+        while (!__atomic_compare_exchange_n(&lane.incoming, &head, request, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    // consumer
+    PS2Request* dequeue()
+    {
+        for (unsigned i = 0; i < kPS2RP_Count; i++)
+        {
+            Lane& lane = m_lanes[i];
+            if (!lane.pending && __atomic_load_n(&lane.incoming, __ATOMIC_RELAXED))
+            {
+                PS2Request* stack = __atomic_exchange_n(&lane.incoming, (PS2Request*)0, __ATOMIC_ACQUIRE);
+                while (stack)
+                {
+                    PS2Request* older = next(stack);
+                    setNext(stack, lane.pending);
+                    lane.pending = stack;
+                    stack = older;
+                }
+            }
+            if (PS2Request* request = lane.pending)
+            {
+                lane.pending = next(request);
+                return request;
+            }
+        }
+        return 0;
+    }
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// PS2RequestPool
+//
+// Preallocated requests for allocateRequest, in a few size classes, so that
+// requests made at runtime (keyboard LEDs and the like) do not go to the
+// kernel heap, and allocateRequest can be used where allocating is not
+// allowed.
+//
+// Each size class is a slab of equal sized blocks with a lock-free free list
+// (any thread, any context).  The list head packs the index of the first free
+// block with a count of pops, so a compare and swap against a head that was
+// popped and pushed back in the meantime fails (ABA).
+//
+// Requests larger than the largest class, or for which the class is empty,
+// fall back to the heap; the latter is counted per class.  release() tells
+// pool blocks from heap ones by address.
+//
+
+#define kRequestPoolStatistics  "RequestPool Statistics"
+
+class PS2RequestPool
+{
+    struct SizeClass
+    {
+        unsigned commands;          // capacity of each request
+        unsigned count;             // number of blocks
+        size_t   blockSize;
+        UInt8*   blocks;
+        UInt32*  next;              // free list link per block (index + 1)
+        UInt64   freeHead;          // pops << 32 | (index + 1), 0 = empty
+        UInt32   inUse;
+        UInt32   highWater;
+        UInt32   exhausted;         // allocations that went to the heap
+    };
+    enum { kClasses = 3 };
+    SizeClass m_classes[kClasses];
+    UInt32    m_published[kClasses][2];   // exhausted, highWater last published
+
+public:
+    bool init();
+    void free();
+
+    void* allocate(unsigned commands);
+    bool release(void* block);
+
+    void publishStats(IORegistryEntry* entry, const char* key);
+};
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// PS2NotificationBus
+//
+// Consumers of the kPS2M_* messages, per message ("topic").  A service
+// subscribes to the message codes (as given to iokit_vendor_specific_msg)
+// listed in its "RM,notificationTopics" property, or to every topic if it
+// has none, which keeps external consumers working as before.
+//
+// Subscriber lists are kept in two preallocated tables.  A subscription
+// change rebuilds the inactive table and then switches them, so publish()
+// neither allocates nor takes a lock or the command gate: it only pins the
+// active table with a reader count while delivering.  A table is rebuilt,
+// and a dropped service released, only once its readers have left; they
+// are waited for with m_lock dropped, so a subscriber's message handler may
+// wait for the gate while a subscription change waits for it.
+//
+
+#define kNotificationStatistics "Notification Statistics"
+#define kNotificationStatsInterval  1000    // ms between statistics updates
+
+class PS2NotificationBus
+{
+public:
+    enum
+    {
+        kTopicSetDisableTouchpad,
+        kTopicGetDisableTouchpad,
+        kTopicNotifyKeyPressed,
+        kTopicNotifyKeyTime,
+        kTopicOther,            // any message not listed above
+        kTopicCount
+    };
+    enum { kMaxSubscribers = 8 };
+
+private:
+    struct Table
+    {
+        IOService* subscribers[kTopicCount][kMaxSubscribers];
+        UInt32     count[kTopicCount];
+        UInt32     readers;
+    };
+    struct TopicStats
+    {
+        UInt64 published;
+        UInt64 delivered;
+        UInt64 totalTime;       // ns, publish to last delivery
+        UInt64 maxTime;
+    };
+    Table      m_tables[2];
+    UInt32     m_active;
+    IOLock*    m_lock;          // protects m_services, m_topics, m_rebuilding
+    bool       m_rebuilding;    // a rebuild is waiting for readers
+    IOService* m_services[kMaxSubscribers];     // retained
+    UInt32     m_topics[kMaxSubscribers];       // topic mask per service
+    TopicStats m_stats[kTopicCount];
+
+    static int topicOf(int message);
+    static void drain(Table& table);
+    void rebuild();
+
+public:
+    bool init();
+    void free();
+    void clear();
+
+    bool subscribe(IOService* service);
+    void unsubscribe(IOService* service);
+    void publish(int message, IOService* sender, void* data);
+
+    void publishStats(IORegistryEntry* entry, const char* key);
+};
+
 // Info.plist definitions
 
 #define kDisableDevice          "DisableDevice"
@@ -170,6 +459,7 @@ struct KeyboardQueueElement
 #endif
 
 class IOACPIPlatformDevice;
+class IOTimerEventSource;
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // ApplePS2Controller Class Declaration
@@ -198,8 +488,8 @@ public:                                // interrupt-time variables and functions
 
 private:
   IOWorkLoop *             _workLoop;
-  queue_head_t             _requestQueue;
-  IOLock*                  _requestQueueLock;
+  PS2RequestQueue          _requestQueue;
+  PS2RequestPool           _requestPool;
   IOLock*                  _cmdbyteLock;
 
   OSObject *               _interruptTargetKeyboard;
@@ -227,7 +517,10 @@ private:
   IONotifier*              _publishNotify;
   IONotifier*              _terminateNotify;
     
-  OSSet*                   _notificationServices;
+  PS2NotificationBus       _notificationBus;
+  IOTimerEventSource*      _notificationStatsTimer;
+  volatile bool            _notificationStatsPending;  // timer armed
+  PS2KeyClock              _keyClock;
     
 #if DEBUGGER_SUPPORT
   IOSimpleLock *           _controllerLock;       // mach simple spin lock
@@ -247,16 +540,87 @@ private:
 #ifdef NEWIRQ
   bool   				   _newIRQLayout;
 #endif
-  int                      _wakedelay;
+  int                      _wakedelay;            // ms, upper bound of readiness probe
   bool                     _mouseWakeFirst;
+#if PARALLEL_WAKE
+  bool                     _parallelWake;
+  bool                     _wakeParallelActive;   // drivers are being woken concurrently
+  bool                     _wakeMousePending;
+  thread_call_t            _wakeMouseThreadCall;
+#endif
+#if PACKET_CAPTURE
+  UInt64 *                 _captureRing;          // kCaptureRecords, never freed while running
+  UInt32                   _captureHead;          // records written (free running)
+  volatile bool            _capturing;
+  bool                     _captureKeyboard;      // keyboard bytes too (PacketCaptureKeyboard)
+  uint64_t                 _captureStart;
+  IOTimerEventSource*      _replayTimer;
+  OSData*                  _replayTrace;
+  unsigned                 _replayIndex;
+  unsigned                 _replaySpeed;          // 1 = original, n = n times faster, 0 = no delays
+  uint64_t                 _replayStart;
+  volatile bool            _replaying;
+#endif
+  uint64_t                 _wakeTime;             // when the last wake started
+  UInt32                   _wakeProbeTime;        // usec spent waiting for the 8042
+  UInt32                   _wakeReinitTime[2];    // usec per kDT_Keyboard/kDT_Mouse
+  UInt32                   _wakeFirstEventTime[2];  // ms from wake to first packet
+  bool                     _wakeFirstEventPending[2];
   IOCommandGate*           _cmdGate;
 #if WATCHDOG_TIMER
   IOTimerEventSource*      _watchdogTimer;
 #endif
   OSDictionary*            _rmcfCache;
 
+#if INTERRUPT_DRIVEN_REQUESTS
+  // State of the request currently being executed by the request engine.
+  // Only touched with the command gate closed, except for _responseStream
+  // and _responseBuffer, which are shared with the interrupt handlers under
+  // _responseLock.
+
+  enum RequestWait
+  {
+    kRW_None,                                     // running
+    kRW_Byte,                                     // waiting for a response byte
+    kRW_Sleep,                                    // waiting out kPS2C_SleepMS
+    kRW_Drain,                                    // waiting for quiet after a failed group
+    kRW_Expired                                   // request timer fired
+  };
+
+  struct RequestWaiter                            // submitRequestAndBlock caller
+  {
+    PS2Request *           request;
+    bool                   done;
+    RequestWaiter *        next;
+  };
+
+  IOTimerEventSource*      _requestTimer;
+  IOSimpleLock*            _responseLock;
+  volatile int             _responseStream;       // kDT_* routed to _responseBuffer
+  RingBuffer<UInt8, 32>    _responseBuffer;
+  // Bytes for the drivers, per kDT_Keyboard/kDT_Mouse.  Filled with
+  // _responseLock held (so they stay in port order) and drained by whoever
+  // wins _driverFeedOwner, with the lock released and interrupts enabled.
+  RingBuffer<UInt8, 128>   _driverFeed[2];
+  UInt32                   _driverFeedOwner[2];
+  PS2Request *             _activeRequest;
+  unsigned                 _activeIndex;
+  PS2DeviceType            _activeDeviceMode;
+  bool                     _activeTransmitToMouse;
+  bool                     _activeFailed;
+  unsigned                 _activeGroupStart;     // kPS2C_TryCommands in effect
+  unsigned                 _activeGroupEnd;
+  bool                     _activeFirstByteHeld;
+  UInt8                    _activeFirstByte;
+  RequestWait              _activeWait;
+  unsigned                 _activeDrained;        // bytes dropped so far, while draining
+  bool                     _activeDraining;
+  RequestWaiter *          _requestWaiters;
+#endif
+
   virtual PS2InterruptResult _dispatchDriverInterrupt(PS2DeviceType deviceType, UInt8 data);
   virtual void dispatchDriverInterrupt(PS2DeviceType deviceType, UInt8 data);
+  void signalPacketReady(PS2DeviceType deviceType);
 #if HANDLE_INTERRUPT_DATA_LATER
   virtual void  interruptOccurred(IOInterruptEventSource *, int);
 #else
@@ -269,6 +633,38 @@ private:
 #endif
   virtual void  processRequest(PS2Request * request);
   virtual void  processRequestQueue(IOInterruptEventSource *, int);
+  void completeRequest(PS2Request * request, bool failed, unsigned index);
+  bool testCommandCondition(PS2Request * request, unsigned index);
+  unsigned abandonCommandGroup(PS2Request * request, unsigned groupStart, unsigned index);
+  UInt32 drainDataPort(PS2DeviceType deviceType);
+#if INTERRUPT_DRIVEN_REQUESTS
+  bool canUseRequestEngine(void);
+  void runRequestEngine(void);
+  bool stepActiveRequest(bool polled);
+  bool readResponseByte(int expectedByte, UInt8 * result, bool polled);
+  bool pollResponseByte(UInt32 timeoutMS = kRequestByteTimeout);
+  void setResponseStream(int stream);
+  void dispatchResponseByte(UInt8 data);
+  UInt32 flushResponseData(void);
+  bool drainResponseData(bool polled);
+  void finishRequestsPolled(void);
+  void onRequestTimer(void);
+  inline bool routeResponseByte(UInt8 status, UInt8 data)
+  {
+    // only called at interrupt time (or polling) with _responseLock held
+    if (_responseStream != ((status & kMouseData) ? kDT_Mouse : kDT_Keyboard))
+      return false;
+    _responseBuffer.push(data);
+    return true;
+  }
+  inline void queueDriverByte(PS2DeviceType deviceType, UInt8 data)
+  {
+    // called with _responseLock held; feedDriver delivers it
+    if (!liveInputHeld())
+      _driverFeed[deviceType].push(data);
+  }
+  bool feedDriver(PS2DeviceType deviceType);
+#endif
 
   virtual UInt8 readDataPort(PS2DeviceType deviceType);
   virtual void  writeCommandPort(UInt8 byte);
@@ -278,10 +674,8 @@ private:
   static void interruptHandlerMouse(OSObject*, void* refCon, IOService*, int);
   static void interruptHandlerKeyboard(OSObject*, void* refCon, IOService*, int);
    
-  void notificationHandlerGated(IOService * newService, IONotifier * notifier);
   bool notificationHandler(void * refCon, IOService * newService, IONotifier * notifier);
-
-  void dispatchMessageGated(int* message, void* data);
+  void onNotificationStatsTimer(void);
     
 #if OUT_OF_ORDER_DATA_CORRECTION_FEATURE
   virtual UInt8 readDataPort(PS2DeviceType deviceType, UInt8 expectedByte);
@@ -297,6 +691,39 @@ private:
   virtual void setPowerStateGated(UInt32 newPowerState);
 
   virtual void dispatchDriverPowerControl(UInt32 whatToDo, PS2DeviceType deviceType);
+  UInt32 probeControllerReady(UInt32 limit);
+  void wakeDevice(PS2DeviceType deviceType);
+#if PARALLEL_WAKE
+  void wakeDevicesParallel(void);
+  static void wakeMouseCallout(thread_call_param_t param0,
+                               thread_call_param_t param1);
+  void wakeMouseGated(void);
+#endif
+  void noteFirstEvent(PS2DeviceType deviceType);
+  inline bool liveInputHeld() const
+  {
+#if PARALLEL_WAKE
+    // while the drivers are woken in parallel, the IRQs are on for the
+    // request engine only: device input waits until both are reinitialized
+    if (__atomic_load_n(&_wakeParallelActive, __ATOMIC_RELAXED))
+      return true;
+#endif
+#if PACKET_CAPTURE
+    // while a trace is replayed, the drivers get the trace and nothing else
+    return _replaying;
+#else
+    return false;
+#endif
+  }
+#if PACKET_CAPTURE
+  void captureByte(PS2DeviceType deviceType, UInt8 data);
+  void setPacketCapture(bool enable);
+  void publishPacketCapture(void);
+  void startPacketReplay(OSData* trace, unsigned speed);
+  void stopPacketReplay(bool resync);
+  void onReplayTimer(void);
+#endif
+  void publishWakeStatistics(void);
   void free(void) override;
   IOReturn setPropertiesGated(OSObject* props);
   void submitRequestAndBlockGated(PS2Request* request);
@@ -330,8 +757,10 @@ public:
                                          PS2PowerControlAction action);
 
   virtual void uninstallPowerControlAction(PS2DeviceType deviceType);
+  virtual void powerControlSleep(UInt32 ms);
     
   virtual void dispatchMessage(int message, void* data);
+  inline PS2KeyClock* getKeyClock() { return &_keyClock; }
     
   IOReturn setProperties(OSObject* props) override;
   virtual void lock();
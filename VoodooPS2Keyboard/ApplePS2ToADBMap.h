@@ -42,7 +42,7 @@
 
 // PS/2 scancode reference : USB HID to PS/2 Scan Code Translation Table PS/2 Set 1 columns
 // http://download.microsoft.com/download/1/6/1/161ba512-40e2-4cc9-843a-923143f3456c/translate.pdf
-static const UInt8 PS2ToADBMapStock[ADB_CONVERTER_LEN] =
+static constexpr UInt8 PS2ToADBMapStock[ADB_CONVERTER_LEN] =
 {
 /*  ADB        AT  ANSI Key-Legend
     ======================== */
@@ -605,7 +605,7 @@ static const UInt8 PS2ToADBMapStock[ADB_CONVERTER_LEN] =
 #define kMaskLeftFn         0x0100
 #define kMaskWindowsContext 0x0200
 
-static const UInt16 _PS2flagsStock[ADB_CONVERTER_LEN] =
+static constexpr UInt16 _PS2flagsStock[ADB_CONVERTER_LEN] =
 {
     // flags/modifier key        AT  ANSI Key-Legend
     0x00,   // 00
@@ -1137,4 +1137,55 @@ static const UInt16 _PS2flagsStock[ADB_CONVERTER_LEN] =
     0x00,   // e0 ff // End reserved
 };
 
+///////////////////////////////////////////////////////////////////////////////////
+//
+//
+// Stock PS2KeyEntry table, folded together at compile time from the tables above.
+// The keyboard driver copies it as a whole into its working table on init.
+// (PS2KeyEntry and the kKeyAction values come from VoodooPS2Keyboard.h)
+//
+
+struct PS2KeyTable
+{
+    PS2KeyEntry keys[ADB_CONVERTER_LEN];
+};
+
+static constexpr UInt8 stockKeyAction(unsigned keyCode)
+{
+    if (keyCode >= 0x01f0 && keyCode <= 0x01ff)
+        return kKeyActionACPI;
+    switch (keyCode)
+    {
+        case 0x004e:    // Numpad+
+        case 0x004a:    // Numpad-
+        case 0x0153:    // delete
+        case 0x015f:    // sleep
+        case 0x0128:    // discrete trackpad toggle
+        case 0x0137:    // prt sc/sys rq
+        case 0x0127:    // discrete fnkeys toggle
+            return kKeyActionSpecial;
+    }
+    return kKeyActionNone;
+}
+
+static constexpr PS2KeyTable makeStockKeyTable()
+{
+    PS2KeyTable table = {};
+    for (unsigned i = 0; i < ADB_CONVERTER_LEN; i++)
+    {
+        // by default, each map entry is just itself (no mapping)
+        // first half of map is normal scan codes, second half is extended scan codes (e0)
+        PS2KeyEntry& key = table.keys[i];
+        key.remap = i;
+        key.flags = _PS2flagsStock[i] & 0xff;
+        key.modifier = _PS2flagsStock[i] >> 8;
+        key.adb = PS2ToADBMapStock[i];
+        key.adbMapped = PS2ToADBMapStock[i];
+        key.action = stockKeyAction(i);
+    }
+    return table;
+}
+
+static constexpr PS2KeyTable PS2KeyTableStock = makeStockKeyTable();
+
 #endif /* !_APPLEPS2TOADBMAP_H */
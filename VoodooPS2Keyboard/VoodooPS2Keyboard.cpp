@@ -37,7 +37,6 @@
 #include <IOKit/IOTimerEventSource.h>
 #pragma clang diagnostic pop
 
-#include "ApplePS2ToADBMap.h"
 #include "VoodooPS2Controller.h"
 #include "VoodooPS2Keyboard.h"
 #include "ApplePS2ToADBMap.h"
@@ -59,11 +58,19 @@
 #define kMakeRightModsHangulHanja           "Make right modifier keys into Hangul and Hanja"
 #define kUseISOLayoutKeyboard               "Use ISO layout keyboard"
 #define kLogScanCodes                       "LogScanCodes"
+#define kTypematicSuppression               "TypematicSuppression"
+#define kTypematicStatistics                "Typematic Statistics"
 
 #define kBrightnessHack                     "BrightnessHack"
 #define kMacroInversion                     "Macro Inversion"
 #define kMacroTranslation                   "Macro Translation"
 #define kMaxMacroTime                       "MaximumMacroTime"
+#define kCompiledKeymap                     "Compiled Keymap"
+#define kDefault                            "Default"
+#define kACPIStatistics                     "ACPI Statistics"
+
+// _acpiQueue commands: RKAx method index (0-F), plus Arg0 of the call
+#define kACPIKeyDown            0x10
 
 // Definitions for Macro Inversion data format
 //REVIEW: This should really be defined as some sort of structure
@@ -165,6 +172,13 @@ bool ApplePS2Keyboard::init(OSDictionary * dict)
     _interruptHandlerInstalled = false;
     _ledState                  = 0;
     _lastdata = 0;
+    _typematicMode = kTypematicHardware;
+    _publishedTypematicMode = kTypematicHardware;
+    _typematicFallback = false;
+    _interruptCount = 0;
+    _typematicRepeats = 0;
+    _publishedInterrupts = 0;
+    _publishedRepeats = 0;
     
     _swapcommandoption = false;
     _sleepEjectTimer = 0;
@@ -189,28 +203,53 @@ bool ApplePS2Keyboard::init(OSDictionary * dict)
     _macroTranslation = 0;
     _macroBuffer = 0;
     _macroCurrent = 0;
+    _macroState = MacroInversionTrie::kRoot;
     _macroMax = 0;
     _macroMaxTime = 25000000ULL;
     _macroTimer = 0;
 
     _ignoreCapsLedChange = false;
 
-    // start out with all keys up
-    bzero(_keyBitVector, sizeof(_keyBitVector));
-    
-    // make separate copy of ADB translation table.
-    bcopy(PS2ToADBMapStock, _PS2ToADBMapMapped, sizeof(_PS2ToADBMapMapped));
+    // start out with all keys up, no PS2 -> PS2 mapping and the stock ADB codes
+    bzero(_keyDown, sizeof(_keyDown));
+    bzero(_breaklessKeys, sizeof(_breaklessKeys));
+    static_assert(sizeof(PS2KeyTableStock.keys) == KBV_NUM_KEYCODES * sizeof(PS2KeyEntry), "Invalid stock key table size");
+    _keyTableData = OSData::withBytes(PS2KeyTableStock.keys, sizeof(PS2KeyTableStock.keys));
+    _retiredKeyTables = OSArray::withCapacity(2);
+    _keyTableLock = IOLockAlloc();
+    _keyTableTimer = 0;
+    
+    // ACPI methods are run by _acpiThreadCall, created in start
+    _acpiThreadCall = 0;
+    _acpiLock = IOLockAlloc();
+    _brightnessSteps = 0;
+    _backlightSteps = 0;
+    _acpiEvaluations = 0;
+    _acpiCoalesced = 0;
+    _acpiTotalTime = 0;
+    _acpiMaxTime = 0;
+    if (!_keyTableData || !_retiredKeyTables || !_keyTableLock || !_acpiLock)
+        return false;
+    _keyTable = (PS2KeyEntry*)_keyTableData->getBytesNoCopy();
     
-    // Setup the PS2 -> PS2 scan code mapper
-    for (int i = 0; i < countof(_PS2ToPS2Map); i++)
+    return true;
+}
+
+void ApplePS2Keyboard::free()
+{
+    OSSafeReleaseNULL(_keyTableData);
+    OSSafeReleaseNULL(_retiredKeyTables);
+    if (_keyTableLock)
     {
-        // by default, each map entry is just itself (no mapping)
-        // first half of map is normal scan codes, second half is extended scan codes (e0)
-        _PS2ToPS2Map[i] = i;
+        IOLockFree(_keyTableLock);
+        _keyTableLock = 0;
     }
-    bcopy(_PS2flagsStock, _PS2flags, sizeof(_PS2flags));
-    
-    return true;
+    if (_acpiLock)
+    {
+        IOLockFree(_acpiLock);
+        _acpiLock = 0;
+    }
+    super::free();
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -256,28 +295,33 @@ ApplePS2Keyboard* ApplePS2Keyboard::probe(IOService * provider, SInt32 * score)
     
     if (config)
     {
-        // now load PS2 -> PS2 configuration data
-        loadCustomPS2Map(OSDynamicCast(OSArray, config->getObject("Custom PS2 Map")));
-        loadBreaklessPS2(config, "Breakless PS2");
-        
-        // now load PS2 -> ADB configuration data
-        loadCustomADBMap(config, "Custom ADB Map");
+        // a compiled keymap replaces all of the string based maps below, except
+        // for a Default one when a more specific profile has string maps
+        if (compiledKeymapOverridden(list, config) || !loadCompiledKeymap(config, kCompiledKeymap))
+        {
+            // now load PS2 -> PS2 configuration data
+            loadCustomPS2Map(OSDynamicCast(OSArray, config->getObject("Custom PS2 Map")));
+            loadBreaklessPS2(config, "Breakless PS2");
+            
+            // now load PS2 -> ADB configuration data
+            loadCustomADBMap(config, "Custom ADB Map");
+            
+            // function key maps are parsed once here, not on every HIDFKeyMode change
+            _keysStandard = parseCustomPS2Map(OSDynamicCast(OSArray, config->getObject(kFunctionKeysStandard)));
+            _keysSpecial = parseCustomPS2Map(OSDynamicCast(OSArray, config->getObject(kFunctionKeysSpecial)));
+        }
         
         // determine if _fkeymode property should be handled in setParamProperties
-        _keysStandard = OSDynamicCast(OSArray, config->getObject(kFunctionKeysStandard));
-        _keysSpecial = OSDynamicCast(OSArray, config->getObject(kFunctionKeysSpecial));
         _fkeymodesupported = _keysStandard && _keysSpecial;
         if (_fkeymodesupported)
         {
             setProperty(kHIDFKeyMode, (uint64_t)0, 64);
-            _keysStandard->retain();
-            _keysSpecial->retain();
-            loadCustomPS2Map(_keysSpecial);
+            applyCustomPS2Map(_keyTable, _keysSpecial);
         }
         else
         {
-            _keysStandard = NULL;
-            _keysSpecial = NULL;
+            OSSafeReleaseNULL(_keysStandard);
+            OSSafeReleaseNULL(_keysSpecial);
         }
         
         // load custom macro data
@@ -294,13 +338,19 @@ ApplePS2Keyboard* ApplePS2Keyboard::probe(IOService * provider, SInt32 * score)
             }
             _macroBuffer = new UInt8[max*kPacketLength];
             _macroMax = max;
+            if (!_macroTrie.build(_macroInversion))
+                IOLog("%s: Macro Inversion rules could not be compiled\n", getName());
+            _macroState = MacroInversionTrie::kRoot;
         }
     }
     
     // now copy to our PS2ToADBMap -- working copy...
-    bcopy(_PS2ToADBMapMapped, _PS2ToADBMap, sizeof(_PS2ToADBMap));
+    for (int i = 0; i < KBV_NUM_KEYCODES; i++)
+        _keyTable[i].adb = _keyTable[i].adbMapped;
+    setBreaklessKeys(_keyTable);
     
     // populate rest of values via setParamProperties
+    updateKeyTable(config);
     setParamPropertiesGated(config);
     OSSafeReleaseNULL(config);
 
@@ -343,6 +393,12 @@ bool ApplePS2Keyboard::start(IOService * provider)
     setProperty(kDeliverNotifications, kOSBooleanTrue);
 
     setProperty(kDeliverNotifications, kOSBooleanTrue);
+    // ACPI notifications only, none of the kPS2M_* messages from the controller
+    if (OSArray* topics = OSArray::withCapacity(0))
+    {
+        setProperty(kNotificationTopics, topics);
+        topics->release();
+    }
     //
     // The driver has been instructed to start.   This is called after a
     // successful attach.
@@ -386,9 +442,19 @@ bool ApplePS2Keyboard::start(IOService * provider)
     if (_macroTimer)
         pWorkLoop->addEventSource(_macroTimer);
     
+    // _keyTableTimer releases key tables replaced by updateKeyTable
+    _keyTableTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2Keyboard::onKeyTableTimer));
+    if (_keyTableTimer)
+        pWorkLoop->addEventSource(_keyTableTimer);
+    
     // get IOACPIPlatformDevice for Device (PS2K)
     //REVIEW: should really look at the parent chain for IOACPIPlatformDevice instead.
     _provider = (IOACPIPlatformDevice*)IORegistryEntry::fromPath("IOService:/AppleACPIPlatformExpert/PS2K");
+    
+    // ACPI methods triggered by keys are evaluated on a thread call, so slow AML
+    // does not hold up the keys that follow
+    if (_provider)
+        _acpiThreadCall = thread_call_allocate((thread_call_func_t)acpiCallout, (thread_call_param_t)this);
 
     //
     // get brightness levels for ACPI based brightness keys
@@ -543,11 +609,113 @@ bool ApplePS2Keyboard::start(IOService * provider)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+bool ApplePS2Keyboard::loadCompiledKeymap(OSDictionary* dict, const char* name)
+{
+    OSData* data = OSDynamicCast(OSData, dict->getObject(name));
+    if (NULL == data)
+        return false;
+    
+    // validate the whole blob before touching the tables, fall back to the string maps if bad
+    const PS2KeymapHeader* header = (const PS2KeymapHeader*)data->getBytesNoCopy();
+    unsigned length = data->getLength();
+    // (function key maps come in pairs: both sections or neither)
+    if (length < sizeof(PS2KeymapHeader) || kKeymapMagic != header->magic ||
+        kKeymapVersion != header->version || KBV_NUM_KEYCODES != header->keyCount ||
+        !header->standardCount != !header->specialCount ||
+        length != sizeof(PS2KeymapHeader) + header->keyCount * sizeof(PS2KeymapEntry) +
+            (header->standardCount + header->specialCount) * sizeof(PS2KeymapRemap))
+    {
+        IOLog("VoodooPS2Keyboard: invalid %s, using string maps\n", name);
+        return false;
+    }
+    const PS2KeymapEntry* entries = (const PS2KeymapEntry*)(header + 1);
+    const PS2KeymapRemap* remaps = (const PS2KeymapRemap*)(entries + header->keyCount);
+    int remapCount = header->standardCount + header->specialCount;
+    for (int i = 0; i < header->keyCount; i++)
+    {
+        if (entries[i].remap >= KBV_NUM_KEYCODES)
+        {
+            IOLog("VoodooPS2Keyboard: invalid %s entry %x, using string maps\n", name, i);
+            return false;
+        }
+    }
+    for (int i = 0; i < remapCount; i++)
+    {
+        if (remaps[i].from >= KBV_NUM_KEYCODES || remaps[i].to >= KBV_NUM_KEYCODES)
+        {
+            IOLog("VoodooPS2Keyboard: invalid %s function key entry %d, using string maps\n", name, i);
+            return false;
+        }
+    }
+    
+    // records map one to one onto the key table
+    for (int i = 0; i < KBV_NUM_KEYCODES; i++)
+    {
+        PS2KeyEntry& key = _keyTable[i];
+        key.remap = entries[i].remap;
+        key.flags |= entries[i].flags & kBreaklessKey;
+        if (entries[i].flags & kKeymapCustomADB)
+            key.adbMapped = entries[i].adb;
+    }
+    if (remapCount)
+    {
+        _keysStandard = OSData::withBytes(remaps, header->standardCount * sizeof(PS2KeymapRemap));
+        _keysSpecial = OSData::withBytes(remaps + header->standardCount, header->specialCount * sizeof(PS2KeymapRemap));
+    }
+    return true;
+}
+
+bool ApplePS2Keyboard::compiledKeymapOverridden(OSDictionary* list, OSDictionary* config)
+{
+    // The merged configuration holds the objects of the profile each entry came
+    // from, so an entry that is not the Default one was set by the platform
+    // profile or RMCF.  A string map set there is more specific than a compiled
+    // keymap from Default, which was not compiled from it.
+    static const char* const stringMaps[] = {
+        "Custom PS2 Map", "Breakless PS2", "Custom ADB Map", kFunctionKeysStandard, kFunctionKeysSpecial,
+    };
+    
+    OSDictionary* defaults = list ? OSDynamicCast(OSDictionary, list->getObject(kDefault)) : NULL;
+    OSObject* keymap = config->getObject(kCompiledKeymap);
+    if (NULL == keymap || NULL == defaults || defaults->getObject(kCompiledKeymap) != keymap)
+        return false;
+    for (int i = 0; i < countof(stringMaps); i++)
+    {
+        if (config->getObject(stringMaps[i]) != defaults->getObject(stringMaps[i]))
+        {
+            IOLog("VoodooPS2Keyboard: %s overrides the Default %s, using string maps\n", stringMaps[i], kCompiledKeymap);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ApplePS2Keyboard::applyCustomPS2Map(PS2KeyEntry* table, OSData* data)
+{
+    const PS2KeymapRemap* remaps = (const PS2KeymapRemap*)data->getBytesNoCopy();
+    int count = data->getLength() / sizeof(PS2KeymapRemap);
+    for (int i = 0; i < count; i++)
+        table[remaps[i].from].remap = remaps[i].to;
+}
+
 void ApplePS2Keyboard::loadCustomPS2Map(OSArray* pArray)
 {
+    if (OSData* data = parseCustomPS2Map(pArray))
+    {
+        applyCustomPS2Map(_keyTable, data);
+        data->release();
+    }
+}
+
+OSData* ApplePS2Keyboard::parseCustomPS2Map(OSArray* pArray)
+{
+    OSData* result = NULL;
     if (NULL != pArray)
     {
         int count = pArray->getCount();
+        result = OSData::withCapacity(count * sizeof(PS2KeymapRemap));
+        if (NULL == result)
+            return NULL;
         for (int i = 0; i < count; i++)
         {
             OSString* pString = OSDynamicCast(OSString, pArray->getObject(i));
@@ -572,12 +740,15 @@ void ApplePS2Keyboard::loadCustomPS2Map(OSArray* pArray)
                 IOLog("VoodooPS2Keyboard: scan code invalid for PS2 map entry: \"%s\"\n", psz);
                 continue;
             }
-            // modify PS2 to PS2 map per remap entry
-            int index = (scanIn & 0xff) + (exIn == 0xe0 ? KBV_NUM_SCANCODES : 0);
-            assert(index < countof(_PS2ToPS2Map));
-            _PS2ToPS2Map[index] = (scanOut & 0xff) + (exOut == 0xe0 ? KBV_NUM_SCANCODES : 0);
+            // add PS2 to PS2 map remap entry
+            PS2KeymapRemap remap;
+            remap.from = (scanIn & 0xff) + (exIn == 0xe0 ? KBV_NUM_SCANCODES : 0);
+            remap.to = (scanOut & 0xff) + (exOut == 0xe0 ? KBV_NUM_SCANCODES : 0);
+            assert(remap.from < KBV_NUM_KEYCODES);
+            result->appendBytes(&remap, sizeof(remap));
         }
     }
+    return result;
 }
 
 void ApplePS2Keyboard::loadBreaklessPS2(OSDictionary* dict, const char* name)
@@ -611,12 +782,25 @@ void ApplePS2Keyboard::loadBreaklessPS2(OSDictionary* dict, const char* name)
             }
             // modify PS2 to PS2 map per remap entry
             int index = (scanIn & 0xff) + (exIn == 0xe0 ? KBV_NUM_SCANCODES : 0);
-            assert(index < countof(_PS2flags));
-            _PS2flags[index] |= kBreaklessKey;
+            assert(index < KBV_NUM_KEYCODES);
+            _keyTable[index].flags |= kBreaklessKey;
         }
     }
 }
 
+void ApplePS2Keyboard::setBreaklessKeys(const PS2KeyEntry* table)
+{
+    // one word at a time, interruptOccurred may be reading them
+    for (int i = 0; i < KBV_NUM_KEYCODES / 32; i++)
+    {
+        UInt32 bits = 0;
+        for (int j = 0; j < 32; j++)
+            if (table[i * 32 + j].flags & kBreaklessKey)
+                bits |= 1U << j;
+        __atomic_store_n(&_breaklessKeys[i], bits, __ATOMIC_RELAXED);
+    }
+}
+
 void ApplePS2Keyboard::loadCustomADBMap(OSDictionary* dict, const char* name)
 {
     OSArray* pArray = OSDynamicCast(OSArray, dict->getObject(name));
@@ -648,8 +832,8 @@ void ApplePS2Keyboard::loadCustomADBMap(OSDictionary* dict, const char* name)
             }
             // modify PS2 to ADB map per remap entry
             int index = (scanIn & 0xff) + (exIn == 0xe0 ? ADB_CONVERTER_EX_START : 0);
-            assert(index < countof(_PS2ToADBMapMapped));
-            _PS2ToADBMapMapped[index] = adbOut;
+            assert(index < KBV_NUM_KEYCODES);
+            _keyTable[index].adbMapped = adbOut;
         }
     }
 }
@@ -707,32 +891,141 @@ OSData** ApplePS2Keyboard::loadMacroData(OSDictionary* dict, const char* name)
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// MacroInversionTrie Implementation
 
-void ApplePS2Keyboard::setParamPropertiesGated(OSDictionary * dict)
+bool MacroInversionTrie::build(OSData* const* rules)
 {
-    if (NULL == dict)
-        return;
-    
-//REVIEW: this code needs cleanup (should be table driven like mouse/trackpad)
+    free();
 
-    // get time before sleep button takes effect
-	if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSleepPressTime)))
+    // one state per packet of every rule at most, plus the root
+    unsigned rulesCount = 0, packets = 0;
+    for (OSData* const* p = rules; *p; p++, rulesCount++)
+        packets += ((*p)->getLength()-kPrefixBytes) / kPacketKeyDataLength;
+    if (rulesCount >= kNoRule || packets + 1 > 0xFFFF)
+        return false;
+
+    m_edgeCount = 1;
+    while (m_edgeCount < 2 * (packets + 1))
+        m_edgeCount <<= 1;
+    m_nodes = new Node[packets + 1];
+    m_terminals = new Terminal[rulesCount];
+    m_edges = new Edge[m_edgeCount];
+    if (!m_nodes || !m_terminals || !m_edges)
     {
-        _maxsleeppresstime = num->unsigned32BitValue();
-        setProperty(kSleepPressTime, _maxsleeppresstime, 32);
+        free();
+        return false;
     }
-    // get time before eject button takes effect (no modifiers)
-    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kHIDF12EjectDelay)))
+    for (unsigned i = 0; i < m_edgeCount; i++)
+        m_edges[i].child = kNoState;
+    m_nodeCount = 1;
+    m_nodes[kRoot].terminalCount = 0;
+    m_nodes[kRoot].firstDeeper = kNoRule;
+
+    // first pass: states, the first rule going past each, rules ending in each
+    unsigned rule = 0;
+    for (OSData* const* p = rules; *p; p++, rule++)
     {
-        _f12ejectdelay = num->unsigned32BitValue();
-        setProperty(kHIDF12EjectDelay, _f12ejectdelay, 32);
+        const UInt8* data = static_cast<const UInt8*>((*p)->getBytesNoCopy());
+        int count = ((*p)->getLength()-kPrefixBytes) / kPacketKeyDataLength;
+        int state = kRoot;
+        for (int i = 0; i < count; i++)
+        {
+            if (kNoRule == m_nodes[state].firstDeeper)
+                m_nodes[state].firstDeeper = rule;
+            state = addEdge(state, data+kSequenceBytesOffset+i*kPacketKeyDataLength);
+        }
+        m_nodes[state].terminalCount++;
     }
-    // get time between keys part of a macro "inversion"
-    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kMaxMacroTime)))
+    unsigned first = 0;
+    for (unsigned i = 0; i < m_nodeCount; i++)
     {
-        _macroMaxTime = num->unsigned64BitValue();
-        setProperty(kMaxMacroTime, _macroMaxTime, 64);
+        m_nodes[i].firstTerminal = first;
+        first += m_nodes[i].terminalCount;
+        m_nodes[i].terminalCount = 0;
     }
+
+    // second pass: rules ending in each state, in rule order
+    rule = 0;
+    for (OSData* const* p = rules; *p; p++, rule++)
+    {
+        const UInt8* data = static_cast<const UInt8*>((*p)->getBytesNoCopy());
+        int count = ((*p)->getLength()-kPrefixBytes) / kPacketKeyDataLength;
+        int state = kRoot;
+        for (int i = 0; i < count; i++)
+            state = next(state, data+kSequenceBytesOffset+i*kPacketKeyDataLength);
+        Node& node = m_nodes[state];
+        Terminal& terminal = m_terminals[node.firstTerminal + node.terminalCount++];
+        terminal.rule = rule;
+        terminal.mask = (static_cast<UInt16>(data[kModifierBytesOffset+0]) << 8) + data[kModifierBytesOffset+1];
+        terminal.compare = (static_cast<UInt16>(data[kModifierBytesOffset+2]) << 8) + data[kModifierBytesOffset+3];
+        terminal.output[0] = data[kOutputBytesOffset+0];
+        terminal.output[1] = data[kOutputBytesOffset+1];
+    }
+    m_terminalCount = rulesCount;
+    return true;
+}
+
+int MacroInversionTrie::addEdge(int state, const UInt8* keyData)
+{
+    UInt32 key = edgeKey(state, keyData);
+    for (unsigned i = edgeHash(key);; i++)
+    {
+        Edge& edge = m_edges[i & (m_edgeCount - 1)];
+        if (edge.child != kNoState && edge.key != key)
+            continue;
+        if (edge.child == kNoState)
+        {
+            Node& node = m_nodes[m_nodeCount];
+            node.terminalCount = 0;
+            node.firstDeeper = kNoRule;
+            edge.key = key;
+            edge.child = m_nodeCount++;
+        }
+        return edge.child;
+    }
+}
+
+void MacroInversionTrie::free()
+{
+    if (m_nodes)
+        delete[] m_nodes;
+    if (m_terminals)
+        delete[] m_terminals;
+    if (m_edges)
+        delete[] m_edges;
+    m_nodes = 0;
+    m_terminals = 0;
+    m_edges = 0;
+    m_nodeCount = m_terminalCount = m_edgeCount = 0;
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Keyboard::updateKeyTable(OSDictionary* dict)
+{
+    if (NULL == dict)
+        return;
+    
+    // nothing to do unless the dictionary changes the key table
+    static const char* tableKeys[] = { kHIDFKeyMode, kSwapCapsLockLeftControl, kSwapCommandOption,
+        kMakeApplicationKeyRightWindows, kMakeApplicationKeyAppleFN, kMakeRightModsHangulHanja, kUseISOLayoutKeyboard };
+    int i = 0;
+    while (i < countof(tableKeys) && !dict->getObject(tableKeys[i]))
+        i++;
+    if (i == countof(tableKeys))
+        return;
+    
+    // edit a copy of the active table without holding the command gate, so keystrokes
+    // are dispatched meanwhile and never see a partial update
+    // Note: this must never wait for the work loop, setParamProperties is not gated
+    IOLockLock(_keyTableLock);
+    OSData* data = OSData::withBytes(_keyTable, KBV_NUM_KEYCODES * sizeof(PS2KeyEntry));
+    if (!data)
+    {
+        IOLockUnlock(_keyTableLock);
+        return;
+    }
+    PS2KeyEntry* table = (PS2KeyEntry*)data->getBytesNoCopy();
     
     if (_fkeymodesupported)
     {
@@ -745,9 +1038,9 @@ void ApplePS2Keyboard::setParamPropertiesGated(OSDictionary * dict)
         }
         if (oldfkeymode != _fkeymode)
         {
-            OSArray* keys = _fkeymode ? _keysStandard : _keysSpecial;
+            OSData* keys = _fkeymode ? _keysStandard : _keysSpecial;
             assert(keys);
-            loadCustomPS2Map(keys);
+            applyCustomPS2Map(table, keys);
         }
     }
     
@@ -757,12 +1050,12 @@ void ApplePS2Keyboard::setParamPropertiesGated(OSDictionary * dict)
     OSBoolean* xml = OSDynamicCast(OSBoolean, dict->getObject(kSwapCapsLockLeftControl));
     if (xml) {
         if (xml->isTrue()) {
-            _PS2ToADBMap[0x3a]  = _PS2ToADBMapMapped[0x1d];
-            _PS2ToADBMap[0x1d]  = _PS2ToADBMapMapped[0x3a];
+            table[0x3a].adb  = table[0x1d].adbMapped;
+            table[0x1d].adb  = table[0x3a].adbMapped;
         }
         else {
-            _PS2ToADBMap[0x3a]  = _PS2ToADBMapMapped[0x3a];
-            _PS2ToADBMap[0x1d]  = _PS2ToADBMapMapped[0x1d];
+            table[0x3a].adb  = table[0x3a].adbMapped;
+            table[0x1d].adb  = table[0x1d].adbMapped;
         }
         setProperty(kSwapCapsLockLeftControl, xml->isTrue() ? kOSBooleanTrue : kOSBooleanFalse);
     }
@@ -771,40 +1064,32 @@ void ApplePS2Keyboard::setParamPropertiesGated(OSDictionary * dict)
     if (xml) {
         if (xml->isTrue()) {
             _swapcommandoption = true;
-            _PS2ToADBMap[0x38]  = _PS2ToADBMapMapped[0x15b];
-            _PS2ToADBMap[0x15b] = _PS2ToADBMapMapped[0x38];
-            _PS2ToADBMap[0x138] = _PS2ToADBMapMapped[0x15c];
-            _PS2ToADBMap[0x15c] = _PS2ToADBMapMapped[0x138];
+            table[0x38].adb  = table[0x15b].adbMapped;
+            table[0x15b].adb = table[0x38].adbMapped;
+            table[0x138].adb = table[0x15c].adbMapped;
+            table[0x15c].adb = table[0x138].adbMapped;
         }
         else {
             _swapcommandoption = false;
-            _PS2ToADBMap[0x38]  = _PS2ToADBMapMapped[0x38];
-            _PS2ToADBMap[0x15b] = _PS2ToADBMapMapped[0x15b];
-            _PS2ToADBMap[0x138] = _PS2ToADBMapMapped[0x138];
-            _PS2ToADBMap[0x15c] = _PS2ToADBMapMapped[0x15c];
+            table[0x38].adb  = table[0x38].adbMapped;
+            table[0x15b].adb = table[0x15b].adbMapped;
+            table[0x138].adb = table[0x138].adbMapped;
+            table[0x15c].adb = table[0x15c].adbMapped;
         }
         setProperty(kSwapCommandOption, xml->isTrue() ? kOSBooleanTrue : kOSBooleanFalse);
     }
 
-    // special hack for HP Envy brightness
-    xml = OSDynamicCast(OSBoolean, dict->getObject(kBrightnessHack));
-    if (xml && xml->isTrue())
-    {
-        //REVIEW: should really read the key assignments via Info.plist instead of hardcoding to F2/F3
-        _brightnessHack = true;
-    }
-
     // these two options are mutually exclusive
     // kMakeApplicationKeyAppleFN is ignored if kMakeApplicationKeyRightWindows is set
     bool temp = false;
     xml = OSDynamicCast(OSBoolean, dict->getObject(kMakeApplicationKeyRightWindows));
     if (xml) {
         if (xml->isTrue()) {
-            _PS2ToADBMap[0x15d] = _swapcommandoption ?  0x3d : 0x36;  // ADB = right-option/right-command
+            table[0x15d].adb = _swapcommandoption ?  0x3d : 0x36;  // ADB = right-option/right-command
             temp = true;
         }
         else {
-            _PS2ToADBMap[0x15d] = _PS2ToADBMapMapped[0x15d];
+            table[0x15d].adb = table[0x15d].adbMapped;
         }
         setProperty(kMakeApplicationKeyRightWindows, xml->isTrue() ? kOSBooleanTrue : kOSBooleanFalse);
     }
@@ -814,10 +1099,10 @@ void ApplePS2Keyboard::setParamPropertiesGated(OSDictionary * dict)
     if (xml) {
         if (!temp) {
             if (xml->isTrue()) {
-                _PS2ToADBMap[0x15d] = 0x3f; // ADB = AppleFN
+                table[0x15d].adb = 0x3f; // ADB = AppleFN
             }
             else {
-                _PS2ToADBMap[0x15d] = _PS2ToADBMapMapped[0x15d];
+                table[0x15d].adb = table[0x15d].adbMapped;
             }
         }
         setProperty(kMakeApplicationKeyAppleFN, xml->isTrue() ? kOSBooleanTrue : kOSBooleanFalse);
@@ -826,15 +1111,15 @@ void ApplePS2Keyboard::setParamPropertiesGated(OSDictionary * dict)
     xml = OSDynamicCast(OSBoolean, dict->getObject(kMakeRightModsHangulHanja));
     if (xml) {
         if (xml->isTrue()) {
-            _PS2ToADBMap[0x138] = _PS2ToADBMapMapped[0xf2];    // Right alt becomes Hangul
-            _PS2ToADBMap[0x11d] = _PS2ToADBMapMapped[0xf1];    // Right control becomes Hanja
+            table[0x138].adb = table[0xf2].adbMapped;    // Right alt becomes Hangul
+            table[0x11d].adb = table[0xf1].adbMapped;    // Right control becomes Hanja
         }
         else {
             if (_swapcommandoption)
-                _PS2ToADBMap[0x138] = _PS2ToADBMapMapped[0x15c];
+                table[0x138].adb = table[0x15c].adbMapped;
             else
-                _PS2ToADBMap[0x138] = _PS2ToADBMapMapped[0x138];
-            _PS2ToADBMap[0x11d] = _PS2ToADBMapMapped[0x11d];
+                table[0x138].adb = table[0x138].adbMapped;
+            table[0x11d].adb = table[0x11d].adbMapped;
         }
         setProperty(kMakeRightModsHangulHanja, xml->isTrue() ? kOSBooleanTrue : kOSBooleanFalse);
     }
@@ -844,20 +1129,101 @@ void ApplePS2Keyboard::setParamPropertiesGated(OSDictionary * dict)
     xml = OSDynamicCast(OSBoolean, dict->getObject(kUseISOLayoutKeyboard));
     if (xml) {
         if (xml->isTrue()) {
-            _PS2ToADBMap[0x29]  = _PS2ToADBMapMapped[0x56];     //Europe2 ''
-            _PS2ToADBMap[0x56]  = _PS2ToADBMapMapped[0x29];     //Grave '~'
+            table[0x29].adb  = table[0x56].adbMapped;     //Europe2 ''
+            table[0x56].adb  = table[0x29].adbMapped;     //Grave '~'
         }
         else {
-            _PS2ToADBMap[0x29]  = _PS2ToADBMapMapped[0x29];
-            _PS2ToADBMap[0x56]  = _PS2ToADBMapMapped[0x56];
+            table[0x29].adb  = table[0x29].adbMapped;
+            table[0x56].adb  = table[0x56].adbMapped;
         }
         setProperty(kUseISOLayoutKeyboard, xml->isTrue() ? kOSBooleanTrue : kOSBooleanFalse);
     }
     
+    // publish it with one pointer swap, a key event in flight may still be reading
+    // the old table, so it is released from the work loop once that is done
+    setBreaklessKeys(table);
+    __atomic_store_n(&_keyTable, table, __ATOMIC_RELEASE);
+    _retiredKeyTables->setObject(_keyTableData);
+    _keyTableData->release();
+    _keyTableData = data;
+    if (!_cmdGate)
+        _retiredKeyTables->flushCollection();   // not started yet, nothing is reading it
+    else if (_keyTableTimer)
+        setTimerTimeout(_keyTableTimer, 0);
+    IOLockUnlock(_keyTableLock);
+}
+
+void ApplePS2Keyboard::onKeyTableTimer(void)
+{
+    // key events are translated on the work loop only (interruptOccurred reads
+    // _breaklessKeys, not the table), so none is using a retired table anymore
+    IOLockLock(_keyTableLock);
+    _retiredKeyTables->flushCollection();
+    IOLockUnlock(_keyTableLock);
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void ApplePS2Keyboard::setParamPropertiesGated(OSDictionary * dict)
+{
+    if (NULL == dict)
+        return;
+    
+//REVIEW: this code needs cleanup (should be table driven like mouse/trackpad)
+
+    // any value resets the latency histograms
+    if (dict->getObject(kResetLatencyStatistics))
+    {
+        _latency.reset();
+        _latency.publish(this);
+    }
+
+    // get time before sleep button takes effect
+	if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kSleepPressTime)))
+    {
+        _maxsleeppresstime = num->unsigned32BitValue();
+        setProperty(kSleepPressTime, _maxsleeppresstime, 32);
+    }
+    // get time before eject button takes effect (no modifiers)
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kHIDF12EjectDelay)))
+    {
+        _f12ejectdelay = num->unsigned32BitValue();
+        setProperty(kHIDF12EjectDelay, _f12ejectdelay, 32);
+    }
+    // get time between keys part of a macro "inversion"
+    if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kMaxMacroTime)))
+    {
+        _macroMaxTime = num->unsigned64BitValue();
+        setProperty(kMaxMacroTime, _macroMaxTime, 64);
+    }
+    
+    // special hack for HP Envy brightness
+    OSBoolean* xml = OSDynamicCast(OSBoolean, dict->getObject(kBrightnessHack));
+    if (xml && xml->isTrue())
+    {
+        //REVIEW: should really read the key assignments via Info.plist instead of hardcoding to F2/F3
+        _brightnessHack = true;
+    }
+
     if (OSNumber* num = OSDynamicCast(OSNumber, dict->getObject(kLogScanCodes))) {
         _logscancodes = num->unsigned32BitValue();
         setProperty(kLogScanCodes, num);
     }
+    
+    // stop the keyboard from sending key repeats (macOS repeats keys itself)
+    if (OSBoolean* suppress = OSDynamicCast(OSBoolean, dict->getObject(kTypematicSuppression)))
+    {
+        UInt8 mode = __atomic_load_n(&_typematicMode, __ATOMIC_RELAXED);
+        if (suppress->isTrue() != (kTypematicHardware != mode))
+        {
+            mode = suppress->isTrue() ? kTypematicMakeRelease : kTypematicHardware;
+            __atomic_store_n(&_typematicMode, mode, __ATOMIC_RELAXED);
+            // before start, initKeyboard sends it
+            if (_device)
+                setTypematicMode(mode);
+        }
+        setProperty(kTypematicSuppression, suppress);
+    }
 }
 
 IOReturn ApplePS2Keyboard::setParamProperties(OSDictionary *dict)
@@ -867,6 +1233,7 @@ IOReturn ApplePS2Keyboard::setParamProperties(OSDictionary *dict)
     {
         // syncronize through workloop...
         ////_cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePS2Keyboard::setParamPropertiesGated), dict);
+        updateKeyTable(dict);
         setParamPropertiesGated(dict);
     }
     
@@ -879,7 +1246,8 @@ IOReturn ApplePS2Keyboard::setProperties(OSObject *props)
 	OSDictionary *dict = OSDynamicCast(OSDictionary, props);
     if (dict && _cmdGate)
     {
-        // syncronize through workloop...
+        // key table changes are built outside of the workloop, the rest is syncronized through it
+        updateKeyTable(dict);
         _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePS2Keyboard::setParamPropertiesGated), dict);
     }
     
@@ -926,6 +1294,12 @@ void ApplePS2Keyboard::stop(IOService * provider)
             _macroTimer->release();
             _macroTimer = 0;
         }
+        if (_keyTableTimer)
+        {
+            pWorkLoop->removeEventSource(_keyTableTimer);
+            _keyTableTimer->release();
+            _keyTableTimer = 0;
+        }
     }
     
     //
@@ -942,6 +1316,18 @@ void ApplePS2Keyboard::stop(IOService * provider)
     if ( _powerControlHandlerInstalled ) _device->uninstallPowerControlAction();
     _powerControlHandlerInstalled = false;
 
+    //
+    // Wait for ACPI methods still running, they use _provider.
+    //
+
+    if (_acpiThreadCall)
+    {
+        if (thread_call_cancel_wait(_acpiThreadCall))
+            release();  // drop the retain from scheduleACPICommands()
+        thread_call_free(_acpiThreadCall);
+        _acpiThreadCall = 0;
+    }
+
     //
     // Release the pointer to the provider object.
     //
@@ -981,6 +1367,7 @@ void ApplePS2Keyboard::stop(IOService * provider)
         delete[] _macroInversion;
         _macroInversion = 0;
     }
+    _macroTrie.free();
     if (_macroTranslation)
     {
         for (OSData** p = _macroTranslation; *p; p++)
@@ -1011,43 +1398,9 @@ IOReturn ApplePS2Keyboard::message(UInt32 type, IOService* provider, void* argum
     switch (type)
     {
         case kIOACPIMessageDeviceNotification:
-            if (NULL != argument) {
-                UInt32 arg = *static_cast<UInt32*>(argument);
-                if ((arg & 0xFFFF0000) == 0)
-                {
-                    UInt8 packet[kPacketLength];
-                    packet[0] = arg >> 8;
-                    packet[1] = arg;
-                    if (1 == packet[0] || 2 == packet[0])
-                    {
-                        // mark packet with timestamp
-                        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
-                        if (!_macroInversion || !invertMacros(packet))
-                        {
-                            // normal packet
-                            dispatchKeyboardEventWithPacket(packet);
-                        }
-                    }
-                    if (3 == packet[0] || 4 == packet[0])
-                    {
-                        // code 3 and 4 indicate send both make and break
-                        packet[0] -= 2;
-                        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
-                        if (!_macroInversion || !invertMacros(packet))
-                        {
-                            // normal packet (make)
-                            dispatchKeyboardEventWithPacket(packet);
-                        }
-                        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
-                        packet[1] |= 0x80; // break code
-                        if (!_macroInversion || !invertMacros(packet))
-                        {
-                            // normal packet (break)
-                            dispatchKeyboardEventWithPacket(packet);
-                        }
-                    }
-                }
-            }
+            // key events are translated on the work loop only (see onKeyTableTimer)
+            if (NULL != argument && _cmdGate)
+                _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePS2Keyboard::dispatchACPINotificationGated), argument);
             break;
     }
 
@@ -1056,6 +1409,51 @@ IOReturn ApplePS2Keyboard::message(UInt32 type, IOService* provider, void* argum
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Keyboard::dispatchACPINotificationGated(UInt32* argument)
+{
+    //
+    // ACPI keyboard events (eg. from an EC query), as key code packets
+    //
+
+    UInt32 arg = *argument;
+    if ((arg & 0xFFFF0000) == 0)
+    {
+        UInt8 packet[kPacketLength];
+        packet[0] = arg >> 8;
+        packet[1] = arg;
+        if (1 == packet[0] || 2 == packet[0])
+        {
+            // mark packet with timestamp
+            clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+            if (!_macroInversion || !invertMacros(packet))
+            {
+                // normal packet
+                dispatchKeyboardEventWithPacket(packet);
+            }
+        }
+        if (3 == packet[0] || 4 == packet[0])
+        {
+            // code 3 and 4 indicate send both make and break
+            packet[0] -= 2;
+            clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+            if (!_macroInversion || !invertMacros(packet))
+            {
+                // normal packet (make)
+                dispatchKeyboardEventWithPacket(packet);
+            }
+            clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+            packet[1] |= 0x80; // break code
+            if (!_macroInversion || !invertMacros(packet))
+            {
+                // normal packet (break)
+                dispatchKeyboardEventWithPacket(packet);
+            }
+        }
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2InterruptAction
 {
     ////IOLog("ps2interrupt: scanCode = %02x\n", data);
@@ -1069,7 +1467,10 @@ PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2Inter
     // NOT send any BLOCKING commands to our device in this context.
     //
     
-    UInt8* packet = _ringBuffer.head();
+    __atomic_store_n(&_interruptCount, _interruptCount + 1, __ATOMIC_RELAXED);
+    UInt8* packet = _ringBuffer.reserve();
+    if (!_extendCount)
+        _latency.packetStarted();
     
     // special case for $AA $00, spontaneous reset (usually due to static electricity)
     if (kSC_Reset == _lastdata && 0x00 == data)
@@ -1081,7 +1482,8 @@ PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2Inter
         packet[1] = kSC_Reset;
         // mark packet with timestamp
         clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
-        _ringBuffer.advanceHead(kPacketLength);
+        if (_ringBuffer.commit())
+            _latency.packetQueued();
         _extendCount = 0;
         return kPS2IR_packetReady;
     }
@@ -1144,14 +1546,17 @@ PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2Inter
     UInt8 extended = _extendCount;
     if (!_extendCount || 0 == --_extendCount)
     {
-        // Update our key bit vector, which maintains the up/down status of all keys.
+        // Update our key table, which maintains the up/down status of all keys.
         unsigned keyCodeRaw =  (extended << 8) | (data & ~kSC_UpBit);
-        if (!(_PS2flags[keyCodeRaw] & kBreaklessKey))
+        if (!KBV_IS_BREAKLESS(keyCodeRaw))
         {
             if (!(data & kSC_UpBit))
             {
                 if (KBV_IS_KEYDOWN(keyCodeRaw))
-                    return kPS2IR_packetBuffering;
+                {
+                    // packetReady sends the fallback, if any
+                    return noteTypematicRepeat() ? kPS2IR_packetReady : kPS2IR_packetBuffering;
+                }
                 KBV_KEYDOWN(keyCodeRaw);
             }
             else
@@ -1164,7 +1569,8 @@ PS2InterruptResult ApplePS2Keyboard::interruptOccurred(UInt8 data)   // PS2Inter
         packet[1] = data;
         // mark packet with timestamp
         clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
-        _ringBuffer.advanceHead(kPacketLength);
+        if (_ringBuffer.commit())
+            _latency.packetQueued();
         return kPS2IR_packetReady;
     }
     return kPS2IR_packetBuffering;
@@ -1174,9 +1580,10 @@ void ApplePS2Keyboard::packetReady()
 {
     // empty the ring buffer, dispatching each packet...
     // each packet is always two bytes, for simplicity...
-    while (_ringBuffer.count() >= kPacketLength)
+    while (_ringBuffer.count())
     {
         UInt8* packet = _ringBuffer.tail();
+        _latency.packetDrained();
         if (0x00 != packet[0])
         {
             if (!_macroInversion || !invertMacros(packet))
@@ -1190,27 +1597,20 @@ void ApplePS2Keyboard::packetReady()
             // command/reset packet
             ////initKeyboard();
         }
-        _ringBuffer.advanceTail(kPacketLength);
+        _ringBuffer.advanceTail();
     }
-}
-
-bool ApplePS2Keyboard::compareMacro(const UInt8* buffer, const UInt8* data, int count)
-{
-    while (count--)
-    {
-        if (buffer[0] != data[0] || buffer[1] != data[1])
-            return false;
-        buffer += kPacketLength;
-        data += kPacketKeyDataLength;
-    }
-    return true;
+    if (__atomic_exchange_n(&_typematicFallback, false, __ATOMIC_RELAXED))
+        setTypematicMode(kTypematicSlowest);
+    _ringBuffer.publishStats(this, kRingBufferStatistics);
+    _latency.publish(this);
+    publishTypematicStats();
 }
 
 bool ApplePS2Keyboard::invertMacros(const UInt8* packet)
 {
     assert(_macroInversion);
     
-    if (!_macroTimer || !_macroBuffer)
+    if (!_macroTimer || !_macroBuffer || _macroTrie.empty())
         return false;
 
     if (_macroCurrent > 0)
@@ -1231,46 +1631,37 @@ bool ApplePS2Keyboard::invertMacros(const UInt8* packet)
 #endif
     }
  
-    // add current packet to macro buffer for comparison
-    memcpy(_macroBuffer+_macroCurrent*kPacketLength, packet, kPacketLength);
-    int buffered = _macroCurrent+1;
-    int total = buffered*kPacketKeyDataLength;
-    // compare against macro inversions
-    for (OSData** p = _macroInversion; *p; p++)
-    {
-        int length = (*p)->getLength()-kPrefixBytes;
-        if (total <= length)
+    // advance the macro inversion trie by the current packet
+    int state = _macroTrie.next(_macroState, packet);
+    if (MacroInversionTrie::kNoState != state)
+    {
+        const UInt8* output;
+        switch (_macroTrie.match(state, _PS2modifierState, &output))
         {
-            const UInt8* data = static_cast<const UInt8*>((*p)->getBytesNoCopy());
-            if (compareMacro(_macroBuffer, data+kSequenceBytesOffset, buffered))
-            {
-                if (total == length)
-                {
-                    // get modifier mask/compare from macro definition
-                    UInt16 mask = (static_cast<UInt16>(data[kModifierBytesOffset+0]) << 8) + data[kModifierBytesOffset+1];
-                    UInt16 compare = (static_cast<UInt16>(data[kModifierBytesOffset+2]) << 8) + data[kModifierBytesOffset+3];
-                    if ((0xFFFF == compare && (_PS2modifierState & mask)) || ((_PS2modifierState & mask) == compare))
-                    {
-                        // exact match causes macro inversion
-                        // grab bytes from macro definition
-                        _macroBuffer[0] = data[kOutputBytesOffset+0];
-                        _macroBuffer[1] = data[kOutputBytesOffset+1];
-                        // dispatch constructed packet (timestamp is stamp on first macro packet)
-                        dispatchKeyboardEventWithPacket(_macroBuffer);
-                        cancelTimer(_macroTimer);
-                        _macroCurrent = 0;
-                        return true;
-                    }
-                }
-                else
-                {
-                    // partial match, keep waiting for full match
-                    cancelTimer(_macroTimer);
-                    setTimerTimeout(_macroTimer, _macroMaxTime);
-                    _macroCurrent++;
-                    return true;
-                }
-            }
+            case MacroInversionTrie::kMatch:
+                // exact match causes macro inversion
+                // grab bytes from macro definition
+                memcpy(_macroBuffer+_macroCurrent*kPacketLength, packet, kPacketLength);
+                _macroBuffer[0] = output[0];
+                _macroBuffer[1] = output[1];
+                // dispatch constructed packet (timestamp is stamp on first macro packet)
+                dispatchKeyboardEventWithPacket(_macroBuffer);
+                cancelTimer(_macroTimer);
+                _macroCurrent = 0;
+                _macroState = MacroInversionTrie::kRoot;
+                return true;
+
+            case MacroInversionTrie::kPartial:
+                // partial match, keep waiting for full match
+                memcpy(_macroBuffer+_macroCurrent*kPacketLength, packet, kPacketLength);
+                cancelTimer(_macroTimer);
+                setTimerTimeout(_macroTimer, _macroMaxTime);
+                _macroCurrent++;
+                _macroState = state;
+                return true;
+
+            case MacroInversionTrie::kNoMatch:
+                break;
         }
     }
     // no match, so... empty macro buffer that may have been existing...
@@ -1314,6 +1705,7 @@ void ApplePS2Keyboard::dispatchInvertBuffer()
         packet += kPacketLength;
     }
     _macroCurrent = 0;
+    _macroState = MacroInversionTrie::kRoot;
     cancelTimer(_macroTimer);
 }
 
@@ -1327,22 +1719,25 @@ void ApplePS2Keyboard::dispatchInvertBuffer()
 //
 // Just keeping it here in case someone wants to try with theirs.
 
-void ApplePS2Keyboard::modifyScreenBrightness(int adbKeyCode, bool goingDown)
+void ApplePS2Keyboard::modifyScreenBrightness(int steps)
 {
     assert(_provider);
     assert(_brightnessLevels);
     
     // get current brightness level
     UInt32 result;
-    if (kIOReturnSuccess != _provider->evaluateInteger("KBQC", &result))
+    uint64_t start;
+    clock_get_uptime(&start);
+    IOReturn status = _provider->evaluateInteger("KBQC", &result);
+    noteACPITime(start);
+    if (kIOReturnSuccess != status)
     {
         DEBUG_LOG("ps2br: KBQC returned error\n");
         return;
     }
     int current = result;
 #ifdef DEBUG_VERBOSE
-    if (goingDown)
-        DEBUG_LOG("ps2br: Current brightness: %d\n", current);
+    DEBUG_LOG("ps2br: Current brightness: %d\n", current);
 #endif
     // calculate new brightness level, find current in table >= entry in table
     // note first two entries in table are ac-power/battery
@@ -1353,15 +1748,14 @@ void ApplePS2Keyboard::modifyScreenBrightness(int adbKeyCode, bool goingDown)
             break;
         ++index;
     }
-    // move to next or previous
-    index += (adbKeyCode == 0x90 ? +1 : -1);
+    // move by all steps pressed since the last update
+    index += steps;
     if (index >= _brightnessCount)
         index = _brightnessCount - 1;
     if (index < 2)
         index = 2;
 #ifdef DEBUG_VERBOSE
-    if (goingDown)
-        DEBUG_LOG("ps2br: setting brightness %d\n", _brightnessLevels[index]);
+    DEBUG_LOG("ps2br: setting brightness %d\n", _brightnessLevels[index]);
 #endif
     OSNumber* num = OSNumber::withNumber(_brightnessLevels[index], 32);
     if (!num)
@@ -1369,7 +1763,10 @@ void ApplePS2Keyboard::modifyScreenBrightness(int adbKeyCode, bool goingDown)
         DEBUG_LOG("ps2br: OSNumber::withNumber failed\n");
         return;
     }
-    if (goingDown && kIOReturnSuccess != _provider->evaluateObject("KBCM", NULL, (OSObject**)&num, 1))
+    clock_get_uptime(&start);
+    status = _provider->evaluateObject("KBCM", NULL, (OSObject**)&num, 1);
+    noteACPITime(start);
+    if (kIOReturnSuccess != status)
     {
         DEBUG_LOG("ps2br: KBCM returned error\n");
     }
@@ -1384,22 +1781,25 @@ void ApplePS2Keyboard::modifyScreenBrightness(int adbKeyCode, bool goingDown)
 // how to implememnt the KKQC, KKCM, and KKCL methods.
 //
 
-void ApplePS2Keyboard::modifyKeyboardBacklight(int keyCode, bool goingDown)
+void ApplePS2Keyboard::modifyKeyboardBacklight(int steps)
 {
     assert(_provider);
     assert(_backlightLevels);
     
     // get current brightness level
     UInt32 result;
-    if (kIOReturnSuccess != _provider->evaluateInteger("KKQC", &result))
+    uint64_t start;
+    clock_get_uptime(&start);
+    IOReturn status = _provider->evaluateInteger("KKQC", &result);
+    noteACPITime(start);
+    if (kIOReturnSuccess != status)
     {
         DEBUG_LOG("ps2bl: KKQC returned error\n");
         return;
     }
     int current = result;
 #ifdef DEBUG_VERBOSE
-    if (goingDown)
-        DEBUG_LOG("ps2bl: Current keyboard backlight: %d\n", current);
+    DEBUG_LOG("ps2bl: Current keyboard backlight: %d\n", current);
 #endif
     // calculate new brightness level, find current in table >= entry in table
     // note first two entries in table are ac-power/battery
@@ -1410,15 +1810,14 @@ void ApplePS2Keyboard::modifyKeyboardBacklight(int keyCode, bool goingDown)
             break;
         ++index;
     }
-    // move to next or previous
-    index += (keyCode == 0x4e ? +1 : -1);
+    // move by all steps pressed since the last update
+    index += steps;
     if (index >= _backlightCount)
         index = _backlightCount - 1;
     if (index < 0)
         index = 0;
 #ifdef DEBUG_VERBOSE
-    if (goingDown)
-        DEBUG_LOG("ps2bl: setting keyboard backlight %d\n", _backlightLevels[index]);
+    DEBUG_LOG("ps2bl: setting keyboard backlight %d\n", _backlightLevels[index]);
 #endif
     OSNumber* num = OSNumber::withNumber(_backlightLevels[index], 32);
     if (!num)
@@ -1426,13 +1825,108 @@ void ApplePS2Keyboard::modifyKeyboardBacklight(int keyCode, bool goingDown)
         DEBUG_LOG("ps2bl: OSNumber::withNumber failed\n");
         return;
     }
-    if (goingDown && kIOReturnSuccess != _provider->evaluateObject("KKCM", NULL, (OSObject**)&num, 1))
+    clock_get_uptime(&start);
+    status = _provider->evaluateObject("KKCM", NULL, (OSObject**)&num, 1);
+    noteACPITime(start);
+    if (kIOReturnSuccess != status)
     {
         DEBUG_LOG("ps2bl: KKCM returned error\n");
     }
     num->release();
 }
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// ACPI side effects of keys are run on _acpiThreadCall.  The work loop queues
+// RKAx calls in order (bounded, a full queue drops the call) and adds up
+// brightness/backlight steps, so a burst of steps costs one KBCM/KKCM.
+
+void ApplePS2Keyboard::queueACPICommand(UInt8 command)
+{
+    _acpiQueue.push(command);
+    scheduleACPICommands();
+}
+
+void ApplePS2Keyboard::queueACPISteps(SInt32* steps, int step)
+{
+    if (__atomic_fetch_add(steps, step, __ATOMIC_RELAXED))
+        __atomic_add_fetch(&_acpiCoalesced, 1, __ATOMIC_RELAXED);
+    scheduleACPICommands();
+}
+
+void ApplePS2Keyboard::scheduleACPICommands()
+{
+    if (!_acpiThreadCall)
+    {
+        // no thread call, run them inline as before
+        runACPICommands();
+        return;
+    }
+    retain();
+    if (thread_call_enter(_acpiThreadCall) == TRUE)
+        release();
+}
+
+void ApplePS2Keyboard::acpiCallout(thread_call_param_t param0, thread_call_param_t param1)
+{
+    ApplePS2Keyboard* me = (ApplePS2Keyboard*)param0;
+    assert(me);
+    
+    me->runACPICommands();
+    me->release();  // drop the retain from scheduleACPICommands()
+}
+
+void ApplePS2Keyboard::runACPICommands()
+{
+    // a thread call entered while running can run again in parallel
+    IOLockLock(_acpiLock);
+    while (_acpiQueue.count())
+    {
+        UInt8 command = _acpiQueue.fetch();
+        // evaluate RKA[0-F] for these keys
+        char method[5] = "RKAx";
+        char n = command & 0x0f;
+        method[3] = n < 10 ? n + '0' : n - 10 + 'A';
+        if (OSNumber* num = OSNumber::withNumber((command & kACPIKeyDown) != 0, 32))
+        {
+            // call ACPI RKAx(Arg0=goingDown)
+            uint64_t start;
+            clock_get_uptime(&start);
+            _provider->evaluateObject(method, NULL, (OSObject**)&num, 1);
+            noteACPITime(start);
+            num->release();
+        }
+    }
+    if (int steps = __atomic_exchange_n(&_brightnessSteps, 0, __ATOMIC_RELAXED))
+        modifyScreenBrightness(steps);
+    if (int steps = __atomic_exchange_n(&_backlightSteps, 0, __ATOMIC_RELAXED))
+        modifyKeyboardBacklight(steps);
+    
+    if (OSDictionary* dict = OSDictionary::withCapacity(6))
+    {
+        setPropertyNumber(dict, "Evaluations", _acpiEvaluations, 32);
+        setPropertyNumber(dict, "Coalesced", __atomic_load_n(&_acpiCoalesced, __ATOMIC_RELAXED), 32);
+        setPropertyNumber(dict, "Dropped", _acpiQueue.overflows(), 32);
+        setPropertyNumber(dict, "HighWater", _acpiQueue.highWater(), 32);
+        setPropertyNumber(dict, "TotalTime", _acpiTotalTime, 64);
+        setPropertyNumber(dict, "MaxTime", _acpiMaxTime, 64);
+        setProperty(kACPIStatistics, dict);
+        dict->release();
+    }
+    IOLockUnlock(_acpiLock);
+}
+
+void ApplePS2Keyboard::noteACPITime(uint64_t start)
+{
+    // (under _acpiLock) time spent in one ACPI evaluation
+    uint64_t now, ns;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - start, &ns);
+    _acpiEvaluations++;
+    _acpiTotalTime += ns;
+    if (ns > _acpiMaxTime)
+        _acpiMaxTime = ns;
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 void ApplePS2Keyboard::onSleepEjectTimer()
@@ -1474,6 +1968,8 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
     unsigned keyCodeRaw = scanCode & ~kSC_UpBit;
     bool goingDown = !(scanCode & kSC_UpBit);
     unsigned keyCode;
+    // one snapshot of the key table for the whole key event
+    const PS2KeyEntry* keyTable = __atomic_load_n(&_keyTable, __ATOMIC_ACQUIRE);
     uint64_t now_abs = *(uint64_t*)(&packet[kPacketTimeOffset]);
     uint64_t now_ns;
     absolutetime_to_nanoseconds(now_abs, &now_ns);
@@ -1494,14 +1990,14 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
         if (scanCode == 0xf2 || scanCode == 0xf1)
         {
             clock_get_uptime(&now_abs);
-            dispatchKeyboardEventX(_PS2ToADBMap[scanCode], true, now_abs);
+            dispatchKeyboardEventX(keyTable[scanCode].adb, true, now_abs);
             clock_get_uptime(&now_abs);
-            dispatchKeyboardEventX(_PS2ToADBMap[scanCode], false, now_abs);
+            dispatchKeyboardEventX(keyTable[scanCode].adb, false, now_abs);
             return true;
         }
         
         // Allow PS2 -> PS2 map to work, look in normal part of the table
-        keyCode = _PS2ToPS2Map[keyCodeRaw];
+        keyCode = keyTable[keyCodeRaw].remap;
         
 #ifdef DEBUG_VERBOSE
         if (keyCode != keyCodeRaw)
@@ -1512,7 +2008,7 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
     {
         // allow PS2 -> PS2 map to work, look in extended part of the table
         keyCodeRaw += KBV_NUM_SCANCODES;
-        keyCode = _PS2ToPS2Map[keyCodeRaw];
+        keyCode = keyTable[keyCodeRaw].remap;
         
 #ifdef DEBUG_VERBOSE
         if (keyCode != keyCodeRaw)
@@ -1527,137 +2023,134 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
     }
     
     // tracking modifier key state
-    if (UInt8 bit = (_PS2flags[keyCodeRaw] >> 8))
+    if (UInt8 bit = keyTable[keyCodeRaw].modifier)
     {
         UInt16 mask = 1 << (bit-1);
         goingDown ? _PS2modifierState |= mask : _PS2modifierState &= ~mask;
     }
 
     // codes e0f0 through e0ff can be used to call back into ACPI methods on this device
-    if (keyCode >= 0x01f0 && keyCode <= 0x01ff && _provider != NULL)
+    UInt8 action = keyTable[keyCode].action;
+    if (kKeyActionACPI == action && _provider != NULL)
     {
-        // evaluate RKA[0-F] for these keys
-        char method[5] = "RKAx";
-        char n = keyCode - 0x01f0;
-        method[3] = n < 10 ? n + '0' : n - 10 + 'A';
-        if (OSNumber* num = OSNumber::withNumber(goingDown, 32))
-        {
-            // call ACPI RKAx(Arg0=goingDown)
-            _provider->evaluateObject(method, NULL, (OSObject**)&num, 1);
-            num->release();
-        }
+        // evaluate RKA[0-F] for these keys, off the work loop
+        queueACPICommand((keyCode - 0x01f0) | (goingDown ? kACPIKeyDown : 0));
     }
 
     // handle special cases
-    switch (keyCode)
+    if (kKeyActionSpecial == action)
     {
-        case 0x4e:  // Numpad+
-        case 0x4a:  // Numpad-
-            if (_backlightLevels && checkModifierState(kMaskLeftControl|kMaskLeftAlt))
-            {
-                // Ctrl+Alt+Numpad(+/-) => use to manipulate keyboard backlight
-                modifyKeyboardBacklight(keyCode, goingDown);
-                keyCode = 0;
-            }
-            else if (_brightnessHack && checkModifierState(kMaskLeftControl|kMaskLeftShift))
-            {
-                // Ctrl+Shift+NumPad(+/0) => manipulate brightness (special hack for HP Envy)
-                // Fn+F2 generates e0 ab and so does Fn+F3 (we will null those out in ps2 map)
-                static unsigned keys[] = { 0x2a, 0x1d };
-                // if Option key is down don't pull up on the Shift keys
-                int start = checkModifierState(kMaskLeftWindows) ? 1 : 0;
-                for (int i = start; i < countof(keys); i++)
-                    if (KBV_IS_KEYDOWN(keys[i]))
-                        dispatchKeyboardEventX(_PS2ToADBMap[keys[i]], false, now_abs);
-                dispatchKeyboardEventX(keyCode == 0x4e ? 0x90 : 0x91, goingDown, now_abs);
-                for (int i = start; i < countof(keys); i++)
-                    if (KBV_IS_KEYDOWN(keys[i]))
-                        dispatchKeyboardEventX(_PS2ToADBMap[keys[i]], true, now_abs);
-                keyCode = 0;
-            }
-            break;
+        switch (keyCode)
+        {
+            case 0x4e:  // Numpad+
+            case 0x4a:  // Numpad-
+                if (_backlightLevels && checkModifierState(kMaskLeftControl|kMaskLeftAlt))
+                {
+                    // Ctrl+Alt+Numpad(+/-) => use to manipulate keyboard backlight
+                    if (goingDown)
+                        queueACPISteps(&_backlightSteps, keyCode == 0x4e ? +1 : -1);
+                    keyCode = 0;
+                }
+                else if (_brightnessHack && checkModifierState(kMaskLeftControl|kMaskLeftShift))
+                {
+                    // Ctrl+Shift+NumPad(+/0) => manipulate brightness (special hack for HP Envy)
+                    // Fn+F2 generates e0 ab and so does Fn+F3 (we will null those out in ps2 map)
+                    static unsigned keys[] = { 0x2a, 0x1d };
+                    // if Option key is down don't pull up on the Shift keys
+                    int start = checkModifierState(kMaskLeftWindows) ? 1 : 0;
+                    for (int i = start; i < countof(keys); i++)
+                        if (KBV_IS_KEYDOWN(keys[i]))
+                            dispatchKeyboardEventX(keyTable[keys[i]].adb, false, now_abs);
+                    dispatchKeyboardEventX(keyCode == 0x4e ? 0x90 : 0x91, goingDown, now_abs);
+                    for (int i = start; i < countof(keys); i++)
+                        if (KBV_IS_KEYDOWN(keys[i]))
+                            dispatchKeyboardEventX(keyTable[keys[i]].adb, true, now_abs);
+                    keyCode = 0;
+                }
+                break;
             
-        case 0x0153:    // delete
-            // check for Ctrl+Alt+Delete? (three finger salute)
-            if (checkModifierState(kMaskLeftControl|kMaskLeftAlt))
-            {
-                keyCode = 0;
-                if (!goingDown)
+            case 0x0153:    // delete
+                // check for Ctrl+Alt+Delete? (three finger salute)
+                if (checkModifierState(kMaskLeftControl|kMaskLeftAlt))
                 {
-                    // Note: If OS X thinks the Command and Control keys are down at the time of
-                    //  receiving an ADB 0x7f (power button), it will unconditionaly and unsafely
-                    //  reboot the computer, much like the old PC/AT Ctrl+Alt+Delete!
-                    // That's why we make sure Control (0x3b) and Alt (0x37) are up!!
-                    dispatchKeyboardEventX(0x37, false, now_abs);
-                    dispatchKeyboardEventX(0x3b, false, now_abs);
-                    dispatchKeyboardEventX(0x7f, true, now_abs);
-                    dispatchKeyboardEventX(0x7f, false, now_abs);
+                    keyCode = 0;
+                    if (!goingDown)
+                    {
+                        // Note: If OS X thinks the Command and Control keys are down at the time of
+                        //  receiving an ADB 0x7f (power button), it will unconditionaly and unsafely
+                        //  reboot the computer, much like the old PC/AT Ctrl+Alt+Delete!
+                        // That's why we make sure Control (0x3b) and Alt (0x37) are up!!
+                        dispatchKeyboardEventX(0x37, false, now_abs);
+                        dispatchKeyboardEventX(0x3b, false, now_abs);
+                        dispatchKeyboardEventX(0x7f, true, now_abs);
+                        dispatchKeyboardEventX(0x7f, false, now_abs);
+                    }
                 }
-            }
-            break;
+                break;
                 
-        case 0x015f:    // sleep
-            keyCode = 0;
-            if (goingDown)
-            {
-                _timerFunc = kTimerSleep;
-                if (_fkeymode || !_maxsleeppresstime)
-                    onSleepEjectTimer();
+            case 0x015f:    // sleep
+                keyCode = 0;
+                if (goingDown)
+                {
+                    _timerFunc = kTimerSleep;
+                    if (_fkeymode || !_maxsleeppresstime)
+                        onSleepEjectTimer();
+                    else
+                        setTimerTimeout(_sleepEjectTimer, (uint64_t)_maxsleeppresstime * 1000000);
+                }
                 else
-                    setTimerTimeout(_sleepEjectTimer, (uint64_t)_maxsleeppresstime * 1000000);
-            }
-            else
-            {
-                cancelTimer(_sleepEjectTimer);
-            }
-            break;
-
-        //REVIEW: this is getting a bit ugly
-        case 0x0128:    // alternate that cannot fnkeys toggle (discrete trackpad toggle)
-        case 0x0137:    // prt sc/sys rq
-        {
-            unsigned origKeyCode = keyCode;
-            keyCode = 0;
-            if (!goingDown)
+                {
+                    cancelTimer(_sleepEjectTimer);
+                }
                 break;
-            if (!checkModifierState(kMaskLeftControl))
+
+            //REVIEW: this is getting a bit ugly
+            case 0x0128:    // alternate that cannot fnkeys toggle (discrete trackpad toggle)
+            case 0x0137:    // prt sc/sys rq
             {
-                // get current enabled status, and toggle it
-                bool enabled;
-                _device->dispatchMessage(kPS2M_getDisableTouchpad, &enabled);
-                enabled = !enabled;
-                _device->dispatchMessage(kPS2M_setDisableTouchpad, &enabled);
-                break;
+                unsigned origKeyCode = keyCode;
+                keyCode = 0;
+                if (!goingDown)
+                    break;
+                if (!checkModifierState(kMaskLeftControl))
+                {
+                    // get current enabled status, and toggle it
+                    bool enabled;
+                    _device->dispatchMessage(kPS2M_getDisableTouchpad, &enabled);
+                    enabled = !enabled;
+                    _device->dispatchMessage(kPS2M_setDisableTouchpad, &enabled);
+                    break;
+                }
+                if (origKeyCode != 0x0137)
+                    break; // do not fall through for 0x0128
+                // fall through
             }
-            if (origKeyCode != 0x0137)
-                break; // do not fall through for 0x0128
-            // fall through
-        }
-        case 0x0127:    // alternate for fnkeys toggle (discrete fnkeys toggle)
-            keyCode = 0;
-            if (!goingDown)
-                break;
-            if (_fkeymodesupported)
-            {
-                // modify HIDFKeyMode via IOService... IOHIDSystem
-                if (IOService* service = IOService::waitForMatchingService(serviceMatching(kIOHIDSystem), 0))
+            case 0x0127:    // alternate for fnkeys toggle (discrete fnkeys toggle)
+                keyCode = 0;
+                if (!goingDown)
+                    break;
+                if (_fkeymodesupported)
                 {
-                    const OSObject* num = OSNumber::withNumber(!_fkeymode, 32);
-                    const OSString* key = OSString::withCString(kHIDFKeyMode);
-                    if (num && key)
+                    // modify HIDFKeyMode via IOService... IOHIDSystem
+                    if (IOService* service = IOService::waitForMatchingService(serviceMatching(kIOHIDSystem), 0))
                     {
-                        if (OSDictionary* dict = OSDictionary::withObjects(&num, &key, 1))
+                        const OSObject* num = OSNumber::withNumber(!_fkeymode, 32);
+                        const OSString* key = OSString::withCString(kHIDFKeyMode);
+                        if (num && key)
                         {
-                            service->setProperties(dict);
-                            dict->release();
+                            if (OSDictionary* dict = OSDictionary::withObjects(&num, &key, 1))
+                            {
+                                service->setProperties(dict);
+                                dict->release();
+                            }
                         }
+                        OSSafeReleaseNULL(num);
+                        OSSafeReleaseNULL(key);
+                        service->release();
                     }
-                    OSSafeReleaseNULL(num);
-                    OSSafeReleaseNULL(key);
-                    service->release();
                 }
-            }
-            break;
+                break;
+        }
     }
 
 #ifdef DEBUG
@@ -1683,7 +2176,7 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
     // We have a valid key event -- dispatch it to our superclass.
     
     // map scan code to Apple code
-    UInt8 adbKeyCode = _PS2ToADBMap[keyCode];
+    UInt8 adbKeyCode = keyTable[keyCode].adb;
     bool eatKey = false;
     
     // special cases
@@ -1693,7 +2186,8 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
         case 0x91:
             if (_brightnessLevels)
             {
-                modifyScreenBrightness(adbKeyCode, goingDown);
+                if (goingDown)
+                    queueACPISteps(&_brightnessSteps, adbKeyCode == 0x90 ? +1 : -1);
                 adbKeyCode = DEADKEY;
             }
             break;
@@ -1739,6 +2233,8 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
     
     // allow mouse/trackpad driver to have time of last keyboard activity
     // used to implement "PalmNoAction When Typing" and "OutsizeZoneNoAction When Typing"
+    if (PS2KeyClock::isTypingKey(adbKeyCode, goingDown))
+        _device->getKeyClock()->keyPressed(now_ns);
     PS2KeyInfo info;
     info.time = now_ns;
     info.adbKeyCode = adbKeyCode;
@@ -1774,12 +2270,13 @@ bool ApplePS2Keyboard::dispatchKeyboardEventWithPacket(const UInt8* packet)
         return true;
     }
 
+    _latency.packetParsed();
     if (keyCode && !info.eatKey)
     {
         // dispatch to HID system
-        if (goingDown || !(_PS2flags[keyCodeRaw] & kBreaklessKey))
+        if (goingDown || !(keyTable[keyCodeRaw].flags & kBreaklessKey))
             dispatchKeyboardEventX(adbKeyCode, goingDown, now_abs);
-        if (goingDown && (_PS2flags[keyCodeRaw] & kBreaklessKey))
+        if (goingDown && (keyTable[keyCodeRaw].flags & kBreaklessKey))
             dispatchKeyboardEventX(adbKeyCode, false, now_abs);
     }
     
@@ -1854,6 +2351,7 @@ void ApplePS2Keyboard::setLEDs(UInt8 ledState)
     request->commands[3].command = kPS2C_ReadDataPortAndCompare;
     request->commands[3].inOrOut = kSC_Acknowledge;
     request->commandsCount = 4;
+    request->priority = kPS2RP_Cosmetic;
     _device->submitRequest(request);
 }
 
@@ -1877,12 +2375,101 @@ void ApplePS2Keyboard::setKeyboardEnable(bool enable)
     request.commands[1].command = kPS2C_ReadDataPortAndCompare;
     request.commands[1].inOrOut = kSC_Acknowledge;
     request.commandsCount = 2;
+    request.priority = enable ? kPS2RP_Input : kPS2RP_Normal;
     assert(request.commandsCount <= countof(request.commands));
     _device->submitRequestAndBlock(&request);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Keyboard::setTypematicMode(UInt8 mode)
+{
+    //
+    // Asynchronously instructs the keyboard how to repeat held keys: with its
+    // defaults, not at all (make/release only), or as slow as possible.
+    //
+    // Not from interruptOccurred: allocateRequest may have to IOMalloc.
+    //
+
+    PS2Request* request = _device->allocateRequest(4);
+
+    request->commands[0].command = kPS2C_WriteDataPort;
+    request->commands[1].command = kPS2C_ReadDataPortAndCompare;
+    request->commands[1].inOrOut = kSC_Acknowledge;
+    request->commandsCount = 2;
+    switch (mode)
+    {
+        case kTypematicMakeRelease:
+            request->commands[0].inOrOut = kDP_SetAllMakeRelease;
+            break;
+
+        case kTypematicSlowest:
+            // (set typematic rate/delay command)
+            request->commands[0].inOrOut = kDP_SetKeyboardTypematic;
+            request->commands[2].command = kPS2C_WriteDataPort;
+            request->commands[2].inOrOut = 0x7F;    // 1000ms delay, 2 repeats/s
+            request->commands[3].command = kPS2C_ReadDataPortAndCompare;
+            request->commands[3].inOrOut = kSC_Acknowledge;
+            request->commandsCount = 4;
+            break;
+
+        default:
+            // also resets kDP_SetAllMakeRelease
+            request->commands[0].inOrOut = kDP_SetDefaults;
+            break;
+    }
+    _device->submitRequest(request);
+}
+
+bool ApplePS2Keyboard::noteTypematicRepeat()
+{
+    //
+    // A held key was repeated by the keyboard (called from interruptOccurred).
+    // If that happens after kDP_SetAllMakeRelease, the keyboard accepted but
+    // ignored it (it only applies to scan code set 3 on many keyboards), so
+    // fall back to the slowest repeat rate.  Returns true if the fallback is
+    // due: packetReady sends it, as a request cannot be allocated here.
+    //
+    // Breakless keys are not tracked, so their repeats are never counted or
+    // discarded: they repeat only as the keyboard's own typematic does.
+    //
+
+    __atomic_store_n(&_typematicRepeats, _typematicRepeats + 1, __ATOMIC_RELAXED);
+    if (kTypematicMakeRelease != __atomic_load_n(&_typematicMode, __ATOMIC_RELAXED))
+        return false;
+    __atomic_store_n(&_typematicMode, kTypematicSlowest, __ATOMIC_RELAXED);
+    __atomic_store_n(&_typematicFallback, true, __ATOMIC_RELAXED);
+    return true;
+}
+
+void ApplePS2Keyboard::publishTypematicStats()
+{
+    UInt8 mode = __atomic_load_n(&_typematicMode, __ATOMIC_RELAXED);
+    UInt32 interrupts = __atomic_load_n(&_interruptCount, __ATOMIC_RELAXED);
+    UInt32 repeats = __atomic_load_n(&_typematicRepeats, __ATOMIC_RELAXED);
+    // interrupts always change, so refresh once the repeats or the mode do
+    if (mode == _publishedTypematicMode && repeats == _publishedRepeats && interrupts - _publishedInterrupts < 256)
+        return;
+    _publishedTypematicMode = mode;
+    _publishedInterrupts = interrupts;
+    _publishedRepeats = repeats;
+    if (OSDictionary* dict = OSDictionary::withCapacity(3))
+    {
+        static const char* const modes[] = { "Hardware", "Make/Release", "Slowest" };
+        if (OSString* str = OSString::withCString(modes[mode]))
+        {
+            dict->setObject("Mode", str);
+            str->release();
+        }
+        setPropertyNumber(dict, "Interrupts", interrupts, 32);
+        setPropertyNumber(dict, "Repeats", repeats, 32);
+        setProperty(kTypematicStatistics, dict);
+        dict->release();
+    }
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 const unsigned char * ApplePS2Keyboard::defaultKeymapOfLength(UInt32 * length)
 {
     //
@@ -2172,6 +2759,30 @@ void ApplePS2Keyboard::initKeyboard()
     assert(request.commandsCount <= countof(request.commands));
     _device->submitRequestAndBlock(&request);
     
+    //
+    // Stop key repeats if requested (TypematicSuppression), kDP_SetDefaults
+    // above has reset them.  Keyboards that don't acknowledge
+    // kDP_SetAllMakeRelease get the slowest repeat rate instead.
+    //
+    
+    UInt8 mode = __atomic_load_n(&_typematicMode, __ATOMIC_RELAXED);
+    if (kTypematicMakeRelease == mode)
+    {
+        request.commands[0].command = kPS2C_WriteDataPort;
+        request.commands[0].inOrOut = kDP_SetAllMakeRelease;
+        request.commands[1].command = kPS2C_ReadDataPortAndCompare;
+        request.commands[1].inOrOut = kSC_Acknowledge;
+        request.commandsCount = 2;
+        _device->submitRequestAndBlock(&request);
+        if (2 != request.commandsCount)
+        {
+            mode = kTypematicSlowest;
+            __atomic_store_n(&_typematicMode, mode, __ATOMIC_RELAXED);
+        }
+    }
+    if (kTypematicSlowest == mode)
+        setTypematicMode(mode);
+    
     // look for any keys that are down (just in case the reset happened with keys down)
     // for each key that is down, dispatch a key up for it
     UInt8 packet[kPacketLength];
@@ -2186,7 +2797,8 @@ void ApplePS2Keyboard::initKeyboard()
     }
     
     // start out with all keys up
-    bzero(_keyBitVector, sizeof(_keyBitVector));
+    for (int scanCode = 0; scanCode < KBV_NUM_KEYCODES; scanCode++)
+        KBV_KEYUP(scanCode);
     _PS2modifierState = 0;
     
     //
@@ -2200,7 +2812,8 @@ void ApplePS2Keyboard::initKeyboard()
     //
     
     _extendCount = 0;
-    _ringBuffer.reset();
+    _ringBuffer.discard();
+    _latency.discardPackets();
 
     //
     // Finally, we enable the keyboard itself, so that it may start reporting
@@ -35,33 +35,102 @@
 #include <IOKit/IOCommandGate.h>
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-// Definitions used to keep track of key state.   Key up/down state is tracked
-// in a bit list.  Bits are set for key-down, and cleared for key-up.  The bit
-// vector and macros for it's manipulation are defined here.
+// Definitions used to keep track of key state and translation.  Everything a
+// keystroke needs to translate it (PS2 -> PS2 remap, breakless/modifier flags,
+// ADB code and action) is packed into one 8 byte PS2KeyEntry per key code, so
+// the dispatch path reads a single record instead of four parallel tables.
+// Reconfiguration replaces the whole table with one pointer swap, so the
+// up/down state is kept apart from it, one byte per key code.  Only the work
+// loop reads the table: the interrupt handler needs just the breakless flags,
+// which are mirrored into a bit array that lives as long as the driver.
 //
 
 #define KBV_NUM_KEYCODES        512     // related with ADB_CONVERTER_LEN
-#define KBV_BITS_PER_UNIT       32      // for UInt32
-#define KBV_BITS_MASK           31
-#define KBV_BITS_SHIFT          5       // 1<<5 == 32, for cheap divide
-#define KBV_NUNITS ((KBV_NUM_KEYCODES + \
-            (KBV_BITS_PER_UNIT-1))/KBV_BITS_PER_UNIT)
 
-#define KBV_KEYDOWN(n) \
-    (_keyBitVector)[((n)>>KBV_BITS_SHIFT)] |= (1 << ((n) & KBV_BITS_MASK))
-
-#define KBV_KEYUP(n) \
-    (_keyBitVector)[((n)>>KBV_BITS_SHIFT)] &= ~(1 << ((n) & KBV_BITS_MASK))
-
-#define KBV_IS_KEYDOWN(n) \
-    (((_keyBitVector)[((n)>>KBV_BITS_SHIFT)] & (1 << ((n) & KBV_BITS_MASK))) != 0)
+#define KBV_KEYDOWN(n)          (_keyDown[(n)] = 1)
+#define KBV_KEYUP(n)            (_keyDown[(n)] = 0)
+#define KBV_IS_KEYDOWN(n)       (_keyDown[(n)] != 0)
+#define KBV_IS_BREAKLESS(n)     ((__atomic_load_n(&_breaklessKeys[(n) >> 5], __ATOMIC_RELAXED) >> ((n) & 31)) & 1)
 
 #define KBV_NUM_SCANCODES       256
 
-// Special bits for _PS2ToPS2Map
+// Special bits for PS2KeyEntry::flags
 
 #define kBreaklessKey           0x01    // keys with this flag don't generate break codes
 
+// Values for PS2KeyEntry::action (looked up with the remapped key code)
+
+enum
+{
+    kKeyActionNone = 0,
+    kKeyActionACPI,         // e0f0 through e0ff, evaluates RKAx
+    kKeyActionSpecial,      // handled by the special case switch in dispatchKeyboardEventWithPacket
+};
+
+// Values for _typematicMode, how the keyboard itself repeats held keys
+
+enum
+{
+    kTypematicHardware = 0, // keyboard defaults, repeats are discarded in interruptOccurred
+    kTypematicMakeRelease,  // kDP_SetAllMakeRelease, no repeats at all
+    kTypematicSlowest,      // kDP_SetAllMakeRelease not supported, 1000ms delay and 2 repeats/s
+};
+
+struct PS2KeyEntry
+{
+    UInt16 remap;           // PS2 -> PS2 map, index of the key code to use instead
+    UInt8 flags;            // kBreaklessKey
+    UInt8 modifier;         // (bit number + 1) for modifier key tracking, 0 if none
+    UInt8 adb;              // working ADB code (after swaps)
+    UInt8 adbMapped;        // ADB code from stock table plus "PS2 To ADB" map
+    UInt8 action;           // kKeyAction*
+    UInt8 reserved;
+};
+static_assert(sizeof(PS2KeyEntry) == 8, "PS2KeyEntry must stay packed");
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// Compiled keymap ("Compiled Keymap" data property), as produced by
+// Docs/ps2keymap.py from the "Custom PS2 Map", "Breakless PS2", "Custom ADB Map"
+// and "Function Keys Standard"/"Function Keys Special" strings.  Layout is a
+// PS2KeymapHeader, keyCount PS2KeymapEntry records (one per key table index),
+// then standardCount + specialCount PS2KeymapRemap records (both counts are 0,
+// or neither).  Little endian.  A compiled keymap from the "Default" profile is
+// ignored when the platform profile or RMCF sets any of those strings.
+//
+
+#define kKeymapMagic            0x4b325350  // "PS2K"
+#define kKeymapVersion          1
+
+// Special bits for PS2KeymapEntry::flags (kBreaklessKey is shared with PS2KeyEntry)
+
+#define kKeymapCustomADB        0x80    // adb replaces the stock ADB code
+
+struct PS2KeymapHeader
+{
+    UInt32 magic;           // kKeymapMagic
+    UInt16 version;         // kKeymapVersion
+    UInt16 keyCount;        // KBV_NUM_KEYCODES
+    UInt16 standardCount;   // PS2KeymapRemap records for "Function Keys Standard"
+    UInt16 specialCount;    // PS2KeymapRemap records for "Function Keys Special"
+    UInt32 reserved;
+};
+static_assert(sizeof(PS2KeymapHeader) == 16, "Invalid PS2KeymapHeader size");
+
+struct PS2KeymapEntry
+{
+    UInt16 remap;           // PS2 -> PS2 map, key table index
+    UInt8 flags;            // kBreaklessKey, kKeymapCustomADB
+    UInt8 adb;              // ADB code if kKeymapCustomADB
+};
+static_assert(sizeof(PS2KeymapEntry) == 4, "Invalid PS2KeymapEntry size");
+
+struct PS2KeymapRemap
+{
+    UInt16 from;            // key table index
+    UInt16 to;              // key table index
+};
+static_assert(sizeof(PS2KeymapRemap) == 4, "Invalid PS2KeymapRemap size");
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // ApplePS2Keyboard Class Declaration
 //
@@ -71,6 +140,99 @@
 #define kPacketTimeOffset 8
 #define kPacketKeyDataLength 2
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// MacroInversionTrie
+//
+// The "Macro Inversion" rules compiled into a trie over the packet key data,
+// so invertMacros advances one state per packet instead of comparing the
+// buffered packets against every rule.  Rules only match from the first
+// buffered packet, so there are no failure links.
+//
+// Each state keeps the rules ending there (in rule order, with their
+// modifier mask/compare and output) and the first rule that goes on past it.
+// That is enough to give the same answer as walking the rule list in order:
+// the first rule either ends here with matching modifiers, or continues.
+//
+// Transitions are one open addressing hash table keyed by state and key
+// data, so next() does not depend on the number of rules.
+//
+
+class MacroInversionTrie
+{
+public:
+    enum { kRoot = 0, kNoState = -1 };
+    enum Result { kNoMatch, kPartial, kMatch };
+
+private:
+    enum { kNoRule = 0xFFFF };
+    struct Node
+    {
+        UInt16 firstTerminal;       // index into m_terminals
+        UInt16 terminalCount;
+        UInt16 firstDeeper;         // first rule continuing past this state
+    };
+    struct Terminal
+    {
+        UInt16 rule;
+        UInt16 mask;
+        UInt16 compare;
+        UInt8  output[kPacketKeyDataLength];
+    };
+    struct Edge
+    {
+        UInt32 key;                 // state << 16 | key data
+        SInt32 child;               // kNoState if the slot is empty
+    };
+
+    Node*     m_nodes;
+    unsigned  m_nodeCount;
+    Terminal* m_terminals;
+    unsigned  m_terminalCount;
+    Edge*     m_edges;
+    unsigned  m_edgeCount;          // power of 2
+
+    static inline UInt32 edgeKey(int state, const UInt8* keyData)
+        { return (UInt32)state << 16 | keyData[0] << 8 | keyData[1]; }
+    static inline unsigned edgeHash(UInt32 key)
+        { return (key * 2654435761U) >> 7; }
+    int addEdge(int state, const UInt8* keyData);
+
+public:
+    inline MacroInversionTrie() : m_nodes(0), m_nodeCount(0), m_terminals(0), m_terminalCount(0), m_edges(0), m_edgeCount(0) {}
+    bool build(OSData* const* rules);
+    void free();
+    inline bool empty() const { return !m_nodeCount; }
+
+    // state after 'packet' following 'state', kNoState if no rule goes on with it
+    inline int next(int state, const UInt8* packet) const
+    {
+        UInt32 key = edgeKey(state, packet);
+        for (unsigned i = edgeHash(key);; i++)
+        {
+            const Edge& edge = m_edges[i & (m_edgeCount - 1)];
+            if (edge.child == kNoState || edge.key == key)
+                return edge.child;
+        }
+    }
+
+    // kMatch (with the rule's output) if a rule ends in 'state' with matching
+    // modifiers before any rule continues past it, kPartial if a rule goes on
+    inline Result match(int state, UInt16 modifiers, const UInt8** output) const
+    {
+        const Node& node = m_nodes[state];
+        const Terminal* terminal = m_terminals + node.firstTerminal;
+        for (unsigned i = 0; i < node.terminalCount && terminal->rule < node.firstDeeper; i++, terminal++)
+        {
+            if ((0xFFFF == terminal->compare && (modifiers & terminal->mask)) || ((modifiers & terminal->mask) == terminal->compare))
+            {
+                *output = terminal->output;
+                return kMatch;
+            }
+        }
+        return node.firstDeeper != kNoRule ? kPartial : kNoMatch;
+    }
+};
+
 class EXPORT ApplePS2Keyboard : public IOHIKeyboard
 {
     typedef IOHIKeyboard super;
@@ -78,10 +240,19 @@ class EXPORT ApplePS2Keyboard : public IOHIKeyboard
 
 private:
     ApplePS2KeyboardDevice *    _device;
-    UInt32                      _keyBitVector[KBV_NUNITS];
+    UInt8                       _keyDown[KBV_NUM_KEYCODES];
+    UInt32                      _breaklessKeys[KBV_NUM_KEYCODES / 32]; // kBreaklessKey of _keyTable, for interruptOccurred
     UInt8                       _extendCount;
-    RingBuffer<UInt8, kPacketLength*32> _ringBuffer;
+    RingBuffer<UInt8, 32, kPacketLength> _ringBuffer;
+    LatencyStats _latency;
     UInt8                       _lastdata;
+    UInt8                       _typematicMode;     // kTypematic*
+    UInt8                       _publishedTypematicMode;
+    volatile bool               _typematicFallback; // set in interruptOccurred, sent from packetReady
+    UInt32                      _interruptCount;    // written from interruptOccurred only
+    UInt32                      _typematicRepeats;  // written from interruptOccurred only
+    UInt32                      _publishedInterrupts;
+    UInt32                      _publishedRepeats;
     bool                        _interruptHandlerInstalled;
     bool                        _powerControlHandlerInstalled;
     UInt8                       _ledState;
@@ -89,14 +260,15 @@ private:
 
     // for keyboard remapping
     UInt16                      _PS2modifierState;
-    UInt16                      _PS2ToPS2Map[KBV_NUM_SCANCODES*2];
-    UInt16                      _PS2flags[KBV_NUM_SCANCODES*2];
-    UInt8                       _PS2ToADBMap[ADB_CONVERTER_LEN];
-    UInt8                       _PS2ToADBMapMapped[ADB_CONVERTER_LEN];
+    PS2KeyEntry*                _keyTable;          // bytes of _keyTableData, read lock-free
+    OSData*                     _keyTableData;
+    OSArray*                    _retiredKeyTables;  // replaced tables, released from the work loop
+    IOLock*                     _keyTableLock;      // serializes updateKeyTable
+    IOTimerEventSource*         _keyTableTimer;
     UInt32                      _fkeymode;
     bool                        _fkeymodesupported;
-    OSArray*                    _keysStandard;
-    OSArray*                    _keysSpecial;
+    OSData*                     _keysStandard;      // PS2KeymapRemap[]
+    OSData*                     _keysSpecial;       // PS2KeymapRemap[]
     bool                        _swapcommandoption;
     int                         _logscancodes;
     UInt32                      _f12ejectdelay;
@@ -115,12 +287,26 @@ private:
     int *                       _backlightLevels;
     int                         _backlightCount;
     
+    // ACPI methods run on _acpiThreadCall instead of the work loop, RKAx calls in
+    // order through _acpiQueue, brightness/backlight steps summed up until then
+    thread_call_t               _acpiThreadCall;
+    IOLock*                     _acpiLock;          // serializes runACPICommands
+    RingBuffer<UInt8, 16>       _acpiQueue;         // RKAx: method index | kACPIKeyDown
+    SInt32                      _brightnessSteps;
+    SInt32                      _backlightSteps;
+    UInt32                      _acpiEvaluations;
+    UInt32                      _acpiCoalesced;
+    uint64_t                    _acpiTotalTime;
+    uint64_t                    _acpiMaxTime;
+    
     // special hack for Envy brightness access, while retaining F2/F3 functionality
     bool                        _brightnessHack;
     
     // macro processing
     OSData**                    _macroTranslation;
     OSData**                    _macroInversion;
+    MacroInversionTrie          _macroTrie;
+    int                         _macroState;        // trie state of _macroBuffer
     UInt8*                      _macroBuffer;
     int                         _macroMax;
     int                         _macroCurrent;
@@ -135,15 +321,32 @@ private:
     virtual void setKeyboardEnable(bool enable);
     virtual void initKeyboard();
     virtual void setDevicePowerState(UInt32 whatToDo);
-    void modifyKeyboardBacklight(int adbKeyCode, bool goingDown);
-    void modifyScreenBrightness(int adbKeyCode, bool goingDown);
+    void setTypematicMode(UInt8 mode);
+    bool noteTypematicRepeat();
+    void publishTypematicStats();
+    void modifyKeyboardBacklight(int steps);
+    void modifyScreenBrightness(int steps);
+    void queueACPICommand(UInt8 command);
+    void queueACPISteps(SInt32* steps, int step);
+    void scheduleACPICommands();
+    static void acpiCallout(thread_call_param_t param0, thread_call_param_t param1);
+    void runACPICommands();
+    void noteACPITime(uint64_t start);
     inline bool checkModifierState(UInt16 mask)
         { return mask == (_PS2modifierState & mask); }
     
+    bool loadCompiledKeymap(OSDictionary* dict, const char* name);
+    bool compiledKeymapOverridden(OSDictionary* list, OSDictionary* config);
+    static OSData* parseCustomPS2Map(OSArray* pArray);
+    static void applyCustomPS2Map(PS2KeyEntry* table, OSData* data);
     void loadCustomPS2Map(OSArray* pArray);
     void loadBreaklessPS2(OSDictionary* dict, const char* name);
+    void setBreaklessKeys(const PS2KeyEntry* table);
     void loadCustomADBMap(OSDictionary* dict, const char* name);
+    void updateKeyTable(OSDictionary* dict);
+    void onKeyTableTimer(void);
     void setParamPropertiesGated(OSDictionary* dict);
+    void dispatchACPINotificationGated(UInt32* argument);
     void onSleepEjectTimer(void);
     
     static OSData** loadMacroData(OSDictionary* dict, const char* name);
@@ -151,7 +354,6 @@ private:
     void onMacroTimer(void);
     bool invertMacros(const UInt8* packet);
     void dispatchInvertBuffer();
-    static bool compareMacro(const UInt8* packet, const UInt8* data, int count);
 
 protected:
     const unsigned char * defaultKeymapOfLength(UInt32 * length) override;
@@ -159,7 +361,7 @@ protected:
     void setNumLockFeedback(bool locked) override;
     UInt32 maxKeyCodes() override;
     inline void dispatchKeyboardEventX(unsigned int keyCode, bool goingDown, uint64_t time)
-        { dispatchKeyboardEvent(keyCode, goingDown, *(AbsoluteTime*)&time); }
+        { dispatchKeyboardEvent(keyCode, goingDown, *(AbsoluteTime*)&time); _latency.packetDispatched(); }
     inline void setTimerTimeout(IOTimerEventSource* timer, uint64_t time)
         { timer->setTimeout(*(AbsoluteTime*)&time); }
     inline void cancelTimer(IOTimerEventSource* timer)
@@ -167,6 +369,7 @@ protected:
 
 public:
     bool init(OSDictionary * dict) override;
+    void free() override;
     ApplePS2Keyboard * probe(IOService * provider, SInt32 * score) override;
 
     bool start(IOService * provider) override;
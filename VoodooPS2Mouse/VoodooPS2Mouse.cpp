@@ -83,7 +83,7 @@ bool ApplePS2Mouse::init(OSDictionary * dict)
   forcesetres                = false;
   scrollres                  = 10;
   actliketrackpad            = false;
-  keytime                    = 0;
+  _keyClock                  = 0;
   maxaftertyping             = 500000000;
   buttonmask                 = ~0;
   scroll                     = true;
@@ -101,6 +101,13 @@ bool ApplePS2Mouse::init(OSDictionary * dict)
   _buttontime = 0;
   _maxmiddleclicktime = 100000000;
 
+  // state for adaptive sample rate
+  _adaptiveRate = false;
+  _lowSampleRate = 100;
+  _rateIdleTime = 1000000000;
+  _rateTimer = 0;
+  _rateRequest = 0;
+
   // announce version
   extern kmod_info_t kmod_info;
   DEBUG_LOG("VoodooPS2Mouse: Version %s starting on OS X Darwin %d.%d.\n", kmod_info.version, version_major, version_minor);
@@ -113,6 +120,13 @@ void ApplePS2Mouse::setParamPropertiesGated(OSDictionary * config)
 {
 	if (NULL == config)
 		return;
+
+    // any value resets the latency histograms
+    if (config->getObject(kResetLatencyStatistics))
+    {
+        _latency.reset();
+        _latency.publish(this);
+    }
     
     const struct {const char *name; int *var;} int32vars[]={
         {"DefaultResolution",               &defres},
@@ -122,6 +136,7 @@ void ApplePS2Mouse::setParamPropertiesGated(OSDictionary * config)
         {"ScrollYInverter",                 &scrollyinverter},
         {"WakeDelay",                       &wakedelay},
         {"ButtonCount",                     &_buttonCount},
+        {"LowSampleRate",                   &_lowSampleRate},
     };
     const struct {const char *name; int *var;} boolvars[]={
         {"ForceDefaultResolution",          &forceres},
@@ -131,6 +146,7 @@ void ApplePS2Mouse::setParamPropertiesGated(OSDictionary * config)
         {"FakeMiddleButton",                &_fakemiddlebutton},
         {"ProcessUSBMouseStopsTrackpad",    &_processusbmouse},
         {"ProcessBluetoothMouseStopsTrackpad", &_processbluetoothmouse},
+        {"AdaptiveSampleRate",              &_adaptiveRate},
     };
     const struct {const char* name; bool* var;} lowbitvars[]={
         {"TrackpadScroll",                  &scroll},
@@ -142,6 +158,7 @@ void ApplePS2Mouse::setParamPropertiesGated(OSDictionary * config)
     const struct {const char* name; uint64_t* var; } int64vars[]={
         {"MiddleClickTime",                 &_maxmiddleclicktime},
         {"QuietTimeAfterTyping",            &maxaftertyping},
+        {"SampleRateIdleTime",              &_rateIdleTime},
     };
     
     
@@ -179,7 +196,7 @@ void ApplePS2Mouse::setParamPropertiesGated(OSDictionary * config)
 
     // disable trackpad when USB mouse is plugged in and this functionality is requested
     if (attachedHIDPointerDevices && attachedHIDPointerDevices->getCount() > 0) {
-        ignoreall = usb_mouse_stops_trackpad;
+        __atomic_store_n(&ignoreall, usb_mouse_stops_trackpad, __ATOMIC_SEQ_CST);
         updateTouchpadLED();
     }
     
@@ -348,6 +365,7 @@ bool ApplePS2Mouse::start(IOService * provider)
   //
 
   _device = (ApplePS2MouseDevice *)provider;
+  _keyClock = _device->getKeyClock();
   _device->retain();
 
   //
@@ -371,6 +389,11 @@ bool ApplePS2Mouse::start(IOService * provider)
   _buttonTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2Mouse::onButtonTimer));
   if (_buttonTimer)
       pWorkLoop->addEventSource(_buttonTimer);
+  _rateTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2Mouse::onRateTimer));
+  if (_rateTimer)
+      pWorkLoop->addEventSource(_rateTimer);
+  // one switch is in flight at a time, so its request is allocated once
+  _rateRequest = _device->allocateRequest(kRateCommands);
     
   //
   // Lock the controller during initialization
@@ -433,9 +456,18 @@ void ApplePS2Mouse::stop(IOService * provider)
 
   //
   // Disable the mouse itself, so that it may stop reporting mouse events.
+  // No more sample rate switches first; the disable waits out one still in
+  // flight, as it is queued behind it.
   //
 
+  if (_cmdGate)
+    _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePS2Mouse::stopReportRate));
   setMouseEnable(false);
+  if (_rateRequest)
+  {
+    _device->freeRequest(_rateRequest);
+    _rateRequest = 0;
+  }
 
   // free up the command gate
   IOWorkLoop* pWorkLoop = getWorkLoop();
@@ -453,6 +485,13 @@ void ApplePS2Mouse::stop(IOService * provider)
       _buttonTimer->release();
       _buttonTimer = 0;
     }
+    if (_rateTimer)
+    {
+      _rateTimer->cancelTimeout();
+      pWorkLoop->removeEventSource(_rateTimer);
+      _rateTimer->release();
+      _rateTimer = 0;
+    }
   }
     
   //
@@ -496,60 +535,88 @@ void ApplePS2Mouse::resetMouse()
   // ... it is just going to time out... and then later show up in the
   // input stream unexpectedly.
     
-  TPS2Request<8> request;
-  request.commands[0].command = kPS2C_WriteCommandPort;
-  request.commands[0].inOrOut = kCP_TransmitToMouse;
-  request.commands[1].command = kPS2C_WriteDataPort;
-  request.commands[1].inOrOut = kDP_SetDefaults;
-  request.commands[2].command = kPS2C_WriteCommandPort;
-  request.commands[2].inOrOut = kCP_TransmitToMouse;
-  request.commands[3].command = kPS2C_WriteDataPort;
-  request.commands[3].inOrOut = kDP_GetMouseInformation;
-  request.commands[4].command = kPS2C_ReadDataPortAndCompare;
-  request.commands[4].inOrOut = kSC_Acknowledge;
-  request.commands[5].command = kPS2C_ReadDataPort;
-  request.commands[5].inOrOut = 0;
-  request.commands[6].command = kPS2C_ReadDataPort;
-  request.commands[6].inOrOut = 0;
-  request.commands[7].command = kPS2C_ReadDataPort;
-  request.commands[7].inOrOut = 0;
-  request.commandsCount = 8;
-  assert(request.commandsCount <= countof(request.commands));
-  _device->submitRequestAndBlock(&request);
-  if (8 != request.commandsCount)
-      DEBUG_LOG("%s: reset mouse sequence failed: %d\n", getName(), request.commandsCount);
-  
+  //
+  // The reset, the Synaptics LED probe and getting the mouse information
+  // all go out as one request.  Each part fails on its own, as they did when
+  // they were separate requests.
+  //
+    
+  TPS2Request<kResetProgramSize> request;
+  PS2CommandBuilder program(request);
+  unsigned reset = program.tryBegin();
+  program.add(kPS2C_WriteCommandPort, kCP_TransmitToMouse);
+  program.add(kPS2C_WriteDataPort, kDP_SetDefaults);
+  program.add(kPS2C_WriteCommandPort, kCP_TransmitToMouse);
+  program.add(kPS2C_WriteDataPort, kDP_GetMouseInformation);
+  program.add(kPS2C_ReadDataPortAndCompare, kSC_Acknowledge);
+  program.read();
+  program.read();
+  program.read();
+  program.end(reset);
+
   // Now deal with Synaptics specifics (ActLikeTrackpad trick)...
-  ledpresent = false;
-  do if (actliketrackpad && !noled)
+  unsigned queryExtModel = 0;
+  if (actliketrackpad && !noled)
   {
-    // do Synaptics specific, but only if it is Synaptics device
-    UInt8 buf3[3];
-    if (!getTouchPadData(0x0, buf3) || (0x46 != buf3[1] && 0x47 != buf3[1]))
-        break;
+    // do Synaptics specific, but only if it is Synaptics device ($46 or $47)
+    unsigned queryIdentify = appendTouchPadQuery(program, 0x0);
+    unsigned isSynaptics = program.skipUnlessEqual(queryIdentify + kQueryResult + 1, 0xFE, 0x46);
     // it is Synaptics, now test for LED capability...
-    if (!getTouchPadData(0x2, buf3) || !(buf3[0] & 0x80))
-        break;
-    int nExtendedQueries = (buf3[0] & 0x70) >> 4;
-    // check LED capability if query is supported
-    if (nExtendedQueries >= 1 && getTouchPadData(0x9, buf3))
-    {
-        ledpresent = (buf3[0] >> 6) & 1;
-        DEBUG_LOG("%s: ledpresent=%d\n", getName(), ledpresent);
-    }
-  } while (false);
+    unsigned queryCaps = appendTouchPadQuery(program, 0x2);
+    unsigned capsValid = program.skipUnlessBitsSet(queryCaps + kQueryResult, 0x80);
+    // check LED capability if query is supported (nExtendedQueries >= 1)
+    unsigned hasExtended = program.skipUnlessBitsSet(queryCaps + kQueryResult, 0x70);
+    queryExtModel = appendTouchPadQuery(program, 0x9);
+    program.end(hasExtended);
+    program.end(capsValid);
+    program.end(isSynaptics);
+  }
 
   //
   // Obtain our mouse's resolution and sampling rate.
   //
-    
+
+  unsigned queryInfo = 0;
   if (_mouseInfoBytes == (UInt32)-1)
   {
     // attempt switch to high resolution
     if (forcesetres && resmode != -1)
-        setMouseResolution(resmode);
-      
-    _mouseInfoBytes = getMouseInformation();
+      appendMouseCommand(program, kDP_SetMouseResolution, resmode);
+    queryInfo = program.tryBegin();
+    program.mouseCommand(kDP_GetMouseInformation);
+    program.read();
+    program.read();
+    program.read();
+    program.end(queryInfo);
+  }
+  else
+  {
+    appendMouseCommand(program, kDP_SetMouseResolution, (_mouseInfoBytes >> 8) & 3);
+  }
+
+  program.finish();
+  assert(request.commandsCount <= countof(request.commands));
+  _device->submitRequestAndBlock(&request);
+  if (!program.succeeded(reset))
+      DEBUG_LOG("%s: reset mouse sequence failed: %d\n", getName(), request.commands[reset].failedAt);
+
+  ledpresent = false;
+  if (queryExtModel && program.succeeded(queryExtModel))
+  {
+    ledpresent = (program.result(queryExtModel + kQueryResult) >> 6) & 1;
+    DEBUG_LOG("%s: ledpresent=%d\n", getName(), ledpresent);
+  }
+
+  if (queryInfo)
+  {
+    _mouseInfoBytes = (UInt32)-1;
+    if (program.succeeded(queryInfo))
+    {
+      _mouseInfoBytes = ((UInt32)program.result(queryInfo + 2) << 16) |
+                        ((UInt32)program.result(queryInfo + 3) << 8 ) |
+                        ((UInt32)program.result(queryInfo + 4));
+    }
+    DEBUG_LOG("%s: mouse information 0x%x\n", getName(), _mouseInfoBytes);
 	if (forceres)
 		_resolution = defres;
 	else
@@ -563,10 +630,6 @@ void ApplePS2Mouse::resetMouse()
 	  }
     DEBUG_LOG("%s: _resolution=0x%x\n", getName(), _resolution);
   }
-  else
-  {
-    setMouseResolution((_mouseInfoBytes >> 8) & 3);
-  }
 
   //
   // Enable the Intellimouse mode, should this be an Intellimouse.
@@ -611,7 +674,8 @@ void ApplePS2Mouse::resetMouse()
   // initialize packet buffer
     
   _packetByteCount = 0;
-  _ringBuffer.reset();
+  _ringBuffer.discard();
+  _latency.discardPackets();
 
   //
   // Finally, we enable the mouse itself, so that it may start reporting
@@ -619,6 +683,7 @@ void ApplePS2Mouse::resetMouse()
   //
     
   setMouseEnable(true);
+  resetReportRate();
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -649,7 +714,7 @@ PS2InterruptResult ApplePS2Mouse::interruptOccurred(UInt8 data)      // PS2Inter
     // needs to be delivered.  Process the mouse data.
     //
     
-    UInt8* packet = _ringBuffer.head();
+    UInt8* packet = _ringBuffer.reserve();
     
     // special case for $AA $00, spontaneous reset (usually due to static electricity)
     if (kSC_Reset == _lastdata && 0x00 == data)
@@ -659,7 +724,8 @@ PS2InterruptResult ApplePS2Mouse::interruptOccurred(UInt8 data)      // PS2Inter
         // spontaneous reset, device has announced with $AA $00, schedule a reset
         packet[0] = 0x00;
         packet[1] = kSC_Reset;
-        _ringBuffer.advanceHead(kPacketLengthMax);
+        if (_ringBuffer.commit())
+            _latency.packetQueued();
         _packetByteCount = 0;
         return kPS2IR_packetReady;
     }
@@ -682,7 +748,8 @@ PS2InterruptResult ApplePS2Mouse::interruptOccurred(UInt8 data)      // PS2Inter
             _mouseResetCount++;
             packet[0] = 0x00;
             packet[1] = kSC_Acknowledge;
-            _ringBuffer.advanceHead(kPacketLengthMax);
+            if (_ringBuffer.commit())
+                _latency.packetQueued();
             return kPS2IR_packetReady;
         }
         return kPS2IR_packetBuffering;
@@ -693,11 +760,17 @@ PS2InterruptResult ApplePS2Mouse::interruptOccurred(UInt8 data)      // PS2Inter
     // we have the three (or four) bytes, dispatch this packet for processing.
     //
     
+    if (0 == _packetByteCount)
+    {
+        _latency.packetStarted();
+        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+    }
     packet[_packetByteCount++] = data;
     if (_packetByteCount == _packetLength)
     {
         _mouseResetCount = 0;
-        _ringBuffer.advanceHead(kPacketLengthMax);
+        if (_ringBuffer.commit())
+            _latency.packetQueued();
         _packetByteCount = 0;
         return kPS2IR_packetReady;
     }
@@ -709,20 +782,25 @@ void ApplePS2Mouse::packetReady()
     // empty the ring buffer, dispatching each packet...
     // all packets are kPacketLengthMax even if _packetLength is smaller, as they
     // are padded at interrupt time.
-    while (_ringBuffer.count() >= kPacketLengthMax)
+    while (_ringBuffer.count())
     {
         UInt8* packet = _ringBuffer.tail();
+        _latency.packetDrained();
         if (0x00 != packet[0])
         {
             // normal packet with deltas
             dispatchRelativePointerEventWithPacket(_ringBuffer.tail(), _packetLength);
+            _queueingDelay.record(*(uint64_t*)(&packet[kPacketTimeOffset]));
         }
         else
         {
             ////initMouse();
         }
-        _ringBuffer.advanceTail(kPacketLengthMax);
+        _ringBuffer.advanceTail();
     }
+    _ringBuffer.publishStats(this, kRingBufferStatistics);
+    _latency.publish(this);
+    _queueingDelay.publish(this);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -737,7 +815,7 @@ void ApplePS2Mouse::onButtonTimer(void)
 
 UInt32 ApplePS2Mouse::middleButton(UInt32 buttons, uint64_t now_abs, MBComingFrom from)
 {
-    if (!_fakemiddlebutton || _buttonCount <= 2 || (ignoreall && fromMouse == from))
+    if (!_fakemiddlebutton || _buttonCount <= 2 || (__atomic_load_n(&ignoreall, __ATOMIC_RELAXED) && fromMouse == from))
         return buttons;
     
     // cancel timer if we see input before timeout has fired, but after expired
@@ -875,8 +953,8 @@ void ApplePS2Mouse::dispatchRelativePointerEventWithPacket(UInt8 * packet,
   SInt32 dy = -(((packet[0] & 0x20) ? 0xffffff00 : 0 ) | packet[2]);
   SInt16 dz = 0;
 
-  uint64_t now_abs;
-  clock_get_uptime(&now_abs);
+  // events carry the time the packet arrived, not when it was dequeued
+  uint64_t now_abs = *(uint64_t*)(&packet[kPacketTimeOffset]);
   uint64_t now_ns;
   absolutetime_to_nanoseconds(now_abs, &now_ns);
     
@@ -914,6 +992,7 @@ void ApplePS2Mouse::dispatchRelativePointerEventWithPacket(UInt8 * packet,
   lastbuttons = buttons;
     
   // ignore button 1 and 2 (could be simulated by trackpad) if just after typing
+  uint64_t keytime = _keyClock->lastKeyTime();
   if (palm_wt || outzone_wt)
   {
     if (now_ns-keytime <= maxaftertyping)
@@ -923,7 +1002,10 @@ void ApplePS2Mouse::dispatchRelativePointerEventWithPacket(UInt8 * packet,
     buttons &= buttonmask;
   }
     
-  if (!ignoreall)
+  _latency.packetParsed();
+  if (_adaptiveRate && (dx || dy || dz))
+     noteMotion(now_abs);
+  if (!__atomic_load_n(&ignoreall, __ATOMIC_RELAXED))
      dispatchRelativePointerEventX(dx, mouseyinverter*dy, buttons, now_abs);
     
   if ( dz && (!(palm_wt || outzone_wt) || now_ns-keytime > maxaftertyping))
@@ -933,7 +1015,7 @@ void ApplePS2Mouse::dispatchRelativePointerEventWithPacket(UInt8 * packet,
     // and positive when scrolling downwards. Invert this before passing to
     // HID/CG.
     //
-    if (!ignoreall)
+    if (!__atomic_load_n(&ignoreall, __ATOMIC_RELAXED))
        dispatchScrollWheelEventX(-scrollyinverter*dz, 0, 0, now_abs);
   }
     
@@ -964,6 +1046,7 @@ void ApplePS2Mouse::setMouseEnable(bool enable)
   request.commands[2].command = kPS2C_ReadDataPortAndCompare;
   request.commands[2].inOrOut = kSC_Acknowledge;
   request.commandsCount = 3;
+  request.priority = enable ? kPS2RP_Input : kPS2RP_Normal;
   assert(request.commandsCount <= countof(request.commands));
   _device->submitRequestAndBlock(&request);
 }
@@ -1002,6 +1085,128 @@ void ApplePS2Mouse::setMouseSampleRate(UInt8 sampleRate)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2Mouse::noteMotion(uint64_t timestamp)
+{
+  uint64_t now_ns;
+  absolutetime_to_nanoseconds(timestamp, &now_ns);
+  if (_reportRate.active(now_ns))
+  {
+    updateReportRate();
+    if (_rateTimer)
+      setTimerTimeout(_rateTimer, _rateIdleTime);
+  }
+}
+
+void ApplePS2Mouse::onRateTimer(void)
+{
+  if (!_adaptiveRate)
+    return;
+  uint64_t now_abs, now_ns, remaining;
+  clock_get_uptime(&now_abs);
+  absolutetime_to_nanoseconds(now_abs, &now_ns);
+  if (_reportRate.idle(now_ns, _rateIdleTime, remaining))
+    updateReportRate();
+  else if (remaining)
+    setTimerTimeout(_rateTimer, remaining);
+}
+
+void ApplePS2Mouse::updateReportRate()
+{
+  // program the wanted rate, unless a switch is still in flight (its
+  // completion comes back here)
+  int rate;
+  if (_rateRequest && _reportRate.request(rate))
+    submitReportRate(rate);
+}
+
+void ApplePS2Mouse::submitReportRate(int rate)
+{
+  //
+  // Same as setMouseSampleRate, but queued without blocking so it can be
+  // issued while packets are being dispatched, and with reporting off
+  // meanwhile (F5 ... F4), so no packet is mixed with the acknowledges.
+  // Only kHighSampleRate and LowSampleRate are ever sent, alternating, so
+  // this can not form one of the 200/100/80 or 200/200/80 sequences that
+  // switch Intellimouse modes.
+  //
+
+  UInt8 sampleRate = ReportRate::kHigh == rate ? kHighSampleRate : _lowSampleRate;
+  DEBUG_LOG("%s: sample rate %d\n", getName(), sampleRate);
+  _rateRequest->commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
+  _rateRequest->commands[0].inOrOut = kDP_SetDefaultsAndDisable;
+  _rateRequest->commands[1].command = kPS2C_SendMouseCommandAndCompareAck;
+  _rateRequest->commands[1].inOrOut = kDP_SetMouseSampleRate;
+  _rateRequest->commands[2].command = kPS2C_SendMouseCommandAndCompareAck;
+  _rateRequest->commands[2].inOrOut = sampleRate;
+  _rateRequest->commands[3].command = kPS2C_SendMouseCommandAndCompareAck;
+  _rateRequest->commands[3].inOrOut = kDP_Enable;
+  _rateRequest->commandsCount = kRateCommands;
+  _rateRequest->completionTarget = this;
+  _rateRequest->completionAction = OSMemberFunctionCast(PS2CompletionAction, this, &ApplePS2Mouse::reportRateDone);
+  _rateRequest->completionParam = 0;
+  _device->submitRequest(_rateRequest);
+}
+
+void ApplePS2Mouse::reportRateDone(void* param)
+{
+  // completion of _rateRequest, on the work loop
+  uint64_t now_abs, now_ns;
+  clock_get_uptime(&now_abs);
+  absolutetime_to_nanoseconds(now_abs, &now_ns);
+  switch (_reportRate.complete(kRateCommands == _rateRequest->commandsCount, now_ns))
+  {
+    case ReportRate::kDone:
+      updateReportRate();
+      break;
+
+    case ReportRate::kRetry:
+      submitReportRate(_reportRate.requested());
+      break;
+
+    case ReportRate::kFailed:
+      // reporting was turned off first, make sure it is back on
+      IOLog("%s: sample rate switch failed: %d\n", getName(), _rateRequest->commandsCount);
+      if (!_reportRate.stopped())
+      {
+        if (PS2Request* request = _device->allocateRequest(1))
+        {
+          request->commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
+          request->commands[0].inOrOut = kDP_Enable;
+          request->commandsCount = 1;
+          _device->submitRequest(request);
+        }
+      }
+      break;
+  }
+  _reportRate.publish(this, _lowSampleRate, kHighSampleRate, now_ns);
+}
+
+void ApplePS2Mouse::resetReportRate()
+{
+  // after a reset the mouse runs at whatever rate the Intellimouse knock left
+  // it at, start over at the low one
+  if (!_rateTimer)
+    return;
+  _rateTimer->cancelTimeout();
+  if (!_adaptiveRate)
+    return;
+  uint64_t now_abs, now_ns;
+  clock_get_uptime(&now_abs);
+  absolutetime_to_nanoseconds(now_abs, &now_ns);
+  _reportRate.sync(ReportRate::kLow, now_ns, false);
+  updateReportRate();
+}
+
+void ApplePS2Mouse::stopReportRate()
+{
+  // gated, so no completion is halfway through queueing a retry
+  if (_rateTimer)
+    _rateTimer->cancelTimeout();
+  _reportRate.stop();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2Mouse::setMouseResolution(UInt8 resolution)
 {
   //
@@ -1049,7 +1254,6 @@ PS2MouseId ApplePS2Mouse::setIntellimouseMode()
   // Do NOT issue this request from the interrupt/completion context.
   //
 
-  UInt8      mouseIDByte;
   PS2MouseId mouseID;
 
   //
@@ -1058,66 +1262,70 @@ PS2MouseId ApplePS2Mouse::setIntellimouseMode()
   // point the mouse will start sending 4 byte packets for mouse events and
   // return a mouse ID of 3.
   //
+  // The whole negotiation, including the second round for 5 button mode,
+  // is sent as one request.
+  //
 
-  setMouseSampleRate(200);
-  setMouseSampleRate(100);
-  setMouseSampleRate(80 );
+  TPS2Request<kIntellimouseProgramSize> request;
+  PS2CommandBuilder program(request);
+  appendMouseCommand(program, kDP_SetMouseSampleRate, 200);
+  appendMouseCommand(program, kDP_SetMouseSampleRate, 100);
+  appendMouseCommand(program, kDP_SetMouseSampleRate, 80);
 
   //
   // Pause before sending the next command after switching mouse mode.
   //
 
-  IOSleep(50);
+  program.sleep(50);
 
   //
   // Determine whether we have an Intellimouse by asking for the mouse's ID.
   //
 
-  mouseIDByte = getMouseID();
-  switch(mouseIDByte)
+  unsigned firstID = appendGetMouseID(program);
+
+  // Try to enter 5 button mode if we're not there already.
+  // Same sequence as above, more or less.
+  unsigned isIntellimouse = program.skipUnlessEqual(firstID + 2, 0xFF, kMouseTypeIntellimouse);
+  appendMouseCommand(program, kDP_SetMouseSampleRate, 200);
+  appendMouseCommand(program, kDP_SetMouseSampleRate, 200);
+  appendMouseCommand(program, kDP_SetMouseSampleRate, 80);
+  program.sleep(50);
+  unsigned secondID = appendGetMouseID(program);
+  program.end(isIntellimouse);
+
+  //
+  // Restore the original sampling rate, before we obliterated it.
+  //
+
+  appendMouseCommand(program, kDP_SetMouseSampleRate, _mouseInfoBytes & 0x0000FF);
+
+  program.finish();
+  assert(request.commandsCount <= countof(request.commands));
+  _device->submitRequestAndBlock(&request);
+
+  // %%KCD - I have a device that (incorrectly?) responds
+  // with the Intellimouse Explorer mouse ID in response to the standard
+  // Intellimouse device query.  It also seems to then go into
+  // five button mode in that case, so look for that here.
+  UInt8 mouseIDByte = program.succeeded(firstID) ? program.result(firstID + 2) : (UInt8)-1;
+  DEBUG_LOG("%s: mouse ID 0x%x\n", getName(), mouseIDByte);
+  switch (mouseIDByte)
   {
-    // %%KCD - I have a device that (incorrectly?) responds
-    // with the Intellimouse Explorer mouse ID in response to the standard
-    // Intellimouse device query.  It also seems to then go into
-    // five button mode in that case, so look for that here.
     case kMouseTypeIntellimouseExplorer:
       mouseID = kMouseTypeIntellimouseExplorer;
       break;
     case kMouseTypeIntellimouse:
       mouseID = kMouseTypeIntellimouse;
+      // second round
+      if (program.succeeded(secondID) && kMouseTypeIntellimouseExplorer == program.result(secondID + 2))
+        mouseID = kMouseTypeIntellimouseExplorer;
       break;
     default:
       mouseID = kMouseTypeStandard;
       break;
   }
 
-  if (mouseID == kMouseTypeIntellimouse)
-  {
-    // Try to enter 5 button mode if we're not there already.
-    // Same code as above, more or less.
-    setMouseSampleRate(200);
-    setMouseSampleRate(200);
-    setMouseSampleRate(80 );
-    IOSleep(50);
-
-    mouseIDByte = getMouseID();
-    switch (mouseIDByte)
-    {
-      case kMouseTypeIntellimouseExplorer:
-        mouseID = kMouseTypeIntellimouseExplorer;
-        break;
-      default:
-        mouseID = kMouseTypeIntellimouse;
-        break;
-    }
-  }
-
-  //
-  // Restore the original sampling rate, before we obliterated it.
-  //
-
-  setMouseSampleRate(_mouseInfoBytes & 0x0000FF);
-
   DEBUG_LOG("%s::setIntellimouseMode() returns 0x%x\n", getName(), mouseID);
     
   return mouseID;
@@ -1211,13 +1419,15 @@ void ApplePS2Mouse::setDevicePowerState( UInt32 whatToDo )
     switch ( whatToDo )
     {
         case kPS2C_DisableDevice:
+            if (_rateTimer)
+                _rateTimer->cancelTimeout();
             // Disable mouse (synchronous).
             setMouseEnable( false );
             break;
 
         case kPS2C_EnableDevice:
             // Allow time for device to initialize
-            IOSleep(wakedelay);
+            _device->powerControlSleep(wakedelay);
             
             // Enable mouse and restore state.
             resetMouse();
@@ -1236,60 +1446,35 @@ IOReturn ApplePS2Mouse::message(UInt32 type, IOService* provider, void* argument
     // Here is where we receive messages from the keyboard driver
     //
     // This allows for the keyboard driver to enable/disable the trackpad
-    // when a certain keycode is pressed.
+    // when a certain keycode is pressed.  The time of the last key press is
+    // read from _keyClock instead of being sent as a message.
     //
-    // It also allows the trackpad driver to learn the last time a key
-    //  has been pressed, so it can implement various "ignore trackpad
-    //  input while typing" options.
+    // The controller delivers these without a gate (see PS2NotificationBus),
+    // so ignoreall is only accessed atomically, and updateTouchpadLED copes
+    // with a change racing its own request.
     //
     switch (type)
     {
         case kPS2M_getDisableTouchpad:
         {
             bool* pResult = (bool*)argument;
-            *pResult = !ignoreall;
-            break;
+            *pResult = !__atomic_load_n(&ignoreall, __ATOMIC_RELAXED);
+            return kIOReturnSuccess;
         }
             
         case kPS2M_setDisableTouchpad:
         {
             bool enable = *((bool*)argument);
             // ignoreall is true when trackpad has been disabled
-            if (enable == ignoreall)
+            if (__atomic_exchange_n(&ignoreall, !enable, __ATOMIC_SEQ_CST) != !enable)
             {
-                // save state, and update LED
-                ignoreall = !enable;
+                // state changed, update LED
                 updateTouchpadLED();
             }
-            break;
-        }
-            
-        case kPS2M_notifyKeyPressed:
-        {
-            // just remember last time key pressed... this can be used in
-            // interrupt handler to detect unintended input while typing
-            PS2KeyInfo* pInfo = (PS2KeyInfo*)argument;
-            switch (pInfo->adbKeyCode)
-            {
-                    // don't store key time for modifier keys going down
-                case 0x38:  // left shift
-                case 0x3c:  // right shift
-                case 0x3b:  // left control
-                case 0x3e:  // right control
-                case 0x3a:  // left alt (command)
-                case 0x3d:  // right alt
-                case 0x37:  // left windows (option)
-                case 0x36:  // right windows
-                    if (pInfo->goingDown)
-                        break;
-                default:
-                    keytime = pInfo->time;
-            }
-            break;
+            return kIOReturnSuccess;
         }
     }
-    
-    return kIOReturnSuccess;
+    return super::message(type, provider, argument);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -1335,8 +1520,16 @@ IOReturn ApplePS2Mouse::message(UInt32 type, IOService* provider, void* argument
 
 void ApplePS2Mouse::updateTouchpadLED()
 {
+    // ignoreall can change on another thread while the LED request is out:
+    // every sender checks the state again once its request is done, so the
+    // last one to complete always leaves the LED matching it
     if (ledpresent && !noled)
-        setTouchpadLED(ignoreall ? 0x88 : 0x10);
+    {
+        UInt8 touchLED;
+        do
+            setTouchpadLED(touchLED = touchpadLEDValue());
+        while (touchLED != touchpadLEDValue());
+    }
 }
 
 bool ApplePS2Mouse::setTouchpadLED(UInt8 touchLED)
@@ -1438,6 +1631,43 @@ bool ApplePS2Mouse::getTouchPadData(UInt8 dataSelector, UInt8 buf3[])
     return true;
 }
 
+unsigned ApplePS2Mouse::appendTouchPadQuery(PS2CommandBuilder& program, UInt8 dataSelector)
+{
+    // Same sequence as getTouchPadData, as a group of its own: a failed
+    // query does not stop the rest of the request.
+    unsigned query = program.tryBegin();
+    program.mouseCommand(kDP_SetDefaultsAndDisable);
+    program.specialCommand(dataSelector);
+    program.mouseCommand(kDP_GetMouseInformation);
+    program.read();
+    program.read();
+    program.read();
+    program.mouseCommand(kDP_SetDefaultsAndDisable);
+    program.end(query);
+    return query;
+}
+
+unsigned ApplePS2Mouse::appendMouseCommand(PS2CommandBuilder& program, UInt8 command, UInt8 arg)
+{
+    // command with argument (eg. sample rate, resolution); as before, a
+    // failure is ignored
+    unsigned group = program.tryBegin();
+    program.mouseCommand(command);
+    program.mouseCommand(arg);
+    program.end(group);
+    return group;
+}
+
+unsigned ApplePS2Mouse::appendGetMouseID(PS2CommandBuilder& program)
+{
+    // the ID byte is at the returned index + 2
+    unsigned group = program.tryBegin();
+    program.mouseCommand(kDP_GetId);
+    program.read();
+    program.end(group);
+    return group;
+}
+
 void ApplePS2Mouse::registerHIDPointerNotifications()
 {
     IOServiceMatchingNotificationHandler notificationHandler = OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &ApplePS2Mouse::notificationHIDAttachedHandler);
@@ -1555,14 +1785,14 @@ void ApplePS2Mouse::notificationHIDAttachedHandlerGated(IOService * newService,
     if (notifier == usb_hid_publish_notify || notifier == bluetooth_hid_publish_notify) {
         if (usb_mouse_stops_trackpad && attachedHIDPointerDevices->getCount() > 0) {
             // One or more USB or Bluetooth pointer devices attached, disable trackpad
-            ignoreall = true;
+            __atomic_store_n(&ignoreall, true, __ATOMIC_SEQ_CST);
         }
     }
     
     if (notifier == usb_hid_terminate_notify || notifier == bluetooth_hid_terminate_notify) {
         if (usb_mouse_stops_trackpad && attachedHIDPointerDevices->getCount() == 0) {
             // No USB or bluetooth pointer devices attached, re-enable trackpad
-            ignoreall = false;
+            __atomic_store_n(&ignoreall, false, __ATOMIC_SEQ_CST);
         }
     }
 }
@@ -39,6 +39,25 @@
 #define kPacketLengthMax          4
 #define kPacketLengthStandard     3
 #define kPacketLengthIntellimouse 4
+#define kPacketTimeOffset         8 // arrival time of the first byte
+#define kPacketBufferLength       (kPacketTimeOffset+8)
+
+// commands of appendTouchPadQuery, appendMouseCommand and appendGetMouseID
+#define kTouchPadQueryCommands    15
+#define kMouseCommandCommands     3
+#define kGetMouseIDCommands       3
+// resetMouse and setIntellimouseMode send their sequences as one request
+// each, of at most: the reset (9), the Synaptics LED probe (3 queries, 3
+// blocks) and the resolution and information query (5)
+#define kResetProgramSize         (9 + 3*kTouchPadQueryCommands + 3 + kMouseCommandCommands + 5)
+// 7 rate/resolution commands, 2 pauses, 2 ID queries and the 5 button block
+#define kIntellimouseProgramSize  (7*kMouseCommandCommands + 2 + 2*kGetMouseIDCommands + 1)
+// index of the first result byte, relative to appendTouchPadQuery's return
+#define kQueryResult              11
+// sample rate used while the mouse is moving (AdaptiveSampleRate)
+#define kHighSampleRate           200
+// commands of a sample rate switch (F5, F3 rate, F4)
+#define kRateCommands             4
 
 typedef enum
 {
@@ -60,7 +79,9 @@ private:
   ApplePS2MouseDevice * _device;
   bool                  _interruptHandlerInstalled;
   bool                  _powerControlHandlerInstalled;
-  RingBuffer<UInt8, kPacketLengthMax*32> _ringBuffer;
+  RingBuffer<UInt8, 32, kPacketBufferLength> _ringBuffer;
+  LatencyStats _latency;
+  QueueingDelay _queueingDelay;
   UInt32                _packetByteCount;
   UInt8                 _lastdata;
   UInt32                _packetLength;
@@ -78,7 +99,7 @@ private:
   int32_t               resmode;
   int32_t               scrollres;
   int                   actliketrackpad;
-  uint64_t              keytime;
+  PS2KeyClock*          _keyClock;
   uint64_t              maxaftertyping;
   UInt32                buttonmask;
   bool                  outzone_wt, palm, palm_wt;
@@ -116,8 +137,23 @@ private:
   IOTimerEventSource* _buttonTimer;
   uint64_t _maxmiddleclicktime;
   int _fakemiddlebutton;
-    
+
+  // for adaptive sample rate
+  int _adaptiveRate;
+  int _lowSampleRate;
+  uint64_t _rateIdleTime;
+  ReportRate _reportRate;
+  IOTimerEventSource* _rateTimer;
+  PS2Request* _rateRequest;
+
   void onButtonTimer(void);
+  void onRateTimer(void);
+  void noteMotion(uint64_t timestamp);
+  void updateReportRate();
+  void submitReportRate(int rate);
+  void reportRateDone(void* param);
+  void resetReportRate();
+  void stopReportRate();
   enum MBComingFrom { fromTimer, fromMouse };
   UInt32 middleButton(UInt32 butttons, uint64_t now, MBComingFrom from);
    
@@ -134,8 +170,12 @@ private:
   virtual void   setDevicePowerState(UInt32 whatToDo);
     
   void updateTouchpadLED();
+  inline UInt8 touchpadLEDValue() const { return __atomic_load_n(&ignoreall, __ATOMIC_RELAXED) ? 0x88 : 0x10; }
   bool setTouchpadLED(UInt8 touchLED);
   bool getTouchPadData(UInt8 dataSelector, UInt8 buf3[]);
+  unsigned appendTouchPadQuery(PS2CommandBuilder& program, UInt8 dataSelector);
+  unsigned appendMouseCommand(PS2CommandBuilder& program, UInt8 command, UInt8 arg);
+  unsigned appendGetMouseID(PS2CommandBuilder& program);
   void setParamPropertiesGated(OSDictionary * dict);
   void injectVersionDependentProperties(OSDictionary* dict);
 
@@ -149,9 +189,9 @@ protected:
   IOItemCount buttonCount() override;
   IOFixed     resolution() override;
   inline void dispatchRelativePointerEventX(int dx, int dy, UInt32 buttonState, uint64_t now)
-    { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); }
+    { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); _latency.packetDispatched(); }
   inline void dispatchScrollWheelEventX(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now)
-    { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); }
+    { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); _latency.packetDispatched(); }
   inline void setTimerTimeout(IOTimerEventSource* timer, uint64_t time)
     { timer->setTimeout(*(AbsoluteTime*)&time); }
   inline void cancelTimer(IOTimerEventSource* timer)
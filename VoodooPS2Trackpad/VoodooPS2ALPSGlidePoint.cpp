@@ -348,13 +348,19 @@ PS2InterruptResult ApplePS2ALPSGlidePoint::interruptOccurred(UInt8 data)
         return kPS2IR_packetBuffering;
     }
 
-    UInt8* packet = _ringBuffer.head();
+    UInt8* packet = _ringBuffer.reserve();
+    if (0 == _packetByteCount)
+    {
+        _latency.packetStarted();
+        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+    }
     packet[_packetByteCount++] = data;
     if (kPacketLengthLarge == _packetByteCount ||
         (kPacketLengthSmall == _packetByteCount && (packet[0] & 0xc8) == 0x08))
     {
         // complete 6 or 3-byte packet received...
-        _ringBuffer.advanceHead(kPacketLengthMax);
+        if (_ringBuffer.commit())
+            _latency.packetQueued();
         _packetByteCount = 0;
         return kPS2IR_packetReady;
     }
@@ -364,16 +370,21 @@ PS2InterruptResult ApplePS2ALPSGlidePoint::interruptOccurred(UInt8 data)
 void ApplePS2ALPSGlidePoint::packetReady()
 {
     // empty the ring buffer, dispatching each packet...
-    while (_ringBuffer.count() >= kPacketLengthMax)
+    while (_ringBuffer.count())
     {
         UInt8* packet = _ringBuffer.tail();
+        _latency.packetDrained();
         // now we have complete packet, either 6-byte or 3-byte
         if ((packet[0] & 0xf8) == 0xf8)
             dispatchAbsolutePointerEventWithPacket(packet, kPacketLengthLarge);
         else
             dispatchRelativePointerEventWithPacket(packet, kPacketLengthSmall);
-        _ringBuffer.advanceTail(kPacketLengthMax);
+        _queueingDelay.record(*(uint64_t*)(&packet[kPacketTimeOffset]));
+        _ringBuffer.advanceTail();
     }
+    _ringBuffer.publishStats(this, kRingBufferStatistics);
+    _latency.publish(this);
+    _queueingDelay.publish(this);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -390,7 +401,7 @@ void ApplePS2ALPSGlidePoint::dispatchAbsolutePointerEventWithPacket(UInt8* packe
     int y = (packet[4] & 0x7f) | ((packet[3] & 0x70) << (7-4));
     int z = packet[5]; // touch pression
     
-    clock_get_uptime(&now_abs);
+    now_abs = *(uint64_t*)(&packet[kPacketTimeOffset]);
     
     left  |= (packet[2]) & 1;
     left  |= (packet[3]) & 1;
@@ -517,8 +528,7 @@ void ApplePS2ALPSGlidePoint::
 	if(packet[0] & 0x20)
 		dy = dy  - 256;
 
-    uint64_t now_abs;
-    clock_get_uptime(&now_abs);
+    uint64_t now_abs = *(uint64_t*)(&packet[kPacketTimeOffset]);
     dispatchRelativePointerEventX(dx, dy, buttons, now_abs);
 }
 
@@ -699,7 +709,8 @@ void ApplePS2ALPSGlidePoint::setDevicePowerState( UInt32 whatToDo )
             //
 			setAbsoluteMode();
             
-            _ringBuffer.reset();
+            _ringBuffer.discard();
+            _latency.discardPackets();
             _packetByteCount = 0;
             
             setTouchPadEnable( true );
@@ -738,66 +749,52 @@ void ApplePS2ALPSGlidePoint::getStatus(ALPSStatus_t *status)
 
 void ApplePS2ALPSGlidePoint::getModel(ALPSStatus_t *E6,ALPSStatus_t *E7)
 {
-    // "E6 report"
-    TPS2Request<9> request;
-    request.commands[0].command  = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[0].inOrOut  = kDP_SetMouseResolution;
-	request.commands[1].command = kPS2C_SendMouseCommandAndCompareAck;
-	request.commands[1].inOrOut = 0;
+    // Both reports are fetched with one request; a failure getting the
+    // "E6 report" does not keep us from trying the "E7 report".
+    TPS2Request<20> request;
+    PS2CommandBuilder program(request);
 
+    // "E6 report"
+    unsigned reportE6 = program.tryBegin();
+    program.mouseCommand(kDP_SetMouseResolution);
+    program.mouseCommand(0);
     // 3X set mouse scaling 1 to 1
-    request.commands[2].command  = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[2].inOrOut  = kDP_SetMouseScaling1To1;
-    request.commands[3].command  = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[3].inOrOut  = kDP_SetMouseScaling1To1;
-    request.commands[4].command  = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[4].inOrOut  = kDP_SetMouseScaling1To1;
-    request.commands[5].command  = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[5].inOrOut  = kDP_GetMouseInformation;
-    request.commands[6].command  = kPS2C_ReadDataPort;
-    request.commands[6].inOrOut  = 0;
-    request.commands[7].command = kPS2C_ReadDataPort;
-    request.commands[7].inOrOut = 0;
-    request.commands[8].command = kPS2C_ReadDataPort;
-    request.commands[8].inOrOut = 0;
-	request.commandsCount = 9;
+    program.mouseCommand(kDP_SetMouseScaling1To1);
+    program.mouseCommand(kDP_SetMouseScaling1To1);
+    program.mouseCommand(kDP_SetMouseScaling1To1);
+    program.mouseCommand(kDP_GetMouseInformation);
+    unsigned resultE6 = program.read();
+    program.read();
+    program.read();
+    program.end(reportE6);
+
+    // "E7 report"
+    unsigned reportE7 = program.tryBegin();
+    program.mouseCommand(kDP_SetMouseResolution);
+    program.mouseCommand(0);
+    // 3X set mouse scaling 2 to 1
+    program.mouseCommand(kDP_SetMouseScaling2To1);
+    program.mouseCommand(kDP_SetMouseScaling2To1);
+    program.mouseCommand(kDP_SetMouseScaling2To1);
+    program.mouseCommand(kDP_GetMouseInformation);
+    unsigned resultE7 = program.read();
+    program.read();
+    program.read();
+    program.end(reportE7);
+
+    program.finish();
     assert(request.commandsCount <= countof(request.commands));
     _device->submitRequestAndBlock(&request);
 	
     // result is "E6 report"
-	E6->byte0 = request.commands[6].inOrOut;
-	E6->byte1 = request.commands[7].inOrOut;
-	E6->byte2 = request.commands[8].inOrOut;
+	E6->byte0 = program.result(resultE6);
+	E6->byte1 = program.result(resultE6 + 1);
+	E6->byte2 = program.result(resultE6 + 2);
 	
-    // Now fetch "E7 report"
-    request.commands[0].command  = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[0].inOrOut  = kDP_SetMouseResolution;
-	request.commands[1].command = kPS2C_SendMouseCommandAndCompareAck;
-	request.commands[1].inOrOut = 0;
-	
-    // 3X set mouse scaling 2 to 1
-    request.commands[2].command  = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[2].inOrOut  = kDP_SetMouseScaling2To1;
-    request.commands[3].command  = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[3].inOrOut  = kDP_SetMouseScaling2To1;
-    request.commands[4].command  = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[4].inOrOut  = kDP_SetMouseScaling2To1;
-    request.commands[5].command  = kPS2C_SendMouseCommandAndCompareAck;
-    request.commands[5].inOrOut  = kDP_GetMouseInformation;
-    request.commands[6].command  = kPS2C_ReadDataPort;
-    request.commands[6].inOrOut  = 0;
-    request.commands[7].command = kPS2C_ReadDataPort;
-    request.commands[7].inOrOut = 0;
-    request.commands[8].command = kPS2C_ReadDataPort;
-    request.commands[8].inOrOut = 0;
-	request.commandsCount = 9;
-    assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
-
     // result is "E7 report"
-	E7->byte0 = request.commands[6].inOrOut;
-	E7->byte1 = request.commands[7].inOrOut;
-	E7->byte2 = request.commands[8].inOrOut;
+	E7->byte0 = program.result(resultE7);
+	E7->byte1 = program.result(resultE7 + 1);
+	E7->byte2 = program.result(resultE7 + 2);
 }
 
 void ApplePS2ALPSGlidePoint::setAbsoluteMode()
@@ -44,6 +44,8 @@ typedef struct ALPSStatus
 #define kPacketLengthSmall  3
 #define kPacketLengthLarge  6
 #define kPacketLengthMax    6
+#define kPacketTimeOffset   8 // arrival time of the first byte
+#define kPacketBufferLength (kPacketTimeOffset+8)
 
 class EXPORT ApplePS2ALPSGlidePoint : public IOHIPointing
 {
@@ -54,7 +56,9 @@ private:
     ApplePS2MouseDevice * _device;
     bool                  _interruptHandlerInstalled;
     bool                  _powerControlHandlerInstalled;
-    RingBuffer<UInt8, kPacketLengthMax*32> _ringBuffer;
+    RingBuffer<UInt8, 32, kPacketBufferLength> _ringBuffer;
+    LatencyStats          _latency;
+    QueueingDelay         _queueingDelay;
     UInt32                _packetByteCount;
     IOFixed               _resolution;
     UInt16                _touchPadVersion;
@@ -94,9 +98,9 @@ protected:
     virtual void   setDevicePowerState(UInt32 whatToDo);
     
     inline void dispatchRelativePointerEventX(int dx, int dy, UInt32 buttonState, uint64_t now)
-        { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); }
+        { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); _latency.packetDispatched(); }
     inline void dispatchScrollWheelEventX(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now)
-        { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); }
+        { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); _latency.packetDispatched(); }
 
 protected:
 	IOItemCount buttonCount() override;
@@ -446,11 +446,17 @@ PS2InterruptResult ApplePS2SentelicFSP::interruptOccurred( UInt8 data )
     // we have the three bytes, dispatch this packet for processing.
     //
 	
-    UInt8* packet = _ringBuffer.head();
+    UInt8* packet = _ringBuffer.reserve();
+    if (0 == _packetByteCount)
+    {
+        _latency.packetStarted();
+        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+    }
     packet[_packetByteCount++] = data;
     if (_packetByteCount == _packetSize)
     {
-        _ringBuffer.advanceHead(kPacketLengthMax);
+        if (_ringBuffer.commit())
+            _latency.packetQueued();
         _packetByteCount = 0;
         return kPS2IR_packetReady;
     }
@@ -460,11 +466,17 @@ PS2InterruptResult ApplePS2SentelicFSP::interruptOccurred( UInt8 data )
 void ApplePS2SentelicFSP::packetReady()
 {
     // empty the ring buffer, dispatching each packet...
-    while (_ringBuffer.count() >= kPacketLengthMax)
+    while (_ringBuffer.count())
     {
-        dispatchRelativePointerEventWithPacket(_ringBuffer.tail(), _packetSize);
-        _ringBuffer.advanceTail(kPacketLengthMax);
+        UInt8* packet = _ringBuffer.tail();
+        _latency.packetDrained();
+        dispatchRelativePointerEventWithPacket(packet, _packetSize);
+        _queueingDelay.record(*(uint64_t*)(&packet[kPacketTimeOffset]));
+        _ringBuffer.advanceTail();
     }
+    _ringBuffer.publishStats(this, kRingBufferStatistics);
+    _latency.publish(this);
+    _queueingDelay.publish(this);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -498,7 +510,7 @@ void ApplePS2SentelicFSP::dispatchRelativePointerEventWithPacket(UInt8* packet,
     dx = ((packet[0] & 0x10) ? 0xffffff00 : 0 ) | packet[1];
     dy = -(((packet[0] & 0x20) ? 0xffffff00 : 0 ) | packet[2]);
     
-    clock_get_uptime(&now_abs);
+    now_abs = *(uint64_t*)(&packet[kPacketTimeOffset]);
     dispatchRelativePointerEventX(dx, dy, buttons, now_abs);
 
     if (packetSize == 4)
@@ -636,7 +648,7 @@ void ApplePS2SentelicFSP::setDevicePowerState( UInt32 whatToDo )
             // completed its power-on self-test and calibration.
             //
 			
-            IOSleep(1000);
+            _device->powerControlSleep(1000);
 			
             //
             // Clear packet buffer pointer to avoid issues caused by
@@ -644,7 +656,8 @@ void ApplePS2SentelicFSP::setDevicePowerState( UInt32 whatToDo )
             //
 			
             _packetByteCount = 0;
-            _ringBuffer.reset();
+            _ringBuffer.discard();
+            _latency.discardPackets();
 			
             //
             // Finally, we enable the trackpad itself, so that it may
@@ -30,6 +30,8 @@
 #define kPacketLengthMax          4
 #define kPacketLengthStandard     3
 #define kPacketLengthLarge        4
+#define kPacketTimeOffset         8 // arrival time of the first byte
+#define kPacketBufferLength       (kPacketTimeOffset+8)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 // ApplePS2SentelicFSP Class Declaration
@@ -44,7 +46,9 @@ private:
     ApplePS2MouseDevice * _device;
     bool                  _interruptHandlerInstalled;
     bool                  _powerControlHandlerInstalled;
-    RingBuffer<UInt8, kPacketLengthMax*32> _ringBuffer;
+    RingBuffer<UInt8, 32, kPacketBufferLength> _ringBuffer;
+    LatencyStats          _latency;
+    QueueingDelay         _queueingDelay;
     UInt32                _packetByteCount;
     UInt8                 _packetSize;
     IOFixed               _resolution;
@@ -67,9 +71,9 @@ protected:
     IOFixed     resolution() override;
     
     inline void dispatchRelativePointerEventX(int dx, int dy, UInt32 buttonState, uint64_t now)
-        { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); }
+        { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); _latency.packetDispatched(); }
     inline void dispatchScrollWheelEventX(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now)
-        { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); }
+        { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); _latency.packetDispatched(); }
     
     
 public:
@@ -114,12 +114,22 @@ bool ApplePS2SynapticsTouchPad::init(OSDictionary * dict)
     
     // init my stuff
     memset(&fingerStates, 0, SYNAPTICS_MAX_FINGERS * sizeof(struct synaptics_hw_state));
+    _batch.count = 0;
     agmFingerCount = 0;
     lastFingerCount = 0;
     hadLiftFinger = false;
     wasSkipped = false;
     for (int i = 0; i < SYNAPTICS_MAX_FINGERS; i++)
         fingerStates[i].virtualFingerIndex = -1;
+    _zeroDropTransitions = false;
+    agmFresh = false;
+    agmTime = 0;
+    agmX = agmY = agmPrimaryX = agmPrimaryY = 0;
+    _secondaryProvisional = false;
+    _transitionPending = false;
+    _transitionStart = 0;
+    _transitionPackets = 0;
+    resetTransitionStats();
     
     // set defaults for configuration items
 
@@ -144,6 +154,22 @@ bool ApplePS2SynapticsTouchPad::init(OSDictionary * dict)
     _extendedwmode=false;
     _extendedwmodeSupported=false;
     _dynamicEW=false;
+
+    _coalescePackets=false;
+    _touchEventPending=false;
+    _touchFrameCount=-1;
+    _touchFrameButtons=0;
+    _touchFramesDelivered=0;
+    _touchFramesCoalesced=0;
+    _touchFramesPublished=0;
+    _coalesceStatsTime=0;
+
+    _idleFrameLimit=10;
+    _idleFrameRun=0;
+    _idleFramesSent=0;
+    _idleFramesSuppressed=0;
+    _idleFramesPublished=0;
+    _idleStatsTime=0;
     
     _processusbmouse = true;
     _processbluetoothmouse = true;
@@ -166,23 +192,36 @@ bool ApplePS2SynapticsTouchPad::init(OSDictionary * dict)
     _pendingbuttons = 0;
     _buttontime = 0;
     _maxmiddleclicktime = 100000000;
+
+    _adaptiveRate = false;
+    _rateIdleTime = 1000000000;
+    _rateTimer = 0;
+    _rateRequest = 0;
+    _rateMotionX = _rateMotionY = 0;
+    _useHighRate = false;
     _fakemiddlebutton = true;
     
     ignoredeltas=0;
     ignoredeltasstart=0;
-    keytime = 0;
+    _keyClock = 0;
     ignoreall = false;
     passthru = false;
     ledpresent = false;
     clickpadtype = 0;
+    selectDecoder();
     _clickbuttons = 0;
     _reportsv = false;
     usb_mouse_stops_trackpad = true;
-    _modifierdown = 0;
     scrollzoommask = 0;
 
     _forceTouchMode = FORCE_TOUCH_BUTTON;
     _forceTouchPressureThreshold = 100;
+
+    _smoothingFilter = SMOOTHING_AVERAGE;
+    _oneEuro.minCutoff = 1000;
+    _oneEuro.beta = 7;
+    _oneEuro.dCutoff = 1000;
+    _predictionTime = 0;
     
     // announce version
 	extern kmod_info_t kmod_info;
@@ -374,9 +413,52 @@ void ApplePS2SynapticsTouchPad::doHardwareReset()
 
 void ApplePS2SynapticsTouchPad::queryCapabilities()
 {
+    uint64_t start_abs;
+    clock_get_uptime(&start_abs);
+
+    //
+    // All the identify queries go out as a single request.  The extended
+    // queries are only sent if the capabilities report them, and those
+    // depending on "continued capabilities" only if it reports them.  At
+    // kQueryProgramSize commands the request is too large for the stack; it
+    // is kept (not freed by the controller on completion) for the results.
+    //
+
+    PS2Request* request = _device->allocateRequest(kQueryProgramSize);
+    request->completionTarget = kStackCompletionTarget;
+    PS2CommandBuilder program(request, kQueryProgramSize);
+    program.mouseCommand(kDP_SetDefaultsAndDisable);
+    unsigned queryCaps = appendTouchPadQuery(program, 0x2);
+    unsigned queryModes = appendTouchPadQuery(program, 0x1);
+    unsigned queryModel = appendTouchPadQuery(program, 0x3);
+    unsigned querySNPrefix = appendTouchPadQuery(program, 0x6);
+    unsigned querySNSuffix = appendTouchPadQuery(program, 0x7);
+    unsigned queryResolution = appendTouchPadQuery(program, 0x8);
+    unsigned capsValid = program.skipUnlessBitsSet(queryCaps + kQueryResult, 0x80);
+    unsigned hasExtended1 = program.skipUnlessBitsSet(queryCaps + kQueryResult, 0x70); // nExtendedQueries >= 1
+    unsigned queryExtModel = appendTouchPadQuery(program, 0x9);
+    unsigned hasExtended4 = program.skipUnlessBitsSet(queryCaps + kQueryResult, 0x40); // nExtendedQueries >= 4
+    unsigned queryContinued = appendTouchPadQuery(program, 0xc);
+    unsigned reportsMaxBlock = program.skipUnlessBitsSet(queryContinued + kQueryResult, 1 << 1);
+    unsigned queryMax = appendTouchPadQuery(program, 0xd);
+    program.end(reportsMaxBlock);
+    unsigned deluxeLedsBlock = program.skipUnlessBitsSet(queryContinued + kQueryResult + 1, 1 << 1);
+    unsigned queryDeluxeLeds = appendTouchPadQuery(program, 0xe);
+    program.end(deluxeLedsBlock);
+    unsigned reportsMinBlock = program.skipUnlessBitsSet(queryContinued + kQueryResult + 1, 1 << 5);
+    unsigned queryMin = appendTouchPadQuery(program, 0xf);
+    program.end(reportsMinBlock);
+    program.end(hasExtended4);
+    program.end(hasExtended1);
+    program.end(capsValid);
+    if (program.finish())
+        _device->submitRequestAndBlock(request);
+    else
+        request->commandsCount = 0;
+
     // get TouchPad general capabilities
     UInt8 buf3[3];
-    if (!getTouchPadData(0x2, buf3) || !(buf3[0] & 0x80))
+    if (!touchPadQueryResult(program, queryCaps, buf3) || !(buf3[0] & 0x80))
         buf3[0] = buf3[2] = 0;
     int nExtendedQueries = (buf3[0] & 0x70) >> 4;
     INFO_LOG("VoodooPS2Trackpad: nExtendedQueries=%d\n", nExtendedQueries);
@@ -389,7 +471,7 @@ void ApplePS2SynapticsTouchPad::queryCapabilities()
         UInt8 passthru2 = buf3[2] >> 7;
         // see if guest device for pass through is present
         UInt8 passthru1 = 0;
-        if (getTouchPadData(0x1, buf3))
+        if (touchPadQueryResult(program, queryModes, buf3))
         {
             // first byte, bit 0 indicates guest present
             passthru1 = buf3[0] & 0x01;
@@ -414,45 +496,45 @@ void ApplePS2SynapticsTouchPad::queryCapabilities()
         ledpresent = true;
         INFO_LOG("VoodooPS2Trackpad: ledpresent=%d (forced for type 0x46)\n", ledpresent);
     }
-    else if (nExtendedQueries >= 1 && getTouchPadData(0x9, buf3))
+    else if (nExtendedQueries >= 1 && touchPadQueryResult(program, queryExtModel, buf3))
     {
         ledpresent = (buf3[0] >> 6) & 1;
         INFO_LOG("VoodooPS2Trackpad: ledpresent=%d\n", ledpresent);
     }
     
     // get resolution data for scaling x -> y or y -> x depending
-    if (getTouchPadData(0x8, buf3) && (buf3[1] & 0x80) && buf3[0] && buf3[2])
+    if (touchPadQueryResult(program, queryResolution, buf3) && (buf3[1] & 0x80) && buf3[0] && buf3[2])
     {
         xupmm = buf3[0];
         yupmm = buf3[2];
     }
     
     // now gather some more information about the touchpad
-    if (getTouchPadData(0x1, buf3))
+    if (touchPadQueryResult(program, queryModes, buf3))
     {
         INFO_LOG("VoodooPS2Trackpad: Mode/model($01) bytes = { 0x%x, 0x%x, 0x%x }\n", buf3[0], buf3[1], buf3[2]);
     }
-    if (getTouchPadData(0x2, buf3))
+    if (touchPadQueryResult(program, queryCaps, buf3))
     {
         INFO_LOG("VoodooPS2Trackpad: Capabilities($02) bytes = { 0x%x, 0x%x, 0x%x }\n", buf3[0], buf3[1], buf3[2]);
     }
-    if (getTouchPadData(0x3, buf3))
+    if (touchPadQueryResult(program, queryModel, buf3))
     {
         INFO_LOG("VoodooPS2Trackpad: Model ID($03) bytes = { 0x%x, 0x%x, 0x%x }\n", buf3[0], buf3[1], buf3[2]);
     }
-    if (getTouchPadData(0x6, buf3))
+    if (touchPadQueryResult(program, querySNPrefix, buf3))
     {
         INFO_LOG("VoodooPS2Trackpad: SN Prefix($06) bytes = { 0x%x, 0x%x, 0x%x }\n", buf3[0], buf3[1], buf3[2]);
     }
-    if (getTouchPadData(0x7, buf3))
+    if (touchPadQueryResult(program, querySNSuffix, buf3))
     {
         INFO_LOG("VoodooPS2Trackpad: SN Suffix($07) bytes = { 0x%x, 0x%x, 0x%x }\n", buf3[0], buf3[1], buf3[2]);
     }
-    if (getTouchPadData(0x8, buf3))
+    if (touchPadQueryResult(program, queryResolution, buf3))
     {
         INFO_LOG("VoodooPS2Trackpad: Resolutions($08) bytes = { 0x%x, 0x%x, 0x%x }\n", buf3[0], buf3[1], buf3[2]);
     }
-    if (nExtendedQueries >= 1 && getTouchPadData(0x9, buf3))
+    if (nExtendedQueries >= 1 && touchPadQueryResult(program, queryExtModel, buf3))
     {
         INFO_LOG("VoodooPS2Trackpad: Extended Model($09) bytes = { 0x%x, 0x%x, 0x%x }\n", buf3[0], buf3[1], buf3[2]);
     }
@@ -461,7 +543,7 @@ void ApplePS2SynapticsTouchPad::queryCapabilities()
     bool reportsMin = false;
     bool deluxeLeds = false;
     
-    if (nExtendedQueries >= 4 && getTouchPadData(0xc, buf3))
+    if (nExtendedQueries >= 4 && touchPadQueryResult(program, queryContinued, buf3))
     {
         setProperty("0xc Query", buf3, 3);
         INFO_LOG("VoodooPS2Trackpad: Continued Capabilities($0C) bytes = { 0x%x, 0x%x, 0x%x }\n", buf3[0], buf3[1], buf3[2]);
@@ -486,14 +568,14 @@ void ApplePS2SynapticsTouchPad::queryCapabilities()
         reportsMin = (bool)(buf3[1] & (1 << 5));
         deluxeLeds = (bool)(buf3[1] & (1 << 1));
     }
-    if (reportsMax && getTouchPadData(0xd, buf3))
+    if (reportsMax && touchPadQueryResult(program, queryMax, buf3))
     {
         logical_max_x = (buf3[0] << 5) | ((buf3[1] & 0x0f) << 1);
         logical_max_y = (buf3[2] << 5) | ((buf3[1] & 0xf0) >> 3);
 
         INFO_LOG("VoodooPS2Trackpad: Maximum coords($0D) bytes = { 0x%x, 0x%x, 0x%x }\n", buf3[0], buf3[1], buf3[2]);
     }
-    if (deluxeLeds && getTouchPadData(0xe, buf3))
+    if (deluxeLeds && touchPadQueryResult(program, queryDeluxeLeds, buf3))
     {
         INFO_LOG("VoodooPS2Trackpad: Deluxe LED bytes($0E) = { 0x%x, 0x%x, 0x%x }\n", buf3[0], buf3[1], buf3[2]);
     }
@@ -502,7 +584,7 @@ void ApplePS2SynapticsTouchPad::queryCapabilities()
     margin_size_x = 5 * xupmm;
     margin_size_y = 5 * yupmm;
 
-    if (reportsMin && getTouchPadData(0xf, buf3))
+    if (reportsMin && touchPadQueryResult(program, queryMin, buf3))
     {
         logical_min_x = (buf3[0] << 5) | ((buf3[1] & 0x0f) << 1);
         logical_min_y = (buf3[2] << 5) | ((buf3[1] & 0xf0) >> 3);
@@ -512,6 +594,7 @@ void ApplePS2SynapticsTouchPad::queryCapabilities()
         logical_min_x = logical_max_x - 3 * margin_size_x;
         logical_min_y = logical_max_y - 3 * margin_size_y;
     }
+    _device->freeRequest(request);
 
     // We should set physical dimensions anyway
     logical_min_x += margin_size_x;
@@ -548,6 +631,9 @@ void ApplePS2SynapticsTouchPad::queryCapabilities()
           logical_max_x, logical_max_y,
           physical_max_x, physical_max_y,
           xupmm, yupmm);
+
+    selectDecoder();
+    publishInitTime("QueryCapabilities (us)", start_abs);
 }
 
 bool ApplePS2SynapticsTouchPad::handleOpen(IOService *forClient, IOOptionBits options, void *arg) {
@@ -582,6 +668,7 @@ bool ApplePS2SynapticsTouchPad::start( IOService * provider )
 
     _device = (ApplePS2MouseDevice *) provider;
     _device->retain();
+    _keyClock = _device->getKeyClock();
     
     //
     // Announce hardware properties.
@@ -635,6 +722,15 @@ bool ApplePS2SynapticsTouchPad::start( IOService * provider )
         }
         pWorkLoop->addEventSource(_buttonTimer);
     }
+
+    //
+    // Setup adaptive report rate timer event source
+    //
+    _rateTimer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &ApplePS2SynapticsTouchPad::onRateTimer));
+    if (_rateTimer)
+        pWorkLoop->addEventSource(_rateTimer);
+    // one switch is in flight at a time, so its request is allocated once
+    _rateRequest = _device->allocateRequest(kModeByteCommands);
     
     pWorkLoop->addEventSource(_cmdGate);
     
@@ -727,14 +823,27 @@ void ApplePS2SynapticsTouchPad::stop( IOService * provider )
     // turn off the LED just in case it was on
     //
     
-    ignoreall = false;
+    __atomic_store_n(&ignoreall, false, __ATOMIC_SEQ_CST);
     updateTouchpadLED();
 
+    //
+    // No more report rate switches; the disable below waits out one still
+    // in flight, as it is queued behind it.
+    //
+
+    if (_cmdGate)
+        _cmdGate->runAction(OSMemberFunctionCast(IOCommandGate::Action, this, &ApplePS2SynapticsTouchPad::stopReportRate));
+
     //
     // Disable the mouse itself, so that it may stop reporting mouse events.
     //
 
     setTouchPadEnable(false);
+    if (_rateRequest)
+    {
+        _device->freeRequest(_rateRequest);
+        _rateRequest = 0;
+    }
 
     // free up timer for scroll momentum
     IOWorkLoop* pWorkLoop = getWorkLoop();
@@ -746,6 +855,13 @@ void ApplePS2SynapticsTouchPad::stop( IOService * provider )
             _buttonTimer->release();
             _buttonTimer = 0;
         }
+        if (_rateTimer)
+        {
+            _rateTimer->cancelTimeout();
+            pWorkLoop->removeEventSource(_rateTimer);
+            _rateTimer->release();
+            _rateTimer = 0;
+        }
         if (_cmdGate)
         {
             pWorkLoop->removeEventSource(_cmdGate);
@@ -798,7 +914,7 @@ PS2InterruptResult ApplePS2SynapticsTouchPad::interruptOccurred(UInt8 data)
     // any BLOCKING commands to our device in this context.
     //
     
-    UInt8* packet = _ringBuffer.head();
+    UInt8* packet = _ringBuffer.reserve();
 
     // special case for $AA $00, spontaneous reset (usually due to static electricity)
     if (kSC_Reset == _lastdata && 0x00 == data)
@@ -808,7 +924,8 @@ PS2InterruptResult ApplePS2SynapticsTouchPad::interruptOccurred(UInt8 data)
         // spontaneous reset, device has announced with $AA $00, schedule a reset
         packet[0] = 0x00;
         packet[1] = kSC_Reset;
-        _ringBuffer.advanceHead(kPacketLength);
+        if (_ringBuffer.commit())
+            _latency.packetQueued();
         _packetByteCount = 0;
         return kPS2IR_packetReady;
     }
@@ -822,7 +939,8 @@ PS2InterruptResult ApplePS2SynapticsTouchPad::interruptOccurred(UInt8 data)
         
         packet[0] = 0x00;
         packet[1] = 0;  // reason=byte0
-        _ringBuffer.advanceHead(kPacketLength);
+        if (_ringBuffer.commit())
+            _latency.packetQueued();
         return kPS2IR_packetReady;
     }
     if (3 == _packetByteCount && (data & 0xc8) != 0xc0)
@@ -831,7 +949,8 @@ PS2InterruptResult ApplePS2SynapticsTouchPad::interruptOccurred(UInt8 data)
         
         packet[0] = 0x00;
         packet[1] = 3;  // reason=byte3
-        _ringBuffer.advanceHead(kPacketLength);
+        if (_ringBuffer.commit())
+            _latency.packetQueued();
         _packetByteCount = 0;
         return kPS2IR_packetReady;
     }
@@ -849,35 +968,75 @@ PS2InterruptResult ApplePS2SynapticsTouchPad::interruptOccurred(UInt8 data)
     // returning kPS2IR_packetReady
     //
     
+    if (0 == _packetByteCount)
+    {
+        _latency.packetStarted();
+        clock_get_uptime((uint64_t*)(&packet[kPacketTimeOffset]));
+    }
     packet[_packetByteCount++] = data;
     if (kPacketLength == _packetByteCount)
     {
-        _ringBuffer.advanceHead(kPacketLength);
+        if (_ringBuffer.commit())
+            _latency.packetQueued();
         _packetByteCount = 0;
         return kPS2IR_packetReady;
     }
     return kPS2IR_packetBuffering;
 }
 
+void ApplePS2SynapticsTouchPad::decodePacketBatch()
+{
+    // Unpack the position and W fields of everything queued in one pass, so
+    // a backlog (after a stall or wake) is bit twiddled in one tight loop and
+    // the state logic only reads the arrays.  Kernel code can't use SSE or
+    // NEON, so this is the portable scalar loop, and the fields are exactly
+    // what the per-packet unpacking gives.
+    unsigned count = _ringBuffer.count();
+    if (count > kPacketBatch)
+        count = kPacketBatch;
+    for (unsigned i = 0; i < count; i++)
+        unpackPacket(_ringBuffer.peek(i), _batch.x[i], _batch.y[i], _batch.w[i]);
+    _batch.count = count;
+}
+
 void ApplePS2SynapticsTouchPad::packetReady()
 {
     // empty the ring buffer, dispatching each packet...
-    while (_ringBuffer.count() >= kPacketLength)
+    while (_ringBuffer.count())
     {
-        UInt8* packet = _ringBuffer.tail();
-        if (0x00 != packet[0])
+        decodePacketBatch();
+        // a ring buffer discard (initTouchPad, mode change) also clears the batch
+        for (unsigned i = 0; i < _batch.count; i++)
         {
-            // normal packet
-            if (!ignoreall)
-                synaptics_parse_hw_state(_ringBuffer.tail());
-        }
-        else
-        {
-            // a reset packet was buffered... schedule a complete reset
-            //initTouchPad();
+            UInt8* packet = _ringBuffer.tail();
+            _latency.packetDrained();
+            if (0x00 != packet[0])
+            {
+                // normal packet
+                if (!__atomic_load_n(&ignoreall, __ATOMIC_RELAXED))
+                {
+                    (this->*_decoder)(packet, _batch.x[i], _batch.y[i], _batch.w[i]);
+                    _queueingDelay.record(*(uint64_t*)(&packet[kPacketTimeOffset]));
+                }
+            }
+            else
+            {
+                // a reset packet was buffered... schedule a complete reset
+                //initTouchPad();
+            }
+            _ringBuffer.advanceTail();
         }
-        _ringBuffer.advanceTail(kPacketLength);
     }
+    // the last frame of a coalesced run goes out once the backlog is drained
+    deliverTouchData();
+    _ringBuffer.publishStats(this, kRingBufferStatistics);
+    _latency.publish(this);
+    if (_coalescePackets)
+        publishCoalescingStats(false);
+    if (_idleFrameLimit)
+        publishIdleFrameStats(false);
+    publishTransitionStats(false);
+    _queueingDelay.publish(this);
 }
 
 #define sqr(x) ((x) * (x))
@@ -896,27 +1055,39 @@ void ApplePS2SynapticsTouchPad::assignVirtualFinger(int physicalFinger) {
         if (!virtualFingerStates[j].touch) {
             fingerStates[physicalFinger].virtualFingerIndex = j;
             virtualFingerStates[j].touch = true;
-            virtualFingerStates[j].x_avg.reset();
-            virtualFingerStates[j].y_avg.reset();
+            virtualFingerStates[j].reset_position();
             break;
         }
 }
 
-void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[])
+#define DECODER(clickpad, thinkpad, passthru) &ApplePS2SynapticsTouchPad::synaptics_parse_hw_state<clickpad, thinkpad, passthru>
+
+void ApplePS2SynapticsTouchPad::selectDecoder()
+{
+    // indexed by (ClickPad << 2) | (ThinkPad << 1) | PassThru
+    static const PacketDecoder decoders[8] = {
+        DECODER(false, false, false), DECODER(false, false, true),
+        DECODER(false, true, false),  DECODER(false, true, true),
+        DECODER(true, false, false),  DECODER(true, false, true),
+        DECODER(true, true, false),   DECODER(true, true, true),
+    };
+    _decoder = decoders[(clickpadtype ? 4 : 0) | (isthinkpad ? 2 : 0) | (passthru ? 1 : 0)];
+    DEBUG_LOG("VoodooPS2Trackpad: packet decoder clickpad=%d thinkpad=%d passthru=%d\n", clickpadtype != 0, isthinkpad != 0, passthru);
+}
+
+#undef DECODER
+
+template <bool ClickPad, bool ThinkPad, bool PassThru>
+void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[], int x, int y, int w)
 {
 
     // Check if input is disabled via ApplePS2Keyboard request
-    if (ignoreall)
+    if (__atomic_load_n(&ignoreall, __ATOMIC_RELAXED))
         return;
+
+    // events carry the time the packet arrived, not when it was dequeued
+    uint64_t packetTime = *(uint64_t*)(&buf[kPacketTimeOffset]);
     
-    int w = (((buf[0] & 0x30) >> 2) |
-             ((buf[0] & 0x04) >> 1) |
-             ((buf[3] & 0x04) >> 2));
-    
-    
-    int x = buf[4]|((buf[1]&0x0f)<<8)|((buf[3]&0x10)<<8);
-    int y = buf[5]|((buf[1]&0xf0)<<4)|((buf[3]&0x20)<<7);
-  
     DEBUG_LOG("VoodooPS2 w: %d\n", w);
     
     
@@ -925,20 +1096,20 @@ void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[])
     UInt32 buttonsraw = buf[0] & 0x03; // mask for just R L
     UInt32 buttons = buttonsraw;
     
-    if (passthru && 3 == w)
+    if (PassThru && 3 == w)
         passbuttons = buf[1] & 0x7; // mask for just M R L
     
     buttons |= passbuttons;
     lastbuttons = buttons;
     
-    if (clickpadtype)
+    if (ClickPad)
     {
         // ClickPad puts its "button" presses in a different location
         // And for single button ClickPad we have to provide a way to simulate right clicks
         int clickbuttons = buf[3] & 0x3;
         
         //Let's quickly do some extra logic to see if we are pressing any of the physical buttons for the trackpoint
-        if (isthinkpad)
+        if (ThinkPad)
         {
             
             DEBUG_LOG("IS THINKPAD");
@@ -980,7 +1151,7 @@ void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[])
             setClickButtons(0);
         
         //Remember the button state on thinkpads.. this is required so we can handle the middle click vs middle scrolling appropriately.
-        if (isthinkpad)
+        if (ThinkPad)
         {
             if (thinkpadButtonState)
                 _clickbuttons = thinkpadButtonState;
@@ -1019,6 +1190,11 @@ void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[])
                 else if (fingerStates[1].y == Y_MAX_POSITIVE)
                     fingerStates[1].y = YMAX;
 
+                agmFresh = true;
+                agmX = fingerStates[1].x;
+                agmY = fingerStates[1].y;
+                agmPrimaryX = fingerStates[0].x;
+                agmPrimaryY = fingerStates[0].y;
                 break;
             case 2:
                 DEBUG_LOG("synaptics_parse_hw_state: ===========FINGER COUNT PACKET===========");
@@ -1029,9 +1205,8 @@ void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[])
                 break;
         }
     }
-    else if (w == 3 && passthru) {
-        AbsoluteTime timestamp;
-        clock_get_uptime(&timestamp);
+    else if (w == 3 && PassThru) {
+        AbsoluteTime timestamp = packetTime;
 
         
         
@@ -1055,6 +1230,8 @@ void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[])
 
         SInt32 dx = ((buf[1] & 0x10) ? 0xffffff00 : 0 ) | buf[4];
         SInt32 dy = ((buf[1] & 0x20) ? 0xffffff00 : 0 ) | buf[5];
+        if (_adaptiveRate && (dx || dy))
+            noteMotion(timestamp);
         if (/*mousemiddlescroll && */((buf[1] & 0x4) || thinkpadButtonState == 4)) // only for physical middle button
         {
             if (dx != 0 || dy != 0)
@@ -1066,19 +1243,19 @@ void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[])
             else
                 scrolly = dy;// * mousescrollmultipliery;
 
-            if (isthinkpad && thinkpadMiddleButtonPressed)
+            if (ThinkPad && thinkpadMiddleButtonPressed)
             {
                 scrolly = scrolly * thinkpadNubScrollYMultiplier;
                 scrollx = scrollx * thinkpadNubScrollXMultiplier;
             }
 
-            dispatchScrollWheelEvent(scrolly, -scrollx, 0, timestamp);
+            dispatchScrollWheelEventX(scrolly, -scrollx, 0, packetTime);
             dx = dy = 0;
         }
         dx *= mousemultiplierx;
         dy *= mousemultipliery;
         //If this is a thinkpad, we do extra logic here to see if we're doing a middle click
-        if (isthinkpad)
+        if (ThinkPad)
         {
             if (/*mousemiddlescroll && */combinedButtons == 4)
             {
@@ -1087,15 +1264,15 @@ void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[])
             else
             {
                 if (thinkpadMiddleButtonPressed && !thinkpadMiddleScrolled)
-                    dispatchRelativePointerEvent(dx, -dy, 4, timestamp);
-                dispatchRelativePointerEvent(dx, -dy, combinedButtons, timestamp);
+                    dispatchRelativePointerEventX(dx, -dy, 4, packetTime);
+                dispatchRelativePointerEventX(dx, -dy, combinedButtons, packetTime);
                 thinkpadMiddleButtonPressed = false;
                 thinkpadMiddleScrolled = false;
             }
         }
         else
         {
-            dispatchRelativePointerEvent(dx, -dy, combinedButtons, timestamp);
+            dispatchRelativePointerEventX(dx, -dy, combinedButtons, packetTime);
         }
 #ifdef DEBUG_VERBOSE
         static int count = 0;
@@ -1159,15 +1336,25 @@ void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[])
         if (clampedFingerCount > SYNAPTICS_MAX_FINGERS)
             clampedFingerCount = SYNAPTICS_MAX_FINGERS;
 
-        if (renumberFingers())
-            sendTouchData();
-        
-        
-        AbsoluteTime timestamp;
-        clock_get_uptime(&timestamp);
+        if (_adaptiveRate && clampedFingerCount)
+        {
+            // only movement or a change of fingers counts, not a resting finger
+            int moved = abs(fingerStates[0].x - _rateMotionX) + abs(fingerStates[0].y - _rateMotionY);
+            if (moved > kRateMotionThreshold || clampedFingerCount != lastFingerCount)
+            {
+                _rateMotionX = fingerStates[0].x;
+                _rateMotionY = fingerStates[0].y;
+                noteMotion(packetTime);
+            }
+        }
+
+        _latency.packetParsed();
+        if (renumberFingers(packetTime))
+            sendTouchData(packetTime);
+        agmFresh = false;
         
         
-        if (isthinkpad)
+        if (ThinkPad)
         {
             if (buttons == 4)
             {
@@ -1176,17 +1363,17 @@ void ApplePS2SynapticsTouchPad::synaptics_parse_hw_state(const UInt8 buf[])
             else
             {
                 if (thinkpadMiddleButtonPressed && !thinkpadMiddleScrolled)
-                    dispatchRelativePointerEvent(0, 0, 4, timestamp);
-                dispatchRelativePointerEvent(0, 0, buttons, timestamp);
+                    dispatchRelativePointerEventX(0, 0, 4, packetTime);
+                dispatchRelativePointerEventX(0, 0, buttons, packetTime);
                 thinkpadMiddleButtonPressed = false;
                 thinkpadMiddleScrolled = false;
             }
         }else{//Deactivated this thingy because I was sending a right click after I pressed the left physical button on my thinkpad
             if (right && !prev_right){
-                dispatchRelativePointerEvent(0, 0, 0x02, timestamp);
+                dispatchRelativePointerEventX(0, 0, 0x02, packetTime);
             }
             else if (prev_right && !(right)){
-                 dispatchRelativePointerEvent(0, 0, 0x00, timestamp);
+                 dispatchRelativePointerEventX(0, 0, 0x00, packetTime);
             }
         }
         
@@ -1222,8 +1409,7 @@ void ApplePS2SynapticsTouchPad::freeAndMarkVirtualFingers() {
     for (int i = 0; i < SYNAPTICS_MAX_FINGERS; i++) { // free up all virtual fingers
         auto &vfi = virtualFingerStates[i];
         vfi.touch = false;
-        vfi.x_avg.reset(); // maybe it should be done only for unpressed fingers?
-        vfi.y_avg.reset();
+        vfi.reset_position(); // maybe it should be done only for unpressed fingers?
         vfi.pressure = 0;
         vfi.width = 0;
     }
@@ -1260,14 +1446,46 @@ void ApplePS2SynapticsTouchPad::swapFingers(int dst, int src) {
     assignVirtualFinger(src);
 }
 
+bool ApplePS2SynapticsTouchPad::synthesizeSecondaryFinger(uint64_t now_ns) {
+    // The AGM packet carrying the new secondary finger has not arrived yet.
+    // Keep the last one, moved by as much as the primary finger moved since,
+    // unless it is too old to say anything about where that finger is.
+    if (!agmTime || now_ns - agmTime > kAGMMaxAge)
+        return false;
+    auto &f1 = fingerStates[1];
+    f1.x = agmX + fingerStates[0].x - agmPrimaryX;
+    f1.y = agmY + fingerStates[0].y - agmPrimaryY;
+    clip_no_update_limits(f1.x, logical_min_x, logical_max_x, margin_size_x);
+    clip_no_update_limits(f1.y, logical_min_y, logical_max_y, margin_size_y);
+    DEBUG_LOG("synaptics_parse_hw_state: synthesized secondary finger x=%d y=%d", f1.x, f1.y);
+    return true;
+}
+
 #define FINGER_DIST 1000000
 
-bool ApplePS2SynapticsTouchPad::renumberFingers() {
+bool ApplePS2SynapticsTouchPad::renumberFingers(uint64_t timestamp) {
     const auto &f0 = fingerStates[0];
     const auto &f1 = fingerStates[1];
     auto &f2 = fingerStates[2];
     auto &f3 = fingerStates[3];
 
+    uint64_t now_ns;
+    absolutetime_to_nanoseconds(timestamp, &now_ns);
+    if (agmFresh)
+        agmTime = now_ns;
+
+    if (_secondaryProvisional && agmFresh) {
+        // real position of the new finger arrived, restart its history there
+        _secondaryProvisional = false;
+        int j = f1.virtualFingerIndex;
+        if (clampedFingerCount == lastFingerCount && j >= 0 && j < SYNAPTICS_MAX_FINGERS) {
+            auto &vfj = virtualFingerStates[j];
+            vfj.reset_position();
+            vfj.x_avg.filter(f1.x);
+            vfj.y_avg.filter(f1.y);
+        }
+    }
+
     if (clampedFingerCount == lastFingerCount && clampedFingerCount >= 3) {
         // update imaginary finger states
         if (f0.virtualFingerIndex != -1 && f1.virtualFingerIndex != -1) {
@@ -1302,10 +1520,10 @@ bool ApplePS2SynapticsTouchPad::renumberFingers() {
             IOLog("synaptics_parse_hw_state: WTF - have %d fingers, but first 2 don't have virtual finger", clampedFingerCount);
     }
     
-    // We really need to send the "no touch" event
-    // multiple times, because if we don't do it and return,
-    // gestures like desktop switching or inertial scrolling
-    // got stuck midway until the next touch.
+    // The "no touch" event has to go out more than once after lift-off,
+    // or gestures like desktop switching or inertial scrolling get stuck
+    // midway until the next touch; sendTouchData stops after IdleFrames
+    // of them, until the next touch or button change.
     //if(!lastFingerCount && !clampedFingerCount) {
     //    return 0;
     //}
@@ -1318,24 +1536,39 @@ bool ApplePS2SynapticsTouchPad::renumberFingers() {
             // Prevent jumps by unpressing finger. Other way could be leaving the old finger pressed.
             DEBUG_LOG("synaptics_parse_hw_state: unpressing finger: dist is %d", d);
             auto &vfj = virtualFingerStates[j];
-            vfj.x_avg.reset();
-            vfj.y_avg.reset();
+            vfj.reset_position();
             vfj.pressure = 0;
             vfj.width = 0;
             clampedFingerCount = 0;
         }
     }
+    if (clampedFingerCount != lastFingerCount && !_transitionPending) {
+        _transitionPending = true;
+        _transitionStart = now_ns;
+        _transitionPackets = 0;
+    }
+    if (_transitionPending)
+        _transitionPackets++;
+
     if (clampedFingerCount != lastFingerCount) {
-        if (clampedFingerCount > lastFingerCount && clampedFingerCount >= 3) {
-            // Skip sending touch data once because we need to wait for the next extended packet
-            if (wasSkipped)
-                wasSkipped = false;
-            else {
-                DEBUG_LOG("synaptics_parse_hw_state: Skip sending touch data");
-                wasSkipped = true;
-                return false;
-            }
+        // With _zeroDropTransitions, report right away instead of waiting
+        // for the next extended packet. On the first packet of 3+ fingers
+        // the AGM packet still describes the previous secondary finger, even
+        // if it was just received.
+        bool added = clampedFingerCount > lastFingerCount;
+        bool synthesize = clampedFingerCount >= 2 && (!agmFresh || (added && clampedFingerCount >= 3));
+        bool synthesized = _zeroDropTransitions && synthesize && synthesizeSecondaryFinger(now_ns);
+        if (synthesized)
+            _secondaryProvisional = added;
+        // Otherwise (or without a recent AGM packet to go by) skip sending
+        // touch data once because we need to wait for the next extended packet
+        bool skip = added && (_zeroDropTransitions ? synthesize && !synthesized : clampedFingerCount >= 3);
+        if (skip && !wasSkipped) {
+            DEBUG_LOG("synaptics_parse_hw_state: Skip sending touch data");
+            wasSkipped = true;
+            return false;
         }
+        wasSkipped = false;
 
         if (lastFingerCount == 0) {
             // Assign to identity mapping
@@ -1344,8 +1577,7 @@ bool ApplePS2SynapticsTouchPad::renumberFingers() {
                 fi.virtualFingerIndex = i;
                 auto &vfi = virtualFingerStates[i];
                 vfi.touch = true;
-                vfi.x_avg.reset();
-                vfi.y_avg.reset();
+                vfi.reset_position();
                 if (i == 2 || i == 3) // 3 or 4 fingers added simultaneously
                     clone(fi, upperFinger()); // Copy from the upper finger
             }
@@ -1547,6 +1779,10 @@ bool ApplePS2SynapticsTouchPad::renumberFingers() {
         virtual_finger_state &fiv = virtualFingerStates[fi.virtualFingerIndex];
         fiv.x_avg.filter(fi.x);
         fiv.y_avg.filter(fi.y);
+        uint64_t interval = (now_ns - fiv.sample_time) / 1000;
+        fiv.x_filter.filter(fi.x, interval, _oneEuro);
+        fiv.y_filter.filter(fi.y, interval, _oneEuro);
+        fiv.sample_time = now_ns;
         fiv.width = fi.w;
         fiv.pressure = fi.z;
         fiv.button = left;
@@ -1556,20 +1792,75 @@ bool ApplePS2SynapticsTouchPad::renumberFingers() {
     return true;
 }
 
-void ApplePS2SynapticsTouchPad::sendTouchData() {
+void ApplePS2SynapticsTouchPad::filteredPosition(const virtual_finger_state& state, uint64_t now_ns, int& x, int& y) const {
+    switch (_smoothingFilter) {
+        case SMOOTHING_ONE_EURO:
+            x = state.x_filter.value();
+            y = state.y_filter.value();
+            break;
+
+        case SMOOTHING_PREDICT: {
+            // extrapolate over the time the sample already waited plus the
+            // configured lookahead, but never further than 50ms
+            uint64_t ahead = (now_ns - state.sample_time) / 1000 + _predictionTime;
+            if (ahead > 50000)
+                ahead = 50000;
+            x = state.x_filter.predict(ahead);
+            y = state.y_filter.predict(ahead);
+            break;
+        }
+
+        default:
+            x = state.x_avg.average();
+            y = state.y_avg.average();
+            break;
+    }
+}
+
+void ApplePS2SynapticsTouchPad::sendTouchData(uint64_t timestamp) {
     // Ignore input for specified time after keyboard usage
-    AbsoluteTime timestamp;
-    clock_get_uptime(&timestamp);
     uint64_t timestamp_ns;
     absolutetime_to_nanoseconds(timestamp, &timestamp_ns);
+    // prediction and start delays are measured up to now, not to the arrival
+    uint64_t now_abs, now_ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs, &now_ns);
     
-    if (timestamp_ns - keytime < maxaftertyping)
+    if (timestamp_ns - _keyClock->lastKeyTime() < maxaftertyping)
+    {
+        _transitionPending = false;
+        deliverTouchData();
         return;
+    }
+
+    // a pending (coalesced) frame may only absorb this one if neither the
+    // finger count nor any button changed; otherwise it goes out first
+    UInt32 frameButtons = touchFrameButtons();
+    if (clampedFingerCount != _touchFrameCount || frameButtons != _touchFrameButtons)
+        deliverTouchData();
 
     if (lastFingerCount != clampedFingerCount) {
         lastFingerCount = clampedFingerCount;
-        return; // Skip while fingers are placed on the touchpad or removed
+        if (!_zeroDropTransitions)
+            return; // Skip while fingers are placed on the touchpad or removed
+    }
+    if (_transitionPending)
+        transitionFrameSent(now_ns);
+
+    // nothing touching and no button change: after _idleFrameLimit of these
+    // frames VoodooInput has seen the lift-off, further ones are just noise
+    if (_idleFrameLimit && !clampedFingerCount && frameButtons == _touchFrameButtons)
+    {
+        if (_idleFrameRun >= _idleFrameLimit)
+        {
+            ++_idleFramesSuppressed;
+            return;
+        }
+        ++_idleFrameRun;
+        ++_idleFramesSent;
     }
+    else
+        _idleFrameRun = 0;
 
     static_assert(VOODOO_INPUT_MAX_TRANSDUCERS >= SYNAPTICS_MAX_FINGERS, "Trackpad supports too many fingers");
 
@@ -1586,8 +1877,8 @@ void ApplePS2SynapticsTouchPad::sendTouchData() {
         transducer.type = FINGER;
         transducer.isValid = true;
         
-        int posX = state.x_avg.average();
-        int posY = state.y_avg.average();
+        int posX, posY;
+        filteredPosition(state, now_ns, posX, posY);
 
         clip(posX, logical_min_x, logical_max_x, margin_size_x, dimensions_changed);
         clip(posY, logical_min_y, logical_max_y, margin_size_y, dimensions_changed);
@@ -1597,7 +1888,9 @@ void ApplePS2SynapticsTouchPad::sendTouchData() {
         
         DEBUG_LOG("synaptics_parse_hw_state finger[%d] x=%d y=%d raw_x=%d raw_y=%d", i, posX, posY, state.x_avg.average(), state.y_avg.average());
 
-        transducer.previousCoordinates = transducer.currentCoordinates;
+        // keep the coordinates of the last delivered frame while coalescing
+        if (!_touchEventPending)
+            transducer.previousCoordinates = transducer.currentCoordinates;
 
         transducer.currentCoordinates.x = posX;
         transducer.currentCoordinates.y = posY;
@@ -1651,12 +1944,135 @@ void ApplePS2SynapticsTouchPad::sendTouchData() {
         super::messageClient(kIOMessageVoodooInputUpdateDimensionsMessage, voodooInputInstance, &d, sizeof(VoodooInputDimensions));
     }
 
-    // send the event into the multitouch interface
-    super::messageClient(kIOMessageVoodooInputMessage, voodooInputInstance, &inputEvent, sizeof(VoodooInputEvent));
+    // motion-only frame with more packets queued behind it: hold it back,
+    // the next frame either replaces it or flushes it
+    bool transition = clampedFingerCount != _touchFrameCount || frameButtons != _touchFrameButtons;
+    _touchFrameCount = clampedFingerCount;
+    _touchFrameButtons = frameButtons;
+    if (_touchEventPending)
+        ++_touchFramesCoalesced; // the held back frame was replaced by this one
+    _touchEventPending = true;
+    _latency.packetHeld();
+    if (!_coalescePackets || transition || _ringBuffer.count() <= 1)
+    {
+        // send the event into the multitouch interface
+        deliverTouchData();
+    }
 
     lastFingerCount = clampedFingerCount;
 }
 
+UInt32 ApplePS2SynapticsTouchPad::touchFrameButtons() const
+{
+    // everything that makes a frame a transition rather than plain motion:
+    // physical buttons, clickpad buttons and force touch state per finger
+    UInt32 result = lastbuttons | (right << 3);
+    for (int i = 0; i < SYNAPTICS_MAX_FINGERS; i++)
+    {
+        const auto& state = virtualFingerStates[i];
+        if (!state.touch)
+            continue;
+        if (state.button)
+            result |= 1 << (8 + i);
+        if (FORCE_TOUCH_THRESHOLD == _forceTouchMode && state.pressure > _forceTouchPressureThreshold)
+            result |= 1 << (16 + i);
+    }
+    return result;
+}
+
+void ApplePS2SynapticsTouchPad::deliverTouchData()
+{
+    if (!_touchEventPending)
+        return;
+    _touchEventPending = false;
+    ++_touchFramesDelivered;
+    super::messageClient(kIOMessageVoodooInputMessage, voodooInputInstance, &inputEvent, sizeof(VoodooInputEvent));
+    _latency.heldDispatched();
+}
+
+void ApplePS2SynapticsTouchPad::transitionFrameSent(uint64_t now_ns)
+{
+    // every packet of the transition before this one was swallowed
+    _transitionPending = false;
+    ++_transitions;
+    _transitionFramesDropped += _transitionPackets - 1;
+    UInt64 delay = (now_ns - _transitionStart) / 1000;
+    _transitionDelayTotal += delay;
+    if (delay > _transitionDelayMax)
+        _transitionDelayMax = delay > 0xFFFFFFFF ? 0xFFFFFFFF : (UInt32)delay;
+}
+
+void ApplePS2SynapticsTouchPad::resetTransitionStats()
+{
+    _transitions = 0;
+    _transitionFramesDropped = 0;
+    _transitionDelayTotal = 0;
+    _transitionDelayMax = 0;
+    _transitionsPublished = ~0ULL;
+    _transitionStatsTime = 0;
+}
+
+void ApplePS2SynapticsTouchPad::publishTransitionStats(bool force)
+{
+    uint64_t now_abs, now_ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    if (!force && (_transitionsPublished == _transitions || now_ns - _transitionStatsTime < 1000000000ULL))
+        return;
+    _transitionStatsTime = now_ns;
+    _transitionsPublished = _transitions;
+
+    OSDictionary* dict = OSDictionary::withCapacity(4);
+    if (!dict)
+        return;
+    setPropertyNumber(dict, "Transitions", _transitions, 64);
+    setPropertyNumber(dict, "Dropped Frames", _transitionFramesDropped, 64);
+    setPropertyNumber(dict, "Mean Start Delay (us)", _transitions ? _transitionDelayTotal / _transitions : 0, 64);
+    setPropertyNumber(dict, "Max Start Delay (us)", _transitionDelayMax, 32);
+    setProperty(kTransitionStatistics, dict);
+    dict->release();
+}
+
+void ApplePS2SynapticsTouchPad::publishCoalescingStats(bool force)
+{
+    // counters move with every packet, so refresh them at most once a second
+    uint64_t now_abs, now_ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    if (!force && (_touchFramesPublished == _touchFramesDelivered + _touchFramesCoalesced || now_ns - _coalesceStatsTime < 1000000000ULL))
+        return;
+    _coalesceStatsTime = now_ns;
+    _touchFramesPublished = _touchFramesDelivered + _touchFramesCoalesced;
+
+    OSDictionary* dict = OSDictionary::withCapacity(2);
+    if (!dict)
+        return;
+    setPropertyNumber(dict, "Delivered", _touchFramesDelivered, 64);
+    setPropertyNumber(dict, "Coalesced", _touchFramesCoalesced, 64);
+    setProperty(kCoalescingStatistics, dict);
+    dict->release();
+}
+
+void ApplePS2SynapticsTouchPad::publishIdleFrameStats(bool force)
+{
+    // same once a second refresh as the coalescing counters
+    uint64_t now_abs, now_ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    if (!force && (_idleFramesPublished == _idleFramesSent + _idleFramesSuppressed || now_ns - _idleStatsTime < 1000000000ULL))
+        return;
+    _idleStatsTime = now_ns;
+    _idleFramesPublished = _idleFramesSent + _idleFramesSuppressed;
+
+    OSDictionary* dict = OSDictionary::withCapacity(2);
+    if (!dict)
+        return;
+    setPropertyNumber(dict, "Sent", _idleFramesSent, 64);
+    setPropertyNumber(dict, "Suppressed", _idleFramesSuppressed, 64);
+    setProperty(kIdleFrameStatistics, dict);
+    dict->release();
+}
+
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
@@ -1670,7 +2086,7 @@ void ApplePS2SynapticsTouchPad::onButtonTimer(void)
 
 UInt32 ApplePS2SynapticsTouchPad::middleButton(UInt32 buttons, uint64_t now_abs, MBComingFrom from)
 {
-    if (!_fakemiddlebutton || _buttonCount <= 2 || (ignoreall && fromTrackpad == from))
+    if (!_fakemiddlebutton || _buttonCount <= 2 || (__atomic_load_n(&ignoreall, __ATOMIC_RELAXED) && fromTrackpad == from))
         return buttons;
     
     // cancel timer if we see input before timeout has fired, but after expired
@@ -1803,6 +2219,7 @@ void ApplePS2SynapticsTouchPad::setTouchPadEnable( bool enable )
     request.commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
     request.commands[0].inOrOut = enable ? kDP_Enable : kDP_SetDefaultsAndDisable;
     request.commandsCount = 1;
+    request.priority = enable ? kPS2RP_Input : kPS2RP_Normal;
     assert(request.commandsCount <= countof(request.commands));
     _device->submitRequestAndBlock(&request);
 }
@@ -1891,49 +2308,97 @@ bool ApplePS2SynapticsTouchPad::getTouchPadData(UInt8 dataSelector, UInt8 buf3[]
     return true;
 }
 
+unsigned ApplePS2SynapticsTouchPad::appendTouchPadQuery(PS2CommandBuilder& program, UInt8 dataSelector)
+{
+    // Same sequence as getTouchPadData, without the leading $F5 (the
+    // previous query ends with one).  A failed query does not stop the
+    // ones after it.
+    unsigned query = program.tryBegin();
+    program.specialCommand(dataSelector);
+    program.mouseCommand(kDP_GetMouseInformation);
+    program.read();
+    program.read();
+    program.read();
+    program.mouseCommand(kDP_SetDefaultsAndDisable);
+    program.end(query);
+    return query;
+}
+
+bool ApplePS2SynapticsTouchPad::touchPadQueryResult(const PS2CommandBuilder& program, unsigned query, UInt8 buf3[])
+{
+    if (!program.succeeded(query))
+        return false;
+    buf3[0] = program.result(query + kQueryResult);
+    buf3[1] = program.result(query + kQueryResult + 1);
+    buf3[2] = program.result(query + kQueryResult + 2);
+    return true;
+}
+
+void ApplePS2SynapticsTouchPad::publishInitTime(const char* key, uint64_t start_abs)
+{
+    uint64_t now_abs, ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs - start_abs, &ns);
+
+    OSDictionary* dict = OSDynamicCast(OSDictionary, getProperty(kInitStatistics));
+    dict = dict ? OSDictionary::withDictionary(dict) : OSDictionary::withCapacity(2);
+    if (!dict)
+        return;
+    setPropertyNumber(dict, key, ns / 1000, 32);
+    setProperty(kInitStatistics, dict);
+    dict->release();
+}
+
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
 void ApplePS2SynapticsTouchPad::initTouchPad()
 {
+    uint64_t start_abs;
+    clock_get_uptime(&start_abs);
+
     //
     // Clear packet buffer pointer to avoid issues caused by
     // stale packet fragments.
     //
     
     _packetByteCount = 0;
-    _ringBuffer.reset();
+    _ringBuffer.discard();
+    _batch.count = 0;
+    _latency.discardPackets();
     
     _clickbuttons = 0;
     tracksecondary=false;
     
-    // clear state of control key cache
-    _modifierdown = 0;
-    
     //
     // Resend the touchpad mode byte sequence
     // IRQ is enabled as side effect of setting mode byte
     // Also touchpad is enabled as side effect
     //
-    
-    setTouchpadModeByte();
-    
-    //
-    // Set LED state as it is lost after sleep
+    // Set LED state as it is lost after sleep (sent in the same request)
     //
-    updateTouchpadLED();
+    
+    setTouchpadModeByte(true);
+    updateTouchpadLED(false);
+    resetReportRate();
+
+    publishInitTime("InitTouchPad (us)", start_abs);
 }
 
-bool ApplePS2SynapticsTouchPad::setTouchpadModeByte()
+bool ApplePS2SynapticsTouchPad::setTouchpadModeByte(bool sendLED)
 {
     if (!_dynamicEW)
     {
         _touchPadModeByte = _extendedwmodeSupported ? _touchPadModeByte | (1<<2) : _touchPadModeByte & ~(1<<2);
         _extendedwmode = _extendedwmodeSupported;
     }
-    return setTouchPadModeByte(_touchPadModeByte);
+    int touchLED = sendLED && ledpresent && !noled ? touchpadLEDValue() : -1;
+    bool result = setTouchPadModeByte(_touchPadModeByte, touchLED);
+    if (touchLED >= 0)
+        sendTouchpadLED(touchLED);
+    return result;
 }
 
-bool ApplePS2SynapticsTouchPad::setTouchPadModeByte(UInt8 modeByteValue)
+bool ApplePS2SynapticsTouchPad::setTouchPadModeByte(UInt8 modeByteValue, int touchLED)
 {
     // make sure we are not early in the initialization...
     if (!_device)
@@ -1970,12 +2435,12 @@ bool ApplePS2SynapticsTouchPad::setTouchPadModeByte(UInt8 modeByteValue)
     // Currently we are doing some of this, but not all...
     // (not the F5, but probably should be at startup only)
     
-    // IMPORTANT: Currently this init sequence is 30 commands.  Current limit
-    //  for a PS2Request is 30.  So don't add any. Break it into multiple
-    //  requests!
+    // IMPORTANT: Currently this init sequence is up to 28 commands, plus 13
+    //  for the optional LED sequence.  The request below is sized for that,
+    //  so grow it if you add any.
     
     int i;
-    TPS2Request<> request;
+    TPS2Request<kMaxCommands + 13> request;
     
 #ifdef FULL_HW_RESET
     // This was an attempt to solve wake from sleep problems.  Not needed.
@@ -2013,59 +2478,82 @@ bool ApplePS2SynapticsTouchPad::setTouchPadModeByte(UInt8 modeByteValue)
         DEBUG_LOG("VoodooPS2Trackpad: sending undoc pre failed: %d\n", request.commandsCount);
 #endif
     
+    DEBUG_LOG("VoodooPS2Trackpad: sending final init sequence...\n");
+    i = buildTouchPadModeByte(request.commands, modeByteValue, touchLED);
+    request.commandsCount = i;
+    assert(request.commandsCount <= countof(request.commands));
+    _device->submitRequestAndBlock(&request);
+    if (i != request.commandsCount)
+        DEBUG_LOG("VoodooPS2Trackpad: sending final init sequence failed: %d\n", request.commandsCount);
+
+    return i == request.commandsCount;
+}
+
+int ApplePS2SynapticsTouchPad::buildTouchPadModeByte(PS2Command* commands, UInt8 modeByteValue, int touchLED)
+{
+    //
+    // The mode byte sequence of setTouchPadModeByte, also queued on its own
+    // by submitReportRate: at most kModeByteCommands commands, plus 13 for the
+    // optional LED.
+    //
+
     // Disable stream mode before the command sequence.
-    i = 0;
-    request.commands[i++].inOrOut = kDP_SetDefaultsAndDisable;     // F5
-    request.commands[i++].inOrOut = kDP_SetDefaultsAndDisable;     // F5
-    request.commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
-    request.commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
+    int i = 0;
+    commands[i++].inOrOut = kDP_SetDefaultsAndDisable;     // F5
+    commands[i++].inOrOut = kDP_SetDefaultsAndDisable;     // F5
+    commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
+    commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
     
     // 4 set resolution commands, each encode 2 data bits.
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = (modeByteValue >> 6) & 0x3;    // 0x (depends on mode byte)
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = (modeByteValue >> 4) & 0x3;    // 0x (depends on mode byte)
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = (modeByteValue >> 2) & 0x3;    // 0x (depends on mode byte)
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = (modeByteValue >> 0) & 0x3;    // 0x (depends on mode byte)
+    commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
+    commands[i++].inOrOut = (modeByteValue >> 6) & 0x3;    // 0x (depends on mode byte)
+    commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
+    commands[i++].inOrOut = (modeByteValue >> 4) & 0x3;    // 0x (depends on mode byte)
+    commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
+    commands[i++].inOrOut = (modeByteValue >> 2) & 0x3;    // 0x (depends on mode byte)
+    commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
+    commands[i++].inOrOut = (modeByteValue >> 0) & 0x3;    // 0x (depends on mode byte)
     
     // Set sample rate 20 to set mode byte 2. Older pads have 4 mode
     // bytes (0,1,2,3), but only mode byte 2 remain in modern pads.
-    request.commands[i++].inOrOut = kDP_SetMouseSampleRate;        // F3
-    request.commands[i++].inOrOut = 20;                            // 14
-    request.commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
+    commands[i++].inOrOut = kDP_SetMouseSampleRate;        // F3
+    commands[i++].inOrOut = 20;                            // 14
+    commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
 
 #ifdef UNDOCUMENTED_INIT_SEQUENCE_POST
     // maybe this is commit?
-    request.commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = 0x0;                           // 00
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = 0x0;                           // 00
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = 0x0;                           // 00
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = 0x3;                           // 03
-    request.commands[i++].inOrOut = kDP_SetMouseSampleRate;        // F3
-    request.commands[i++].inOrOut = 200;                           // C8
+    commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
+    commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
+    commands[i++].inOrOut = 0x0;                           // 00
+    commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
+    commands[i++].inOrOut = 0x0;                           // 00
+    commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
+    commands[i++].inOrOut = 0x0;                           // 00
+    commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
+    commands[i++].inOrOut = 0x3;                           // 03
+    commands[i++].inOrOut = kDP_SetMouseSampleRate;        // F3
+    commands[i++].inOrOut = 200;                           // C8
 #endif
 
     // enable trackpad
-    request.commands[i++].inOrOut = kDP_Enable;                    // F4
-    
-    DEBUG_LOG("VoodooPS2Trackpad: sending final init sequence...\n");
-    
+    commands[i++].inOrOut = kDP_Enable;                    // F4
+
     // all these commands are "send mouse" and "compare ack"
     for (int x = 0; x < i; x++)
-        request.commands[x].command = kPS2C_SendMouseCommandAndCompareAck;
-    request.commandsCount = i;
-    assert(request.commandsCount <= countof(request.commands));
-    _device->submitRequestAndBlock(&request);
-    if (i != request.commandsCount)
-        DEBUG_LOG("VoodooPS2Trackpad: sending final init sequence failed: %d\n", request.commandsCount);
+        commands[x].command = kPS2C_SendMouseCommandAndCompareAck;
 
-    return i == request.commandsCount;
+    // LED state goes along in the same request; it may fail on its own
+    // without failing the mode byte
+    if (touchLED >= 0)
+    {
+        int group = i++;
+        i = appendTouchpadLED(commands, i, touchLED);
+        commands[group].command = kPS2C_TryCommands;
+        commands[group].inOrOut32 = 0;
+        commands[group].skipCount = i - group - 1;
+    }
+    assert(i <= kModeByteCommands + (touchLED >= 0 ? 13 : 0));
+    return i;
 }
 
 
@@ -2096,38 +2584,8 @@ bool ApplePS2SynapticsTouchPad::setModeByte(UInt8 modeByteValue)
     if (!_device)
         return false;
 
-    int i;
-    TPS2Request<> request;
-
-    // Disable stream mode before the command sequence.
-    i = 0;
-    request.commands[i++].inOrOut = kDP_SetDefaultsAndDisable;     // F5
-    request.commands[i++].inOrOut = kDP_SetDefaultsAndDisable;     // F5
-    request.commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
-    request.commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
-
-    // 4 set resolution commands, each encode 2 data bits.
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = (modeByteValue >> 6) & 0x3;    // 0x (depends on mode byte)
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = (modeByteValue >> 4) & 0x3;    // 0x (depends on mode byte)
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = (modeByteValue >> 2) & 0x3;    // 0x (depends on mode byte)
-    request.commands[i++].inOrOut = kDP_SetMouseResolution;        // E8
-    request.commands[i++].inOrOut = (modeByteValue >> 0) & 0x3;    // 0x (depends on mode byte)
-
-    // Set sample rate 20 to set mode byte 2. Older pads have 4 mode
-    // bytes (0,1,2,3), but only mode byte 2 remain in modern pads.
-    request.commands[i++].inOrOut = kDP_SetMouseSampleRate;        // F3
-    request.commands[i++].inOrOut = 20;                            // 14
-    request.commands[i++].inOrOut = kDP_SetMouseScaling1To1;       // E6
-
-    // enable trackpad
-    request.commands[i++].inOrOut = kDP_Enable;                    // F4
-
-    // all these commands are "send mouse" and "compare ack"
-    for (int x = 0; x < i; x++)
-        request.commands[x].command = kPS2C_SendMouseCommandAndCompareAck;
+    TPS2Request<kModeByteCommands> request;
+    int i = buildTouchPadModeByte(request.commands, modeByteValue, -1);
     request.commandsCount = i;
     assert(request.commandsCount <= countof(request.commands));
     _device->submitRequestAndBlock(&request);
@@ -2139,10 +2597,134 @@ bool ApplePS2SynapticsTouchPad::setModeByte(UInt8 modeByteValue)
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
+void ApplePS2SynapticsTouchPad::noteMotion(uint64_t timestamp)
+{
+    uint64_t now_ns;
+    absolutetime_to_nanoseconds(timestamp, &now_ns);
+    if (_reportRate.active(now_ns))
+    {
+        updateReportRate();
+        if (_rateTimer)
+            setTimerTimeout(_rateTimer, _rateIdleTime);
+    }
+}
+
+void ApplePS2SynapticsTouchPad::onRateTimer(void)
+{
+    if (!_adaptiveRate)
+        return;
+    uint64_t now_abs, now_ns, remaining;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    if (_reportRate.idle(now_ns, _rateIdleTime, remaining))
+        updateReportRate();
+    else if (remaining)
+        setTimerTimeout(_rateTimer, remaining);
+}
+
+void ApplePS2SynapticsTouchPad::updateReportRate()
+{
+    // program the wanted rate, unless a switch is still in flight (its
+    // completion comes back here)
+    int rate;
+    if (_rateRequest && _reportRate.request(rate))
+        submitReportRate(rate);
+}
+
+void ApplePS2SynapticsTouchPad::submitReportRate(int rate)
+{
+    //
+    // Asynchronously reprograms the mode byte with the new rate, packets are
+    // dispatched as usual meanwhile.  _touchPadModeByte is updated once the
+    // sequence went through, in reportRateDone.
+    //
+
+    UInt8 modeByte = ReportRate::kHigh == rate ? _touchPadModeByte | (1<<6) : _touchPadModeByte & ~(1<<6);
+    DEBUG_LOG("VoodooPS2Trackpad: report rate %s\n", ReportRate::kHigh == rate ? "high" : "low");
+    int count = buildTouchPadModeByte(_rateRequest->commands, modeByte);
+    _rateRequest->commandsCount = count;
+    _rateRequest->completionTarget = this;
+    _rateRequest->completionAction = OSMemberFunctionCast(PS2CompletionAction, this, &ApplePS2SynapticsTouchPad::reportRateDone);
+    _rateRequest->completionParam = (void*)(uintptr_t)count;
+    _device->submitRequest(_rateRequest);
+}
+
+void ApplePS2SynapticsTouchPad::reportRateDone(void* param)
+{
+    // completion of _rateRequest, on the work loop
+    uint64_t now_abs, now_ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    bool ok = _rateRequest->commandsCount == (uintptr_t)param;
+    switch (_reportRate.complete(ok, now_ns))
+    {
+        case ReportRate::kDone:
+            _touchPadModeByte = ReportRate::kHigh == _reportRate.device() ? _touchPadModeByte | (1<<6) : _touchPadModeByte & ~(1<<6);
+            updateReportRate();
+            break;
+
+        case ReportRate::kRetry:
+            submitReportRate(_reportRate.requested());
+            break;
+
+        case ReportRate::kFailed:
+            // the sequence starts by disabling the touchpad, make sure it is back
+            IOLog("VoodooPS2Trackpad: report rate switch failed: %d\n", _rateRequest->commandsCount);
+            if (!_reportRate.stopped())
+            {
+                if (PS2Request* request = _device->allocateRequest(1))
+                {
+                    request->commands[0].command = kPS2C_SendMouseCommandAndCompareAck;
+                    request->commands[0].inOrOut = kDP_Enable;
+                    request->commandsCount = 1;
+                    _device->submitRequest(request);
+                }
+            }
+            break;
+    }
+    _reportRate.publish(this, 40, 80, now_ns);
+}
+
+void ApplePS2SynapticsTouchPad::resetReportRate()
+{
+    // the mode byte was just programmed, pick up its rate from there
+    if (!_rateTimer)
+        return;
+    _rateTimer->cancelTimeout();
+    if (!_adaptiveRate)
+        return;
+    uint64_t now_abs, now_ns;
+    clock_get_uptime(&now_abs);
+    absolutetime_to_nanoseconds(now_abs, &now_ns);
+    _reportRate.sync(_touchPadModeByte & (1<<6) ? ReportRate::kHigh : ReportRate::kLow, now_ns);
+    if (_reportRate.rate() == ReportRate::kHigh)
+        setTimerTimeout(_rateTimer, _rateIdleTime);
+    _reportRate.publish(this, 40, 80, now_ns);
+}
+
+void ApplePS2SynapticsTouchPad::stopReportRate()
+{
+    // gated, so no completion is halfway through queueing a retry
+    if (_rateTimer)
+        _rateTimer->cancelTimeout();
+    _reportRate.stop();
+}
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
 void ApplePS2SynapticsTouchPad::setParamPropertiesGated(OSDictionary * config)
 {
 	if (NULL == config)
 		return;
+
+    // any value resets the latency histograms
+    if (config->getObject(kResetLatencyStatistics))
+    {
+        _latency.reset();
+        _latency.publish(this);
+        resetTransitionStats();
+        publishTransitionStats(true);
+    }
     
 	const struct {const char *name; int *var;} int32vars[]={
         {"FingerZ",                         &z_finger},
@@ -2162,6 +2744,12 @@ void ApplePS2SynapticsTouchPad::setParamPropertiesGated(OSDictionary * config)
         {"MouseMultiplierY",                &mousemultipliery},
         {"ForceTouchMode",                  (int*)&_forceTouchMode}, // 0 - disable, 1 - left button, 2 - pressure threshold, 3 - pass pressure value
         {"ForceTouchPressureThreshold",     &_forceTouchPressureThreshold}, // used in mode 2
+        {"SmoothingFilter",                 (int*)&_smoothingFilter}, // 0 - 5 sample average, 1 - one euro, 2 - one euro + prediction
+        {"OneEuroMinCutoff",                &_oneEuro.minCutoff}, // mHz
+        {"OneEuroBeta",                     &_oneEuro.beta},
+        {"OneEuroDCutoff",                  &_oneEuro.dCutoff}, // mHz
+        {"PredictionTime",                  &_predictionTime}, // usec, used in mode 2
+        {"IdleFrames",                      &_idleFrameLimit}, // 0 - never suppress
 	};
 	const struct {const char *name; int *var;} boolvars[]={
         {"DisableLEDUpdate",                &noled},
@@ -2174,6 +2762,9 @@ void ApplePS2SynapticsTouchPad::setParamPropertiesGated(OSDictionary * config)
         {"DynamicEWMode",                   &_dynamicEW},
         {"ProcessUSBMouseStopsTrackpad",    &_processusbmouse},
         {"ProcessBluetoothMouseStopsTrackpad", &_processbluetoothmouse},
+        {"CoalescePackets",                 &_coalescePackets},
+        {"AdaptiveReportRate",              &_adaptiveRate},
+        {"ZeroDropTransitions",             &_zeroDropTransitions},
  	};
     const struct {const char* name; bool* var;} lowbitvars[]={
         {"OutsidezoneNoAction When Typing", &outzone_wt},
@@ -2185,6 +2776,7 @@ void ApplePS2SynapticsTouchPad::setParamPropertiesGated(OSDictionary * config)
         {"QuietTimeAfterTyping",            &maxaftertyping},
         {"ClickPadClickTime",               &clickpadclicktime},
         {"MiddleClickTime",                 &_maxmiddleclicktime},
+        {"ReportRateIdleTime",              &_rateIdleTime},
     };
     
 	uint8_t oldmode = _touchPadModeByte;
@@ -2193,10 +2785,7 @@ void ApplePS2SynapticsTouchPad::setParamPropertiesGated(OSDictionary * config)
 	OSBoolean *bl;
 	if ((bl=OSDynamicCast (OSBoolean, config->getObject ("UseHighRate"))))
     {
-		if (bl->isTrue())
-			_touchPadModeByte |= 1<<6;
-		else
-			_touchPadModeByte &= ~(1<<6);
+        _useHighRate = bl->isTrue();
         setProperty("UseHighRate", bl->isTrue());
     }
     
@@ -2238,6 +2827,17 @@ void ApplePS2SynapticsTouchPad::setParamPropertiesGated(OSDictionary * config)
         }
     }
 
+    if (_coalescePackets)
+        publishCoalescingStats(true);
+    if (_idleFrameLimit)
+        publishIdleFrameStats(true);
+    else
+        removeProperty(kIdleFrameStatistics);
+
+    // the rate is UseHighRate's, unless AdaptiveReportRate is switching it (so
+    // turning that off goes back to UseHighRate's rate)
+    if (!_adaptiveRate)
+        _touchPadModeByte = _useHighRate ? _touchPadModeByte | (1<<6) : _touchPadModeByte & ~(1<<6);
     // this driver assumes wmode is available (6-byte packets)
     _touchPadModeByte |= 1<<0;
     // extendedwmode is optional, used automatically for ClickPads
@@ -2248,14 +2848,20 @@ void ApplePS2SynapticsTouchPad::setParamPropertiesGated(OSDictionary * config)
     {
 		setTouchpadModeByte();
         _packetByteCount=0;
-        _ringBuffer.reset();
+        _ringBuffer.discard();
+        _batch.count = 0;
+        _latency.discardPackets();
     }
+    resetReportRate();
 
     // disable trackpad when USB mouse is plugged in and this functionality is requested
     if (attachedHIDPointerDevices && attachedHIDPointerDevices->getCount() > 0) {
-        ignoreall = usb_mouse_stops_trackpad;
+        __atomic_store_n(&ignoreall, usb_mouse_stops_trackpad, __ATOMIC_SEQ_CST);
         updateTouchpadLED();
     }
+
+    // Thinkpad may have changed
+    selectDecoder();
 }
 
 IOReturn ApplePS2SynapticsTouchPad::setParamProperties(OSDictionary* dict)
@@ -2295,6 +2901,8 @@ void ApplePS2SynapticsTouchPad::setDevicePowerState( UInt32 whatToDo )
             // Disable touchpad (synchronous).
             //
 
+            if (_rateTimer)
+                _rateTimer->cancelTimeout();
             setTouchPadEnable( false ); // Disable stream mode
             _touchPadModeByte |= 1 << 3;
             setModeByte(_touchPadModeByte); // Enable sleep
@@ -2306,10 +2914,10 @@ void ApplePS2SynapticsTouchPad::setDevicePowerState( UInt32 whatToDo )
             // completed its power-on self-test and calibration.
             //
 
-            IOSleep(wakedelay);
+            _device->powerControlSleep(wakedelay);
             _touchPadModeByte &= ~(1 << 3); // Wake from sleep
             setModeByte(_touchPadModeByte);
-            IOSleep(wakedelay);
+            _device->powerControlSleep(wakedelay);
             
             // Reset and enable the touchpad.
             initTouchPad();
@@ -2325,116 +2933,35 @@ IOReturn ApplePS2SynapticsTouchPad::message(UInt32 type, IOService* provider, vo
     // Here is where we receive messages from the keyboard driver
     //
     // This allows for the keyboard driver to enable/disable the trackpad
-    // when a certain keycode is pressed.
+    // when a certain keycode is pressed.  (The time of the last key press is
+    // read from _keyClock, not sent as a message.)
     //
-    // It also allows the trackpad driver to learn the last time a key
-    //  has been pressed, so it can implement various "ignore trackpad
-    //  input while typing" options.
+    // The controller delivers these without a gate (see PS2NotificationBus),
+    // on whatever thread published them: ignoreall is only accessed
+    // atomically, and updateTouchpadLED copes with a concurrent change.
     //
     switch (type)
     {
         case kPS2M_getDisableTouchpad:
         {
             bool* pResult = (bool*)argument;
-            *pResult = !ignoreall;
-            break;
+            *pResult = !__atomic_load_n(&ignoreall, __ATOMIC_RELAXED);
+            return kIOReturnSuccess;
         }
             
         case kPS2M_setDisableTouchpad:
         {
             bool enable = *((bool*)argument);
             // ignoreall is true when trackpad has been disabled
-            if (enable == ignoreall)
+            if (__atomic_exchange_n(&ignoreall, !enable, __ATOMIC_SEQ_CST) != !enable)
             {
-                // save state, and update LED
-                ignoreall = !enable;
+                // state changed, update LED
                 updateTouchpadLED();
             }
-            break;
-        }
-            
-        case kPS2M_notifyKeyPressed:
-        {
-            // just remember last time key pressed... this can be used in
-            // interrupt handler to detect unintended input while typing
-            PS2KeyInfo* pInfo = (PS2KeyInfo*)argument;
-            static const int masks[] =
-            {
-                0x10,       // 0x36
-                0x100000,   // 0x37
-                0,          // 0x38
-                0,          // 0x39
-                0x080000,   // 0x3a
-                0x040000,   // 0x3b
-                0,          // 0x3c
-                0x08,       // 0x3d
-                0x04,       // 0x3e
-                0x200000,   // 0x3f
-            };
-#ifdef SIMULATE_PASSTHRU
-            /*
-            static int buttons = 0;
-            int button;
-            switch (pInfo->adbKeyCode)
-            {
-                // make right Alt,Menu,Ctrl into three button passthru
-                case 0x36:
-                    button = 0x1;
-                    goto dispatch_it;
-                case 0x3f:
-                    button = 0x4;
-                    goto dispatch_it;
-                case 0x3e:
-                    button = 0x2;
-                    // fall through...
-                dispatch_it:
-                    if (pInfo->goingDown)
-                        buttons |= button;
-                    else
-                        buttons &= ~button;
-                    UInt8 packet[6];
-                    packet[0] = 0x84 | trackbuttons;
-                    packet[1] = 0x08 | buttons;
-                    packet[2] = 0;
-                    packet[3] = 0xC4 | trackbuttons;
-                    packet[4] = 0;
-                    packet[5] = 0;
-                    dispatchEventsWithPacket(packet, 6);
-                    pInfo->eatKey = true;
-            }
-             */
-#endif
-            switch (pInfo->adbKeyCode)
-            {
-                // don't store key time for modifier keys going down
-                // track modifiers for scrollzoom feature...
-                // (note: it turns out we didn't need to do this, but leaving this code in for now in case it is useful)
-                case 0x38:  // left shift
-                case 0x3c:  // right shift
-                case 0x3b:  // left control
-                case 0x3e:  // right control
-                case 0x3a:  // left windows (option)
-                case 0x3d:  // right windows
-                case 0x37:  // left alt (command)
-                case 0x36:  // right alt
-                case 0x3f:  // osx fn (function)
-                    if (pInfo->goingDown)
-                    {
-                        _modifierdown |= masks[pInfo->adbKeyCode-0x36];
-                        break;
-                    }
-                    _modifierdown &= ~masks[pInfo->adbKeyCode-0x36];
-                    keytime = pInfo->time;
-                    break;
-                    
-                default:
-                    keytime = pInfo->time;
-            }
-            break;
+            return kIOReturnSuccess;
         }
     }
-    
-    return kIOReturnSuccess;
+    return super::message(type, provider, argument);
 }
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -2475,16 +3002,16 @@ IOReturn ApplePS2SynapticsTouchPad::message(UInt32 type, IOService* provider, vo
 // Signed-off-by: Takashi Iwai <tiwai@suse.de>
 //
 
-void ApplePS2SynapticsTouchPad::updateTouchpadLED()
+void ApplePS2SynapticsTouchPad::updateTouchpadLED(bool sendLED)
 {
-    if (ledpresent && !noled)
-        setTouchpadLED(ignoreall ? 0x88 : 0x10);
+    if (sendLED && ledpresent && !noled)
+        sendTouchpadLED();
 
     // if PS2M implements "TPDN" then, we can notify it of changes to LED state
     // (allows implementation of LED change in ACPI)
     if (_provider)
     {
-        if (OSNumber* num = OSNumber::withNumber(ignoreall, 32))
+        if (OSNumber* num = OSNumber::withNumber(__atomic_load_n(&ignoreall, __ATOMIC_RELAXED), 32))
         {
             _provider->evaluateObject(kTPDN, NULL, (OSObject**)&num, 1);
             num->release();
@@ -2492,38 +3019,56 @@ void ApplePS2SynapticsTouchPad::updateTouchpadLED()
     }
 }
 
+void ApplePS2SynapticsTouchPad::sendTouchpadLED(int sentLED)
+{
+    // ignoreall can change on another thread while an LED request is out, and
+    // the requests of two threads can complete in either order: every sender
+    // checks the state once its request is done, so the last one to complete
+    // always leaves the LED matching it
+    UInt8 touchLED = sentLED;
+    if (sentLED < 0)
+        setTouchpadLED(touchLED = touchpadLEDValue());
+    while (touchLED != touchpadLEDValue())
+        setTouchpadLED(touchLED = touchpadLEDValue());
+}
+
 bool ApplePS2SynapticsTouchPad::setTouchpadLED(UInt8 touchLED)
 {
     TPS2Request<12> request;
+    request.commandsCount = appendTouchpadLED(request.commands, 0, touchLED);
+    request.priority = kPS2RP_Cosmetic;
+    assert(request.commandsCount <= countof(request.commands));
+    _device->submitRequestAndBlock(&request);
     
+    return 12 == request.commandsCount;
+}
+
+int ApplePS2SynapticsTouchPad::appendTouchpadLED(PS2Command* commands, int i, UInt8 touchLED)
+{
     // send NOP before special command sequence
-    request.commands[0].inOrOut  = kDP_SetMouseScaling1To1;
+    commands[i++].inOrOut  = kDP_SetMouseScaling1To1;
     
     // 4 set resolution commands, each encode 2 data bits of LED level
-    request.commands[1].inOrOut  = kDP_SetMouseResolution;
-    request.commands[2].inOrOut  = (touchLED >> 6) & 0x3;
-    request.commands[3].inOrOut  = kDP_SetMouseResolution;
-    request.commands[4].inOrOut  = (touchLED >> 4) & 0x3;
-    request.commands[5].inOrOut  = kDP_SetMouseResolution;
-    request.commands[6].inOrOut  = (touchLED >> 2) & 0x3;
-    request.commands[7].inOrOut  = kDP_SetMouseResolution;
-    request.commands[8].inOrOut  = (touchLED >> 0) & 0x3;
+    commands[i++].inOrOut  = kDP_SetMouseResolution;
+    commands[i++].inOrOut  = (touchLED >> 6) & 0x3;
+    commands[i++].inOrOut  = kDP_SetMouseResolution;
+    commands[i++].inOrOut  = (touchLED >> 4) & 0x3;
+    commands[i++].inOrOut  = kDP_SetMouseResolution;
+    commands[i++].inOrOut  = (touchLED >> 2) & 0x3;
+    commands[i++].inOrOut  = kDP_SetMouseResolution;
+    commands[i++].inOrOut  = (touchLED >> 0) & 0x3;
     
     // Set sample rate 10 (10 is command for setting LED)
-    request.commands[9].inOrOut  = kDP_SetMouseSampleRate;
-    request.commands[10].inOrOut = 10; // 0x0A command for setting LED
+    commands[i++].inOrOut  = kDP_SetMouseSampleRate;
+    commands[i++].inOrOut  = 10; // 0x0A command for setting LED
     
     // finally send NOP command to end the special sequence
-    request.commands[11].inOrOut  = kDP_SetMouseScaling1To1;
-    request.commandsCount = 12;
-    assert(request.commandsCount <= countof(request.commands));
+    commands[i++].inOrOut  = kDP_SetMouseScaling1To1;
     
     // all these commands are "send mouse" and "compare ack"
-    for (int x = 0; x < request.commandsCount; x++)
-        request.commands[x].command = kPS2C_SendMouseCommandAndCompareAck;
-    _device->submitRequestAndBlock(&request);
-    
-    return 12 == request.commandsCount;
+    for (int x = i - 12; x < i; x++)
+        commands[x].command = kPS2C_SendMouseCommandAndCompareAck;
+    return i;
 }
 
 void ApplePS2SynapticsTouchPad::registerHIDPointerNotifications()
@@ -2636,7 +3181,7 @@ void ApplePS2SynapticsTouchPad::notificationHIDAttachedHandlerGated(IOService *
     if (notifier == usb_hid_publish_notify || notifier == bluetooth_hid_publish_notify) {
         if (usb_mouse_stops_trackpad && attachedHIDPointerDevices->getCount() > 0) {
             // One or more USB or Bluetooth pointer devices attached, disable trackpad
-            ignoreall = true;
+            __atomic_store_n(&ignoreall, true, __ATOMIC_SEQ_CST);
             updateTouchpadLED();
         }
     }
@@ -2644,7 +3189,7 @@ void ApplePS2SynapticsTouchPad::notificationHIDAttachedHandlerGated(IOService *
     if (notifier == usb_hid_terminate_notify || notifier == bluetooth_hid_terminate_notify) {
         if (usb_mouse_stops_trackpad && attachedHIDPointerDevices->getCount() == 0) {
             // No USB or bluetooth pointer devices attached, re-enable trackpad
-            ignoreall = false;
+            __atomic_store_n(&ignoreall, false, __ATOMIC_SEQ_CST);
             updateTouchpadLED();
         }
     }
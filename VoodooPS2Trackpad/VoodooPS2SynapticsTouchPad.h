@@ -160,6 +160,82 @@ public:
     }
 };
 
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+// OneEuroFilter Class Declaration
+//
+// Speed adaptive low pass ("1 euro" filter): slow movement gets a low cutoff
+// to kill jitter, fast movement raises the cutoff so the pointer does not lag.
+// Everything is fixed point (no floating point in the kernel): positions and
+// speeds are kept in 1/256 units, cutoffs are in mHz and intervals in usec.
+//
+
+struct OneEuroParams
+{
+    int minCutoff;      // mHz, cutoff used when the finger is at rest
+    int beta;           // mHz of extra cutoff per unit/s of speed
+    int dCutoff;        // mHz, cutoff for the speed estimate itself
+};
+
+class OneEuroFilter
+{
+private:
+    SInt64 m_value;
+    SInt64 m_speed;
+    bool m_valid;
+
+    static SInt64 alpha(SInt64 cutoff, SInt64 interval)
+    {
+        // alpha = 1 / (1 + tau / Te), tau = 1 / (2 pi fc); returned as Q16
+        if (cutoff > 1000000)
+            cutoff = 1000000;
+        SInt64 k = cutoff * interval;
+        return (k << 16) / (k + 159154943);
+    }
+    static SInt64 lowpass(SInt64 last, SInt64 data, SInt64 a)
+    {
+        return last + (a * (data - last)) / 65536;
+    }
+
+public:
+    inline OneEuroFilter() { reset(); }
+    int filter(int data, uint64_t interval, const OneEuroParams& params)
+    {
+        SInt64 value = (SInt64)data << 8;
+        if (!m_valid)
+        {
+            m_value = value;
+            m_speed = 0;
+            m_valid = true;
+            return data;
+        }
+        // samples further apart than 100ms are not part of the same motion
+        if (interval > 100000)
+            interval = 100000;
+        else if (interval == 0)
+            interval = 1;
+        SInt64 speed = (value - m_value) * 1000000 / (SInt64)interval;
+        m_speed = lowpass(m_speed, speed, alpha(params.dCutoff, interval));
+        SInt64 absSpeed = m_speed < 0 ? -m_speed : m_speed;
+        SInt64 cutoff = params.minCutoff + ((SInt64)params.beta * absSpeed >> 8);
+        m_value = lowpass(m_value, value, alpha(cutoff, interval));
+        return (int)(m_value >> 8);
+    }
+    inline void reset()
+    {
+        m_valid = false;
+        m_value = 0;
+        m_speed = 0;
+    }
+    inline int value() const { return (int)(m_value >> 8); }
+    // filtered speed in units/s
+    inline int speed() const { return (int)(m_speed / 256); }
+    // position extrapolated 'ahead' usec along the filtered speed
+    inline int predict(uint64_t ahead) const
+    {
+        return (int)((m_value + m_speed * (SInt64)ahead / 1000000) >> 8);
+    }
+};
+
 struct synaptics_hw_state {
     int x;
     int y;
@@ -177,12 +253,29 @@ struct synaptics_hw_state {
 struct virtual_finger_state {
     SimpleAverage<int, 5> x_avg;
     SimpleAverage<int, 5> y_avg;
+    OneEuroFilter x_filter;
+    OneEuroFilter y_filter;
+    uint64_t sample_time;
     uint8_t pressure;
     uint8_t width;
     bool touch;
     bool button;
+
+    inline void reset_position()
+    {
+        x_avg.reset();
+        y_avg.reset();
+        x_filter.reset();
+        y_filter.reset();
+    }
 };
 
+typedef enum {
+    SMOOTHING_AVERAGE = 0,
+    SMOOTHING_ONE_EURO = 1,
+    SMOOTHING_PREDICT = 2
+} SmoothingFilter;
+
 typedef enum {
     FORCE_TOUCH_DISABLED = 0,
     FORCE_TOUCH_BUTTON = 1,
@@ -211,18 +304,59 @@ typedef enum {
 
 
 #define kPacketLength 6
+#define kPacketTimeOffset 8 // arrival time of the first byte
+#define kPacketBufferLength (kPacketTimeOffset+8)
+// packets decodePacketBatch unpacks at once (the ring buffer holds 31)
+#define kPacketBatch 32
+
+// absolute fields of the packets drained together, see decodePacketBatch
+struct synaptics_packet_batch {
+    int x[kPacketBatch];
+    int y[kPacketBatch];
+    int w[kPacketBatch];
+    unsigned count;
+};
+
+// most commands buildTouchPadModeByte adds (without the LED)
+#define kModeByteCommands 27
+// primary finger movement (in touchpad units) that counts as motion for the
+// adaptive report rate; a resting finger jitters less than this
+#define kRateMotionThreshold 16
+// oldest AGM packet a new secondary finger is synthesized from (ns); about
+// two AGM packets at 40 packets/s, older ones are from another touch
+#define kAGMMaxAge 60000000
+
+#define kCoalescingStatistics "Coalescing Statistics"
+#define kIdleFrameStatistics "Idle Frame Statistics"
+#define kTransitionStatistics "Transition Statistics"
+#define kInitStatistics "Initialization Statistics"
+
+// commands of appendTouchPadQuery
+#define kTouchPadQueryCommands 14
+// queryCapabilities sends all its queries as one request of this size: $F5,
+// 11 queries and the 6 blocks around the conditional ones
+#define kQueryProgramSize (1 + 11*kTouchPadQueryCommands + 6)
+// index of the first result byte, relative to appendTouchPadQuery's return
+#define kQueryResult 10
 
 class EXPORT ApplePS2SynapticsTouchPad : public IOHIPointing
 {
     typedef IOHIPointing super;
 	OSDeclareDefaultStructors(ApplePS2SynapticsTouchPad);
 
+#if PS2_EXTERNAL_PORT_IO
+    // the host build's decoder tests and benchmark run _decoder directly
+    template <class> friend struct SynapticsDecodeLoop;
+#endif
+
 private:
     IOService *voodooInputInstance;
     ApplePS2MouseDevice * _device;
     bool                _interruptHandlerInstalled;
     bool                _powerControlHandlerInstalled;
-    RingBuffer<UInt8, kPacketLength*32> _ringBuffer;
+    RingBuffer<UInt8, 32, kPacketBufferLength> _ringBuffer;
+    LatencyStats _latency;
+    QueueingDelay _queueingDelay;
     UInt32              _packetByteCount;
     UInt8               _lastdata;
     UInt16              _touchPadVersion;
@@ -255,21 +389,71 @@ private:
     int upperFingerIndex() const;
     const synaptics_hw_state& upperFinger() const;
     void swapFingers(int dst, int src);
-    void synaptics_parse_hw_state(const UInt8 buf[]);
+    // one decoder per capability combination, so the per-packet path does not
+    // test them; bound by selectDecoder whenever one of them may have changed
+    template <bool ClickPad, bool ThinkPad, bool PassThru>
+    void synaptics_parse_hw_state(const UInt8 buf[], int x, int y, int w);
+    typedef void (ApplePS2SynapticsTouchPad::*PacketDecoder)(const UInt8 buf[], int x, int y, int w);
+    PacketDecoder _decoder;
+    void selectDecoder();
+    synaptics_packet_batch _batch;
+    void decodePacketBatch();
+    static inline void unpackPacket(const UInt8 buf[], int& x, int& y, int& w)
+    {
+        w = ((buf[0] & 0x30) >> 2) | ((buf[0] & 0x04) >> 1) | ((buf[3] & 0x04) >> 2);
+        x = buf[4] | ((buf[1] & 0x0f) << 8) | ((buf[3] & 0x10) << 8);
+        y = buf[5] | ((buf[1] & 0xf0) << 4) | ((buf[3] & 0x20) << 7);
+    }
     
     /// Translates physical fingers into virtual fingers so that host software doesn't see 'jumps' and has coordinates for all fingers.
+    /// @param timestamp Arrival time of the packet
     /// @return True if is ready to send finger state to host interface
-    bool renumberFingers();
-    void sendTouchData();
+    bool renumberFingers(uint64_t timestamp);
+    void sendTouchData(uint64_t timestamp);
+    UInt32 touchFrameButtons() const;
+    void deliverTouchData();
+    void publishCoalescingStats(bool force);
+    void publishIdleFrameStats(bool force);
     void freeAndMarkVirtualFingers();
     int dist(int physicalFinger, int virtualFinger);
 
     ForceTouchMode _forceTouchMode;
     int _forceTouchPressureThreshold;
+
+    SmoothingFilter _smoothingFilter;
+    OneEuroParams _oneEuro;
+    int _predictionTime;
+    void filteredPosition(const virtual_finger_state& state, uint64_t now_ns, int& x, int& y) const;
     
     int clampedFingerCount;
     int agmFingerCount;
     bool wasSkipped;
+
+    // finger count transitions: with _zeroDropTransitions the first packet
+    // of a transition is reported, the secondary finger is taken from the
+    // last AGM packet (if it is recent) moved along with the primary finger
+    // until a fresh AGM packet replaces it
+    int _zeroDropTransitions;
+    bool agmFresh;                  // AGM packet seen since the last normal packet
+    uint64_t agmTime;               // ns, normal packet following the last AGM packet
+    int agmX, agmY;                 // secondary finger of the last AGM packet
+    int agmPrimaryX, agmPrimaryY;   // primary finger when it arrived
+    bool _secondaryProvisional;     // fingerStates[1] of a new finger is synthesized
+    bool synthesizeSecondaryFinger(uint64_t now_ns);
+
+    // gesture start latency: first packet of a transition to its first frame
+    bool _transitionPending;
+    uint64_t _transitionStart;
+    UInt32 _transitionPackets;
+    UInt64 _transitions;
+    UInt64 _transitionFramesDropped;
+    UInt64 _transitionDelayTotal;   // usec
+    UInt32 _transitionDelayMax;     // usec
+    UInt64 _transitionsPublished;
+    uint64_t _transitionStatsTime;
+    void transitionFrameSent(uint64_t now_ns);
+    void resetTransitionStats();
+    void publishTransitionStats(bool force);
 	int z_finger;
     bool outzone_wt, palm, palm_wt;
     int zlimit;
@@ -309,7 +493,7 @@ private:
     UInt32 passbuttons;
     UInt32 lastbuttons;
     int ignoredeltas;
-    uint64_t keytime;
+    PS2KeyClock* _keyClock;
     bool ignoreall;
 #ifdef SIMULATE_PASSTHRU
     UInt32 trackbuttons;
@@ -324,6 +508,27 @@ private:
     int _processusbmouse;
     int _processbluetoothmouse;
 
+    // packet coalescing: motion-only frames queued behind each other are
+    // merged, so only the last frame of a run reaches VoodooInput
+    int _coalescePackets;
+    bool _touchEventPending;        // inputEvent built but not yet delivered
+    int _touchFrameCount;           // finger count of the last built frame
+    UInt32 _touchFrameButtons;      // button state of the last built frame
+    UInt64 _touchFramesDelivered;
+    UInt64 _touchFramesCoalesced;
+    UInt64 _touchFramesPublished;
+    uint64_t _coalesceStatsTime;
+
+    // idle frames: after lift-off only this many "no touch" frames are sent
+    // (enough for VoodooInput to end gestures and inertial scrolling), the
+    // rest is dropped until a finger or button changes (0 = send all)
+    int _idleFrameLimit;
+    int _idleFrameRun;              // "no touch" frames sent since the last change
+    UInt64 _idleFramesSent;
+    UInt64 _idleFramesSuppressed;
+    UInt64 _idleFramesPublished;
+    uint64_t _idleStatsTime;
+
     OSSet* attachedHIDPointerDevices;
     
     IONotifier* usb_hid_publish_notify;     // Notification when an USB mouse HID device is connected
@@ -332,7 +537,6 @@ private:
     IONotifier* bluetooth_hid_publish_notify; // Notification when a bluetooth HID device is connected
     IONotifier* bluetooth_hid_terminate_notify; // Notification when a bluetooth HID device is disconnected
     
-    int _modifierdown; // state of left+right control keys
     int scrollzoommask;
     
     // for scaling x/y values
@@ -351,6 +555,24 @@ private:
     UInt32 _pendingbuttons;
     uint64_t _buttontime;
     IOTimerEventSource* _buttonTimer;
+
+    // adaptive report rate: mode byte bit 6 (80 instead of 40 packets/s) is
+    // set while fingers move and cleared after _rateIdleTime without motion;
+    // otherwise bit 6 is _useHighRate
+    int _useHighRate;
+    int _adaptiveRate;
+    uint64_t _rateIdleTime;
+    ReportRate _reportRate;
+    IOTimerEventSource* _rateTimer;
+    PS2Request* _rateRequest;
+    int _rateMotionX, _rateMotionY;
+    void noteMotion(uint64_t timestamp);
+    void updateReportRate();
+    void submitReportRate(int rate);
+    void reportRateDone(void* param);
+    void resetReportRate();
+    void stopReportRate();
+    void onRateTimer(void);
     uint64_t _maxmiddleclicktime;
     int _fakemiddlebutton;
 
@@ -371,14 +593,21 @@ private:
     virtual void   setTouchPadEnable( bool enable );
     virtual bool   getTouchPadData( UInt8 dataSelector, UInt8 buf3[] );
     virtual bool   getTouchPadStatus(  UInt8 buf3[] );
-    virtual bool   setTouchPadModeByte(UInt8 modeByteValue);
+    virtual bool   setTouchPadModeByte(UInt8 modeByteValue, int touchLED = -1);
+    unsigned appendTouchPadQuery(PS2CommandBuilder& program, UInt8 dataSelector);
+    bool touchPadQueryResult(const PS2CommandBuilder& program, unsigned query, UInt8 buf3[]);
+    void publishInitTime(const char* key, uint64_t start_abs);
 	virtual PS2InterruptResult interruptOccurred(UInt8 data);
     virtual void packetReady();
     virtual void   setDevicePowerState(UInt32 whatToDo);
     
-    void updateTouchpadLED();
+    void updateTouchpadLED(bool sendLED = true);
+    void sendTouchpadLED(int sentLED = -1);
     bool setTouchpadLED(UInt8 touchLED);
-    bool setTouchpadModeByte(); // set based on state
+    int appendTouchpadLED(PS2Command* commands, int i, UInt8 touchLED);
+    int buildTouchPadModeByte(PS2Command* commands, UInt8 modeByteValue, int touchLED = -1);
+    inline UInt8 touchpadLEDValue() const { return __atomic_load_n(&ignoreall, __ATOMIC_RELAXED) ? 0x88 : 0x10; }
+    bool setTouchpadModeByte(bool sendLED = false); // set based on state
     void initTouchPad();
     bool setModeByte(UInt8 modeByteValue);
     bool setModeByte(); // set based on state
@@ -408,9 +637,9 @@ protected:
 	IOItemCount buttonCount() override;
 	IOFixed     resolution() override;
     inline void dispatchRelativePointerEventX(int dx, int dy, UInt32 buttonState, uint64_t now)
-        { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); }
+        { dispatchRelativePointerEvent(dx, dy, buttonState, *(AbsoluteTime*)&now); _latency.packetDispatched(); }
     inline void dispatchScrollWheelEventX(short deltaAxis1, short deltaAxis2, short deltaAxis3, uint64_t now)
-        { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); }
+        { dispatchScrollWheelEvent(deltaAxis1, deltaAxis2, deltaAxis3, *(AbsoluteTime*)&now); _latency.packetDispatched(); }
     inline void setTimerTimeout(IOTimerEventSource* timer, uint64_t time)
         { timer->setTimeout(*(AbsoluteTime*)&time); }
     inline void cancelTimer(IOTimerEventSource* timer)